@@ -13,8 +13,15 @@
 #include "debugprint.h"
 #include "machine.h"
 #include "printhex.h"
+#include "vmm/directmap.h"
 #include "vmm/vmmapper.h"
 
+// MADT entries start after the header, LAPIC address and flags
+#define MADT_ENTRIES_OFFSET 0x2C
+
+#define MADT_ENTRY_LOCAL_APIC 0
+#define MADT_LOCAL_APIC_ENABLED 0x1
+
 #define RSDT_ENTRY_COUNT(sdt)                                                  \
     ((sdt->length - sizeof(BIOS_SDTHeader)) /                                  \
      4) // TODO hard-coded to 32-bit rev0
@@ -60,8 +67,6 @@ static bool checksum_sdt(BIOS_SDTHeader *sdt) {
 
 // Returns 0 if a new mapping is needed but we're at the limit...
 static uint64_t get_mapping_for(uint64_t phys) {
-    // TODO this is great, until one of the tables crosses a page boundary 🙄
-
 #ifdef DEBUG_ACPI
 #ifdef VERY_NOISY_ACPI
     debugstr("Mapping ACPI at ");
@@ -69,6 +74,18 @@ static uint64_t get_mapping_for(uint64_t phys) {
 #endif
 #endif
 
+    if (vmm_direct_map_covers(phys)) {
+        // Easy - it's already mapped, and contiguous
+#ifdef DEBUG_ACPI
+#ifdef VERY_NOISY_ACPI
+        debugstr(": Using direct mapping\n");
+#endif
+#endif
+
+        return (uint64_t)phys_to_virt(phys);
+    }
+
+    // TODO this is great, until one of the tables crosses a page boundary 🙄
     if (phys > 0x400000) {
         // not in already-mapped low 4MiB region...
         for (int i = 0; i < page_stack_ptr; i++) {
@@ -177,9 +194,10 @@ static BIOS_SDTHeader *map_sdt(uint64_t phys_addr) {
         debugstr(" entries in the ACPI tables\n");
 #endif
 
+        // Entries are left as physical addresses (the direct map doesn't
+        // fit in 32 bits) - `find_acpi_table` looks the mappings up again
         for (int i = 0; i < entries; i++) {
-            *entry = (uint32_t)(((uint64_t)map_sdt((uint64_t)*entry)) &
-                                0xFFFFFFFF);
+            map_sdt((uint64_t)*entry);
             entry++;
         }
     }
@@ -211,12 +229,17 @@ BIOS_SDTHeader *find_acpi_table(BIOS_SDTHeader *rsdp, const char *ident) {
 
     for (int i = 0; i < entries; i++) {
         BIOS_SDTHeader *sdt =
-                (BIOS_SDTHeader *)(((uint64_t)*entry) | 0xFFFFFFFF00000000);
+                (BIOS_SDTHeader *)get_mapping_for((uint64_t)*entry);
+
+        if (sdt == NULL) {
+            entry++;
+            continue;
+        }
 
 #ifdef DEBUG_ACPI
 #ifdef VERY_NOISY_ACPI
         debugstr("Find ACPI entry: Checking: ");
-        printhex64(((uint64_t)entry) | 0xFFFFFFFF00000000, debugchar);
+        printhex64((uint64_t)sdt, debugchar);
         debugstr(" = ");
         debugstr_len(sdt->signature, 4);
         debugstr("\n");
@@ -230,4 +253,30 @@ BIOS_SDTHeader *find_acpi_table(BIOS_SDTHeader *rsdp, const char *ident) {
     }
 
     return NULL;
-}
\ No newline at end of file
+}
+
+uint8_t acpi_madt_cpus(BIOS_SDTHeader *madt, uint8_t *apic_ids, uint8_t max) {
+    uint8_t *ptr = ((uint8_t *)madt) + MADT_ENTRIES_OFFSET;
+    uint8_t *end = ((uint8_t *)madt) + madt->length;
+    uint8_t count = 0;
+
+    while (ptr + 2 <= end && count < max) {
+        uint8_t type = ptr[0];
+        uint8_t len = ptr[1];
+
+        if (len < 2 || ptr + len > end) {
+            // Broken entry - don't trust anything after it
+            break;
+        }
+
+        // [type, len, processor ID, APIC ID, flags (32-bit, unaligned)]
+        if (type == MADT_ENTRY_LOCAL_APIC && len >= 8 &&
+            (ptr[4] & MADT_LOCAL_APIC_ENABLED)) {
+            apic_ids[count++] = ptr[3];
+        }
+
+        ptr += len;
+    }
+
+    return count;
+}
@@ -12,7 +12,9 @@
 #include <stdnoreturn.h>
 
 #include "acpitables.h"
+#include "cpu.h"
 #include "debugprint.h"
+#include "fba/alloc.h"
 #include "gdt.h"
 #include "init_pagetables.h"
 #include "interrupts.h"
@@ -22,7 +24,14 @@
 #include "pci/enumerate.h"
 #include "pmm/pagealloc.h"
 #include "printhex.h"
+#include "sched.h"
+#include "slab/alloc.h"
+#include "slab/kmalloc.h"
+#include "smp.h"
 #include "syscalls.h"
+#include "task.h"
+#include "vmm/directmap.h"
+#include "vmm/pcid.h"
 #include "vmm/recursive.h"
 #include "vmm/vmmapper.h"
 
@@ -31,6 +40,19 @@
 #define VERSTR #unknown
 #endif
 
+#ifdef PMM_BACKEND_BUDDY
+// The buddy allocator's bitmaps are a fixed size, and need to be fully
+// mapped up-front (there's no PMM yet to map them on demand) - so they
+// live at the bottom of the second 2MiB (which pagetables_init maps)
+// and the PMM manages the physical memory from just above them.
+#ifndef STATIC_PMM_VREGION
+#define STATIC_PMM_VREGION ((void *)0xFFFFFFFF80200000)
+#endif
+
+#ifndef PMM_PHYS_BASE
+#define PMM_PHYS_BASE (0x200000 + PMM_BUDDY_BUFFER_SIZE)
+#endif
+#else
 // This is the static virtual address region (128GB from this base)
 // that is reserved for PMM structures and stack.
 #ifndef STATIC_PMM_VREGION
@@ -41,6 +63,7 @@
 #ifndef PMM_PHYS_BASE
 #define PMM_PHYS_BASE 0x200000
 #endif
+#endif
 
 #ifndef VRAM_VIRT_BASE
 #define VRAM_VIRT_BASE ((char *const)0xffffffff800b8000)
@@ -224,6 +247,9 @@ static inline void init_this_cpu(BIOS_SDTHeader *rsdt) {
     }
 
     init_local_apic(madt);
+
+    // Fine if not - address space switches will just flush the TLB
+    vmm_pcid_init();
 }
 
 // Replace the bootstrap 32-bit pages with 64-bit user pages.
@@ -257,13 +283,46 @@ static inline void init_kernel_gdt() {
                    GDT_ENTRY_FLAGS_64BIT);
 }
 
+// Just gives the user-mode supervisor's context switch workload
+// something to switch to and from...
+static noreturn void yield_partner(void) {
+    while (true) {
+        sched_yield();
+    }
+}
+
+static inline void init_scheduler() {
+    // The boot code carries on as the user-mode supervisor, so it
+    // becomes the BSP's first task...
+    if (task_adopt_current() == NULL) {
+        debugstr("Failed to create initial task; halting\n");
+        halt_and_catch_fire();
+    }
+
+    Task *idle = task_create_kernel(sched_idle);
+    if (idle == NULL) {
+        debugstr("Failed to create idle task; halting\n");
+        halt_and_catch_fire();
+    }
+
+    sched_init_cpu(idle);
+
+    Task *partner = task_create_kernel(yield_partner);
+    if (partner) {
+        sched_enqueue(partner);
+    }
+}
+
 MemoryRegion *physical_region;
 BIOS_SDTHeader *acpi_root_table;
 
+static PerCPUPageCache pmm_cpu_caches[MAX_CPU_COUNT];
+static PerCPUBlockMagazine fba_cpu_magazines[MAX_CPU_COUNT];
+static PerCPUSlabMagazines slab_cpu_magazines[MAX_CPU_COUNT];
+
 noreturn void start_system(void) {
     uint64_t system_start_virt = 0x1000000;
-    uint64_t system_start_phys =
-            (uint64_t)&_system_bin_start & ~(0xFFFFFFFF80000000);
+    uint64_t system_start_phys = virt_to_phys(&_system_bin_start);
     uint64_t system_len_bytes =
             (uint64_t)&_system_bin_end - (uint64_t)&_system_bin_start;
     uint64_t system_len_pages = system_len_bytes >> 12;
@@ -271,10 +330,8 @@ noreturn void start_system(void) {
     uint16_t flags = PRESENT | USER;
 
     // Map pages for the user code
-    for (int i = 0; i < system_len_pages; i++) {
-        vmm_map_page(system_start_virt + (i << 12),
-                     system_start_phys + (i << 12), flags);
-    }
+    vmm_map_range(system_start_virt, system_start_phys, system_len_pages,
+                  flags);
 
     // TODO the way this is set up currently, there's no way to know how much
     // BSS/Data we need... We'll just map a page for now...
@@ -299,6 +356,8 @@ noreturn void start_system(void) {
             "pushf\n\t"         // Push EFLAGS
             "push $0x23\n\t"    // Push user code segment selector (GDT entry 4)
             "push %1\n\t"       // Push user code entry point
+            "cli\n\t"           // No interrupts while GS is the user's...
+            "swapgs\n\t"        // Swap to user GS
             "iretq\n\t"         // "Return" to user mode
             :
             : "r"(user_stack + 0x1000), "r"((uint64_t)0x0000000001000000)
@@ -308,6 +367,8 @@ noreturn void start_system(void) {
 }
 
 noreturn void start_kernel(BIOS_RSDP *rsdp, E820h_MemMap *memmap) {
+    smp_init_bsp();
+
     debugterm_init(VRAM_VIRT_BASE);
     banner();
 
@@ -316,6 +377,61 @@ noreturn void start_kernel(BIOS_RSDP *rsdp, E820h_MemMap *memmap) {
     pagetables_init();
     physical_region =
             page_alloc_init(memmap, PMM_PHYS_BASE, STATIC_PMM_VREGION);
+    page_alloc_init_cpu_caches(physical_region, pmm_cpu_caches);
+
+    if (!vmm_direct_map_init(memmap)) {
+        debugstr("WARN: Direct map setup failed; only low memory will be "
+                 "directly accessible\n");
+    }
+
+    if (!vmm_kernel_half_init((uint64_t *)vmm_recursive_find_pml4())) {
+        debugstr("Kernel page table setup failed; halting\n");
+        halt_and_catch_fire();
+    }
+
+    if (!fba_init((uint64_t *)vmm_recursive_find_pml4(), KERNEL_FBA_BEGIN,
+                  FBA_MAX_BLOCKS)) {
+        debugstr("FBA setup failed; halting\n");
+        halt_and_catch_fire();
+    }
+
+#ifdef DEBUG_MAGAZINE_DOUBLE_FREE
+    // The magazines' cached bitmap comes from the FBA itself, before
+    // they're turned on
+    uint64_t *fba_cached_bitmap = fba_alloc_blocks(
+            FBA_CACHED_BITMAP_QUADS * sizeof(uint64_t) / VM_PAGE_SIZE);
+
+    if (fba_cached_bitmap == NULL) {
+        debugstr("FBA magazine setup failed; halting\n");
+        halt_and_catch_fire();
+    }
+#else
+    uint64_t *fba_cached_bitmap = NULL;
+#endif
+
+    fba_init_cpu_magazines(fba_cpu_magazines, fba_cached_bitmap);
+
+    slab_alloc_init();
+
+#ifdef DEBUG_MAGAZINE_DOUBLE_FREE
+    uint64_t *slab_cached_bitmap = fba_alloc_blocks(
+            SLAB_CACHED_BITMAP_QUADS * sizeof(uint64_t) / VM_PAGE_SIZE);
+
+    if (slab_cached_bitmap == NULL) {
+        debugstr("Slab magazine setup failed; halting\n");
+        halt_and_catch_fire();
+    }
+#else
+    uint64_t *slab_cached_bitmap = NULL;
+#endif
+
+    slab_alloc_init_cpu_magazines(slab_cpu_magazines, slab_cached_bitmap);
+
+    if (!kmalloc_init()) {
+        debugstr("kmalloc setup failed; halting\n");
+        halt_and_catch_fire();
+    }
+
     install_interrupts();
     syscall_init();
 
@@ -349,8 +465,10 @@ noreturn void start_kernel(BIOS_RSDP *rsdp, E820h_MemMap *memmap) {
     debug_memmap(memmap);
     debug_madt(acpi_root_table);
     init_this_cpu(acpi_root_table);
+    smp_start_aps(acpi_root_table);
     init_kernel_drivers(acpi_root_table);
     pci_enumerate();
+    init_scheduler();
 
 #ifdef DEBUG_FORCE_HANDLED_PAGE_FAULT
     debugstr("\nForcing a (handled) page fault with write to "
@@ -394,6 +512,14 @@ noreturn void start_kernel(BIOS_RSDP *rsdp, E820h_MemMap *memmap) {
     debugstr("\n");
 #endif
 
+#ifdef DEBUG_PCID_BENCH
+    debug_pcid_switch_bench();
+#endif
+
+#ifdef DEBUG_SWITCH_BENCH
+    debug_switch_bench();
+#endif
+
 #ifdef DEBUG_TEST_TASKS
     void debug_test_tasks(void);
     debugstr("Running endless task test...\n");
@@ -3,11 +3,26 @@
  * anos - An Operating System
  *
  * Copyright (c) 2024 Ross Bamford
+ *
+ * Blocks are tracked in a bitmap (bit set == block in use) kept in the
+ * first few blocks of the FBA space itself. On top of that there are
+ * two levels of summary (bit set == that word below has something free
+ * in it) so finding a free block never means scanning the bitmap.
+ *
+ * Optionally, each CPU keeps a magazine of free blocks in front of all
+ * that, so single-block allocs and frees usually take no lock. Blocks
+ * in a magazine (or on the lazy-free list) are still set in the bitmap,
+ * so (for debugging) a second "cached" bitmap can mark those, to catch
+ * repeat frees.
+ *
+ * Freed blocks go on a lazy-free list, so they can be unmapped in
+ * batches with one TLB flush each.
  */
 
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "cpu.h"
 #include "debugprint.h"
 #include "fba/alloc.h"
 #include "pmm/pagealloc.h"
@@ -20,14 +35,15 @@
 #define tprintf(...)
 #define NULL (((void *)0))
 
-#define SPIN_LOCK()                                                            \
-    do {                                                                       \
-        spinlock_lock(&fba_lock);                                              \
-    } while (0)
+// Multi-block allocs and frees are mapped / unmapped in batches of up
+// to this many pages (the physical addresses are kept on the stack)
+#define FBA_BATCH_PAGES 64
+
+#define SPIN_LOCK() uint64_t lock_flags = spinlock_lock_irqsave(&fba_lock)
 
 #define SPIN_UNLOCK_RET(retval)                                                \
     do {                                                                       \
-        spinlock_unlock(&fba_lock);                                            \
+        spinlock_unlock_irqrestore(&fba_lock, lock_flags);                     \
         return (retval);                                                       \
     } while (0)
 
@@ -39,12 +55,30 @@ static uint64_t _fba_bitmap_size_quads;
 static uint64_t _fba_bitmap_size_bits;
 static uint64_t *_fba_bitmap, *_fba_bitmap_end;
 static SpinLock fba_lock;
+static PerCPUBlockMagazine *_fba_magazines;
+static uint64_t *_fba_cached; // Bit set == free, but in a magazine / lazy
+
+// Blocks waiting to be unmapped - still set in the bitmap until they are
+static uintptr_t _fba_lazy[FBA_LAZY_FREE_BATCH];
+static uint64_t _fba_lazy_count;
+
+#define FBA_SUMMARY_QUADS ((FBA_MAX_BLOCKS >> 12))
+#define FBA_SUMMARY_TOP_QUADS (((FBA_SUMMARY_QUADS + 63) >> 6))
+
+// Bit set == that bitmap word has a free block
+static uint64_t _fba_summary[FBA_SUMMARY_QUADS];
+// Bit set == that summary word has a bitmap word with a free block
+static uint64_t _fba_summary_top[FBA_SUMMARY_TOP_QUADS];
+static uint64_t _fba_summary_quads;
+static uint64_t _fba_summary_top_quads;
 
 #ifdef UNIT_TESTS
 uintptr_t test_fba_check_begin() { return _fba_begin; }
 uint64_t test_fba_check_size() { return _fba_size_blocks; }
 uint64_t *test_fba_bitmap() { return _fba_bitmap; }
 uint64_t *test_fba_bitmap_end() { return _fba_bitmap_end; }
+uint64_t *test_fba_summary() { return _fba_summary; }
+uint64_t *test_fba_summary_top() { return _fba_summary_top; }
 
 #ifdef DEBUG_UNIT_TESTS
 #include <stdio.h>
@@ -55,6 +89,102 @@ uint64_t *test_fba_bitmap_end() { return _fba_bitmap_end; }
 
 extern MemoryRegion *physical_region;
 
+// Update the summaries after a bitmap word has changed
+static inline void summary_update(uint64_t word) {
+    uint64_t summary_word = word >> 6;
+    uint64_t summary_bit = 1ULL << (word & 63);
+    uint64_t top_bit = 1ULL << (summary_word & 63);
+
+    if (_fba_bitmap[word] == 0xffffffffffffffff) {
+        _fba_summary[summary_word] &= ~summary_bit;
+
+        if (_fba_summary[summary_word] == 0) {
+            _fba_summary_top[summary_word >> 6] &= ~top_bit;
+        }
+    } else {
+        _fba_summary[summary_word] |= summary_bit;
+        _fba_summary_top[summary_word >> 6] |= top_bit;
+    }
+}
+
+static inline void block_set(uint64_t block) {
+    bitmap_set(_fba_bitmap, block);
+    summary_update(block >> 6);
+}
+
+static inline void block_clear(uint64_t block) {
+    bitmap_clear(_fba_bitmap, block);
+    summary_update(block >> 6);
+}
+
+// The cached bits are changed by magazine allocs / frees without the
+// lock, so these are atomic. Without a cached bitmap (i.e. without
+// magazines, or without checking) nothing is ever cached.
+
+// Mark a block cached, returning false if it already was
+static inline bool cached_set(uint64_t block) {
+    if (_fba_cached == NULL) {
+        return true;
+    }
+
+    uint64_t bit = 1ULL << (block & 63);
+    return (__atomic_fetch_or(&_fba_cached[block >> 6], bit,
+                              __ATOMIC_RELAXED) &
+            bit) == 0;
+}
+
+static inline void cached_clear(uint64_t block) {
+    if (_fba_cached) {
+        __atomic_fetch_and(&_fba_cached[block >> 6], ~(1ULL << (block & 63)),
+                           __ATOMIC_RELAXED);
+    }
+}
+
+static inline uint64_t block_index(uintptr_t block_address) {
+    return (block_address - _fba_begin) / VM_PAGE_SIZE;
+}
+
+// Find the first bitmap word at or after `word` with a free block,
+// skipping full ones via the summaries. Returns the bitmap size (in
+// words) if there isn't one.
+static inline uint64_t next_free_word(uint64_t word) {
+    uint64_t summary_word = word >> 6;
+
+    if (summary_word >= _fba_summary_quads) {
+        return _fba_bitmap_size_quads;
+    }
+
+    uint64_t bits = _fba_summary[summary_word] & (~0ULL << (word & 63));
+
+    while (bits == 0) {
+        // Nothing more in this summary word - find the next one that
+        // has something, from the top level...
+        summary_word++;
+
+        uint64_t top_word = summary_word >> 6;
+
+        if (top_word >= _fba_summary_top_quads) {
+            return _fba_bitmap_size_quads;
+        }
+
+        uint64_t top_bits =
+                _fba_summary_top[top_word] & (~0ULL << (summary_word & 63));
+
+        while (top_bits == 0) {
+            if (++top_word >= _fba_summary_top_quads) {
+                return _fba_bitmap_size_quads;
+            }
+
+            top_bits = _fba_summary_top[top_word];
+        }
+
+        summary_word = (top_word << 6) + __builtin_ctzll(top_bits);
+        bits = _fba_summary[summary_word];
+    }
+
+    return (summary_word << 6) + __builtin_ctzll(bits);
+}
+
 bool fba_init(uint64_t *pml4, uintptr_t fba_begin, uint64_t fba_size_blocks) {
     if ((fba_begin & 0xfff) != 0) { // begin must be page aligned
         return false;
@@ -70,6 +200,11 @@ bool fba_init(uint64_t *pml4, uintptr_t fba_begin, uint64_t fba_size_blocks) {
         return true;
     }
 
+    if (fba_size_blocks > FBA_MAX_BLOCKS) {
+        // too big for the summaries
+        return false;
+    }
+
     uint64_t bitmap_page_count = fba_size_blocks >> 15;
     uint64_t bitmap_page_end = fba_begin + (bitmap_page_count << 12);
 
@@ -93,16 +228,38 @@ bool fba_init(uint64_t *pml4, uintptr_t fba_begin, uint64_t fba_size_blocks) {
     _fba_bitmap_size_blocks = bitmap_page_count;
     _fba_bitmap_size_quads = bitmap_page_count << 9;
     _fba_bitmap_size_bits = _fba_bitmap_size_quads << 6;
-
-    // Mark blocks used by the bitmap as in-use
-    for (int i = 0; i < bitmap_page_count; i++) {
-        bitmap_set((uint64_t *)fba_begin, i);
-    }
+    _fba_summary_quads = _fba_bitmap_size_quads >> 6;
+    _fba_summary_top_quads = (_fba_summary_quads + 63) >> 6;
 
     _fba_bitmap = (uint64_t *)_fba_begin;
     _fba_bitmap_end = _fba_bitmap + (bitmap_page_count << 9);
 
+    // Everything starts out free...
+    for (uint64_t i = 0; i < _fba_bitmap_size_quads; i++) {
+        _fba_bitmap[i] = 0;
+    }
+
+    for (uint64_t i = 0; i < _fba_summary_quads; i++) {
+        _fba_summary[i] = 0xffffffffffffffff;
+    }
+
+    for (uint64_t i = 0; i < _fba_summary_top_quads; i++) {
+        _fba_summary_top[i] = 0;
+    }
+
+    for (uint64_t i = 0; i < _fba_summary_quads; i++) {
+        _fba_summary_top[i >> 6] |= 1ULL << (i & 63);
+    }
+
+    // ... except the blocks used by the bitmap itself
+    for (int i = 0; i < bitmap_page_count; i++) {
+        block_set(i);
+    }
+
     _pml4 = pml4;
+    _fba_magazines = NULL;
+    _fba_cached = NULL;
+    _fba_lazy_count = 0;
 
     return true;
 }
@@ -120,8 +277,203 @@ static inline void *do_alloc(uintptr_t block_address) {
     return (void *)block_address;
 }
 
-// This is kinda messy, but should be _reasonably_ performant.
-// TODO Once SIMD etc is supported it could be optimised much more...
+static inline void free_pages(uint64_t *pages, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        page_free(physical_region, pages[i]);
+    }
+}
+
+// Free the page that was mapped at a block, warning if there wasn't one
+static inline void free_unmapped_page(uintptr_t block_address,
+                                      uintptr_t phys) {
+    if (!phys) {
+#ifdef UNIT_TESTS
+        tprintf("WARN: fba_free: unmap failed for block address 0x%016x\n",
+                block_address);
+#else
+        debugstr("WARN: fba_free: unmap failed for block address ");
+        printhex64(block_address, debugchar);
+        debugstr(" [PML4: ");
+        printhex64((uint64_t)_pml4, debugchar);
+        debugstr("]\n");
+#endif
+    } else {
+        page_free(physical_region, phys);
+    }
+}
+
+// Unmap a run of allocated blocks and free their physical pages.
+// The blocks must still be marked in use while this runs.
+static void unmap_blocks(uintptr_t block_address, uint64_t count) {
+    uintptr_t phys[FBA_BATCH_PAGES];
+
+    while (count) {
+        uint64_t batch = count < FBA_BATCH_PAGES ? count : FBA_BATCH_PAGES;
+        vmm_unmap_range_in(_pml4, block_address, batch, phys);
+
+        for (uint64_t i = 0; i < batch; i++) {
+            free_unmapped_page(block_address + i * VM_PAGE_SIZE, phys[i]);
+        }
+
+        block_address += batch * VM_PAGE_SIZE;
+        count -= batch;
+    }
+}
+
+// Unmap everything on the lazy-free list with a single flush, free the
+// pages and give the blocks back to the bitmap. Returns the number of
+// blocks freed. Caller must hold the lock.
+static uint64_t lazy_flush(void) {
+    uintptr_t phys[FBA_LAZY_FREE_BATCH];
+    uint64_t count = _fba_lazy_count;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // This flushes the whole batch from every CPU's TLB in one go (a
+    // single shootdown) before it returns, so the pages can't still be
+    // in use anywhere once they're freed below...
+    vmm_unmap_pages_in(_pml4, _fba_lazy, count, phys);
+
+    for (uint64_t i = 0; i < count; i++) {
+        free_unmapped_page(_fba_lazy[i], phys[i]);
+        block_clear(block_index(_fba_lazy[i]));
+        cached_clear(block_index(_fba_lazy[i]));
+    }
+
+    _fba_lazy_count = 0;
+    return count;
+}
+
+// Put an allocated block on the lazy-free list (unless it's already
+// there), flushing the list once it's full. Caller must hold the lock.
+static inline void lazy_free(uintptr_t block_address) {
+    for (uint64_t i = 0; i < _fba_lazy_count; i++) {
+        if (_fba_lazy[i] == block_address) {
+            return;
+        }
+    }
+
+    _fba_lazy[_fba_lazy_count++] = block_address;
+
+    if (_fba_lazy_count == FBA_LAZY_FREE_BATCH) {
+        lazy_flush();
+    }
+}
+
+static inline uint8_t first_set_bit_64(uint64_t nonzero_uint64) {
+#if defined(__GNUC__) || defined(__clang__)
+    // GCC & Clang have a nice intrinsic for this, as long as value is never
+    // zero...
+    return __builtin_ctzll(nonzero_uint64);
+#else
+    // Otherwise, fallback to De Bruijn sequence...
+    static const int DeBruijnTable[64] = {
+            0,  1,  48, 2,  57, 49, 28, 3,  61, 58, 50, 42, 38, 29, 17, 4,
+            62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
+            63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+            46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9,  13, 8,  7,  6};
+
+    // Isolate least significant set bit and multiply by De Bruijn constant
+    return DeBruijnTable[((nonzero_uint64 & -nonzero_uint64) *
+                          ((uint64_t)(0x03f79d71b4cb0a89))) >>
+                         58];
+#endif
+}
+
+// Find a free block, flushing the lazy-free list to make one if need
+// be. Returns the bitmap size (in blocks) if there isn't one. Caller
+// must hold the lock.
+static inline uint64_t find_free_block(uint64_t from_word) {
+    uint64_t word = next_free_word(from_word);
+
+    if (word == _fba_bitmap_size_quads && lazy_flush()) {
+        word = next_free_word(0);
+    }
+
+    if (word == _fba_bitmap_size_quads) {
+        return _fba_bitmap_size_bits;
+    }
+
+    return (word << 6) + first_set_bit_64(~_fba_bitmap[word]);
+}
+
+// Back a run of blocks with physical pages, mapping them a batch at a
+// time. If that fails part way through, everything mapped so far is
+// unmapped and freed again. Caller must hold the lock.
+static bool map_blocks(uintptr_t block_address, uint64_t count) {
+    uint64_t pages[FBA_BATCH_PAGES];
+    uint64_t done = 0;
+
+    while (done < count) {
+        uint64_t batch =
+                count - done < FBA_BATCH_PAGES ? count - done : FBA_BATCH_PAGES;
+        uintptr_t batch_address = block_address + done * VM_PAGE_SIZE;
+
+        for (uint64_t i = 0; i < batch; i++) {
+            pages[i] = page_alloc(physical_region);
+
+            if (pages[i] & 0xfff) {
+                // not page aligned, signals error.
+                free_pages(pages, i);
+                unmap_blocks(block_address, done);
+                return false;
+            }
+        }
+
+        if (!vmm_map_pages_in(_pml4, batch_address, pages, batch,
+                              PRESENT | WRITE)) {
+            vmm_unmap_range_in(_pml4, batch_address, batch, NULL);
+            free_pages(pages, batch);
+            unmap_blocks(block_address, done);
+            return false;
+        }
+
+        done += batch;
+    }
+
+    return true;
+}
+
+// Mask with a bit set at each multiple of `align` within a word
+// (align must be a power of 2 and <= 64)
+static inline uint64_t align_starts(uint8_t align) {
+    if (align == 64) {
+        return 1;
+    }
+
+    return 0xffffffffffffffff / ((1ULL << align) - 1);
+}
+
+// Bit i in the result is set if bits i to i + n - 1 are all set in
+// `free` (n must be 1 - 64). Each step doubles the length of run
+// checked, so this is at most six shift-ANDs.
+static inline uint64_t runs_within(uint64_t free, uint64_t n) {
+    uint64_t runs = free;
+    uint64_t len = 1;
+
+    while (len < n) {
+        uint64_t shift = n - len < len ? n - len : len;
+        runs &= runs >> shift;
+        len += shift;
+    }
+
+    return runs;
+}
+
+// Find the first run of `n` unset bits starting on a multiple of
+// `align_page_count`, a word at a time:
+//
+//   * A run carried over from previous words is extended by the free
+//     bits at the bottom of the word (trailing zeroes);
+//   * Runs of up to 64 that fit in the word are found with shift-ANDs,
+//     masked to the aligned start positions;
+//   * Whatever is free at the top of the word (leading zeroes), from
+//     the first aligned bit, starts the run carried into the next.
+//
+// Full words are skipped using the summaries (so `bitmap` must be the
+// FBA bitmap) whenever there's no run being carried.
 //
 // align_page_count must be a power of 2 and <= 64
 //
@@ -131,108 +483,53 @@ static inline uint64_t find_unset_run(const uint64_t *bitmap,
     if (n == 0 || num_quads == 0)
         return 0;
 
-    // Create alignment mask (align_page_count is power of 2)
     uint64_t align_mask = align_page_count - 1;
+    uint64_t aligned = align_starts(align_page_count);
+
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+
+    for (uint64_t word_idx = 0; word_idx < num_quads; word_idx++) {
+        if (run_length == 0) {
+            word_idx = next_free_word(word_idx);
 
-    uint64_t consec_zeroes = 0;
-    uint64_t start_bit = 0;
-
-    // Handle special case where n <= 64 more efficiently
-    if (n <= 64) {
-        for (uint64_t word_idx = 0; word_idx < num_quads; word_idx++) {
-            uint64_t word = bitmap[word_idx];
-            if (word == 0) {
-                // Whole word is zero
-                if (consec_zeroes == 0) {
-                    // Check alignment of potential start
-                    uint64_t current_bit = word_idx * 64;
-                    uint64_t aligned_start =
-                            (current_bit + align_mask) & ~align_mask;
-                    if (aligned_start != current_bit) {
-                        // Skip to next aligned position
-                        consec_zeroes = 0;
-                        continue;
-                    }
-                    start_bit = current_bit;
-                }
-                consec_zeroes += 64;
-                if (consec_zeroes >= n) {
-                    return start_bit;
-                }
-            } else if (word == (uint64_t)(0xffffffffffffffff)) {
-                consec_zeroes = 0;
-            } else {
-                // Mixed word - check each bit
-                for (int bit_idx = 0; bit_idx < 64; bit_idx++) {
-                    uint64_t current_bit = word_idx * 64 + bit_idx;
-                    if (!(word & ((uint64_t)(1) << bit_idx))) {
-                        if (consec_zeroes == 0) {
-                            // Check alignment
-                            uint64_t aligned_start =
-                                    (current_bit + align_mask) & ~align_mask;
-                            if (aligned_start != current_bit) {
-                                // Skip to next aligned position
-                                continue;
-                            }
-                            start_bit = current_bit;
-                        }
-                        consec_zeroes++;
-                        if (consec_zeroes == n) {
-                            return start_bit;
-                        }
-                    } else {
-                        consec_zeroes = 0;
-                    }
-                }
+            if (word_idx >= num_quads) {
+                break;
             }
         }
-        return num_quads << 6;
-    }
 
-    // For n > 64
-    for (uint64_t word_idx = 0; word_idx < num_quads; word_idx++) {
         uint64_t word = bitmap[word_idx];
-        if (word == 0) {
-            if (consec_zeroes == 0) {
-                // Check alignment of potential start
-                uint64_t current_bit = word_idx * 64;
-                uint64_t aligned_start =
-                        (current_bit + align_mask) & ~align_mask;
-                if (aligned_start != current_bit) {
-                    // Skip to next aligned position
-                    continue;
-                }
-                start_bit = current_bit;
+        uint64_t base = word_idx << 6;
+
+        if (run_length) {
+            uint64_t low_free = word ? __builtin_ctzll(word) : 64;
+
+            if (run_length + low_free >= n) {
+                return run_start;
             }
-            consec_zeroes += 64;
-            if (consec_zeroes >= n) {
-                return start_bit;
+
+            if (low_free == 64) {
+                run_length += 64;
+                continue;
             }
-        } else if (word == (uint64_t)(0xffffffffffffffff)) {
-            consec_zeroes = 0;
-        } else {
-            for (int bit_idx = 0; bit_idx < 64; bit_idx++) {
-                uint64_t current_bit = word_idx * 64 + bit_idx;
-                if (!(word & ((uint64_t)(1) << bit_idx))) {
-                    if (consec_zeroes == 0) {
-                        // Check alignment
-                        uint64_t aligned_start =
-                                (current_bit + align_mask) & ~align_mask;
-                        if (aligned_start != current_bit) {
-                            continue;
-                        }
-                        start_bit = current_bit;
-                    }
-                    consec_zeroes++;
-                    if (consec_zeroes == n) {
-                        return start_bit;
-                    }
-                } else {
-                    consec_zeroes = 0;
-                }
+
+            run_length = 0;
+        }
+
+        if (n <= 64) {
+            uint64_t runs = runs_within(~word, n) & aligned;
+
+            if (runs) {
+                return base + __builtin_ctzll(runs);
             }
         }
+
+        uint64_t high_free = word ? __builtin_clzll(word) : 64;
+
+        run_start = (base + 64 - high_free + align_mask) & ~align_mask;
+        run_length = base + 64 - run_start;
     }
+
     return num_quads << 6;
 }
 
@@ -240,6 +537,39 @@ void *fba_alloc_blocks(uint32_t count) {
     return fba_alloc_blocks_aligned(count, 1);
 }
 
+static void *alloc_blocks_aligned(uint32_t count, uint8_t page_align) {
+    SPIN_LOCK();
+    uint64_t *bmp = _fba_bitmap;
+    uint64_t bit =
+            find_unset_run(bmp, _fba_bitmap_size_quads, page_align, count);
+
+    if (bit == _fba_bitmap_size_bits) {
+        tprintf("Unable to satisfy request for %d blocks\n", count);
+        SPIN_UNLOCK_RET(NULL);
+    }
+
+    tprintf("Bit is %ld\n", bit);
+
+    uintptr_t first_block_address =
+            _fba_begin + ((bmp - _fba_bitmap) * 64 + bit) * VM_PAGE_SIZE;
+
+    for (int i = 0; i < count; i++) {
+        block_set(bit + i);
+    }
+
+    if (!map_blocks(first_block_address, count)) {
+        tprintf("Unable to back request for %d blocks\n", count);
+
+        for (int i = 0; i < count; i++) {
+            block_clear(bit + i);
+        }
+
+        SPIN_UNLOCK_RET(NULL);
+    }
+
+    SPIN_UNLOCK_RET((void *)first_block_address);
+}
+
 void *fba_alloc_blocks_aligned(uint32_t count, uint8_t page_align) {
     tprintf("bmp     = %p\n", _fba_bitmap);
     tprintf("bmp_end = %p\n", _fba_bitmap_end);
@@ -254,130 +584,226 @@ void *fba_alloc_blocks_aligned(uint32_t count, uint8_t page_align) {
         return NULL;
     }
 
-    SPIN_LOCK();
-    uint64_t *bmp = _fba_bitmap;
-    uint64_t bit =
-            find_unset_run(bmp, _fba_bitmap_size_quads, page_align, count);
+    void *result = alloc_blocks_aligned(count, page_align);
 
-    if (bit == _fba_bitmap_size_bits) {
-        tprintf("Unable to satisfy request for %d blocks\n", count);
-        SPIN_UNLOCK_RET(NULL);
+    // If that failed, the blocks (or pages) waiting to be unmapped, or
+    // sitting in this CPU's magazine, might be enough to make it work...
+    if (result == NULL &&
+        fba_shrink_cpu_magazine() + fba_flush_lazy_frees() > 0) {
+        result = alloc_blocks_aligned(count, page_align);
     }
 
-    tprintf("Bit is %ld\n", bit);
+    return result;
+}
 
-    uintptr_t first_block_address =
-            _fba_begin + ((bmp - _fba_bitmap) * 64 + bit) * VM_PAGE_SIZE;
+// Move up to a batch of free blocks from the bitmap into the magazine
+// (as cached), and back them with pages. The mapping is done after
+// dropping the lock - nobody else can have the blocks by then. Must be
+// called with interrupts disabled...
+static void magazine_refill(PerCPUBlockMagazine *magazine) {
+    uint64_t first = magazine->count;
+    uint64_t block = 0;
 
-    for (int i = 0; i < count; i++) {
-        bitmap_set(bmp, bit + i);
-        uintptr_t block_address = _fba_begin + ((bmp - _fba_bitmap) * 64 + bit +
-                                                i) * VM_PAGE_SIZE;
-        if (!do_alloc(block_address)) {
-            // TODO we leak memory here if one fails - we should free whatever
-            // we've allocated in that case...
-#ifdef UNIT_TESTS
-            tprintf("Unable to satisfy request for %d blocks\n", count);
-#else
-            debugstr("WARN: fba_alloc_blocks: Failed to allocate block ");
-            printhex32(i, debugchar);
-            debugstr(" of ");
-            printhex32(count, debugchar);
-            debugstr(" requested; PROBABLE MEMORY LEAK\n");
-#endif
-            SPIN_UNLOCK_RET(NULL);
+    spinlock_lock(&fba_lock);
+
+    while (magazine->count < FBA_CPU_MAGAZINE_BATCH) {
+        block = find_free_block(block >> 6);
+
+        if (block == _fba_bitmap_size_bits) {
+            break;
         }
+
+        block_set(block);
+        cached_set(block);
+        magazine->blocks[magazine->count++] =
+                _fba_begin + block * VM_PAGE_SIZE;
     }
 
-    SPIN_UNLOCK_RET((void *)first_block_address);
+    spinlock_unlock(&fba_lock);
+
+    for (uint64_t i = first; i < magazine->count; i++) {
+        if (do_alloc(magazine->blocks[i]) == NULL) {
+            // Out of pages - give back the blocks we couldn't back
+            spinlock_lock(&fba_lock);
+
+            for (uint64_t j = i; j < magazine->count; j++) {
+                block_clear(block_index(magazine->blocks[j]));
+                cached_clear(block_index(magazine->blocks[j]));
+            }
+
+            spinlock_unlock(&fba_lock);
+
+            magazine->count = i;
+            break;
+        }
+    }
 }
 
-static inline uint8_t first_set_bit_64(uint64_t nonzero_uint64) {
-#if defined(__GNUC__) || defined(__clang__)
-    // GCC & Clang have a nice intrinsic for this, as long as value is never
-    // zero...
-    return __builtin_ctzll(nonzero_uint64);
-#else
-    // Otherwise, fallback to De Bruijn sequence...
-    static const int DeBruijnTable[64] = {
-            0,  1,  48, 2,  57, 49, 28, 3,  61, 58, 50, 42, 38, 29, 17, 4,
-            62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
-            63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
-            46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9,  13, 8,  7,  6};
+// Move the oldest `count` blocks in the magazine to the lazy-free list,
+// so recently-freed (likely hot) blocks stay cached. Must be called
+// with interrupts disabled...
+static void magazine_flush(PerCPUBlockMagazine *magazine, uint64_t count) {
+    spinlock_lock(&fba_lock);
 
-    // Isolate least significant set bit and multiply by De Bruijn constant
-    return DeBruijnTable[((nonzero_uint64 & -nonzero_uint64) *
-                          ((uint64_t)(0x03f79d71b4cb0a89))) >>
-                         58];
-#endif
+    for (uint64_t i = 0; i < count; i++) {
+        lazy_free(magazine->blocks[i]);
+    }
+
+    spinlock_unlock(&fba_lock);
+
+    for (uint64_t i = count; i < magazine->count; i++) {
+        magazine->blocks[i - count] = magazine->blocks[i];
+    }
+
+    magazine->count -= count;
+}
+
+void fba_init_cpu_magazines(PerCPUBlockMagazine *magazines,
+                            uint64_t *cached_bitmap) {
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        magazines[i].count = 0;
+    }
+
+    for (uint64_t i = 0; cached_bitmap && i < _fba_bitmap_size_quads; i++) {
+        cached_bitmap[i] = 0;
+    }
+
+    _fba_cached = cached_bitmap;
+    _fba_magazines = magazines;
+}
+
+uint64_t fba_shrink_cpu_magazine(void) {
+    if (_fba_magazines == NULL) {
+        return 0;
+    }
+
+    uint64_t flags = cpu_save_disable_interrupts();
+    PerCPUBlockMagazine *magazine = &_fba_magazines[cpu_current_id()];
+    uint64_t count = magazine->count;
+
+    magazine_flush(magazine, count);
+
+    spinlock_lock(&fba_lock);
+    lazy_flush();
+    spinlock_unlock(&fba_lock);
+
+    cpu_restore_interrupts(flags);
+    return count;
+}
+
+uint64_t fba_flush_lazy_frees(void) {
+    uint64_t flags = spinlock_lock_irqsave(&fba_lock);
+    uint64_t count = lazy_flush();
+    spinlock_unlock_irqrestore(&fba_lock, flags);
+
+    return count;
 }
 
 void *fba_alloc_block() {
     tprintf("bmp     = %p\n", _fba_bitmap);
     tprintf("bmp_end = %p\n", _fba_bitmap_end);
 
-    SPIN_LOCK();
+    if (_fba_magazines) {
+        uint64_t flags = cpu_save_disable_interrupts();
+        PerCPUBlockMagazine *magazine = &_fba_magazines[cpu_current_id()];
 
-    uint64_t *bmp;
-    for (bmp = _fba_bitmap; bmp < _fba_bitmap_end; bmp++) {
-        if (*bmp != 0xffffffffffffffff) {
-            tprintf("Block %p has space [0x%016lx]!\n", bmp, *bmp);
-            break;
+        if (magazine->count == 0) {
+            magazine_refill(magazine);
+        }
+
+        void *block = NULL;
+        if (magazine->count > 0) {
+            block = (void *)magazine->blocks[--magazine->count];
+            cached_clear(block_index((uintptr_t)block));
         }
+
+        cpu_restore_interrupts(flags);
+        return block;
     }
 
-    if (bmp == _fba_bitmap_end) {
+    SPIN_LOCK();
+
+    uint64_t block = find_free_block(0);
+
+    if (block == _fba_bitmap_size_bits) {
         tprintf("All blocks are full\n");
         SPIN_UNLOCK_RET(NULL);
     }
 
-    int bit = first_set_bit_64(~(*bmp));
-    bitmap_set(bmp, bit);
-    uintptr_t block_address =
-            _fba_begin + ((bmp - _fba_bitmap) * 64 + bit) * VM_PAGE_SIZE;
+    tprintf("Block %ld is free!\n", block);
+
+    block_set(block);
+    uintptr_t block_address = _fba_begin + block * VM_PAGE_SIZE;
     SPIN_UNLOCK_RET(do_alloc(block_address));
 }
 
 void fba_free(void *block) {
+    uintptr_t block_address = (uintptr_t)block & PAGE_ALIGN_MASK;
+    uintptr_t fba_end = _fba_begin + (_fba_size_blocks * VM_PAGE_SIZE);
+
+    if (_fba_magazines == NULL || block_address < _fba_begin ||
+        block_address >= fba_end) {
+        fba_free_blocks(block, 1);
+        return;
+    }
+
+    uint64_t block_idx = block_index(block_address);
+
+    if (!bitmap_check(_fba_bitmap, block_idx)) {
+        // Not allocated
+        return;
+    }
+
+    if (!cached_set(block_idx)) {
+        // Already freed (in a magazine, or waiting to be unmapped)
+        return;
+    }
+
+    uint64_t flags = cpu_save_disable_interrupts();
+    PerCPUBlockMagazine *magazine = &_fba_magazines[cpu_current_id()];
+
+    if (magazine->count == FBA_CPU_MAGAZINE_SIZE) {
+        magazine_flush(magazine, FBA_CPU_MAGAZINE_BATCH);
+    }
+
+    magazine->blocks[magazine->count++] = block_address;
+
+    cpu_restore_interrupts(flags);
+}
+
+void fba_free_blocks(void *block, uint32_t count) {
     if (block == NULL) {
         return;
     }
 
     uintptr_t block_address = (uintptr_t)block;
-    if (block_address < _fba_begin ||
-        block_address >= _fba_begin + (_fba_size_blocks * VM_PAGE_SIZE)) {
+    uintptr_t fba_end = _fba_begin + (_fba_size_blocks * VM_PAGE_SIZE);
+
+    if (block_address < _fba_begin || block_address >= fba_end) {
         // Address is out of range
         return;
     }
 
-    spinlock_lock(&fba_lock);
+    uint64_t first_block = (block_address - _fba_begin) / VM_PAGE_SIZE;
+    uint64_t end_block = first_block + count;
 
-    uint64_t block_index = (block_address - _fba_begin) / VM_PAGE_SIZE;
-    uint64_t quad_index = block_index / 64;
-    uint64_t bit_index = block_index % 64;
+    if (end_block > _fba_size_blocks) {
+        end_block = _fba_size_blocks;
+    }
 
-    if (bitmap_check(_fba_bitmap + quad_index, bit_index)) {
-        bitmap_clear(_fba_bitmap + quad_index, bit_index);
-        uintptr_t phys = vmm_unmap_page_in(_pml4, block_address);
+    uint64_t flags = spinlock_lock_irqsave(&fba_lock);
 
-        if (!phys) {
-#ifdef UNIT_TESTS
-            tprintf("WARN: fba_free: vmm_unmap_page_in failed for block "
-                    "address "
-                    "0x%016x\n",
-                    block_address);
-#else
-            debugstr("WARN: fba_free: vmm_unmap_page_in failed for block "
-                     "address ");
-            printhex64(block_address, debugchar);
-            debugstr(" [PML4: ");
-            printhex64((uint64_t)_pml4, debugchar);
-            debugstr("]\n");
-#endif
-        } else {
-            page_free(physical_region, phys);
+    // Skipping any that aren't allocated, or are already freed...
+    for (uint64_t block_idx = first_block; block_idx < end_block;
+         block_idx++) {
+        uint64_t quad_index = block_idx / 64;
+        uint64_t bit_index = block_idx % 64;
+
+        if (bitmap_check(_fba_bitmap + quad_index, bit_index) &&
+            cached_set(block_idx)) {
+            lazy_free(_fba_begin + block_idx * VM_PAGE_SIZE);
         }
     }
 
-    spinlock_unlock(&fba_lock);
-}
\ No newline at end of file
+    spinlock_unlock_irqrestore(&fba_lock, flags);
+}
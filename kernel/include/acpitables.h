@@ -81,4 +81,13 @@ BIOS_SDTHeader *map_acpi_tables(BIOS_RSDP *rsdp);
 
 BIOS_SDTHeader *find_acpi_table(BIOS_SDTHeader *rsdp, const char *ident);
 
+/*
+ * Find the local APIC IDs of the enabled processors listed in the
+ * MADT, in the order they're listed. At most `max` are stored in
+ * `apic_ids`.
+ *
+ * Returns the number stored.
+ */
+uint8_t acpi_madt_cpus(BIOS_SDTHeader *madt, uint8_t *apic_ids, uint8_t max);
+
 #endif //__ANOS_KERNEL_ACPITABLES_H
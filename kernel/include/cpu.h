@@ -0,0 +1,129 @@
+/*
+ * stage3 - Per-CPU basics
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Small helpers for code that keeps per-CPU state (e.g. allocator
+ * caches) and needs to know which CPU it's running on, or to keep
+ * itself from being interrupted while it touches that state.
+ */
+
+#ifndef __ANOS_KERNEL_CPU_H
+#define __ANOS_KERNEL_CPU_H
+
+#include <stdint.h>
+
+// Upper bound on the number of CPUs the kernel will manage. Anything
+// sized per-CPU is sized by this...
+#ifndef MAX_CPU_COUNT
+#define MAX_CPU_COUNT 16
+#endif
+
+#ifdef UNIT_TESTS
+// Tests provide these (see tests/test_cpu.c), so they can pretend
+// different threads are different CPUs...
+uint8_t cpu_current_id(void);
+uint64_t cpu_save_disable_interrupts(void);
+void cpu_restore_interrupts(uint64_t flags);
+#else
+#include "percpu.h"
+
+#define MSR_GS_BASE 0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+/*
+ * Point this CPU's GS base at its per-CPU data. The other (user) GS
+ * base is zeroed, ready for the first `swapgs` out to user mode.
+ *
+ * Until this has been done, nothing below here (and nothing that uses
+ * per-CPU data) will work!
+ */
+static inline void cpu_init_data(PerCPUState *state) {
+    uint64_t addr = (uint64_t)state;
+
+    __asm__ volatile("wrmsr\n\t"
+                     :
+                     : "c"(MSR_GS_BASE), "a"((uint32_t)addr),
+                       "d"((uint32_t)(addr >> 32))
+                     : "memory");
+    __asm__ volatile("wrmsr\n\t"
+                     :
+                     : "c"(MSR_KERNEL_GS_BASE), "a"(0), "d"(0)
+                     : "memory");
+}
+
+/*
+ * Get (a plain pointer to) this CPU's per-CPU data.
+ */
+static inline PerCPUState *cpu_get_data(void) {
+    PerCPUState *state;
+    __asm__ volatile("mov %%gs:%c1, %0\n\t"
+                     : "=r"(state)
+                     : "i"(__builtin_offsetof(PerCPUState, self)));
+    return state;
+}
+
+/*
+ * Get the (zero-based, dense) index of the CPU we're running on.
+ */
+static inline uint8_t cpu_current_id(void) {
+    uint8_t id;
+    __asm__ volatile("movb %%gs:%c1, %0\n\t"
+                     : "=r"(id)
+                     : "i"(__builtin_offsetof(PerCPUState, cpu_id)));
+    return id;
+}
+
+/*
+ * Disable interrupts on this CPU, returning the previous RFLAGS
+ * for use with `cpu_restore_interrupts`.
+ */
+static inline uint64_t cpu_save_disable_interrupts(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq\n\t"
+                     "pop %0\n\t"
+                     "cli\n\t"
+                     : "=r"(flags)
+                     :
+                     : "memory");
+    return flags;
+}
+
+/*
+ * Restore the interrupt flag saved by `cpu_save_disable_interrupts`.
+ */
+static inline void cpu_restore_interrupts(uint64_t flags) {
+    if (flags & 0x200) {
+        __asm__ volatile("sti\n\t" : : : "memory");
+    }
+}
+
+/*
+ * Read the timestamp counter.
+ */
+static inline uint64_t cpu_read_tsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc\n\t" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/*
+ * Execute CPUID for the given leaf (with subleaf zero).
+ */
+static inline void cpu_cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+                             uint32_t *ecx, uint32_t *edx) {
+    __asm__ volatile("cpuid\n\t"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(0));
+}
+#endif
+
+/*
+ * Hint to the CPU that we're in a spin-wait loop.
+ */
+static inline void cpu_relax(void) {
+    __asm__ volatile("pause\n\t" : : : "memory");
+}
+
+#endif //__ANOS_KERNEL_CPU_H
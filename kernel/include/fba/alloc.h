@@ -21,11 +21,96 @@
 #define KERNEL_FBA_SIZE ((0x40000000))
 #define KERNEL_FBA_END ((KERNEL_FBA_BEGIN + KERNEL_FBA_SIZE - 1))
 
+// Most blocks `fba_init` will accept - the bitmap summaries are static,
+// and sized for this many.
+#ifndef FBA_MAX_BLOCKS
+#define FBA_MAX_BLOCKS ((KERNEL_FBA_SIZE >> 12))
+#endif
+
+// Number of blocks each per-CPU magazine can hold
+#ifndef FBA_CPU_MAGAZINE_SIZE
+#define FBA_CPU_MAGAZINE_SIZE 32
+#endif
+
+// Number of blocks moved between a per-CPU magazine and the FBA in
+// one go when refilling or flushing
+#ifndef FBA_CPU_MAGAZINE_BATCH
+#define FBA_CPU_MAGAZINE_BATCH 16
+#endif
+
+// Number of freed blocks collected on the lazy-free list before they're
+// all unmapped together
+#ifndef FBA_LAZY_FREE_BATCH
+#define FBA_LAZY_FREE_BATCH 64
+#endif
+
+// Size of the buffer `fba_init_cpu_magazines` needs for its "cached"
+// bitmap (a bit per block)
+#define FBA_CACHED_BITMAP_QUADS ((FBA_MAX_BLOCKS >> 6))
+
+/*
+ * A per-CPU magazine of free blocks, which are still allocated in the
+ * bitmap and still mapped - so handing one out (or taking one back)
+ * needs no lock and no page-table work. Only ever touched by its own
+ * CPU (with interrupts disabled). Aligned so neighbouring CPUs'
+ * magazines don't share cache lines.
+ */
+typedef struct {
+    uint64_t count;
+    uintptr_t blocks[FBA_CPU_MAGAZINE_SIZE];
+} __attribute__((aligned(64))) PerCPUBlockMagazine;
+
 bool fba_init(uint64_t *pml4, uintptr_t fba_begin, uint64_t fba_size_blocks);
 
+/*
+ * Enable per-CPU block magazines for `fba_alloc_block` and `fba_free`.
+ *
+ * The supplied buffer must have room for `MAX_CPU_COUNT` magazines, and
+ * will be zeroed. Magazines are refilled (and flushed) in batches of
+ * `FBA_CPU_MAGAZINE_BATCH` blocks.
+ *
+ * `cached_bitmap` (`FBA_CACHED_BITMAP_QUADS` quads, also zeroed here)
+ * tracks which allocated-in-the-bitmap blocks are actually free, sitting
+ * in a magazine or on the lazy-free list - so freeing one of those again
+ * is caught, rather than it being handed out twice. That costs an atomic
+ * on every alloc and free, so it's for debugging - pass NULL to skip it
+ * (and the kernel does, unless built with DEBUG_MAGAZINE_DOUBLE_FREE).
+ *
+ * The FBA starts out without magazines (and `fba_init` turns them off
+ * again).
+ */
+void fba_init_cpu_magazines(PerCPUBlockMagazine *magazines,
+                            uint64_t *cached_bitmap);
+
+/*
+ * Unmap and free all the blocks in the current CPU's magazine, for use
+ * under memory pressure.
+ *
+ * Returns the number of blocks freed (zero without magazines).
+ */
+uint64_t fba_shrink_cpu_magazine(void);
+
 void *fba_alloc_blocks_aligned(uint32_t count, uint8_t page_align);
 void *fba_alloc_blocks(uint32_t count);
 void *fba_alloc_block();
+
+/*
+ * Freed blocks aren't unmapped straight away - they go on a lazy-free
+ * list (still marked in use, so they can't be handed out again) until
+ * there are `FBA_LAZY_FREE_BATCH` of them, and are then unmapped with
+ * a single TLB flush.
+ */
 void fba_free(void *block);
+void fba_free_blocks(void *block, uint32_t count);
+
+/*
+ * Unmap and free everything on the lazy-free list now.
+ *
+ * Allocations do this themselves if they'd otherwise fail, so it's
+ * only needed to get the pages back sooner.
+ *
+ * Returns the number of blocks freed.
+ */
+uint64_t fba_flush_lazy_frees(void);
 
 #endif //__ANOS_KERNEL_PMM_FBA_ALLOC_H
\ No newline at end of file
@@ -20,6 +20,9 @@
 
 #define GDT_ENTRY_ACCESS_DPL(dpl) (((dpl & 0x03) << 5))
 
+// System segment type for an available 64-bit TSS
+#define GDT_ENTRY_ACCESS_TSS_AVAILABLE 0x09
+
 #define GDT_ENTRY_ACCESS_RING0 0x00
 #define GDT_ENTRY_ACCESS_RING1 0x20
 #define GDT_ENTRY_ACCESS_RING2 0x40
@@ -46,6 +49,20 @@ typedef struct {
     uint8_t base_high;
 } __attribute__((packed)) GDTEntry;
 
+// 64-bit Task State Segment. Its GDT entry takes two slots, the second
+// one being the high half of the base.
+typedef struct {
+    uint32_t reserved0;
+    uint64_t rsp0;
+    uint64_t rsp1;
+    uint64_t rsp2;
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iopb;
+} __attribute__((packed)) TaskStateSegment;
+
 // Execute `lgdt` to load a variable with the GDTR
 static inline void load_gdtr(GDTR *gdtr) {
     __asm__ __volatile__("lgdt (%0)" : : "r"(gdtr));
@@ -40,4 +40,10 @@ void idt_r(Idtr *target, uintptr_t base, uint16_t limit);
 
 void idt_install(uint16_t kernel_cs);
 
+/*
+ * Load the IDT set up by `idt_install` on an AP. Interrupts are left
+ * disabled.
+ */
+void idt_install_ap(void);
+
 #endif
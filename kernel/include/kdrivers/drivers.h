@@ -16,6 +16,8 @@
 
 #include <stdint.h>
 
+#include "acpitables.h"
+
 #define KERNEL_HARDWARE_VADDR_BASE 0xffffffa000000000
 #define KERNEL_DRIVER_VADDR_BASE 0xffffffff81008000
 
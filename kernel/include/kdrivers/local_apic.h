@@ -9,6 +9,7 @@
 #define __ANOS_KERNEL_DRIVERS_LOCAL_APIC_H
 
 #include "acpitables.h"
+#include "kdrivers/drivers.h"
 #include <stdint.h>
 
 #define REG_LAPIC_ID_O 0x04
@@ -17,7 +18,10 @@
 #define REG_LAPIC_SPURIOUS_O 0x3c
 #define REG_LAPIC_DIVIDE_O 0xf8
 #define REG_LAPIC_INITIAL_COUNT_O 0xe0
+#define REG_LAPIC_CURRENT_COUNT_O 0xe4
 #define REG_LAPIC_LVT_TIMER_O 0xc8
+#define REG_LAPIC_ICR_LOW_O 0xc0
+#define REG_LAPIC_ICR_HIGH_O 0xc4
 
 #define LAPIC_REG(lapic, reg) ((lapic + REG_LAPIC##_##reg##_##O))
 
@@ -27,10 +31,19 @@
 #define REG_LAPIC_SPURIOUS(lapic) (LAPIC_REG(lapic, SPURIOUS))
 #define REG_LAPIC_DIVIDE(lapic) (LAPIC_REG(lapic, DIVIDE))
 #define REG_LAPIC_INITIAL_COUNT(lapic) (LAPIC_REG(lapic, INITIAL_COUNT))
+#define REG_LAPIC_CURRENT_COUNT(lapic) (LAPIC_REG(lapic, CURRENT_COUNT))
 #define REG_LAPIC_LVT_TIMER(lapic) (LAPIC_REG(lapic, LVT_TIMER))
+#define REG_LAPIC_ICR_LOW(lapic) (LAPIC_REG(lapic, ICR_LOW))
+#define REG_LAPIC_ICR_HIGH(lapic) (LAPIC_REG(lapic, ICR_HIGH))
 
 #define LAPIC_TIMER_VECTOR (((uint8_t)0x30))
 
+// Timer ticks per second - the scheduler's time slices are counted
+// in these.
+#ifndef LAPIC_TIMER_HZ
+#define LAPIC_TIMER_HZ 1000
+#endif
+
 typedef struct {
     uint64_t base_address;
     uint8_t processor_id;
@@ -39,8 +52,38 @@ typedef struct {
     uint16_t reserved;
 } LocalAPIC;
 
+/*
+ * Map and enable the local APIC on this CPU, and start its timer at
+ * LAPIC_TIMER_HZ. The first call calibrates the timer (against the
+ * PIT), so should be on the BSP.
+ */
 void init_local_apic(BIOS_SDTHeader *madt);
 
 void local_apic_eoe();
 
+/*
+ * Send an INIT IPI to the CPU with the given local APIC ID.
+ */
+void local_apic_send_init(uint8_t apic_id);
+
+/*
+ * Send a STARTUP IPI to the CPU with the given local APIC ID. It'll
+ * start in real mode at `vector << 12`.
+ */
+void local_apic_send_startup(uint8_t apic_id, uint8_t vector);
+
+/*
+ * Send an NMI to the CPU with the given local APIC ID.
+ */
+void local_apic_send_nmi(uint8_t apic_id);
+
+/*
+ * Get the local APIC ID of the CPU we're running on. The LAPIC must
+ * have been mapped (by `init_local_apic`) first!
+ */
+static inline uint8_t local_apic_id(void) {
+    uint32_t volatile *lapic = (uint32_t *)(KERNEL_HARDWARE_VADDR_BASE);
+    return *REG_LAPIC_ID(lapic) >> 24;
+}
+
 #endif //__ANOS_KERNEL_DRIVERS_LOCAL_APIC_H
@@ -0,0 +1,28 @@
+/*
+ * stage3 - Legacy PIT (8254) kernel driver
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * The PIT isn't used as a timer - it's only here because it ticks at
+ * a known rate, so it can be used to work out how fast everything
+ * else does.
+ */
+
+#ifndef __ANOS_KERNEL_DRIVERS_PIT_H
+#define __ANOS_KERNEL_DRIVERS_PIT_H
+
+#include <stdint.h>
+
+#define PIT_HZ 1193182
+
+/*
+ * Busy-wait on PIT channel 2 for (roughly) the given number of
+ * milliseconds (max 54), and return the number of TSC ticks that
+ * took.
+ *
+ * Interrupts should be disabled, or the measurement may be off.
+ */
+uint64_t pit_measure_tsc(uint8_t millis);
+
+#endif //__ANOS_KERNEL_DRIVERS_PIT_H
@@ -12,6 +12,8 @@
 
 typedef enum {
     KTYPE_SLAB_HEADER = 1,
+    KTYPE_SLAB_CACHE_HEADER = 2,
+    KTYPE_KMALLOC_LARGE = 3,
 } KType;
 
 #endif //__ANOS_KERNEL_PROCESS_H
@@ -48,4 +48,7 @@ noreturn void halt_and_catch_fire(void);
 void outl(uint16_t port, uint32_t value);
 uint32_t inl(uint16_t port);
 
+void outb(uint16_t port, uint8_t value);
+uint8_t inb(uint16_t port);
+
 #endif //__ANOS_KERNEL_MACHINE_H
\ No newline at end of file
@@ -0,0 +1,60 @@
+/*
+ * stage3 - Per-CPU data
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Each CPU has one of these, and keeps its address in IA32_GS_BASE
+ * while it's in the kernel (with the user value in IA32_KERNEL_GS_BASE,
+ * `swapgs` on the way in and out of user mode swaps them over). That
+ * way anything in here is a single `gs:` relative load away, with no
+ * need to know which CPU we're on first.
+ */
+
+#ifndef __ANOS_KERNEL_PERCPU_H
+#define __ANOS_KERNEL_PERCPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gdt.h"
+#include "task.h"
+
+// Must match the number of entries set up in smp.c
+#define PERCPU_GDT_ENTRIES 7
+
+/*
+ * The assembly (syscall entry, task switch) depends on the layout of
+ * the first part of this (up to `cpu_id`) - if it changes, change the
+ * PERCPU_ offsets in there too!
+ */
+typedef struct PerCPUState {
+    struct PerCPUState *self; // Plain pointer to this, for C
+    uint64_t kernel_rsp;      // Kernel stack top for syscall entry
+    uint64_t user_rsp;        // Scratch - user stack during a syscall
+    Task *task_current;
+    uint8_t cpu_id;
+    uint8_t apic_id;
+    bool started;
+
+    // Scheduler
+    Task *idle_task;
+    Task *switch_requeue; // Goes back on the queue once we're off its stack
+    Task *switch_reap;    // Exited, freed once we're off its stack
+    uint64_t slice_ticks; // Left in the current task's time slice
+
+    // Statistics
+    uint64_t timer_ticks;
+    uint64_t context_switches;
+    uint64_t steals;     // Tasks taken from other CPUs' queues
+    uint64_t migrations; // Tasks run here that last ran on another CPU
+
+    // CPU setup
+    TaskStateSegment tss;
+    GDTEntry gdt[PERCPU_GDT_ENTRIES];
+    GDTR gdtr;
+    void *stack;
+    uint64_t startup_us;
+} PerCPUState;
+
+#endif //__ANOS_KERNEL_PERCPU_H
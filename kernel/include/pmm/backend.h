@@ -0,0 +1,83 @@
+/*
+ * stage3 - The page allocator backend interface
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * The page allocator is split into a front-end (pagealloc.c, which
+ * handles the per-CPU caches) and a backend that actually owns the
+ * free memory. Exactly one backend is linked into the kernel, chosen
+ * at build time with PMM_BACKEND (see the top-level Makefile).
+ *
+ * As well as the functions here, a backend implements `page_alloc_init`
+ * and `page_alloc_m` from pagealloc.h.
+ *
+ * Nothing outside the PMM should include this.
+ */
+
+#ifndef __ANOS_KERNEL_PMM_BACKEND_H
+#define __ANOS_KERNEL_PMM_BACKEND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "machine.h"
+#include "pmm/pagealloc.h"
+
+/*
+ * Take a single page from the backend.
+ *
+ * Caller must hold the region lock. Returns 0xFF (in the low byte) if
+ * there are no free pages.
+ */
+uint64_t pmm_backend_alloc_page(MemoryRegion *region);
+
+/*
+ * Give a single page back to the backend.
+ *
+ * Caller must hold the region lock.
+ */
+void pmm_backend_free_page(MemoryRegion *region, uint64_t page);
+
+/*
+ * Work out the page-aligned usable range for a memory map entry, with
+ * anything below `managed_base` cut off.
+ *
+ * Returns false if the entry isn't available memory, or there isn't
+ * at least a page of it left once it's been trimmed.
+ */
+static inline bool pmm_backend_entry_range(E820h_MemMapEntry *entry,
+                                           uint64_t managed_base,
+                                           uint64_t *start, uint64_t *end) {
+    if (entry->type != MEM_MAP_ENTRY_AVAILABLE || entry->length == 0) {
+        return false;
+    }
+
+    // Ensure start is page aligned
+    *start = entry->base & 0xFFFFFFFFFFFFF000;
+
+    // Grab end, and align that too
+    *end = (entry->base + entry->length) & 0xFFFFFFFFFFFFF000;
+
+    // Is the aligned base below the actual base for this block?
+    if (entry->base > *start) {
+        // Round up to next page boundary if so...
+        *start += 0x1000;
+    }
+
+    // Cut off any memory below the supplied managed base.
+    if (*start < managed_base) {
+        if (*end <= managed_base) {
+            // This block is entirely below the managed base, just skip it
+            return false;
+        } else {
+            // This block extends beyond the managed base, so adjust the start
+            *start = managed_base;
+        }
+    }
+
+    // Just in case we get a block < 4KiB
+    return *end > *start;
+}
+
+#endif //__ANOS_KERNEL_PMM_BACKEND_H
@@ -10,9 +10,34 @@
 
 #include <stdbool.h>
 
+#include "cpu.h"
 #include "machine.h"
 #include "spinlock.h"
 
+// Number of pages each per-CPU cache can hold
+#ifndef PMM_CPU_CACHE_SIZE
+#define PMM_CPU_CACHE_SIZE 32
+#endif
+
+// Number of pages moved between a per-CPU cache and the backend
+// in one go when refilling or draining
+#ifndef PMM_CPU_CACHE_BATCH
+#define PMM_CPU_CACHE_BATCH 16
+#endif
+
+// Largest block the buddy backend manages, as a power-of-two
+// number of pages (10 is 4MiB)
+#ifndef PMM_BUDDY_MAX_ORDER
+#define PMM_BUDDY_MAX_ORDER 10
+#endif
+
+// Size of the buffer the buddy backend expects to be given in
+// `page_alloc_init` - at two(ish) bits per page, the default is
+// enough for ~4GiB of physical address space.
+#ifndef PMM_BUDDY_BUFFER_SIZE
+#define PMM_BUDDY_BUFFER_SIZE 0x40000
+#endif
+
 typedef struct {
     uintptr_t phys_addr;
 } PhysPage;
@@ -22,12 +47,32 @@ typedef struct {
     uint64_t size;
 } MemoryBlock;
 
+/*
+ * A per-CPU hot cache of free pages, sitting in front of the shared
+ * backend. Only ever touched by its own CPU (with interrupts disabled)
+ * so needs no lock - other CPUs can only ask for it to be drained.
+ * Aligned so neighbouring CPUs' caches don't share cache lines.
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t pages[PMM_CPU_CACHE_SIZE];
+    bool drain; // Another CPU ran out - drain on next alloc / free
+} __attribute__((aligned(64))) PerCPUPageCache;
+
+/*
+ * Note that `free` only counts the pages held by the backend - pages
+ * sitting in per-CPU caches are accounted in the caches themselves.
+ *
+ * `sp` is only used by the stack backend. Any other backend keeps
+ * its state in the buffer immediately following this struct.
+ */
 typedef struct {
     SpinLock lock;
     uint64_t flags;
     uint64_t size;
     uint64_t free;
     MemoryBlock *sp;
+    PerCPUPageCache *cpu_caches;
 } MemoryRegion;
 
 /*
@@ -42,10 +87,18 @@ typedef struct {
  * Will also make sure all free areas are page-aligned.
  *
  * The supplied buffer will be used for the MemoryRegion struct,
- * as well as the stack of MemoryBlocks, which will grow upward
- * as needed, and must be able to accomodate a fully-fragmented
- * region. Growing upward means, if the buffer is in a virtual
- * alloc area, physical memory will only be allocated as it grows.
+ * as well as the backend's own data structures.
+ *
+ * With the stack backend, that's the stack of MemoryBlocks, which
+ * will grow upward as needed, and must be able to accomodate a
+ * fully-fragmented region. Growing upward means, if the buffer is in
+ * a virtual alloc area, physical memory will only be allocated as it
+ * grows.
+ *
+ * With the buddy backend, it's a set of bitmaps sized by the span of
+ * physical memory (around two bits per page), which must fit in
+ * `PMM_BUDDY_BUFFER_SIZE` bytes - memory beyond what will fit is
+ * ignored.
  *
  * Any memory found in the memory map that falls below the supplied
  * managed base address will be ignored by the allocator.
@@ -55,6 +108,33 @@ typedef struct {
 MemoryRegion *page_alloc_init(E820h_MemMap *memmap, uint64_t managed_base,
                               void *buffer);
 
+/*
+ * Enable per-CPU page caches for the given region.
+ *
+ * The supplied buffer must have room for `MAX_CPU_COUNT` caches, and
+ * will be zeroed. Once enabled, `page_alloc` and `page_free` will
+ * usually be satisfied from the current CPU's cache without taking the
+ * region lock - the cache is refilled from (or drained to) the
+ * backend `PMM_CPU_CACHE_BATCH` pages at a time.
+ *
+ * If the backend runs dry, the other CPUs' caches could still be holding
+ * pages. A CPU that finds it empty asks all the others to drain theirs,
+ * but they only do that on their next `page_alloc` / `page_free` - so
+ * allocations can still fail, until they do, while there are pages
+ * cached elsewhere. Callers that can wait should retry.
+ *
+ * Regions start out with no caches, which is fine for single-CPU use.
+ */
+void page_alloc_init_cpu_caches(MemoryRegion *region,
+                                PerCPUPageCache *caches);
+
+/*
+ * Return all pages in the current CPU's cache to the backend.
+ *
+ * Noop if the region has no per-CPU caches.
+ */
+void page_alloc_drain_cpu_cache(MemoryRegion *region);
+
 /*
  * Allocate a contiguous block of `count` physical pages.
  *
@@ -65,17 +145,46 @@ MemoryRegion *page_alloc_init(E820h_MemMap *memmap, uint64_t managed_base,
  * If unsuccessful, an unaligned number (with 0xFF in the least-significant
  * byte) will be returned.
  *
- * This will get harder to satisfy as memory gets fragmented (obviously)
- * but will only generally be used for memory-mapped buffers for devices,
- * so will likely be used mostly early in kernel start-up...
+ * With the stack backend, this will get harder to satisfy as memory gets
+ * fragmented (obviously) but will only generally be used for memory-mapped
+ * buffers for devices, so will likely be used mostly early in kernel
+ * start-up...
+ *
+ * The buddy backend coalesces freed pages back into larger blocks, so
+ * copes much better with fragmentation. It also returns blocks aligned
+ * to `count` rounded up to a power of two (so e.g. 512 pages will be
+ * 2MiB aligned), but can't allocate more than 2^PMM_BUDDY_MAX_ORDER
+ * pages in one go.
+ *
+ * Either way, the pages are freed individually with `page_free`.
  */
 uint64_t page_alloc_m(MemoryRegion *region, uint64_t count);
 
+/*
+ * Allocate a contiguous block of `count` physical pages, starting at
+ * an address that's a multiple of `align` (which must be a power of
+ * two, and at least 4KiB).
+ *
+ * This is mostly for backing large pages - e.g. `count` 512 with an
+ * `align` of 2MiB.
+ *
+ * Returns a suitably aligned start address on success, or an unaligned
+ * number (with 0xFF in the least-significant byte) otherwise.
+ *
+ * The buddy backend can't satisfy alignments above
+ * 2^PMM_BUDDY_MAX_ORDER pages.
+ */
+uint64_t page_alloc_aligned(MemoryRegion *region, uint64_t count,
+                            uint64_t align);
+
 /*
  * Allocate a single physical page.
  *
  * Currently, only 4KiB pages are supported.
  *
+ * If the region has per-CPU caches, this will come from the current
+ * CPU's cache where possible.
+ *
  * Returns a page aligned start address on success.
  *
  * If unsuccessful, an unaligned number (with 0xFF in the least-significant
@@ -87,6 +196,9 @@ uint64_t page_alloc(MemoryRegion *region);
  * Free a physical page.
  *
  * Currently, only 4KiB pages are supported.
+ *
+ * If the region has per-CPU caches, the page will go to the current
+ * CPU's cache (and only reach the backend when that is drained).
  */
 void page_free(MemoryRegion *region, uint64_t page);
 
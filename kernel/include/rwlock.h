@@ -0,0 +1,64 @@
+/*
+ * stage3 - Reader-writer spinlocks
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * For data that's read all the time but hardly ever written (ACPI
+ * tables, the IDT, driver tables and the like). Each CPU counts its
+ * readers on its own cache line, so readers on different CPUs never
+ * touch the same line unless a writer is about. Writers pay for that -
+ * they have to wait for every CPU's readers to leave.
+ */
+
+#ifndef __ANOS_KERNEL_RWLOCK_H
+#define __ANOS_KERNEL_RWLOCK_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+#include "spinlock.h"
+
+typedef struct {
+    uint64_t count;
+    uint64_t fill_cache_line[7];
+} RwLockReaders;
+
+/*
+ * Note this is big (a cache line per CPU) - it's meant for a few
+ * long-lived, read-mostly structures, not for embedding in everything.
+ */
+typedef struct {
+    SpinLock writer;
+    uint64_t writing;
+    uint64_t fill_cache_line[7];
+    RwLockReaders readers[MAX_CPU_COUNT];
+} RwSpinLock;
+
+/*
+ * Init (zero) a reader-writer lock. As with the other locks, this is
+ * optional if the lock is zeroed anyway.
+ */
+void rwlock_init(RwSpinLock *lock);
+
+/*
+ * Take the lock for reading. Interrupts are disabled until the matching
+ * `rwlock_read_unlock` (so we stay on this CPU) - the previous RFLAGS
+ * are returned for passing to it.
+ *
+ * Read locks don't nest - taking one again on the same CPU can deadlock
+ * with a waiting writer.
+ */
+uint64_t rwlock_read_lock(RwSpinLock *lock);
+
+void rwlock_read_unlock(RwSpinLock *lock, uint64_t flags);
+
+/*
+ * Take the lock for writing, waiting for all readers to leave. As with
+ * reads, interrupts are off until `rwlock_write_unlock`.
+ */
+uint64_t rwlock_write_lock(RwSpinLock *lock);
+
+void rwlock_write_unlock(RwSpinLock *lock, uint64_t flags);
+
+#endif //__ANOS_KERNEL_RWLOCK_H
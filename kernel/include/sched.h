@@ -0,0 +1,103 @@
+/*
+ * stage3 - Scheduler
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Preemptive round-robin, with a run queue per CPU. Each task runs
+ * until it yields or its time slice (a number of local APIC timer
+ * ticks) runs out, and then goes to the back of its CPU's queue.
+ *
+ * Each CPU also has an idle task, which only runs when there's
+ * nothing else to (it's never queued).
+ *
+ * CPUs that would otherwise idle steal work from the busiest other
+ * queue. Every so often, each CPU also pulls a task over from the
+ * busiest queue if it's a lot busier than its own - but leaves tasks
+ * that have run recently (so are probably still cache-hot) where
+ * they are.
+ */
+
+#ifndef __ANOS_KERNEL_SCHED_H
+#define __ANOS_KERNEL_SCHED_H
+
+#include <stdint.h>
+#include <stdnoreturn.h>
+
+#include "task.h"
+
+// Length of a time slice, in timer ticks (see LAPIC_TIMER_HZ)
+#ifndef SCHED_QUANTUM_TICKS
+#define SCHED_QUANTUM_TICKS 10
+#endif
+
+// How often each CPU looks for a busier one to pull work from, in ticks
+#ifndef SCHED_BALANCE_TICKS
+#define SCHED_BALANCE_TICKS 100
+#endif
+
+// How many more tasks the busiest queue needs than ours before that's
+// worth doing
+#ifndef SCHED_BALANCE_IMBALANCE
+#define SCHED_BALANCE_IMBALANCE 2
+#endif
+
+// Cache affinity bias - tasks that stopped running fewer than this many
+// ticks ago stay put when rebalancing (idle CPUs take them regardless).
+// Zero turns it off.
+#ifndef SCHED_AFFINITY_TICKS
+#define SCHED_AFFINITY_TICKS (SCHED_QUANTUM_TICKS * 2)
+#endif
+
+/*
+ * Start scheduling on this CPU, with the given idle task. Whatever's
+ * currently running should already be a task (`task_adopt_current`).
+ */
+void sched_init_cpu(Task *idle);
+
+/*
+ * Make a task runnable, at the back of this CPU's run queue.
+ */
+void sched_enqueue(Task *task);
+
+/*
+ * Give up the rest of the current time slice, if there's anything
+ * else to run on this CPU.
+ */
+void sched_yield(void);
+
+/*
+ * Called on each timer tick (from the ISR, after EOI). Switches to the
+ * next task if the current one's time slice is up - in which case this
+ * only returns when the interrupted task is next scheduled.
+ */
+void sched_tick(void);
+
+/*
+ * Called by the task switch once it's on the new task's stack, to put
+ * the task it switched away from back on the run queue. Until then,
+ * another CPU could steal that task and try to run it before we've
+ * finished saving it...
+ *
+ * If that task exited, this is also where it's freed (stack and all).
+ */
+void sched_finish_switch(void);
+
+/*
+ * End the current task, freeing it (and its stack) once this CPU has
+ * switched away. Tasks created with `task_create_kernel` come here if
+ * their entrypoint returns.
+ */
+noreturn void sched_exit(void);
+
+/*
+ * An idle loop, for use as (or by) an idle task.
+ */
+noreturn void sched_idle(void);
+
+/*
+ * Total context switches so far, across all CPUs.
+ */
+uint64_t sched_context_switches(void);
+
+#endif //__ANOS_KERNEL_SCHED_H
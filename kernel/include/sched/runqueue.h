@@ -0,0 +1,68 @@
+/*
+ * stage3 - Scheduler run queues
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * A FIFO of runnable tasks, linked through the tasks' own list nodes
+ * (so a task can only be on one queue at a time). Adding at the tail
+ * and taking from the head are both O(1).
+ *
+ * Other CPUs can steal from a queue, but they only ever try once: if
+ * the queue looks empty (checked without the lock), or its lock is
+ * held, they go elsewhere rather than wait on the owner.
+ */
+
+#ifndef __ANOS_KERNEL_SCHED_RUNQUEUE_H
+#define __ANOS_KERNEL_SCHED_RUNQUEUE_H
+
+#include <stdint.h>
+
+#include "spinlock.h"
+#include "task.h"
+
+typedef struct {
+    SpinLock lock;
+    Task *head;
+    Task *tail;
+    uint64_t count;
+} __attribute__((aligned(64))) RunQueue;
+
+/*
+ * Init (empty) a run queue. Optional if it's zeroed anyway.
+ */
+void runqueue_init(RunQueue *queue);
+
+/*
+ * Add a task at the tail of the queue.
+ *
+ * These all take the queue's lock, but leave interrupts alone - if the
+ * queue can be used from an interrupt handler, callers should have
+ * them off already.
+ */
+void runqueue_enqueue(RunQueue *queue, Task *task);
+
+/*
+ * Take the task at the head of the queue, or NULL if it's empty.
+ */
+Task *runqueue_dequeue(RunQueue *queue);
+
+/*
+ * Number of tasks in the queue. Doesn't lock, so it's only a hint if
+ * other CPUs are using the queue.
+ */
+static inline uint64_t runqueue_length(RunQueue *queue) {
+    return __atomic_load_n(&queue->count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Take the task at the head of someone else's queue (the one that's
+ * been waiting longest), as long as it last stopped running at or
+ * before tick `ran_before`.
+ *
+ * Returns NULL without waiting if the queue is empty, its lock is
+ * held, or the head task ran too recently.
+ */
+Task *runqueue_try_steal(RunQueue *queue, uint64_t ran_before);
+
+#endif //__ANOS_KERNEL_SCHED_RUNQUEUE_H
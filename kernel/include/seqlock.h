@@ -0,0 +1,90 @@
+/*
+ * stage3 - Sequence locks
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * For small, read-mostly records (timekeeping, counters and the like).
+ * Readers never write anything - they read the sequence, copy the data,
+ * and go round again if a writer got in meanwhile:
+ *
+ *     uint64_t seq;
+ *     do {
+ *         seq = seqlock_read_begin(&lock);
+ *         copy = record;
+ *     } while (seqlock_read_retry(&lock, seq));
+ *
+ * So what's read must be safe to read torn (plain data, no pointers
+ * to chase), and writers shouldn't hold the lock long.
+ */
+
+#ifndef __ANOS_KERNEL_SEQLOCK_H
+#define __ANOS_KERNEL_SEQLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "spinlock.h"
+
+/*
+ * The sequence is odd while a write is in progress. The writers'
+ * lock is on its own line, so readers don't see writers fighting
+ * over it.
+ */
+typedef struct {
+    uint64_t sequence;
+    uint64_t fill_cache_line[7];
+    SpinLock writer;
+} SeqLock;
+
+static inline void seqlock_init(SeqLock *lock) {
+    lock->sequence = 0;
+    spinlock_init(&lock->writer);
+}
+
+/*
+ * Start a read, waiting out any write in progress. Returns the
+ * sequence to pass to `seqlock_read_retry`.
+ */
+static inline uint64_t seqlock_read_begin(SeqLock *lock) {
+    uint64_t sequence;
+
+    while ((sequence = __atomic_load_n(&lock->sequence, __ATOMIC_ACQUIRE)) &
+           1) {
+        cpu_relax();
+    }
+
+    return sequence;
+}
+
+/*
+ * Finish a read - returns `true` if a write happened meanwhile, in
+ * which case whatever was read must be thrown away and read again.
+ */
+static inline bool seqlock_read_retry(SeqLock *lock, uint64_t sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&lock->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+/*
+ * Start a write. Writers are serialized with each other, and interrupts
+ * are off until `seqlock_write_end` (a reader interrupting a write on
+ * the same CPU would spin forever) - the previous RFLAGS are returned
+ * for passing to it.
+ */
+static inline uint64_t seqlock_write_begin(SeqLock *lock) {
+    uint64_t flags = spinlock_lock_irqsave(&lock->writer);
+
+    __atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    return flags;
+}
+
+static inline void seqlock_write_end(SeqLock *lock, uint64_t flags) {
+    __atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELEASE);
+    spinlock_unlock_irqrestore(&lock->writer, flags);
+}
+
+#endif //__ANOS_KERNEL_SEQLOCK_H
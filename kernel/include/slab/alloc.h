@@ -9,13 +9,20 @@
  * blocks of 64 bytes (256 blocks per slab).
  *
  * The top block in each slab is reserved for metadata,
- * and slabs form a linked list within the kernel's slab
- * space.
+ * and slabs form doubly-linked lists (partial, full and
+ * empty) within the kernel's slab space.
+ *
+ * Optionally, each CPU keeps a pair of magazines (a loaded
+ * one and the previous one) of free blocks in front of the
+ * slabs, with a shared depot of full and empty magazines
+ * behind them - so most allocs and frees just push or pop a
+ * magazine with interrupts disabled, and take no lock.
  */
 
 #ifndef __ANOS_KERNEL_SLAB_ALLOC_H
 #define __ANOS_KERNEL_SLAB_ALLOC_H
 
+#include "fba/alloc.h"
 #include "structs/list.h"
 #include "vmm/vmconfig.h"
 #include <stdbool.h>
@@ -26,15 +33,52 @@ static const uint64_t SLAB_BASE_MASK = ~(BYTES_PER_SLAB - 1);
 static const uint8_t SLAB_BLOCK_SIZE = 64; // 64-byte blocks
 static const uint64_t BLOCKS_PER_SLAB = BYTES_PER_SLAB / SLAB_BLOCK_SIZE;
 
+// Number of completely empty slabs kept for reuse - any more than this
+// are returned to the FBA
+#ifndef SLAB_EMPTY_WATERMARK
+#define SLAB_EMPTY_WATERMARK 2
+#endif
+
 typedef struct Slab {
     ListNode this;
-    uint64_t reserved;
+    struct Slab *prev;
     uint64_t bitmap0;
     uint64_t bitmap1;
     uint64_t bitmap2;
     uint64_t bitmap3;
 } Slab;
 
+// Number of blocks each magazine holds (so a magazine is two cache lines)
+#ifndef SLAB_MAGAZINE_ROUNDS
+#define SLAB_MAGAZINE_ROUNDS 14
+#endif
+
+// Size of the buffer `slab_alloc_init_cpu_magazines` needs for its
+// "cached" bitmap (a bit per block in the whole FBA area)
+#define SLAB_CACHED_BITMAP_QUADS ((KERNEL_FBA_SIZE >> 12))
+
+/*
+ * A magazine of free blocks. The blocks are still allocated as far as
+ * their slabs are concerned.
+ *
+ * Magazines are carved out of FBA blocks as the depot needs them.
+ */
+typedef struct SlabMagazine {
+    struct SlabMagazine *next;
+    uint64_t rounds;
+    void *blocks[SLAB_MAGAZINE_ROUNDS];
+} SlabMagazine;
+
+/*
+ * A CPU's magazines. The previous magazine is always either full or
+ * empty. Only ever touched by its own CPU (with interrupts disabled),
+ * and aligned so neighbouring CPUs' don't share cache lines.
+ */
+typedef struct {
+    SlabMagazine *loaded;
+    SlabMagazine *previous;
+} __attribute__((aligned(64))) PerCPUSlabMagazines;
+
 static inline Slab *slab_base(void *block_addr) {
     // TODO check block_addr is in the FBA area!
     return (Slab *)(((uintptr_t)block_addr) & SLAB_BASE_MASK);
@@ -46,4 +90,30 @@ void *slab_alloc_block();
 
 void slab_free_block(void *block);
 
+/*
+ * Enable per-CPU magazines for `slab_alloc_block` and `slab_free_block`.
+ *
+ * The supplied buffer must have room for `MAX_CPU_COUNT` entries, and
+ * will be zeroed - each CPU gets its first magazine from the depot on
+ * first use.
+ *
+ * `cached_bitmap` (`SLAB_CACHED_BITMAP_QUADS` quads, also zeroed here)
+ * tracks which blocks are sitting in a magazine, so freeing one of
+ * those again is caught rather than it being handed out twice. That's
+ * a shared atomic on every free (and a bit per block of the whole FBA
+ * area), so it's for debugging - pass NULL to skip it (and the kernel
+ * does, unless built with DEBUG_MAGAZINE_DOUBLE_FREE).
+ */
+void slab_alloc_init_cpu_magazines(PerCPUSlabMagazines *magazines,
+                                   uint64_t *cached_bitmap);
+
+/*
+ * Return all blocks in the depot's full magazines to their slabs, for
+ * use under memory pressure (and done automatically if a new slab
+ * can't be allocated).
+ *
+ * Returns the number of blocks returned (zero without magazines).
+ */
+uint64_t slab_reclaim_depot(void);
+
 #endif //__ANOS_KERNEL_SLAB_ALLOC_H
\ No newline at end of file
@@ -0,0 +1,149 @@
+/*
+ * stage3 - Slab caches
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * A slab cache hands out objects of one fixed size, from 16KiB slabs
+ * allocated from the fixed block allocator. Unlike the basic slab
+ * allocator (in slab/alloc.h) the object size is up to the cache, so
+ * each cache lays its slabs out to suit - the header at the start of
+ * each slab has a bitmap with a bit for each object that fits.
+ *
+ * Each cache has its own lock, and its own (doubly-linked) lists of
+ * partial, full and empty slabs. Up to SLAB_EMPTY_WATERMARK empty
+ * slabs are kept per cache, the rest go back to the FBA.
+ *
+ * Any slack left at the end of a slab is used to colour them - each
+ * new slab starts its objects a cache line (or alignment) further in
+ * than the last, wrapping when the slack runs out, so the same object
+ * in different slabs doesn't always land in the same cache sets.
+ *
+ * Typed caches (from `kmem_cache_create`) can also have a bigger
+ * alignment and a constructor. Objects are constructed when their slab
+ * is created, and callers free them in their constructed state, so
+ * they're never constructed again while the slab lives.
+ */
+
+#ifndef __ANOS_KERNEL_SLAB_CACHE_H
+#define __ANOS_KERNEL_SLAB_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "slab/alloc.h"
+#include "spinlock.h"
+#include "structs/list.h"
+
+// Objects are always at least this aligned (and sizes are rounded up
+// to a multiple of it)
+#define SLAB_CACHE_MIN_ALIGN 16
+
+// Headers are rounded up to this, so the first object starts on a new
+// cache line
+#define SLAB_CACHE_HEADER_ALIGN 64
+
+// Largest object a cache can hold
+#define SLAB_CACHE_MAX_OBJECT_SIZE 4096
+
+// Largest alignment a typed cache can ask for
+#define SLAB_CACHE_MAX_ALIGN 4096
+
+// Slabs are coloured in steps of at least this (one cache line)
+#define SLAB_CACHE_COLOUR_STEP 64
+
+typedef struct CacheSlab CacheSlab;
+
+typedef void (*SlabCacheCtor)(void *object);
+
+typedef struct {
+    SpinLock lock;
+    CacheSlab *partial;
+    CacheSlab *full;
+    CacheSlab *empty;
+    const char *name;
+    SlabCacheCtor ctor;
+    uint32_t object_size;
+    uint16_t objects_per_slab;
+    uint16_t header_size;
+    uint16_t bitmap_quads;
+    uint16_t empty_count;
+    uint16_t align;
+    uint16_t colour_step;
+    uint16_t colour_max;
+    uint16_t colour_next;
+    uint64_t slab_count;
+} SlabCache;
+
+/*
+ * The header at the start of each slab in a cache. The bitmap has the
+ * cache's `bitmap_quads` words, and the objects start after it, at the
+ * cache's `header_size` plus this slab's `colour`.
+ *
+ * Bit set == object in use. Bits past the last object are always set.
+ */
+struct CacheSlab {
+    ListNode this;
+    CacheSlab *prev;
+    SlabCache *cache;
+    uint32_t used;
+    uint32_t colour;
+    uint64_t bitmap[];
+};
+
+/*
+ * Find the slab (and so the cache) an object came from.
+ */
+static inline CacheSlab *cache_slab_base(void *object) {
+    return (CacheSlab *)(((uintptr_t)object) & SLAB_BASE_MASK);
+}
+
+/*
+ * Set up a cache for objects of the given size (rounded up to a
+ * multiple of SLAB_CACHE_MIN_ALIGN). The cache doesn't allocate any
+ * slabs until it's first used.
+ *
+ * Returns false if the size is zero or too big.
+ */
+bool slab_cache_init(SlabCache *cache, uint32_t object_size);
+
+/*
+ * Allocate an object from the cache.
+ *
+ * Returns NULL if a new slab was needed and couldn't be allocated.
+ */
+void *slab_cache_alloc(SlabCache *cache);
+
+/*
+ * Return an object to the cache it came from.
+ */
+void slab_cache_free(void *object);
+
+/*
+ * Create a typed cache for objects of `size` bytes, aligned to `align`
+ * (a power of two - zero means SLAB_CACHE_MIN_ALIGN). If `ctor` isn't
+ * NULL, it's called on each object when its slab is created, and never
+ * again - so objects must be freed back in their constructed state.
+ *
+ * Constructors are called with the cache locked, so they mustn't
+ * allocate from the same cache.
+ *
+ * Returns NULL if the size or alignment is bad, or there's no memory.
+ */
+SlabCache *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+                             SlabCacheCtor ctor);
+
+/*
+ * Destroy a typed cache, returning its slabs to the FBA.
+ *
+ * Returns false (and does nothing) if any objects are still allocated.
+ */
+bool kmem_cache_destroy(SlabCache *cache);
+
+static inline void *kmem_cache_alloc(SlabCache *cache) {
+    return slab_cache_alloc(cache);
+}
+
+static inline void kmem_cache_free(void *object) { slab_cache_free(object); }
+
+#endif //__ANOS_KERNEL_SLAB_CACHE_H
@@ -0,0 +1,55 @@
+/*
+ * stage3 - General-purpose kernel allocation
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Requests up to KMALLOC_MAX_CLASS_SIZE bytes are rounded up to the
+ * nearest size class, and come from that class's slab cache. Anything
+ * bigger goes straight to the fixed block allocator, as whole pages.
+ *
+ * Everything returned is at least SLAB_CACHE_MIN_ALIGN (16-byte)
+ * aligned, and large allocations are page aligned.
+ */
+
+#ifndef __ANOS_KERNEL_SLAB_KMALLOC_H
+#define __ANOS_KERNEL_SLAB_KMALLOC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Biggest request served from the size-class caches
+#define KMALLOC_MAX_CLASS_SIZE 2048
+
+// Number of size classes (16, 32, 48, 64, 96, 128 ... 1536, 2048)
+#define KMALLOC_CLASS_COUNT 14
+
+/*
+ * Set up the size-class caches. The FBA must be initialized first.
+ */
+bool kmalloc_init(void);
+
+/*
+ * Allocate at least `size` bytes. Returns NULL if `size` is zero, or
+ * if there's no memory.
+ */
+void *kmalloc(uint64_t size);
+
+/*
+ * As `kmalloc`, but the memory is zeroed.
+ */
+void *kzalloc(uint64_t size);
+
+/*
+ * Free memory from `kmalloc` (or `kzalloc`). Does nothing if `ptr` is
+ * NULL.
+ */
+void kfree(void *ptr);
+
+/*
+ * The size class a request of `size` bytes would be rounded up to, or
+ * zero if it's too big for the size classes.
+ */
+uint32_t kmalloc_class_size(uint64_t size);
+
+#endif //__ANOS_KERNEL_SLAB_KMALLOC_H
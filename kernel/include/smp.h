@@ -0,0 +1,53 @@
+/*
+ * stage3 - SMP (application processor) startup
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#ifndef __ANOS_KERNEL_SMP_H
+#define __ANOS_KERNEL_SMP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "acpitables.h"
+#include "percpu.h"
+
+// Physical page the AP trampoline gets copied to. Must be below 1MiB
+// and page aligned, since the SIPI vector is just the page number...
+#define SMP_TRAMPOLINE_PHYS 0x1000
+
+// Number of FBA blocks for each AP's kernel stack
+#define SMP_AP_STACK_BLOCKS 4
+
+/*
+ * Set up the BSP's per-CPU data. This has to happen first thing, as
+ * pretty much everything else relies on it.
+ */
+void smp_init_bsp(void);
+
+/*
+ * Start up all the (enabled) application processors listed in the MADT,
+ * one at a time. Each one gets its own per-CPU data, stack, GDT and
+ * TSS, loads the shared IDT, sets up its local APIC and then idles.
+ *
+ * Returns the total number of CPUs running afterward (including the BSP).
+ *
+ * Must be called on the BSP, once, after the BSP's own local APIC
+ * is set up.
+ */
+uint8_t smp_start_aps(BIOS_SDTHeader *rsdt);
+
+/*
+ * The number of CPUs that are up and running.
+ */
+uint8_t smp_cpu_count(void);
+
+/*
+ * Get the per-CPU data for the given CPU, or NULL if there's no such
+ * CPU running.
+ */
+PerCPUState *smp_cpu_state(uint8_t cpu_id);
+
+#endif //__ANOS_KERNEL_SMP_H
@@ -11,6 +11,13 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "cpu.h"
+
+/*
+ * A fair (ticket) spinlock. The low dword of `lock` is the next ticket
+ * to be handed out, and the high dword is the ticket now being served -
+ * so it's free when they're equal.
+ */
 typedef struct {
     uint64_t lock;
     uint64_t fill_cache_line[7];
@@ -22,6 +29,22 @@ typedef struct {
     uint64_t fill_cache_line[6];
 } ReentrantSpinLock;
 
+/*
+ * A queue node for an MCS lock. Each CPU (or thread) waiting for the
+ * lock spins on its own node, so waiters don't all hammer the lock's
+ * cache line - better than `SpinLock` for heavily contended locks.
+ */
+typedef struct McsSpinNode {
+    struct McsSpinNode *next;
+    uint64_t locked;
+    uint64_t fill_cache_line[6];
+} McsSpinNode;
+
+typedef struct {
+    McsSpinNode *tail;
+    uint64_t fill_cache_line[7];
+} McsSpinLock;
+
 /*
  * Init (zero) a spinlock. Note that this is optional,
  * it doesn't need to be called if the lock will be
@@ -31,8 +54,40 @@ void spinlock_init(SpinLock *lock);
 
 void spinlock_lock(SpinLock *lock);
 
+/*
+ * Lock the lock only if it's free right now, without taking a ticket
+ * (so never waits, and never holds anyone else up).
+ *
+ * Returns true if the lock was taken.
+ */
+bool spinlock_try_lock(SpinLock *lock);
+
 void spinlock_unlock(SpinLock *lock);
 
+/*
+ * Disable interrupts on this CPU and lock the lock, returning the
+ * previous RFLAGS to be passed to `spinlock_unlock_irqrestore`.
+ *
+ * Use this for locks that might be taken from interrupt context, or
+ * that shouldn't be held any longer than necessary (e.g. allocators) -
+ * an interrupt can't land while it's held.
+ */
+static inline uint64_t spinlock_lock_irqsave(SpinLock *lock) {
+    uint64_t flags = cpu_save_disable_interrupts();
+    spinlock_lock(lock);
+    return flags;
+}
+
+/*
+ * Unlock a lock taken with `spinlock_lock_irqsave`, and put the
+ * interrupt flag back the way it was.
+ */
+static inline void spinlock_unlock_irqrestore(SpinLock *lock,
+                                              uint64_t flags) {
+    spinlock_unlock(lock);
+    cpu_restore_interrupts(flags);
+}
+
 /*
  * Init (zero) a reentrant spinlock. Note that this
  * is optional, it doesn't need to be called if the
@@ -56,4 +111,22 @@ bool spinlock_reentrant_lock(ReentrantSpinLock *lock, uint64_t ident);
  */
 bool spinlock_reentrant_unlock(ReentrantSpinLock *lock, uint64_t ident);
 
+/*
+ * Init (zero) an MCS lock. As with the other locks, this is optional
+ * if the lock is zeroed anyway.
+ */
+void spinlock_mcs_init(McsSpinLock *lock);
+
+/*
+ * Lock an MCS lock, queueing on the given node. The node belongs to
+ * the caller, and must stay put (and be passed to unlock) until the
+ * lock is released.
+ */
+void spinlock_mcs_lock(McsSpinLock *lock, McsSpinNode *node);
+
+/*
+ * Unlock an MCS lock, handing it to the next waiter (if any).
+ */
+void spinlock_mcs_unlock(McsSpinLock *lock, McsSpinNode *node);
+
 #endif // __ANOS_KERNEL_SPINLOCK_H
\ No newline at end of file
@@ -18,8 +18,26 @@ typedef int64_t SyscallArg;
 typedef enum {
     SYSCALL_OK = 0,
     SYSCALL_BAD_NUMBER = -1,
+    SYSCALL_BAD_ARGS = -2,
 } SyscallResult;
 
+// Filled in by the `sched_stats` syscall. User code has its own copy
+// of this, so only ever add to the end!
+typedef struct {
+    uint64_t context_switches; // Total, across all CPUs
+    uint64_t timer_ticks;      // On the BSP
+    uint64_t timer_hz;
+} SyscallSchedStats;
+
+// Filled in by the `sched_cpu_stats` syscall, for one CPU. Same rules
+// as above...
+typedef struct {
+    uint64_t timer_ticks;
+    uint64_t context_switches;
+    uint64_t steals;     // Tasks it took from other CPUs' queues
+    uint64_t migrations; // Tasks it ran that last ran elsewhere
+} SyscallSchedCpuStats;
+
 // Set things up for fast syscalls (via `sysenter`)
 void syscall_init(void);
 
@@ -11,6 +11,9 @@
 #include "structs/list.h"
 #include <stdint.h>
 
+// Number of FBA blocks for a kernel task's stack
+#define TASK_KERNEL_STACK_BLOCKS 2
+
 /*
  * task_switch.asm depends on the exact layout of this!
  * Make sure it only grows, and stays packed...
@@ -19,11 +22,70 @@ typedef struct {
     ListNode this; // 24 bytes
     uintptr_t tid;
     uintptr_t sp;
+    uintptr_t rsp0; // Kernel stack top, for entries from user mode
+    uint64_t last_ran; // Timer tick (on `cpu`) when it last stopped running
+    uint8_t cpu;       // CPU it last ran on, or TASK_CPU_NONE
+    void *stack;       // Kernel stack it owns (FBA blocks), or NULL
 } Task;
 
+#define TASK_CPU_NONE 0xff
+
+typedef void (*TaskEntrypoint)(void);
+
 Task *task_current();
+
+/*
+ * Switch this CPU to the given task. Returns when something switches
+ * back to the current one.
+ *
+ * This is a voluntary switch - only what a function call has to
+ * preserve is saved, so it's cheap.
+ */
 void task_switch(Task *next);
 
+/*
+ * Switch this CPU to the given task from an interrupt handler (with
+ * interrupts disabled), saving the interrupted task's whole register
+ * frame. Returns when something switches back to it.
+ */
+void task_switch_from_interrupt(Task *next);
+
+/*
+ * Create a new kernel task, with its own stack, that'll start running
+ * at `entry` (with interrupts enabled) the first time it's switched to.
+ * If `entry` returns, the task exits (see `sched_exit`).
+ *
+ * Returns NULL if there isn't memory for it.
+ */
+Task *task_create_kernel(TaskEntrypoint entry);
+
+/*
+ * Free a task created with `task_create_kernel`, along with its stack.
+ * It mustn't be running (or queued) anywhere - in particular, this
+ * can't be called on the stack being freed.
+ */
+void task_destroy(Task *task);
+
+/*
+ * Create a task for whatever's currently running on this CPU (e.g. the
+ * boot code), and make it this CPU's current task - so it can be
+ * switched away from and back to like any other.
+ *
+ * Its kernel stack is taken to be the current per-CPU one.
+ *
+ * Returns NULL if there isn't memory for it.
+ */
+Task *task_adopt_current(void);
+
+#ifdef DEBUG_SWITCH_BENCH
+/*
+ * Time the full-frame and callee-saved-only task switches, and print
+ * the results. Must be called from a task (i.e. after the scheduler
+ * is set up).
+ */
+void debug_switch_bench(void);
+#endif
+
 #ifdef DEBUG_TEST_TASKS
 #include <stdnoreturn.h>
 noreturn void debug_test_tasks();
@@ -0,0 +1,91 @@
+/*
+ * stage3 - The direct physical memory map
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * All available physical RAM (and ACPI reclaimable memory) is mapped,
+ * with huge / large pages where possible, into the virtual mapping
+ * area at DIRECT_MAP_BASE. Once that's done any page the PMM hands out
+ * can be accessed directly, without having to map it somewhere first.
+ */
+
+#ifndef __ANOS_KERNEL_VM_DIRECTMAP_H
+#define __ANOS_KERNEL_VM_DIRECTMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "machine.h"
+#include "vmm/vmmapper.h"
+
+// Start of the direct map - PML4 entry 257, just above the recursive
+// mapping at 256...
+#define DIRECT_MAP_BASE 0xffff808000000000
+
+// ... running up to the PMM structures area at PML4 entry 511, so
+// this is also the maximum physical address that can be mapped.
+#define DIRECT_MAP_SIZE 0x00007f0000000000
+#define DIRECT_MAP_END ((DIRECT_MAP_BASE + DIRECT_MAP_SIZE))
+
+#ifdef UNIT_TESTS
+// Tests use host memory as "physical" memory, so these are identity...
+static inline void *phys_to_virt(uint64_t phys) { return (void *)phys; }
+static inline uint64_t virt_to_phys(const void *virt) {
+    return (uint64_t)virt;
+}
+#else
+// Base of the current physical window - STATIC_KERNEL_SPACE until the
+// direct map is set up, and DIRECT_MAP_BASE after.
+extern uintptr_t vmm_phys_window_base;
+
+/*
+ * Get a virtual address through which the given physical address can
+ * be accessed.
+ *
+ * Once `vmm_direct_map_init` has run this works for any available
+ * physical memory - until then, only the low 4MiB is reachable.
+ */
+static inline void *phys_to_virt(uint64_t phys) {
+    return (void *)(vmm_phys_window_base + phys);
+}
+
+/*
+ * Get the physical address for a virtual address in the direct map,
+ * or in the kernel's static mapping at STATIC_KERNEL_SPACE.
+ *
+ * This **does not** walk the page tables, so the result is meaningless
+ * for any other virtual address (e.g. FBA blocks).
+ */
+static inline uint64_t virt_to_phys(const void *virt) {
+    uintptr_t addr = (uintptr_t)virt;
+
+    if (addr >= DIRECT_MAP_BASE && addr < DIRECT_MAP_END) {
+        return addr - DIRECT_MAP_BASE;
+    }
+
+    return addr - STATIC_KERNEL_SPACE;
+}
+#endif
+
+/*
+ * Set up the direct map for all the available (and ACPI) memory in
+ * the given memory map, in the current page tables, and switch
+ * `phys_to_virt` over to use it.
+ *
+ * This must be called once, early - after the PMM is up (the tables
+ * come from there) but before anything needs to touch memory outside
+ * the low 4MiB. The tables are accessed through the recursive mapping,
+ * so it doesn't matter where the PMM gets them from.
+ *
+ * Returns false if the tables couldn't be allocated, in which case
+ * `phys_to_virt` stays on the static low mapping.
+ */
+bool vmm_direct_map_init(E820h_MemMap *memmap);
+
+/*
+ * Determine whether the given physical address is in the direct map.
+ */
+bool vmm_direct_map_covers(uint64_t phys);
+
+#endif //__ANOS_KERNEL_VM_DIRECTMAP_H
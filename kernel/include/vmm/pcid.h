@@ -0,0 +1,125 @@
+/*
+ * stage3 - Process-context identifiers (PCIDs)
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * With PCIDs enabled, TLB entries are tagged with the (12-bit) PCID
+ * from CR3, so switching address space doesn't have to throw them all
+ * away - the ones for the address space we're switching back to can
+ * still be there when we get back.
+ *
+ * There are only 4095 PCIDs to go round, so each CPU hands them out in
+ * generations: when it runs out, it starts a new generation and every
+ * address space tagged with an older one gets a fresh PCID (and a full
+ * flush of it) the next time it's switched to.
+ *
+ * Without PCID support (or before `vmm_pcid_init`) everything runs with
+ * PCID zero, and switching address space flushes the TLB as usual.
+ */
+
+#ifndef __ANOS_KERNEL_VM_PCID_H
+#define __ANOS_KERNEL_VM_PCID_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+// Largest PCID that will be handed out. Zero never is - it's what the
+// boot tables run with, and what everything uses without PCIDs.
+#define PCID_MAX 0xFFF
+
+// Mask to extract the PCID from a CR3 value
+#define CR3_PCID_MASK ((uint64_t)PCID_MAX)
+
+// Set in a value loaded into CR3 to keep the new PCID's TLB entries
+#define CR3_NO_FLUSH ((1ULL << 63))
+
+/*
+ * Per-address-space PCID state - one PCID (and the generation it came
+ * from) for each CPU, since they're allocated per-CPU.
+ *
+ * This must start out zeroed; generation zero is never current, so a
+ * zeroed tag gets a PCID the first time it's used on each CPU.
+ */
+typedef struct {
+    uint64_t generation[MAX_CPU_COUNT];
+    uint16_t pcid[MAX_CPU_COUNT];
+} PcidTag;
+
+/*
+ * Enable PCIDs on this CPU, if it supports them. Must be called on each
+ * CPU, while it is still running with PCID zero in CR3.
+ *
+ * Returns true if PCIDs are now enabled.
+ */
+bool vmm_pcid_init(void);
+
+/*
+ * Are PCIDs enabled on this CPU?
+ */
+bool vmm_pcid_enabled(void);
+
+/*
+ * Get the value to load into CR3 to switch to the address space with
+ * the given PML4 and tag on this CPU, assigning a PCID if the tag
+ * doesn't have a current one here.
+ *
+ * The value has CR3_NO_FLUSH set unless the PCID was just assigned (in
+ * which case the load must flush whatever its last owner left behind).
+ * Without PCIDs, this is just the PML4 address.
+ *
+ * Must be called with interrupts disabled, and the result loaded before
+ * they're enabled again.
+ */
+uint64_t vmm_pcid_cr3(PcidTag *tag, uint64_t pml4_phys);
+
+/*
+ * Switch this CPU to the address space with the given PML4 and tag.
+ */
+void vmm_switch_address_space(PcidTag *tag, uint64_t pml4_phys);
+
+/*
+ * Forget the PCIDs the given tag has on all CPUs, so the address space
+ * starts with an empty TLB the next time it's switched to.
+ *
+ * This is the cheap way to invalidate after changing the user half of
+ * an address space that isn't current on any CPU.
+ */
+void vmm_pcid_retire(PcidTag *tag);
+
+/*
+ * Forget all PCIDs handed out on this CPU, so every address space
+ * (other than the current one, which keeps its PCID until it's next
+ * switched away from) gets a fresh one next time it's switched to.
+ */
+void vmm_pcid_retire_all(void);
+
+/*
+ * Invalidate the given page in the address space with the given tag on
+ * this CPU, when it isn't the current one (for that, just use
+ * `vmm_invalidate_page`).
+ *
+ * Uses INVPCID if the CPU has it, otherwise just retires the tag's
+ * PCID on this CPU.
+ */
+void vmm_pcid_invalidate_page_in(PcidTag *tag, uintptr_t virt_addr);
+
+/*
+ * Flush all (non-global) TLB entries for all PCIDs on this CPU.
+ *
+ * With INVPCID this is a single instruction - without, it flushes the
+ * current PCID and retires all the others.
+ */
+void vmm_pcid_flush_all(void);
+
+#ifdef DEBUG_PCID_BENCH
+/*
+ * Time switching back and forth between two address spaces, with and
+ * without PCIDs, and print the results.
+ */
+void debug_pcid_switch_bench(void);
+#endif
+
+#endif //__ANOS_KERNEL_VM_PCID_H
@@ -8,6 +8,7 @@
 #ifndef __ANOS_KERNEL_VM_RECURSIVE_H
 #define __ANOS_KERNEL_VM_RECURSIVE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 // Base address for tables (high bits always set, tables will always be in kernel space...)
@@ -51,6 +52,10 @@ static const uintptr_t RECURSIVE_ENTRY = 256;
 static const uintptr_t LVL_MASK = 0x1ff; // Mask to apply to a table index
 static const uintptr_t OFS_MASK = 0xfff; // Mask to apply to a page offset
 
+// Entry bits the walker needs to understand (see vmmapper.h)
+static const uint64_t ENTRY_PRESENT = 0x1;   // Present
+static const uint64_t ENTRY_PAGE_SIZE = 0x80; // Maps a 2MiB / 1GiB page
+
 // Fixed parts of addresses used when building table access addresses for virtual addresses
 // at various levels. These are all precomputed and should just end up as constants...
 //
@@ -161,6 +166,10 @@ static inline PageTable *vmm_recursive_find_pt(uint16_t pml4_entry,
 /*
  * Find the PTE mapping the given virtual address using the _current process_ recursive mapping
  * (specified by `RECURSIVE_ENTRY`).
+ *
+ * If the address is in a large (2MiB) or huge (1GiB) page there is no PTE (or PT) for it, and
+ * the address returned by this (and `vmm_virt_to_pt`) will point into that page's memory - use
+ * `vmm_virt_to_leaf_entry` if that's a possibility. The same goes for the PD / PDE with huge pages.
  */
 static inline uint64_t *vmm_virt_to_pte(uintptr_t virt_addr) {
 
@@ -254,4 +263,56 @@ static inline PageTable *vmm_virt_to_pml4(uintptr_t virt_addr) {
     return (PageTable *)((uintptr_t)vmm_virt_to_pml4e(virt_addr) & OFFSET_MASK);
 }
 
+/*
+ * Determine whether a PDPTE or PDE maps a large / huge page directly (rather than pointing
+ * to a lower-level table).
+ */
+static inline bool vmm_recursive_is_page_entry(uint64_t entry) {
+    return (entry & (ENTRY_PRESENT | ENTRY_PAGE_SIZE)) ==
+           (ENTRY_PRESENT | ENTRY_PAGE_SIZE);
+}
+
+/*
+ * Find the entry that actually maps the given virtual address using the _current process_
+ * recursive mapping (specified by `RECURSIVE_ENTRY`) - the PDPTE for a huge page, the PDE for
+ * a large page, or the PTE for a regular one.
+ *
+ * Unlike the other functions here, this one reads the tables as it goes, to find out where
+ * to stop. If `level` is non-NULL, it'll be set to the level the entry is at (2 for a PDPTE,
+ * 3 for a PDE and 4 for a PTE, matching the L1-L4 numbering used above).
+ *
+ * Returns NULL if a table on the way down isn't present.
+ */
+static inline uint64_t *vmm_virt_to_leaf_entry(uintptr_t virt_addr,
+                                               uint8_t *level) {
+    if ((*vmm_virt_to_pml4e(virt_addr) & ENTRY_PRESENT) == 0) {
+        return (uint64_t *)0;
+    }
+
+    uint64_t *pdpte = vmm_virt_to_pdpte(virt_addr);
+    if (vmm_recursive_is_page_entry(*pdpte)) {
+        if (level) {
+            *level = 2;
+        }
+        return pdpte;
+    } else if ((*pdpte & ENTRY_PRESENT) == 0) {
+        return (uint64_t *)0;
+    }
+
+    uint64_t *pde = vmm_virt_to_pde(virt_addr);
+    if (vmm_recursive_is_page_entry(*pde)) {
+        if (level) {
+            *level = 3;
+        }
+        return pde;
+    } else if ((*pde & ENTRY_PRESENT) == 0) {
+        return (uint64_t *)0;
+    }
+
+    if (level) {
+        *level = 4;
+    }
+    return vmm_virt_to_pte(virt_addr);
+}
+
 #endif //__ANOS_KERNEL_VM_RECURSIVE_H
@@ -0,0 +1,54 @@
+/*
+ * stage3 - TLB shootdown
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Every CPU caches translations in its own TLB, so once a mapping has
+ * been removed (or a table freed) on one CPU, the others have to flush
+ * it too - before the page (or table) goes back to the PMM, or they
+ * could carry on using it after it's been handed out again.
+ *
+ * Requests go to the other CPUs as NMIs rather than on an ordinary
+ * vector. Locks here are taken with interrupts disabled, so a CPU
+ * spinning on a lock the sender holds (the FBA's, say, during a lazy
+ * flush) would never take a maskable interrupt - and the sender would
+ * be waiting for it forever.
+ *
+ * Each of these waits until every other running CPU has flushed, so
+ * the pages can be reused as soon as it returns. With only one CPU
+ * running they do nothing at all.
+ */
+
+#ifndef __ANOS_KERNEL_VM_SHOOTDOWN_H
+#define __ANOS_KERNEL_VM_SHOOTDOWN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Flush a range of pages from every other CPU's TLB.
+ */
+void vmm_shootdown_range(uintptr_t virt_addr, uint64_t num_pages);
+
+/*
+ * As `vmm_shootdown_range`, but for pages that needn't be consecutive.
+ * The array must stay put until this returns.
+ */
+void vmm_shootdown_pages(const uintptr_t *virt_addrs, uint64_t num_pages);
+
+/*
+ * Flush every other CPU's whole TLB (including global entries, and any
+ * cached paging structures), for when tables are being freed.
+ */
+void vmm_shootdown_all(void);
+
+/*
+ * Called from the NMI handler - flush this CPU's TLB if there's a
+ * shootdown waiting for it.
+ *
+ * Returns false if there wasn't (so the NMI was something else).
+ */
+bool vmm_shootdown_handle_nmi(void);
+
+#endif //__ANOS_KERNEL_VM_SHOOTDOWN_H
@@ -47,17 +47,72 @@
  */
 #define USER (1 << 2)
 
-// Again, for now, all physical memory used must be mapped
-// here, the mapper expects to be able to access pages
-// under this...
+/*
+ * Page global attribute - the TLB entry is kept when CR3 is reloaded,
+ * so it survives address-space switches.
+ *
+ * The mapper sets this itself on everything in the shared part of the
+ * kernel half (above the recursive mapping), and never on tables, so
+ * there's no need to pass it in.
+ */
+#define GLOBAL (1 << 8)
+
+/*
+ * Page size attribute - in a PDE or PDPTE, this maps a 2MiB or 1GiB
+ * page directly rather than pointing to a lower-level table.
+ *
+ * The large / huge mapping functions set this themselves, there's no
+ * need to pass it in.
+ */
+#define LARGE_PAGE (1 << 7)
+
+// Size of a large (2MiB, mapped by a PDE) page
+#define LARGE_PAGE_SIZE 0x200000
+
+// Size of a huge (1GiB, mapped by a PDPTE) page
+#define HUGE_PAGE_SIZE 0x40000000
+
+// Range operations covering more than this many pages flush the whole
+// TLB once at the end, rather than invalidating each page...
+#ifndef VMM_RANGE_FLUSH_THRESHOLD
+#define VMM_RANGE_FLUSH_THRESHOLD 32
+#endif
+
+// Number of locks shared out between address spaces (by PML4) - more
+// means less chance of two address spaces sharing one. Power of two.
+#ifndef VMM_ADDRESS_SPACE_LOCK_COUNT
+#define VMM_ADDRESS_SPACE_LOCK_COUNT 64
+#endif
+
+// Page tables emptied by an unmap are freed in batches of (up to) this
+// many, once the TLB flush that makes that safe has been done.
+#ifndef VMM_RECLAIM_BATCH
+#define VMM_RECLAIM_BATCH 16
+#endif
+
+// The kernel (and the low 4MiB of physical RAM) are mapped here.
+// Until the direct map is set up, any page the mapper needs to
+// touch must be in that low 4MiB (see vmm/directmap.h)...
 #define STATIC_KERNEL_SPACE 0xFFFFFFFF80000000
 
 // Just used to page-align addresses to their containing page
 #define PAGE_ALIGN_MASK 0xFFFFFFFFFFFFF000
 
+// Used to extract the physical address from a table entry (dropping
+// the flags at both ends, including NX). This **must** be used for
+// entries that point to tables, since the mapper keeps bookkeeping in
+// their high bits.
+#define ENTRY_ADDR_MASK 0x000FFFFFFFFFF000
+
 // Just used to extract page-relative addresses from their containing page
 #define PAGE_RELATIVE_MASK (~PAGE_ALIGN_MASK)
 
+// As above, but for large (2MiB) pages
+#define LARGE_PAGE_ALIGN_MASK 0xFFFFFFFFFFE00000
+
+// As above, but for huge (1GiB) pages
+#define HUGE_PAGE_ALIGN_MASK 0xFFFFFFFFC0000000
+
 /*
  * Map the given page-aligned physical address into virtual memory 
  * with the specified page tables.
@@ -66,6 +121,9 @@
  * which means it needs to allocate physical pages - it uses the PMM
  * (obviously) and thus it **can** pagefault.
  *
+ * Fails (returning false) if the address is already covered by a
+ * large or huge page.
+ *
  * This function invalidates the TLB automatically.
  */
 bool vmm_map_page_in(uint64_t *pml4, uintptr_t virt_addr, uint64_t page,
@@ -81,6 +139,95 @@ bool vmm_map_page_in(uint64_t *pml4, uintptr_t virt_addr, uint64_t page,
  */
 bool vmm_map_page(uintptr_t virt_addr, uint64_t page, uint16_t flags);
 
+/*
+ * Map `num_pages` consecutive virtual pages, starting at `virt_addr`,
+ * to physically-contiguous memory starting at `phys_addr`, with the
+ * specified page tables.
+ *
+ * This is equivalent to calling `vmm_map_page_in` for each page, but
+ * much cheaper for more than a few pages - the tables are walked once
+ * per page table rather than once per page, the lock is only taken
+ * once, and the TLB is flushed once when the whole range is mapped
+ * (see VMM_RANGE_FLUSH_THRESHOLD).
+ *
+ * Returns false if a table can't be allocated, or part of the range
+ * is covered by a large or huge page - in which case the pages before
+ * that point will have been mapped.
+ */
+bool vmm_map_range_in(uint64_t *pml4, uintptr_t virt_addr, uint64_t phys_addr,
+                      uint64_t num_pages, uint16_t flags);
+
+/*
+ * Map a range of physically-contiguous pages with the current page
+ * tables.
+ *
+ * See `vmm_map_range_in` for specifics.
+ */
+bool vmm_map_range(uintptr_t virt_addr, uint64_t phys_addr, uint64_t num_pages,
+                   uint16_t flags);
+
+/*
+ * Map `num_pages` consecutive virtual pages, starting at `virt_addr`,
+ * to the (page-aligned) physical pages in the `pages` array, with the
+ * specified page tables.
+ *
+ * Works just like `vmm_map_range_in`, for when the physical pages
+ * aren't contiguous.
+ */
+bool vmm_map_pages_in(uint64_t *pml4, uintptr_t virt_addr,
+                      const uint64_t *pages, uint64_t num_pages,
+                      uint16_t flags);
+
+/*
+ * Map the given 2MiB-aligned physical address into virtual memory as
+ * a single large page, with the specified page tables.
+ *
+ * This works just like `vmm_map_page_in`, except the mapping is made
+ * in the PD (with no PT underneath it) - both addresses must be 2MiB
+ * aligned. `page_alloc_aligned` can be used to get suitable physical
+ * memory.
+ *
+ * Returns false if either address isn't aligned, if a page table
+ * already exists for this 2MiB (it won't be replaced), or if a
+ * table can't be allocated.
+ */
+bool vmm_map_large_page_in(uint64_t *pml4, uintptr_t virt_addr, uint64_t page,
+                           uint16_t flags);
+
+/*
+ * Map the given 2MiB-aligned physical address into virtual memory as
+ * a single large page, with the current page tables.
+ *
+ * See `vmm_map_large_page_in` for specifics.
+ */
+bool vmm_map_large_page(uintptr_t virt_addr, uint64_t page, uint16_t flags);
+
+/*
+ * Map the given 1GiB-aligned physical address into virtual memory as
+ * a single huge page, with the specified page tables.
+ *
+ * This works just like `vmm_map_large_page_in`, except the mapping is
+ * made in the PDPT and both addresses must be 1GiB aligned.
+ *
+ * Not all CPUs support huge pages - this will return false (and not
+ * map anything) on those that don't.
+ */
+bool vmm_map_huge_page_in(uint64_t *pml4, uintptr_t virt_addr, uint64_t page,
+                          uint16_t flags);
+
+/*
+ * Determine whether this CPU supports huge (1GiB) pages.
+ */
+bool vmm_huge_pages_supported(void);
+
+/*
+ * Map the given 1GiB-aligned physical address into virtual memory as
+ * a single huge page, with the current page tables.
+ *
+ * See `vmm_map_huge_page_in` for specifics.
+ */
+bool vmm_map_huge_page(uintptr_t virt_addr, uint64_t page, uint16_t flags);
+
 /*
  * Map the page containing the given physical address into virtual memory
  * with the current page tables.
@@ -108,12 +255,16 @@ bool vmm_map_page_containing_in(uint64_t *pml4, uintptr_t virt_addr,
  * This is a "hard" unmap - it will zero out the PTE (rather than, say,
  * setting the page not present) and invalidate the TLB automatically.
  *
- * This function does **not** free any physical memory or otherwise
- * compact the page tables, as doing this on every unmap would be
- * expensive and unnecessary.
+ * This function does **not** free the unmapped physical memory, but
+ * any page table (or PD, or user-space PDPT) the mapper allocated that
+ * this leaves empty is unlinked and given back to the PMM, after the
+ * invalidation.
+ *
+ * If the address is in a large or huge page, that whole page is
+ * unmapped.
  *
- * Returns the physical address that was previously mapped, or
- * 0 for none.
+ * Returns the physical address that was previously mapped (the base
+ * of the page, if it was large or huge), or 0 for none.
  */
 uintptr_t vmm_unmap_page(uintptr_t virt_addr);
 
@@ -124,21 +275,113 @@ uintptr_t vmm_unmap_page(uintptr_t virt_addr);
  * This is a "hard" unmap - it will zero out the PTE (rather than, say,
  * setting the page not present) and invalidate the TLB automatically.
  *
- * This function does **not** free any physical memory or otherwise
- * compact the page tables, as doing this on every unmap would be
- * expensive and unnecessary.
+ * This function does **not** free the unmapped physical memory, but
+ * any page table (or PD, or user-space PDPT) the mapper allocated that
+ * this leaves empty is unlinked and given back to the PMM, after the
+ * invalidation.
+ *
+ * If the address is in a large or huge page, that whole page is
+ * unmapped.
  *
- * Returns the physical address that was previously mapped, or
- * 0 for none.
+ * Returns the physical address that was previously mapped (the base
+ * of the page, if it was large or huge), or 0 for none.
  */
 uintptr_t vmm_unmap_page_in(uint64_t *pml4, uintptr_t virt_addr);
 
 /*
- * Invalidate the TLB for the page containing the given virtual address.
+ * Unmap `num_pages` consecutive virtual pages, starting at `virt_addr`,
+ * with the specified page tables.
+ *
+ * Like `vmm_unmap_page_in` this is a "hard" unmap, but the TLB is only
+ * flushed once, after the whole range has been unmapped. Pages that
+ * aren't mapped are skipped. Tables left empty are freed after the
+ * flush, as with `vmm_unmap_page_in`.
+ *
+ * Only 4KiB mappings are removed - anything in the range that's part
+ * of a large or huge page is left alone (use `vmm_unmap_page_in` for
+ * those).
+ *
+ * If `phys_out` isn't NULL, it must have room for `num_pages` entries,
+ * and will receive the physical address that was previously mapped at
+ * each page (or 0 for none).
+ *
+ * Returns the number of pages that were actually unmapped.
+ */
+uint64_t vmm_unmap_range_in(uint64_t *pml4, uintptr_t virt_addr,
+                            uint64_t num_pages, uintptr_t *phys_out);
+
+/*
+ * Unmap a range of pages with the current page tables.
+ *
+ * See `vmm_unmap_range_in` for specifics.
+ */
+uint64_t vmm_unmap_range(uintptr_t virt_addr, uint64_t num_pages,
+                         uintptr_t *phys_out);
+
+/*
+ * Unmap the `num_pages` (not necessarily consecutive) virtual pages
+ * listed in `virt_addrs`, with the specified page tables.
+ *
+ * As with `vmm_unmap_range_in`, the TLB is only flushed once, after
+ * they've all been unmapped. Pages that aren't mapped (or are part of
+ * a large or huge page) are skipped, and emptied tables are freed.
+ *
+ * If `phys_out` isn't NULL, it must have room for `num_pages` entries,
+ * and will receive the physical address that was previously mapped at
+ * each page (or 0 for none).
+ *
+ * Returns the number of pages that were actually unmapped.
+ */
+uint64_t vmm_unmap_pages_in(uint64_t *pml4, const uintptr_t *virt_addrs,
+                            uint64_t num_pages, uintptr_t *phys_out);
+
+/*
+ * Invalidate the TLB for the page containing the given virtual address
+ * in the current address space (which, since they're global, includes
+ * pages in the shared part of the kernel half for every address space).
  *
  * The mapping functions will do this automatically, so it shouldn't be
  * needed most of the time.
  */
 void vmm_invalidate_page(uintptr_t virt_addr);
 
+/*
+ * Flush all (non-global) TLB entries on this CPU, by reloading CR3 (or,
+ * with PCIDs enabled, for all PCIDs - see `vmm_pcid_flush_all`).
+ *
+ * The range functions will do this automatically for big ranges.
+ */
+void vmm_flush_tlb(void);
+
+/*
+ * Flush all TLB entries on this CPU - including global ones, for all
+ * PCIDs - by toggling CR4.PGE.
+ *
+ * The range functions use this for big ranges in the kernel half,
+ * where `vmm_flush_tlb` wouldn't reach.
+ */
+void vmm_flush_tlb_global(void);
+
+/*
+ * Make sure every kernel-half PML4 entry (other than the recursive
+ * mapping) points at a PDPT, allocating empty ones as needed.
+ *
+ * Once this is done the kernel half's PML4 entries never change, so
+ * every address space can link to the same tables below them, and
+ * kernel mappings made in one are there in all of them.
+ *
+ * Call once at boot, after the direct map is set up. Returns false if
+ * a table couldn't be allocated.
+ */
+bool vmm_kernel_half_init(uint64_t *pml4);
+
+/*
+ * Set up the (page-aligned) PML4 at `pml4_phys` for a new address
+ * space: nothing in the user half, the kernel half linked to the same
+ * tables as `kernel_pml4`, and its own recursive mapping.
+ *
+ * Returns a pointer to the new PML4.
+ */
+uint64_t *vmm_init_address_space(uint64_t *kernel_pml4, uint64_t pml4_phys);
+
 #endif //__ANOS_KERNEL_VM_MAPPER_H
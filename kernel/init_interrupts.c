@@ -18,6 +18,7 @@
                   idt_attr(1, 0, IDT_TYPE_TRAP));                              \
     } while (0)
 
+extern void nmi_handler(void);
 extern void pic_irq_handler(void);
 extern void timer_interrupt_handler(void);
 extern void unknown_interrupt_handler(void);
@@ -32,7 +33,11 @@ static Idtr idtr;
 void idt_install(uint16_t kernel_cs) {
     install_trap(0);
     install_trap(1);
-    install_trap(2);
+
+    // NMIs have their own handler (for TLB shootdowns)
+    idt_entry(idt + 2, nmi_handler, kernel_cs, 0,
+              idt_attr(1, 0, IDT_TYPE_IRQ));
+
     install_trap(3);
     install_trap(4);
     install_trap(5);
@@ -98,3 +103,8 @@ void idt_install(uint16_t kernel_cs) {
     // Enable interrupts
     __asm__ volatile("sti\n\t");
 }
+
+void idt_install_ap(void) {
+    // The table's shared, it just needs loading on this CPU
+    __asm__ volatile("lidt %0" : : "m"(idtr));
+}
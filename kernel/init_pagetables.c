@@ -24,6 +24,10 @@
  *
  * * A new PDPT entry mapping the bottom part of the top PML4 will be added
  *
+ * All the kernel's own pages are also made global (and CR4.PGE set, in
+ * case stage2 didn't) so they stay in the TLB across address-space
+ * switches.
+ *
  * This is where the PMM stack will live - I'm reserving the bottom 128GiB
  * of the top 512GiB (so, the top PML4) for this - starting at
  * 0xFFFFFF8000000000.
@@ -42,17 +46,27 @@
 
 #define PRESENT (1 << 0)
 #define WRITE (1 << 1)
+#define GLOBAL (1 << 8)
+
+#define CR4_PGE (1 << 7)
 
 void pagetables_init() {
     uint64_t *pml4 = (uint64_t *)0xFFFFFFFF8009c000;
     uint64_t *pdpt = (uint64_t *)0xFFFFFFFF8009d000;
     uint64_t *pd = (uint64_t *)0xFFFFFFFF8009e000;
+    uint64_t *pt = (uint64_t *)0xFFFFFFFF8009f000;
 
     // Remove the bottom of the address-space identity mapping that
     // was set up by the bootloader, it's no longer needed...
     *pml4 = 0;
     *pdpt = 0;
 
+    // Only the kernel's mapping of the bottom 2MiB is left in the
+    // bootloader's page table, so that can be global now
+    for (int i = 0; i < 0x200; i++) {
+        pt[i] |= GLOBAL;
+    }
+
     // Map the second 2MiB at the bottom of RAM into kernel space,
     // immediately following the 2MiB mapped by stage2.
     //
@@ -62,7 +76,7 @@ void pagetables_init() {
     // Use 0x98000 as the page table
     uint64_t *newpt = (uint64_t *)0xFFFFFFFF80098000;
     for (int i = 0; i < 0x200; i++) {
-        newpt[i] = ((i << 12) + 0x200000) | PRESENT | WRITE;
+        newpt[i] = ((i << 12) + 0x200000) | PRESENT | WRITE | GLOBAL;
     }
 
     // And hook it into the page directory as the second 2MiB
@@ -87,7 +101,7 @@ void pagetables_init() {
     // Map the physical page below these page tables as the PMM bootstrap
     // page - this will contain the region struct and first bit of the
     // stack.
-    pmm_pt[0] = 0x99000 | PRESENT | WRITE;
+    pmm_pt[0] = 0x99000 | PRESENT | WRITE | GLOBAL;
 
     // Hook this into the PDPT
     pdpt[0] = 0x9a000 | PRESENT | WRITE;
@@ -95,7 +109,16 @@ void pagetables_init() {
     // Set up recursive page table
     pml4[RECURSIVE_ENTRY] = 0x9c000 | PRESENT | WRITE;
 
-    // Just load cr3 to dump the TLB...
+    // Make sure global pages are on...
+    __asm__ volatile("mov %%cr4, %%rax\n\t"
+                     "or %0, %%rax\n\t"
+                     "mov %%rax, %%cr4\n\t"
+                     :
+                     : "i"(CR4_PGE)
+                     : "rax");
+
+    // ... and just load cr3 to dump the TLB (anything global in there
+    // now is a mapping we're keeping anyway).
     __asm__ volatile("mov %cr3, %rax\n\t"
                      "mov %rax, %cr3\n\t");
 }
\ No newline at end of file
@@ -26,6 +26,10 @@ EFLAGS_VIF   equ  1 << 19
 EFLAGS_VIP   equ  1 << 20
 EFLAGS_ID    equ  1 << 21
 
+; Must match PerCPUState in percpu.h
+PERCPU_KERNEL_RSP   equ     8
+PERCPU_USER_RSP     equ     16
+
 %macro write_msr 2
    mov rcx, %1
    mov rax, %2
@@ -75,7 +79,18 @@ syscall_init:
 
 
 ; Entry point for SYSCALLs
+;
+; Interrupts are off (SFMASK clears IF) so the per-CPU scratch slot is
+; safe to use until the user stack is on the kernel one. It has to go
+; there, since the syscall might switch tasks (or even CPUs) before it
+; returns.
 syscall_enter:
+    swapgs                              ; Kernel GS (per-CPU data)
+    mov [gs:PERCPU_USER_RSP], rsp       ; Stash the user stack...
+    mov rsp, [gs:PERCPU_KERNEL_RSP]     ; switch to this task's kernel stack...
+    push qword [gs:PERCPU_USER_RSP]     ; and keep the user stack on it
+    sub rsp, 8                          ; (keeping the stack aligned for C)
+
     push rbp
     mov rbp, rsp
     push rcx        ; Return addr
@@ -98,4 +113,8 @@ syscall_enter:
     pop rbx
     pop rcx
     pop rbp
+
+    add rsp, 8
+    pop rsp                             ; Back to the user stack
+    swapgs                              ; and user GS
     o64 sysret
\ No newline at end of file
@@ -9,9 +9,11 @@
 bits 64
 
 global pic_irq_handler, timer_interrupt_handler, unknown_interrupt_handler, spurious_irq_count
+global nmi_handler
 global syscall_69_handler
 
 extern handle_exception_nc, handle_exception_wc, handle_timer_interrupt, handle_unknown_interrupt
+extern handle_nmi
 extern handle_syscall_69
 
 %macro pusha_sysv_not_rax 0
@@ -46,9 +48,20 @@ extern handle_syscall_69
   pop   rax
 %endmacro
 
+; If we came from (or are going back to) user mode, swap GS base between
+; the user's and this CPU's per-CPU data. The argument is the offset
+; of the stacked CS from rsp.
+%macro swapgs_if_user 1
+  test  byte [rsp+%1],3                   ; Stacked CS RPL
+  jz    %%kernel
+  swapgs
+%%kernel:
+%endmacro
+
 %macro trap_dispatcher_with_code 1        ; General handler for traps that stack an error code
 global trap_dispatcher_%+%1               ; Ensure declared global
 trap_dispatcher_%+%1:                     ; Name e.g. `trap_dispatcher_0`
+  swapgs_if_user 16                       ; (after the error code)
   pusha_sysv
   
   mov   rdi,%1                            ; Put the trap number in the first C argument
@@ -60,12 +73,14 @@ trap_dispatcher_%+%1:                     ; Name e.g. `trap_dispatcher_0`
 
   add   rsp,8                             ; Discard the error code
 
+  swapgs_if_user 8
   iretq                                   ; And done...
 %endmacro
 
 %macro trap_dispatcher_no_code 1          ; General handler for traps that stack an error code
 global trap_dispatcher_%+%1               ; Ensure declared global
 trap_dispatcher_%+%1:                     ; Name e.g. `trap_dispatcher_1`
+  swapgs_if_user 8
   pusha_sysv
   
   mov   rdi,%1                            ; Put the trap number in the first C argument (TODO changing registers!)
@@ -74,12 +89,13 @@ trap_dispatcher_%+%1:                     ; Name e.g. `trap_dispatcher_1`
 
   popa_sysv
 
+  swapgs_if_user 8
   iretq                                    ; And done...
 %endmacro
 
 trap_dispatcher_no_code      0             ; Division Error
 trap_dispatcher_no_code      1             ; Debug
-trap_dispatcher_no_code      2             ; NMI
+                                           ; 2 - NMI has its own handler, below
 trap_dispatcher_no_code      3             ; Breakpoint
 trap_dispatcher_no_code      4             ; Overflow
 trap_dispatcher_no_code      5             ; Bound Range Exceeded
@@ -110,6 +126,18 @@ trap_dispatcher_no_code      29            ; VMM Communication Exception
 trap_dispatcher_with_code    30            ; Security Exception
 trap_dispatcher_no_code      31            ; <reserved>
 
+; NMIs are (mostly) TLB shootdowns from other CPUs. They can land
+; anywhere - even between a SYSCALL and its swapgs - so GS is left
+; alone, and the handler mustn't use it.
+nmi_handler:
+  pusha_sysv
+
+  mov   rdi,72[rsp]                       ; Peek return address into first C argument
+  call  handle_nmi
+
+  popa_sysv
+  iretq
+
 ; ISR dispatcher for PIC IRQs (all of which _should_ be spurious)
 pic_irq_handler:
   push  rax                               ; Stash rax
@@ -123,6 +151,7 @@ pic_irq_handler:
 ; (vector 0x2f) because we should be sending EOI to the master PIC in that case...
 
 timer_interrupt_handler:
+  swapgs_if_user 8
   pusha_sysv
 
   ; TODO stack alignment?
@@ -130,9 +159,11 @@ timer_interrupt_handler:
   call  handle_timer_interrupt            ; Just call directly to C handler
 
   popa_sysv
+  swapgs_if_user 8
   iretq
 
 syscall_69_handler:
+  swapgs_if_user 8
   pusha_sysv_not_rax
   add   rsp,$8
 
@@ -141,10 +172,12 @@ syscall_69_handler:
 
   sub   rsp,$8
   popa_sysv_not_rax
+  swapgs_if_user 8
   iretq
 
 ; ISR dispatcher for Unknown (unhandled) IRQs
 unknown_interrupt_handler:
+  swapgs_if_user 8
   pusha_sysv
 
   ; TODO stack alignment?
@@ -152,6 +185,7 @@ unknown_interrupt_handler:
   call  handle_unknown_interrupt          ; Just call directly to C handler
   
   popa_sysv
+  swapgs_if_user 8
   iretq
 
 ; Running count of spurious PIC IRQs
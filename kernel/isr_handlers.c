@@ -13,6 +13,7 @@
 #include "machine.h"
 #include "pagefault.h"
 #include "printhex.h"
+#include "vmm/shootdown.h"
 
 /*
  * Basic debug handler for exceptions with no error code.
@@ -63,6 +64,16 @@ void handle_exception_nc(uint8_t vector, uint64_t origin_addr) {
     debug_exception_nc(vector, origin_addr);
 }
 
+/*
+ * Handler for NMIs - usually a TLB shootdown from another CPU,
+ * otherwise it's treated like any other exception.
+ */
+void handle_nmi(uint64_t origin_addr) {
+    if (!vmm_shootdown_handle_nmi()) {
+        debug_exception_nc(2, origin_addr);
+    }
+}
+
 /*
  * Actual handler for exceptions with error code.
  *
@@ -8,13 +8,48 @@
 #include <stdint.h>
 
 #include "acpitables.h"
+#include "cpu.h"
 #include "debugprint.h"
 #include "kdrivers/drivers.h"
 #include "kdrivers/local_apic.h"
+#include "kdrivers/pit.h"
 #include "machine.h"
 #include "printhex.h"
 #include "vmm/vmmapper.h"
 
+#define LAPIC_ICR_DELIVERY_NMI 0x00000400
+#define LAPIC_ICR_DELIVERY_INIT 0x00000500
+#define LAPIC_ICR_DELIVERY_STARTUP 0x00000600
+#define LAPIC_ICR_LEVEL_ASSERT 0x00004000
+#define LAPIC_ICR_PENDING 0x00001000
+
+#define LAPIC_TIMER_DIVIDE_16 0x03
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_MASKED 0x10000
+#define LAPIC_TIMER_CALIBRATE_MS 10
+
+// Initial count for LAPIC_TIMER_HZ, worked out on the first init. All
+// the local APIC timers run off the same clock, so the APs reuse it.
+static uint32_t timer_initial_count;
+
+static uint32_t calibrate_timer(uint32_t volatile *lapic) {
+    uint64_t flags = cpu_save_disable_interrupts();
+
+    *REG_LAPIC_DIVIDE(lapic) = LAPIC_TIMER_DIVIDE_16;
+    *REG_LAPIC_LVT_TIMER(lapic) = LAPIC_TIMER_MASKED | LAPIC_TIMER_VECTOR;
+    *REG_LAPIC_INITIAL_COUNT(lapic) = 0xffffffff;
+
+    pit_measure_tsc(LAPIC_TIMER_CALIBRATE_MS);
+
+    uint32_t elapsed = 0xffffffff - *REG_LAPIC_CURRENT_COUNT(lapic);
+    *REG_LAPIC_INITIAL_COUNT(lapic) = 0;
+
+    cpu_restore_interrupts(flags);
+
+    return (uint64_t)elapsed * (1000 / LAPIC_TIMER_CALIBRATE_MS) /
+           LAPIC_TIMER_HZ;
+}
+
 void init_local_apic(BIOS_SDTHeader *madt) {
     uint32_t *lapic_addr = ((uint32_t *)(madt + 1));
     uint32_t *flags = lapic_addr + 1;
@@ -37,13 +72,48 @@ void init_local_apic(BIOS_SDTHeader *madt) {
     // Set spurious interrupt and enable
     *(REG_LAPIC_SPURIOUS(lapic)) = 0x1FF;
 
+    if (timer_initial_count == 0) {
+        timer_initial_count = calibrate_timer(lapic);
+
+        debugstr("LAPIC timer: ");
+        printhex32(timer_initial_count, debugchar);
+        debugstr(" counts per tick\n");
+    }
+
     // Set up timer
-    *REG_LAPIC_DIVIDE(lapic) = 0x03;            // /16 mode
-    *REG_LAPIC_INITIAL_COUNT(lapic) = 20000000; // 20000000 init count
-    *REG_LAPIC_LVT_TIMER(lapic) = 0x20000 | LAPIC_TIMER_VECTOR;
+    *REG_LAPIC_DIVIDE(lapic) = LAPIC_TIMER_DIVIDE_16;
+    *REG_LAPIC_LVT_TIMER(lapic) = LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR;
+    *REG_LAPIC_INITIAL_COUNT(lapic) = timer_initial_count;
 }
 
 void local_apic_eoe() {
     uint32_t volatile *lapic = (uint32_t *)(KERNEL_HARDWARE_VADDR_BASE);
     *(REG_LAPIC_EOI(lapic)) = 0;
 }
+
+static void local_apic_send_ipi(uint8_t apic_id, uint32_t command) {
+    uint32_t volatile *lapic = (uint32_t *)(KERNEL_HARDWARE_VADDR_BASE);
+
+    // Destination goes in first, writing the low half sends it
+    *REG_LAPIC_ICR_HIGH(lapic) = ((uint32_t)apic_id) << 24;
+    *REG_LAPIC_ICR_LOW(lapic) = command;
+
+    while (*REG_LAPIC_ICR_LOW(lapic) & LAPIC_ICR_PENDING) {
+        cpu_relax();
+    }
+}
+
+void local_apic_send_init(uint8_t apic_id) {
+    local_apic_send_ipi(apic_id,
+                        LAPIC_ICR_DELIVERY_INIT | LAPIC_ICR_LEVEL_ASSERT);
+}
+
+void local_apic_send_startup(uint8_t apic_id, uint8_t vector) {
+    local_apic_send_ipi(apic_id, LAPIC_ICR_DELIVERY_STARTUP |
+                                         LAPIC_ICR_LEVEL_ASSERT | vector);
+}
+
+void local_apic_send_nmi(uint8_t apic_id) {
+    local_apic_send_ipi(apic_id,
+                        LAPIC_ICR_DELIVERY_NMI | LAPIC_ICR_LEVEL_ASSERT);
+}
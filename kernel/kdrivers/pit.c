@@ -0,0 +1,45 @@
+/*
+ * stage3 - Legacy PIT (8254) kernel driver
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#include <stdint.h>
+
+#include "cpu.h"
+#include "kdrivers/pit.h"
+#include "machine.h"
+
+#define PIT_CHANNEL2_DATA 0x42
+#define PIT_COMMAND 0x43
+
+// Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count), binary
+#define PIT_CMD_CHANNEL2_ONESHOT 0xB0
+
+// Port 0x61 - bit 0 gates channel 2, bit 1 connects it to the speaker,
+// bit 5 is channel 2's output
+#define PORT_B 0x61
+#define PORT_B_GATE2 0x01
+#define PORT_B_SPEAKER 0x02
+#define PORT_B_OUT2 0x20
+
+uint64_t pit_measure_tsc(uint8_t millis) {
+    uint16_t count = (PIT_HZ / 1000) * millis;
+
+    // Gate on, speaker off...
+    outb(PORT_B, (inb(PORT_B) & ~PORT_B_SPEAKER) | PORT_B_GATE2);
+
+    outb(PIT_COMMAND, PIT_CMD_CHANNEL2_ONESHOT);
+    outb(PIT_CHANNEL2_DATA, count & 0xff);
+    outb(PIT_CHANNEL2_DATA, count >> 8);
+
+    uint64_t start = cpu_read_tsc();
+
+    // ... and wait for it to count down
+    while (!(inb(PORT_B) & PORT_B_OUT2)) {
+        cpu_relax();
+    }
+
+    return cpu_read_tsc() - start;
+}
@@ -0,0 +1,349 @@
+/*
+ * stage3 - The page allocator (Buddy allocator)
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Free blocks of 2^order pages are tracked with one bitmap per order
+ * (bit set == block is free), each with a summary bitmap on top (bit
+ * set == that word of the bitmap has something free in it) so finding
+ * a free block doesn't mean scanning the whole thing.
+ *
+ * Everything lives in the buffer passed to `page_alloc_init`, after
+ * the MemoryRegion - nothing is ever written to the free pages
+ * themselves, so they don't need to be mapped.
+ */
+
+#include <stdbool.h>
+
+#include "machine.h"
+#include "pmm/backend.h"
+#include "pmm/pagealloc.h"
+#include "spinlock.h"
+
+#define NULL (((void *)0))
+
+#define BUDDY_ORDERS ((PMM_BUDDY_MAX_ORDER) + 1)
+#define MAX_BLOCK_PAGES ((1ULL << (PMM_BUDDY_MAX_ORDER)))
+
+typedef struct {
+    uint64_t *bitmap;  // Bit set == block is free
+    uint64_t *summary; // Bit set == that bitmap word is non-zero
+    uint64_t summary_words;
+    uint64_t hint; // All summary words below this are zero
+    uint64_t free_blocks;
+} BuddyOrder;
+
+typedef struct {
+    uint64_t base;  // Physical address of the first tracked page
+    uint64_t pages; // Tracked pages, always a multiple of MAX_BLOCK_PAGES
+    BuddyOrder orders[BUDDY_ORDERS];
+} BuddyState;
+
+static inline BuddyState *buddy_state(MemoryRegion *region) {
+    return (BuddyState *)(region + 1);
+}
+
+static inline uint64_t bitmap_words(uint64_t bits) { return (bits + 63) >> 6; }
+
+static uint64_t buddy_buffer_size(uint64_t pages) {
+    uint64_t size = sizeof(MemoryRegion) + sizeof(BuddyState);
+
+    for (int order = 0; order < BUDDY_ORDERS; order++) {
+        uint64_t words = bitmap_words(pages >> order);
+        size += (words + bitmap_words(words)) * sizeof(uint64_t);
+    }
+
+    return size;
+}
+
+static inline bool block_is_free(BuddyOrder *order, uint64_t block) {
+    return order->bitmap[block >> 6] & (1ULL << (block & 63));
+}
+
+static inline void block_set_free(BuddyOrder *order, uint64_t block) {
+    uint64_t word = block >> 6;
+    uint64_t summary_word = word >> 6;
+
+    order->bitmap[word] |= 1ULL << (block & 63);
+    order->summary[summary_word] |= 1ULL << (word & 63);
+
+    if (summary_word < order->hint) {
+        order->hint = summary_word;
+    }
+
+    order->free_blocks++;
+}
+
+static inline void block_clear_free(BuddyOrder *order, uint64_t block) {
+    uint64_t word = block >> 6;
+
+    order->bitmap[word] &= ~(1ULL << (block & 63));
+
+    if (order->bitmap[word] == 0) {
+        order->summary[word >> 6] &= ~(1ULL << (word & 63));
+    }
+
+    order->free_blocks--;
+}
+
+// Find the lowest free block at this order. Only call this when
+// there's at least one free!
+static inline uint64_t block_find_free(BuddyOrder *order) {
+    for (uint64_t i = order->hint; i < order->summary_words; i++) {
+        if (order->summary[i]) {
+            order->hint = i;
+
+            uint64_t word = (i << 6) + __builtin_ctzll(order->summary[i]);
+            return (word << 6) + __builtin_ctzll(order->bitmap[word]);
+        }
+    }
+
+    // Can't happen unless free_blocks is out of sync with the bitmaps
+    return 0;
+}
+
+// Free a block, merging it with its buddy (and their buddy, and so on)
+// for as long as the buddy is also free.
+static void buddy_free_block(BuddyState *state, uint64_t block,
+                             uint8_t order) {
+    while (order < PMM_BUDDY_MAX_ORDER) {
+        uint64_t buddy = block ^ 1;
+
+        if (!block_is_free(&state->orders[order], buddy)) {
+            break;
+        }
+
+        block_clear_free(&state->orders[order], buddy);
+        block >>= 1;
+        order++;
+    }
+
+    block_set_free(&state->orders[order], block);
+}
+
+// Free a run of pages (given as a page index), as the largest aligned
+// blocks that will fit.
+static void buddy_free_range(BuddyState *state, uint64_t page,
+                             uint64_t count) {
+    while (count) {
+        uint8_t order = PMM_BUDDY_MAX_ORDER;
+
+        if (page) {
+            uint8_t align = __builtin_ctzll(page);
+            if (align < order) {
+                order = align;
+            }
+        }
+
+        uint8_t fit = 63 - __builtin_clzll(count);
+        if (fit < order) {
+            order = fit;
+        }
+
+        buddy_free_block(state, page >> order, order);
+
+        page += 1ULL << order;
+        count -= 1ULL << order;
+    }
+}
+
+// Allocate a block, splitting a bigger one if there isn't one free
+// at the requested order. Returns the page index, or -1 if nothing
+// big enough is free.
+static uint64_t buddy_alloc_block(BuddyState *state, uint8_t order) {
+    uint8_t found = order;
+
+    while (found < BUDDY_ORDERS && state->orders[found].free_blocks == 0) {
+        found++;
+    }
+
+    if (found == BUDDY_ORDERS) {
+        return (uint64_t)-1;
+    }
+
+    uint64_t block = block_find_free(&state->orders[found]);
+    block_clear_free(&state->orders[found], block);
+
+    // Split down to size, freeing the upper half each time
+    while (found > order) {
+        found--;
+        block <<= 1;
+        block_set_free(&state->orders[found], block | 1);
+    }
+
+    return block << order;
+}
+
+MemoryRegion *page_alloc_init(E820h_MemMap *memmap, uint64_t managed_base,
+                              void *buffer) {
+    MemoryRegion *region = (MemoryRegion *)buffer;
+    BuddyState *state = buddy_state(region);
+
+    spinlock_init(&region->lock);
+    region->sp = NULL;
+    region->size = region->free = 0;
+    region->cpu_caches = NULL;
+
+    // Find the span of physical memory we need to track...
+    uint64_t low = (uint64_t)-1, high = 0;
+
+    for (int i = 0; i < memmap->num_entries; i++) {
+        uint64_t start, end;
+
+        if (pmm_backend_entry_range(&memmap->entries[i], managed_base, &start,
+                                    &end)) {
+            if (start < low) {
+                low = start;
+            }
+            if (end > high) {
+                high = end;
+            }
+        }
+    }
+
+    if (high == 0) {
+        state->base = state->pages = 0;
+    } else {
+        // ... rounded out to whole max-order blocks
+        state->base = low & ~((MAX_BLOCK_PAGES << 12) - 1);
+        state->pages = ((high - state->base) >> 12) + MAX_BLOCK_PAGES - 1;
+        state->pages &= ~(MAX_BLOCK_PAGES - 1);
+
+        // Drop memory off the top until the bitmaps fit the buffer
+        while (state->pages &&
+               buddy_buffer_size(state->pages) > PMM_BUDDY_BUFFER_SIZE) {
+            state->pages -= MAX_BLOCK_PAGES;
+        }
+    }
+
+    // Lay the bitmaps out after the state, and clear them
+    uint64_t *next = (uint64_t *)(state + 1);
+
+    for (int order = 0; order < BUDDY_ORDERS; order++) {
+        BuddyOrder *o = &state->orders[order];
+        uint64_t words = bitmap_words(state->pages >> order);
+
+        o->bitmap = next;
+        o->summary = next + words;
+        o->summary_words = bitmap_words(words);
+        o->hint = 0;
+        o->free_blocks = 0;
+
+        next = o->summary + o->summary_words;
+    }
+
+    for (uint64_t *ptr = (uint64_t *)(state + 1); ptr < next; ptr++) {
+        *ptr = 0;
+    }
+
+    // Now free all the available memory into it
+    uint64_t limit = state->base + (state->pages << 12);
+
+    for (int i = 0; i < memmap->num_entries; i++) {
+        uint64_t start, end;
+
+        if (pmm_backend_entry_range(&memmap->entries[i], managed_base, &start,
+                                    &end)) {
+            if (end > limit) {
+                end = limit;
+            }
+
+            if (start >= end) {
+                continue;
+            }
+
+            region->size += end - start;
+            region->free += end - start;
+
+            buddy_free_range(state, (start - state->base) >> 12,
+                             (end - start) >> 12);
+        }
+    }
+
+    return region;
+}
+
+// Allocate `count` pages from a block of the given order, giving back
+// whatever's left over at the end.
+static uint64_t buddy_alloc_pages(MemoryRegion *region, uint64_t count,
+                                  uint8_t order) {
+    BuddyState *state = buddy_state(region);
+
+    uint64_t flags = spinlock_lock_irqsave(&region->lock);
+
+    uint64_t page = buddy_alloc_block(state, order);
+
+    if (page == (uint64_t)-1) {
+        spinlock_unlock_irqrestore(&region->lock, flags);
+        return 0xFF;
+    }
+
+    // Give back whatever we rounded up by
+    buddy_free_range(state, page + count, (1ULL << order) - count);
+
+    region->free -= (count << 12);
+
+    spinlock_unlock_irqrestore(&region->lock, flags);
+    return state->base + (page << 12);
+}
+
+static inline uint8_t order_for(uint64_t count) {
+    uint8_t order = 0;
+    while ((1ULL << order) < count) {
+        order++;
+    }
+
+    return order;
+}
+
+uint64_t page_alloc_m(MemoryRegion *region, uint64_t count) {
+    if (count == 0 || count > MAX_BLOCK_PAGES) {
+        return 0xFF;
+    }
+
+    return buddy_alloc_pages(region, count, order_for(count));
+}
+
+uint64_t page_alloc_aligned(MemoryRegion *region, uint64_t count,
+                            uint64_t align) {
+    if (count == 0 || count > MAX_BLOCK_PAGES || align < 0x1000 ||
+        (align & (align - 1))) {
+        return 0xFF;
+    }
+
+    // Blocks are naturally aligned, so just make sure it's big enough
+    uint8_t order = order_for(count);
+    uint8_t align_order = __builtin_ctzll(align >> 12);
+
+    if (align_order > PMM_BUDDY_MAX_ORDER) {
+        return 0xFF;
+    }
+
+    return buddy_alloc_pages(region, count,
+                             align_order > order ? align_order : order);
+}
+
+uint64_t pmm_backend_alloc_page(MemoryRegion *region) {
+    BuddyState *state = buddy_state(region);
+    uint64_t page = buddy_alloc_block(state, 0);
+
+    if (page == (uint64_t)-1) {
+        return 0xFF;
+    }
+
+    region->free -= 0x1000;
+    return state->base + (page << 12);
+}
+
+void pmm_backend_free_page(MemoryRegion *region, uint64_t page) {
+    BuddyState *state = buddy_state(region);
+
+    // Not ours - ignore it rather than scribble past the bitmaps
+    if (page < state->base || page >= state->base + (state->pages << 12)) {
+        return;
+    }
+
+    region->free += 0x1000;
+    buddy_free_block(state, (page - state->base) >> 12, 0);
+}
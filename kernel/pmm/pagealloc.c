@@ -1,167 +1,165 @@
 /*
- * stage3 - The page allocator (Modified stack allocator)
+ * stage3 - The page allocator (per-CPU cache front-end)
  * anos - An Operating System
  *
  * Copyright (c) 2023 Ross Bamford
+ *
+ * The free memory itself is managed by whichever backend was chosen
+ * at build time (see pmm/backend.h) - this just keeps each CPU's
+ * recently-used pages close at hand in front of it.
  */
 
 #include <stdbool.h>
 
-#include "machine.h"
+#include "cpu.h"
+#include "pmm/backend.h"
 #include "pmm/pagealloc.h"
 #include "spinlock.h"
 
-#ifdef HOSTED_PMM_PRINTF_DEBUGGING
-#include <stdio.h>
-#define hprintf(...) printf(__VA_ARGS__)
-#else
-#define hprintf(...)
-#endif
+#define NULL (((void *)0))
 
-MemoryRegion *page_alloc_init(E820h_MemMap *memmap, uint64_t managed_base,
-                              void *buffer) {
-    MemoryRegion *region = (MemoryRegion *)buffer;
-    spinlock_init(&region->lock);
-    region->sp = (MemoryBlock *)(region + 1);
-    region->sp--; // Start below bottom of stack
-
-    region->size = region->free = 0;
-
-    for (int i = 0; i < memmap->num_entries; i++) {
-        E820h_MemMapEntry *entry = &memmap->entries[i];
-
-        if (entry->type == MEM_MAP_ENTRY_AVAILABLE && entry->length > 0) {
-            // Ensure start is page aligned
-            uint64_t start = entry->base & 0xFFFFFFFFFFFFF000;
-
-            // Grab end, and align that too
-            uint64_t end = (entry->base + entry->length) & 0xFFFFFFFFFFFFF000;
-
-            // Is the aligned base below the actual base for this block?
-            if (entry->base > start) {
-                // Round up to next page boundary if so...
-                start += 0x1000;
-            }
-
-            // Cut off any memory below the supplied managed base.
-            if (start < managed_base) {
-                if (end <= managed_base) {
-                    // This block is entirely below the managed base, just skip
-                    // it
-                    continue;
-                } else {
-                    // This block extends beyond the managed base, so adjust the
-                    // start
-                    start = managed_base;
-                }
-            }
-
-            // Calculate number of bytes remaining...
-            uint64_t total_bytes = end - start;
-
-            // Just in case we get a block < 4KiB
-            if (total_bytes == 0) {
-                continue;
-            }
-
-            region->size += total_bytes;
-            region->free += total_bytes;
-
-            // Stack this block
-            region->sp++;
-            region->sp->base = start;
-            region->sp->size = total_bytes >> 12; // size is pages, not bytes...
-        }
-    }
+#ifdef UNIT_TESTS
+static uint64_t test_region_locks;
+
+uint64_t test_pmm_region_locks() {
+    return __atomic_load_n(&test_region_locks, __ATOMIC_RELAXED);
+}
 
-    return region;
+void test_pmm_reset_region_locks() {
+    __atomic_store_n(&test_region_locks, 0, __ATOMIC_RELAXED);
 }
+#endif
 
-static inline bool stack_empty(MemoryRegion *region) {
-    return region->sp < ((MemoryBlock *)(region + 1));
+// Called whenever the region lock is taken, so tests can see how often
+// the caches actually save us from it
+static inline void count_region_lock(void) {
+#ifdef UNIT_TESTS
+    __atomic_fetch_add(&test_region_locks, 1, __ATOMIC_RELAXED);
+#endif
 }
 
-uint64_t page_alloc_m(MemoryRegion *region, uint64_t count) {
+// Move up to a batch of pages from the backend into the cache.
+// Must be called with interrupts disabled...
+static inline void cpu_cache_refill(MemoryRegion *region,
+                                    PerCPUPageCache *cache) {
     spinlock_lock(&region->lock);
+    count_region_lock();
 
-    if (stack_empty(region)) {
-        spinlock_unlock(&region->lock);
-        return 0xFF;
-    }
+    while (cache->count < PMM_CPU_CACHE_BATCH) {
+        uint64_t page = pmm_backend_alloc_page(region);
 
-    MemoryBlock *ptr = region->sp;
+        if (page & 0xFF) {
+            break;
+        }
+
+        cache->pages[cache->count++] = page;
+    }
 
-    hprintf("\n\nBlock: %p\n", region);
-    while (ptr >= ((MemoryBlock *)(region + 1))) {
-        hprintf("Check block %p - 0x%016x : 0x%016x\n", ptr, ptr->base,
-                ptr->size);
-        if (ptr->size > count) {
-            // Block is more than enough, just split it and return
-            uint64_t page = ptr->base;
+    spinlock_unlock(&region->lock);
+}
 
-            hprintf("  Split block and allocate 0x%016x\n", page);
-            ptr->base += 0x1000;
-            ptr->size -= count;
+// Move the oldest `count` pages from the cache back to the backend,
+// so recently-freed (likely hot) pages stay cached. They're returned in
+// reverse order, which undoes the order refill took them in and gives
+// the stack backend's adjacent-page coalescing the best chance...
+//
+// Must be called with interrupts disabled...
+static inline void cpu_cache_drain(MemoryRegion *region,
+                                   PerCPUPageCache *cache, uint64_t count) {
+    spinlock_lock(&region->lock);
+    count_region_lock();
 
-            region->free -= (count << 12);
+    for (uint64_t i = count; i > 0; i--) {
+        pmm_backend_free_page(region, cache->pages[i - 1]);
+    }
 
-            spinlock_unlock(&region->lock);
-            return page;
-        } else if (ptr->size == count) {
-            // Block is exactly enough, pop (or remove if not top) it and return
-            uint64_t page = ptr->base;
-            hprintf("  Remove block and allocate 0x%016x\n", page);
+    spinlock_unlock(&region->lock);
 
-            if (ptr != region->sp) {
-                // it's not the top block, replace this with the region
-                // from the top of the stack...
-                ptr->base = region->sp->base;
-                ptr->size = region->sp->size;
-            }
+    for (uint64_t i = count; i < cache->count; i++) {
+        cache->pages[i - count] = cache->pages[i];
+    }
 
-            // ... now pop the top either way since we've either used it,
-            // or moved it to replace the one we removed.
-            region->sp--;
+    cache->count -= count;
+}
 
-            region->free -= (count << 12);
+// Drain the whole cache if another CPU has asked us to (because the
+// backend ran dry). Must be called with interrupts disabled...
+static inline void cpu_cache_check_drain(MemoryRegion *region,
+                                         PerCPUPageCache *cache) {
+    if (__atomic_load_n(&cache->drain, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&cache->drain, false, __ATOMIC_RELAXED);
+        cpu_cache_drain(region, cache, cache->count);
+    }
+}
 
-            spinlock_unlock(&region->lock);
-            return page;
+// The backend's empty, but other CPUs' caches might not be - ask them to
+// drain, and have one more go in case some already have. Must be called
+// with interrupts disabled...
+static void cpu_cache_refill_starved(MemoryRegion *region,
+                                     PerCPUPageCache *cache) {
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        PerCPUPageCache *other = &region->cpu_caches[i];
+
+        if (other != cache &&
+            __atomic_load_n(&other->count, __ATOMIC_RELAXED) > 0) {
+            __atomic_store_n(&other->drain, true, __ATOMIC_RELAXED);
         }
+    }
+
+    cpu_cache_refill(region, cache);
+}
 
-        ptr--;
+void page_alloc_init_cpu_caches(MemoryRegion *region,
+                                PerCPUPageCache *caches) {
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        caches[i].count = 0;
+        caches[i].drain = false;
     }
 
-    spinlock_unlock(&region->lock);
-    return 0xFF;
+    region->cpu_caches = caches;
+}
+
+void page_alloc_drain_cpu_cache(MemoryRegion *region) {
+    if (region->cpu_caches == NULL) {
+        return;
+    }
+
+    uint64_t flags = cpu_save_disable_interrupts();
+    PerCPUPageCache *cache = &region->cpu_caches[cpu_current_id()];
+    cpu_cache_drain(region, cache, cache->count);
+    cpu_restore_interrupts(flags);
 }
 
 uint64_t page_alloc(MemoryRegion *region) {
-    spinlock_lock(&region->lock);
+    if (region->cpu_caches) {
+        uint64_t flags = cpu_save_disable_interrupts();
+        PerCPUPageCache *cache = &region->cpu_caches[cpu_current_id()];
 
-    if (stack_empty(region)) {
-        spinlock_unlock(&region->lock);
-        return 0xFF;
-    }
+        cpu_cache_check_drain(region, cache);
 
-    region->free -= 0x1000;
+        if (cache->count == 0) {
+            cpu_cache_refill(region, cache);
+        }
 
-    if (region->sp->size > 1) {
-        // More than one page in this block - just adjust in-place
-        uint64_t page = region->sp->base;
-        region->sp->base += 0x1000;
-        region->sp->size--;
+        if (cache->count == 0) {
+            cpu_cache_refill_starved(region, cache);
+        }
 
-        spinlock_unlock(&region->lock);
-        return page;
-    } else {
-        // Must be exactly one page in this block - just pop and return
-        uint64_t page = region->sp->base;
-        region->sp--;
+        uint64_t page = 0xFF;
+        if (cache->count > 0) {
+            page = cache->pages[--cache->count];
+        }
 
-        spinlock_unlock(&region->lock);
+        cpu_restore_interrupts(flags);
         return page;
     }
+
+    uint64_t flags = spinlock_lock_irqsave(&region->lock);
+    count_region_lock();
+    uint64_t page = pmm_backend_alloc_page(region);
+    spinlock_unlock_irqrestore(&region->lock, flags);
+
+    return page;
 }
 
 void page_free(MemoryRegion *region, uint64_t page) {
@@ -170,31 +168,24 @@ void page_free(MemoryRegion *region, uint64_t page) {
         return;
     }
 
-    spinlock_lock(&region->lock);
-    region->free += 0x1000;
-
-#ifndef NO_PMM_FREE_COALESCE_ADJACENT
-    if (!stack_empty(region)) {
-        if (region->sp->base == page + 0x1000) {
-            // Freeing page below current stack top, so just rebase and resize
-            region->sp->base = page;
-            region->sp->size += 1;
-
-            spinlock_unlock(&region->lock);
-            return;
-        } else if (region->sp->base == page - 0x1000) {
-            // Freeing page above current stack top, so just resize
-            region->sp->size += 1;
-
-            spinlock_unlock(&region->lock);
-            return;
+    if (region->cpu_caches) {
+        uint64_t flags = cpu_save_disable_interrupts();
+        PerCPUPageCache *cache = &region->cpu_caches[cpu_current_id()];
+
+        if (cache->count == PMM_CPU_CACHE_SIZE) {
+            cpu_cache_drain(region, cache, PMM_CPU_CACHE_BATCH);
         }
+
+        cache->pages[cache->count++] = page;
+
+        cpu_cache_check_drain(region, cache);
+
+        cpu_restore_interrupts(flags);
+        return;
     }
-#endif
 
-    // Freeing non-contiguous page, just stack
-    region->sp++;
-    region->sp->base = page;
-    region->sp->size = 1;
-    spinlock_unlock(&region->lock);
-}
\ No newline at end of file
+    uint64_t flags = spinlock_lock_irqsave(&region->lock);
+    count_region_lock();
+    pmm_backend_free_page(region, page);
+    spinlock_unlock_irqrestore(&region->lock, flags);
+}
@@ -0,0 +1,210 @@
+/*
+ * stage3 - The page allocator (Modified stack allocator)
+ * anos - An Operating System
+ *
+ * Copyright (c) 2023 Ross Bamford
+ */
+
+#include <stdbool.h>
+
+#include "machine.h"
+#include "pmm/backend.h"
+#include "pmm/pagealloc.h"
+#include "spinlock.h"
+
+#define NULL (((void *)0))
+
+#ifdef HOSTED_PMM_PRINTF_DEBUGGING
+#include <stdio.h>
+#define hprintf(...) printf(__VA_ARGS__)
+#else
+#define hprintf(...)
+#endif
+
+MemoryRegion *page_alloc_init(E820h_MemMap *memmap, uint64_t managed_base,
+                              void *buffer) {
+    MemoryRegion *region = (MemoryRegion *)buffer;
+    spinlock_init(&region->lock);
+    region->sp = (MemoryBlock *)(region + 1);
+    region->sp--; // Start below bottom of stack
+
+    region->size = region->free = 0;
+    region->cpu_caches = NULL;
+
+    for (int i = 0; i < memmap->num_entries; i++) {
+        uint64_t start, end;
+
+        if (pmm_backend_entry_range(&memmap->entries[i], managed_base, &start,
+                                    &end)) {
+            uint64_t total_bytes = end - start;
+
+            region->size += total_bytes;
+            region->free += total_bytes;
+
+            // Stack this block
+            region->sp++;
+            region->sp->base = start;
+            region->sp->size = total_bytes >> 12; // size is pages, not bytes...
+        }
+    }
+
+    return region;
+}
+
+static inline bool stack_empty(MemoryRegion *region) {
+    return region->sp < ((MemoryBlock *)(region + 1));
+}
+
+static inline void stack_remove_block(MemoryRegion *region,
+                                      MemoryBlock *ptr) {
+    if (ptr != region->sp) {
+        // it's not the top block, replace this with the region
+        // from the top of the stack...
+        ptr->base = region->sp->base;
+        ptr->size = region->sp->size;
+    }
+
+    // ... now pop the top either way since we've either used it,
+    // or moved it to replace the one we removed.
+    region->sp--;
+}
+
+uint64_t page_alloc_m(MemoryRegion *region, uint64_t count) {
+    uint64_t flags = spinlock_lock_irqsave(&region->lock);
+
+    if (stack_empty(region)) {
+        spinlock_unlock_irqrestore(&region->lock, flags);
+        return 0xFF;
+    }
+
+    MemoryBlock *ptr = region->sp;
+
+    hprintf("\n\nBlock: %p\n", region);
+    while (ptr >= ((MemoryBlock *)(region + 1))) {
+        hprintf("Check block %p - 0x%016x : 0x%016x\n", ptr, ptr->base,
+                ptr->size);
+        if (ptr->size > count) {
+            // Block is more than enough, just split it and return
+            uint64_t page = ptr->base;
+
+            hprintf("  Split block and allocate 0x%016x\n", page);
+            ptr->base += (count << 12);
+            ptr->size -= count;
+
+            region->free -= (count << 12);
+
+            spinlock_unlock_irqrestore(&region->lock, flags);
+            return page;
+        } else if (ptr->size == count) {
+            // Block is exactly enough, pop (or remove if not top) it and return
+            uint64_t page = ptr->base;
+            hprintf("  Remove block and allocate 0x%016x\n", page);
+
+            stack_remove_block(region, ptr);
+
+            region->free -= (count << 12);
+
+            spinlock_unlock_irqrestore(&region->lock, flags);
+            return page;
+        }
+
+        ptr--;
+    }
+
+    spinlock_unlock_irqrestore(&region->lock, flags);
+    return 0xFF;
+}
+
+uint64_t page_alloc_aligned(MemoryRegion *region, uint64_t count,
+                            uint64_t align) {
+    if (count == 0 || align < 0x1000 || (align & (align - 1))) {
+        return 0xFF;
+    }
+
+    uint64_t flags = spinlock_lock_irqsave(&region->lock);
+
+    for (MemoryBlock *ptr = region->sp; ptr >= ((MemoryBlock *)(region + 1));
+         ptr--) {
+        uint64_t start = (ptr->base + align - 1) & ~(align - 1);
+        uint64_t end = ptr->base + (ptr->size << 12);
+
+        if (start < ptr->base || start >= end || (end - start) >> 12 < count) {
+            continue;
+        }
+
+        uint64_t head = (start - ptr->base) >> 12;
+        uint64_t tail = ((end - start) >> 12) - count;
+
+        if (head == 0 && tail == 0) {
+            stack_remove_block(region, ptr);
+        } else if (head == 0) {
+            ptr->base += (count << 12);
+            ptr->size = tail;
+        } else {
+            // Keep the unaligned head here, and stack whatever's left
+            // after the allocation as a new block
+            ptr->size = head;
+
+            if (tail) {
+                region->sp++;
+                region->sp->base = start + (count << 12);
+                region->sp->size = tail;
+            }
+        }
+
+        region->free -= (count << 12);
+
+        spinlock_unlock_irqrestore(&region->lock, flags);
+        return start;
+    }
+
+    spinlock_unlock_irqrestore(&region->lock, flags);
+    return 0xFF;
+}
+
+uint64_t pmm_backend_alloc_page(MemoryRegion *region) {
+    if (stack_empty(region)) {
+        return 0xFF;
+    }
+
+    region->free -= 0x1000;
+
+    if (region->sp->size > 1) {
+        // More than one page in this block - just adjust in-place
+        uint64_t page = region->sp->base;
+        region->sp->base += 0x1000;
+        region->sp->size--;
+
+        return page;
+    } else {
+        // Must be exactly one page in this block - just pop and return
+        uint64_t page = region->sp->base;
+        region->sp--;
+
+        return page;
+    }
+}
+
+void pmm_backend_free_page(MemoryRegion *region, uint64_t page) {
+    region->free += 0x1000;
+
+#ifndef NO_PMM_FREE_COALESCE_ADJACENT
+    if (!stack_empty(region)) {
+        if (region->sp->base == page + 0x1000) {
+            // Freeing page below current stack top, so just rebase and resize
+            region->sp->base = page;
+            region->sp->size += 1;
+            return;
+        } else if (region->sp->base == page - 0x1000) {
+            // Freeing page above current stack top, so just resize
+            region->sp->size += 1;
+            return;
+        }
+    }
+#endif
+
+    // Freeing non-contiguous page, just stack
+    region->sp++;
+    region->sp->base = page;
+    region->sp->size = 1;
+}
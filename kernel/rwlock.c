@@ -0,0 +1,72 @@
+/*
+ * stage3 - Reader-writer spinlocks
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Readers bump their CPU's count and then check for a writer; writers
+ * set `writing` and then check the counts. Both sides use sequentially
+ * consistent atomics, so at least one of them always sees the other
+ * and backs off (or waits).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "rwlock.h"
+#include "spinlock.h"
+
+void rwlock_init(RwSpinLock *lock) {
+    spinlock_init(&lock->writer);
+    lock->writing = 0;
+
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        lock->readers[i].count = 0;
+    }
+}
+
+uint64_t rwlock_read_lock(RwSpinLock *lock) {
+    uint64_t flags = cpu_save_disable_interrupts();
+    uint64_t *count = &lock->readers[cpu_current_id()].count;
+
+    while (true) {
+        __atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+
+        if (!__atomic_load_n(&lock->writing, __ATOMIC_SEQ_CST)) {
+            return flags;
+        }
+
+        // Writer about - get out of its way until it's done
+        __atomic_sub_fetch(count, 1, __ATOMIC_RELEASE);
+
+        while (__atomic_load_n(&lock->writing, __ATOMIC_RELAXED)) {
+            cpu_relax();
+        }
+    }
+}
+
+void rwlock_read_unlock(RwSpinLock *lock, uint64_t flags) {
+    __atomic_sub_fetch(&lock->readers[cpu_current_id()].count, 1,
+                       __ATOMIC_RELEASE);
+    cpu_restore_interrupts(flags);
+}
+
+uint64_t rwlock_write_lock(RwSpinLock *lock) {
+    uint64_t flags = spinlock_lock_irqsave(&lock->writer);
+
+    __atomic_store_n(&lock->writing, 1, __ATOMIC_SEQ_CST);
+
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        while (__atomic_load_n(&lock->readers[i].count, __ATOMIC_SEQ_CST)) {
+            cpu_relax();
+        }
+    }
+
+    return flags;
+}
+
+void rwlock_write_unlock(RwSpinLock *lock, uint64_t flags) {
+    __atomic_store_n(&lock->writing, 0, __ATOMIC_RELEASE);
+    spinlock_unlock_irqrestore(&lock->writer, flags);
+}
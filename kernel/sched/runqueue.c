@@ -0,0 +1,88 @@
+/*
+ * stage3 - Scheduler run queues
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sched/runqueue.h"
+#include "spinlock.h"
+#include "task.h"
+
+void runqueue_init(RunQueue *queue) {
+    spinlock_init(&queue->lock);
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->count = 0;
+}
+
+void runqueue_enqueue(RunQueue *queue, Task *task) {
+    task->this.next = NULL;
+
+    spinlock_lock(&queue->lock);
+
+    if (queue->tail) {
+        queue->tail->this.next = (ListNode *)task;
+    } else {
+        queue->head = task;
+    }
+
+    queue->tail = task;
+    __atomic_store_n(&queue->count, queue->count + 1, __ATOMIC_RELAXED);
+
+    spinlock_unlock(&queue->lock);
+}
+
+// Caller must hold the lock
+static Task *take_head(RunQueue *queue) {
+    Task *task = queue->head;
+
+    queue->head = (Task *)task->this.next;
+
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+
+    __atomic_store_n(&queue->count, queue->count - 1, __ATOMIC_RELAXED);
+    task->this.next = NULL;
+
+    return task;
+}
+
+Task *runqueue_dequeue(RunQueue *queue) {
+    spinlock_lock(&queue->lock);
+
+    Task *task = queue->head;
+
+    if (task) {
+        take_head(queue);
+    }
+
+    spinlock_unlock(&queue->lock);
+    return task;
+}
+
+Task *runqueue_try_steal(RunQueue *queue, uint64_t ran_before) {
+    // Don't even touch the lock's cache line if there's nothing there
+    if (runqueue_length(queue) == 0) {
+        return NULL;
+    }
+
+    if (!spinlock_try_lock(&queue->lock)) {
+        return NULL;
+    }
+
+    Task *task = queue->head;
+
+    if (task && task->last_ran <= ran_before) {
+        take_head(queue);
+    } else {
+        task = NULL;
+    }
+
+    spinlock_unlock(&queue->lock);
+    return task;
+}
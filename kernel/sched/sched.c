@@ -0,0 +1,234 @@
+/*
+ * stage3 - Scheduler
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Everything in here runs with interrupts disabled, so "this CPU"
+ * stays this CPU until we switch away.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdnoreturn.h>
+
+#include "cpu.h"
+#include "sched.h"
+#include "sched/runqueue.h"
+#include "smp.h"
+#include "task.h"
+
+static RunQueue run_queues[MAX_CPU_COUNT];
+
+/*
+ * Try to take a task from the busiest other CPU's queue, as long as it
+ * has at least `min_queued` tasks. With `affinity_ticks`, only takes a
+ * task that hasn't run there for at least that many ticks.
+ *
+ * Queue lengths are only peeked at, and the victim's lock is only
+ * tried once, so this never waits on another CPU.
+ */
+static Task *steal_task(PerCPUState *cpu, uint64_t min_queued,
+                        uint64_t affinity_ticks) {
+    uint8_t victim_id = cpu->cpu_id;
+    uint64_t busiest = 0;
+
+    for (uint8_t i = 0; i < smp_cpu_count(); i++) {
+        uint64_t length = runqueue_length(&run_queues[i]);
+
+        if (i != cpu->cpu_id && length > busiest) {
+            busiest = length;
+            victim_id = i;
+        }
+    }
+
+    if (busiest == 0 || busiest < min_queued) {
+        return NULL;
+    }
+
+    uint64_t ran_before = UINT64_MAX;
+
+    if (affinity_ticks) {
+        PerCPUState *victim = smp_cpu_state(victim_id);
+        uint64_t now = __atomic_load_n(&victim->timer_ticks, __ATOMIC_RELAXED);
+        ran_before = now > affinity_ticks ? now - affinity_ticks : 0;
+    }
+
+    Task *task = runqueue_try_steal(&run_queues[victim_id], ran_before);
+
+    if (task) {
+        cpu->steals++;
+    }
+
+    return task;
+}
+
+/*
+ * Pull a task over from the busiest other CPU, if it's busy enough
+ * compared to this one (and it has a task that isn't cache-hot).
+ */
+static void balance(PerCPUState *cpu) {
+    RunQueue *queue = &run_queues[cpu->cpu_id];
+    uint64_t min_queued = runqueue_length(queue) + SCHED_BALANCE_IMBALANCE;
+    Task *task = steal_task(cpu, min_queued, SCHED_AFFINITY_TICKS);
+
+    if (task) {
+        // Call it hot here now, so it isn't bounced straight on again
+        task->last_ran = cpu->timer_ticks;
+        runqueue_enqueue(queue, task);
+    }
+}
+
+/*
+ * Pick the next task to switch to, from this CPU's queue. If there's
+ * nothing queued and this CPU would otherwise idle, steal something
+ * from another one - failing that, it's the idle task if the current
+ * task can't carry on. The current task goes to the back of the queue
+ * (once it's switched out) if `requeue` is set.
+ *
+ * Returns NULL if the current task should just carry on.
+ */
+static Task *pick_next(PerCPUState *cpu, bool requeue) {
+    Task *current = cpu->task_current;
+    Task *next = runqueue_dequeue(&run_queues[cpu->cpu_id]);
+
+    if (next == NULL) {
+        if (requeue && current != cpu->idle_task) {
+            // Nothing else to run, so just carry on
+            return NULL;
+        }
+
+        next = steal_task(cpu, 1, 0);
+
+        if (next == NULL) {
+            if (requeue) {
+                // Already idle
+                return NULL;
+            }
+
+            next = cpu->idle_task;
+        }
+    }
+
+    if (requeue && current != cpu->idle_task) {
+        cpu->switch_requeue = current;
+    }
+
+    if (next->cpu != cpu->cpu_id) {
+        if (next->cpu != TASK_CPU_NONE) {
+            cpu->migrations++;
+        }
+
+        next->cpu = cpu->cpu_id;
+    }
+
+    cpu->slice_ticks = SCHED_QUANTUM_TICKS;
+    return next;
+}
+
+void sched_init_cpu(Task *idle) {
+    uint64_t flags = cpu_save_disable_interrupts();
+    PerCPUState *cpu = cpu_get_data();
+
+    runqueue_init(&run_queues[cpu->cpu_id]);
+    cpu->idle_task = idle;
+    cpu->slice_ticks = SCHED_QUANTUM_TICKS;
+
+    cpu_restore_interrupts(flags);
+}
+
+void sched_enqueue(Task *task) {
+    uint64_t flags = cpu_save_disable_interrupts();
+    runqueue_enqueue(&run_queues[cpu_current_id()], task);
+    cpu_restore_interrupts(flags);
+}
+
+void sched_yield(void) {
+    uint64_t flags = cpu_save_disable_interrupts();
+    Task *next = pick_next(cpu_get_data(), true);
+
+    if (next) {
+        task_switch(next);
+    }
+
+    cpu_restore_interrupts(flags);
+}
+
+void sched_finish_switch(void) {
+    PerCPUState *cpu = cpu_get_data();
+    Task *prev = cpu->switch_requeue;
+
+    if (prev) {
+        cpu->switch_requeue = NULL;
+        prev->last_ran = cpu->timer_ticks;
+        runqueue_enqueue(&run_queues[cpu->cpu_id], prev);
+    }
+
+    Task *dead = cpu->switch_reap;
+
+    if (dead) {
+        cpu->switch_reap = NULL;
+        task_destroy(dead);
+    }
+}
+
+void sched_tick(void) {
+    PerCPUState *cpu = cpu_get_data();
+    Task *next = NULL;
+
+    if (cpu->idle_task == NULL) {
+        // Not scheduling on this CPU (yet)
+        return;
+    }
+
+    if (cpu->task_current == cpu->idle_task) {
+        // Don't make new (or stealable) work wait for a whole time slice
+        next = pick_next(cpu, true);
+    } else {
+        if (cpu->timer_ticks % SCHED_BALANCE_TICKS == 0) {
+            balance(cpu);
+        }
+
+        if (--cpu->slice_ticks == 0) {
+            cpu->slice_ticks = SCHED_QUANTUM_TICKS;
+            next = pick_next(cpu, true);
+        }
+    }
+
+    if (next) {
+        // Preempting, so save the interrupted task's whole frame
+        task_switch_from_interrupt(next);
+    }
+}
+
+noreturn void sched_exit(void) {
+    cpu_save_disable_interrupts();
+
+    // We can't free the stack we're running on, so the task is freed
+    // once the switch has moved off it (in sched_finish_switch)
+    PerCPUState *cpu = cpu_get_data();
+    cpu->switch_reap = cpu->task_current;
+
+    task_switch(pick_next(cpu, false));
+
+    __builtin_unreachable();
+}
+
+noreturn void sched_idle(void) {
+    while (true) {
+        __asm__ volatile("sti\n\t"
+                         "hlt\n\t");
+    }
+}
+
+uint64_t sched_context_switches(void) {
+    uint64_t total = 0;
+
+    for (int i = 0; i < smp_cpu_count(); i++) {
+        total += __atomic_load_n(&smp_cpu_state(i)->context_switches,
+                                 __ATOMIC_RELAXED);
+    }
+
+    return total;
+}
@@ -3,9 +3,17 @@
  * anos - An Operating System
  *
  * Copyright (c) 2024 Ross Bamford
+ *
+ * Slabs are kept on doubly-linked partial, full and empty lists, so
+ * moving one between them is O(1). Up to SLAB_EMPTY_WATERMARK empty
+ * slabs are kept for reuse, the rest go back to the FBA.
+ *
+ * The depot and the slabs have separate locks. Where both are needed,
+ * the depot lock is taken first.
  */
 
 #include "slab/alloc.h"
+#include "cpu.h"
 #include "fba/alloc.h"
 #include "ktypes.h"
 #include "spinlock.h"
@@ -15,26 +23,38 @@
 
 #define NULL (((void *)0))
 
-#define SPIN_LOCK()                                                            \
-    do {                                                                       \
-        spinlock_lock(&slab_lock);                                             \
-    } while (0)
+#define SPIN_LOCK() uint64_t lock_flags = spinlock_lock_irqsave(&slab_lock)
 
 #define SPIN_UNLOCK_RET(retval)                                                \
     do {                                                                       \
-        spinlock_unlock(&slab_lock);                                           \
+        spinlock_unlock_irqrestore(&slab_lock, lock_flags);                    \
         return (retval);                                                       \
     } while (0)
 
-static ListNode *partial;
-static ListNode *full;
+static Slab *partial;
+static Slab *full;
+static Slab *empty;
+static uint64_t empty_count;
 
 static SpinLock slab_lock;
 
+static PerCPUSlabMagazines *cpu_magazines;
+static uint64_t *cached;
+
+static SpinLock depot_lock;
+static SlabMagazine *depot_full;
+static SlabMagazine *depot_empty;
+static uint64_t depot_full_count;
+
 static const uint8_t FBA_BLOCKS_PER_SLAB = BYTES_PER_SLAB / VM_PAGE_SIZE;
 
 bool slab_alloc_init() { return true; }
 
+#ifdef UNIT_TESTS
+uint64_t test_slab_depot_full_count() { return depot_full_count; }
+uint64_t test_slab_empty_count() { return empty_count; }
+#endif
+
 static inline uint8_t first_set_bit_64(uint64_t nonzero_uint64) {
 #if defined(__GNUC__) || defined(__clang__)
     // GCC & Clang have a nice intrinsic for this, as long as value is never
@@ -55,12 +75,90 @@ static inline uint8_t first_set_bit_64(uint64_t nonzero_uint64) {
 #endif
 }
 
-void *slab_alloc_block() {
+// Index of a block in the cached bitmap - its offset (in blocks) into
+// the (1GiB aligned) FBA area
+static inline uint64_t cached_index(void *block) {
+    return (((uintptr_t)block) & (KERNEL_FBA_SIZE - 1)) >> 6;
+}
+
+// Mark a block as sitting in a magazine. Returns false if it already was.
+// Without a cached bitmap (i.e. without checking) nothing is ever cached.
+static inline bool cached_set(void *block) {
+    if (cached == NULL) {
+        return true;
+    }
+
+    uint64_t index = cached_index(block);
+    uint64_t bit = 1ULL << (index & 63);
+
+    return (__atomic_fetch_or(&cached[index >> 6], bit, __ATOMIC_RELAXED) &
+            bit) == 0;
+}
+
+static inline void cached_clear(void *block) {
+    if (cached == NULL) {
+        return;
+    }
+
+    uint64_t index = cached_index(block);
+
+    __atomic_fetch_and(&cached[index >> 6], ~(1ULL << (index & 63)),
+                       __ATOMIC_RELAXED);
+}
+
+static inline bool slab_is_full(Slab *slab) {
+    return slab->bitmap0 == 0xffffffffffffffff &&
+           slab->bitmap1 == 0xffffffffffffffff &&
+           slab->bitmap2 == 0xffffffffffffffff &&
+           slab->bitmap3 == 0xffffffffffffffff;
+}
+
+static inline bool slab_is_empty(Slab *slab) {
+    // Only the header block allocated
+    return slab->bitmap0 == 1 && slab->bitmap1 == 0 && slab->bitmap2 == 0 &&
+           slab->bitmap3 == 0;
+}
+
+static inline void slab_push(Slab **list, Slab *slab) {
+    slab->prev = NULL;
+    slab->this.next = (ListNode *)*list;
+
+    if (*list) {
+        (*list)->prev = slab;
+    }
+
+    *list = slab;
+}
+
+static inline void slab_unlink(Slab **list, Slab *slab) {
+    Slab *next = (Slab *)slab->this.next;
+
+    if (slab->prev) {
+        slab->prev->this.next = (ListNode *)next;
+    } else {
+        *list = next;
+    }
+
+    if (next) {
+        next->prev = slab->prev;
+    }
+
+    slab->this.next = NULL;
+    slab->prev = NULL;
+}
+
+static void *alloc_from_slabs() {
     Slab *target = NULL;
 
     SPIN_LOCK();
 
-    if (partial == NULL) {
+    if (partial == NULL && empty != NULL) {
+        // No partial slabs, but we kept an empty one - use that
+        target = empty;
+        slab_unlink(&empty, target);
+        slab_push(&partial, target);
+        empty_count--;
+    } else if (partial == NULL) {
         // No partial slabs - allocate a new one..
         target = (Slab *)fba_alloc_blocks_aligned(FBA_BLOCKS_PER_SLAB,
                                                   FBA_BLOCKS_PER_SLAB);
@@ -71,7 +169,6 @@ void *slab_alloc_block() {
         }
 
         // zero out header
-        target->this.next = NULL;
         target->this.type = KTYPE_SLAB_HEADER;
         target->this.size = sizeof(Slab);
         target->bitmap0 = 1; // first block always allocated
@@ -79,10 +176,10 @@ void *slab_alloc_block() {
         target->bitmap2 = 0;
         target->bitmap3 = 0;
 
-        partial = list_insert_after(NULL, (ListNode *)target);
+        slab_push(&partial, target);
     } else {
         // Use the first partial slab...
-        target = (Slab *)partial;
+        target = partial;
     }
 
     // find free block
@@ -103,19 +200,236 @@ void *slab_alloc_block() {
 
     bitmap_set(&target->bitmap0, free_block);
 
-    if (target->bitmap0 == 0xffffffffffffffff &&
-        target->bitmap1 == 0xffffffffffffffff &&
-        target->bitmap2 == 0xffffffffffffffff &&
-        target->bitmap3 == 0xffffffffffffffff) {
-        // TODO probably ought to just implement push / pop (front) in list.c...
-        partial = target->this.next;
-        target->this.next = full;
-        full = (ListNode *)target;
+    if (slab_is_full(target)) {
+        slab_unlink(&partial, target);
+        slab_push(&full, target);
     }
 
     SPIN_UNLOCK_RET((void *)(target + free_block));
 }
 
+static void free_to_slab(Slab *slab, uint64_t block_num) {
+    Slab *release = NULL;
+
+    uint64_t flags = spinlock_lock_irqsave(&slab_lock);
+
+    if (!bitmap_check(&slab->bitmap0, block_num)) {
+        // Not allocated
+        spinlock_unlock_irqrestore(&slab_lock, flags);
+        return;
+    }
+
+    if (slab_is_full(slab)) {
+        // Won't be full any more, so back to the partial list
+        slab_unlink(&full, slab);
+        slab_push(&partial, slab);
+    }
+
+    bitmap_clear(&slab->bitmap0, block_num);
+
+    if (slab_is_empty(slab)) {
+        // Keep a few empty slabs around, return the rest to the FBA
+        slab_unlink(&partial, slab);
+
+        if (empty_count < SLAB_EMPTY_WATERMARK) {
+            slab_push(&empty, slab);
+            empty_count++;
+        } else {
+            release = slab;
+        }
+    }
+
+    spinlock_unlock_irqrestore(&slab_lock, flags);
+
+    if (release) {
+        fba_free_blocks(release, FBA_BLOCKS_PER_SLAB);
+    }
+}
+
+// Get an empty magazine from the depot, carving a new FBA block into
+// magazines if there are none. Caller must hold the depot lock.
+static SlabMagazine *depot_get_empty() {
+    if (depot_empty == NULL) {
+        SlabMagazine *magazines = fba_alloc_block();
+
+        if (magazines == NULL) {
+            return NULL;
+        }
+
+        for (int i = 0; i < VM_PAGE_SIZE / sizeof(SlabMagazine); i++) {
+            magazines[i].rounds = 0;
+            magazines[i].next = depot_empty;
+            depot_empty = &magazines[i];
+        }
+    }
+
+    SlabMagazine *magazine = depot_empty;
+    depot_empty = magazine->next;
+    return magazine;
+}
+
+static void *magazine_pop(PerCPUSlabMagazines *cpu) {
+    if (cpu->loaded && cpu->loaded->rounds > 0) {
+        return cpu->loaded->blocks[--cpu->loaded->rounds];
+    }
+
+    if (cpu->previous && cpu->previous->rounds > 0) {
+        // Previous is full, so just swap them over
+        SlabMagazine *tmp = cpu->loaded;
+        cpu->loaded = cpu->previous;
+        cpu->previous = tmp;
+
+        return cpu->loaded->blocks[--cpu->loaded->rounds];
+    }
+
+    // Both empty - swap an empty one for a full one from the depot
+    spinlock_lock(&depot_lock);
+
+    SlabMagazine *full = depot_full;
+
+    if (full) {
+        depot_full = full->next;
+        depot_full_count--;
+
+        if (cpu->previous) {
+            cpu->previous->next = depot_empty;
+            depot_empty = cpu->previous;
+        }
+
+        cpu->previous = cpu->loaded;
+        cpu->loaded = full;
+    }
+
+    spinlock_unlock(&depot_lock);
+
+    if (full == NULL) {
+        return NULL;
+    }
+
+    return cpu->loaded->blocks[--cpu->loaded->rounds];
+}
+
+static void *magazine_alloc(PerCPUSlabMagazines *cpu) {
+    void *block = magazine_pop(cpu);
+
+    if (block) {
+        cached_clear(block);
+    }
+
+    return block;
+}
+
+static bool magazine_free(PerCPUSlabMagazines *cpu, void *block) {
+    if (cpu->loaded && cpu->loaded->rounds < SLAB_MAGAZINE_ROUNDS) {
+        cpu->loaded->blocks[cpu->loaded->rounds++] = block;
+        return true;
+    }
+
+    if (cpu->previous && cpu->previous->rounds == 0) {
+        // Previous is empty, so just swap them over
+        SlabMagazine *tmp = cpu->loaded;
+        cpu->loaded = cpu->previous;
+        cpu->previous = tmp;
+
+        cpu->loaded->blocks[cpu->loaded->rounds++] = block;
+        return true;
+    }
+
+    // Both full (or we don't have any yet) - swap a full one for an empty
+    // one from the depot
+    spinlock_lock(&depot_lock);
+
+    SlabMagazine *empty = depot_get_empty();
+
+    if (empty) {
+        if (cpu->previous) {
+            cpu->previous->next = depot_full;
+            depot_full = cpu->previous;
+            depot_full_count++;
+        }
+
+        cpu->previous = cpu->loaded;
+        cpu->loaded = empty;
+    }
+
+    spinlock_unlock(&depot_lock);
+
+    if (empty == NULL) {
+        return false;
+    }
+
+    cpu->loaded->blocks[cpu->loaded->rounds++] = block;
+    return true;
+}
+
+void slab_alloc_init_cpu_magazines(PerCPUSlabMagazines *magazines,
+                                   uint64_t *cached_bitmap) {
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        magazines[i].loaded = NULL;
+        magazines[i].previous = NULL;
+    }
+
+    for (uint64_t i = 0; cached_bitmap && i < SLAB_CACHED_BITMAP_QUADS; i++) {
+        cached_bitmap[i] = 0;
+    }
+
+    cached = cached_bitmap;
+    cpu_magazines = magazines;
+}
+
+uint64_t slab_reclaim_depot(void) {
+    if (cpu_magazines == NULL) {
+        return 0;
+    }
+
+    uint64_t count = 0;
+
+    uint64_t flags = spinlock_lock_irqsave(&depot_lock);
+
+    while (depot_full) {
+        SlabMagazine *magazine = depot_full;
+        depot_full = magazine->next;
+
+        for (int i = 0; i < magazine->rounds; i++) {
+            Slab *slab = slab_base(magazine->blocks[i]);
+            cached_clear(magazine->blocks[i]);
+            free_to_slab(slab, ((Slab *)magazine->blocks[i]) - slab);
+        }
+
+        count += magazine->rounds;
+        magazine->rounds = 0;
+        magazine->next = depot_empty;
+        depot_empty = magazine;
+    }
+
+    depot_full_count = 0;
+
+    spinlock_unlock_irqrestore(&depot_lock, flags);
+
+    return count;
+}
+
+void *slab_alloc_block() {
+    if (cpu_magazines) {
+        uint64_t flags = cpu_save_disable_interrupts();
+        void *block = magazine_alloc(&cpu_magazines[cpu_current_id()]);
+        cpu_restore_interrupts(flags);
+
+        if (block) {
+            return block;
+        }
+    }
+
+    void *block = alloc_from_slabs();
+
+    if (block == NULL && slab_reclaim_depot() > 0) {
+        // Blocks sitting in the depot might have freed up a slab...
+        block = alloc_from_slabs();
+    }
+
+    return block;
+}
+
 void slab_free_block(void *block) {
     Slab *slab = slab_base(block);
 
@@ -132,46 +446,27 @@ void slab_free_block(void *block) {
         return;
     }
 
-    spinlock_lock(&slab_lock);
+    if (cpu_magazines) {
+        if (!bitmap_check(&slab->bitmap0, block_num)) {
+            // Not allocated
+            return;
+        }
 
-    if (slab->bitmap0 == 0xffffffffffffffff &&
-        slab->bitmap1 == 0xffffffffffffffff &&
-        slab->bitmap2 == 0xffffffffffffffff &&
-        slab->bitmap3 == 0xffffffffffffffff) {
+        if (!cached_set(block)) {
+            // Already freed, and sitting in a magazine
+            return;
+        }
 
-        // This slab is in the full list, we need to find it and remove it
-        // TODO this is stupid inefficient in the worst case if the lists get big...
+        uint64_t flags = cpu_save_disable_interrupts();
+        bool done = magazine_free(&cpu_magazines[cpu_current_id()], block);
+        cpu_restore_interrupts(flags);
 
-        if (full == (ListNode *)slab) {
-            // simple case - just popping head and add to partial list
-            full = slab->this.next;
-            slab->this.next = partial;
-            partial = (ListNode *)slab;
-        } else {
-            // this is the inefficient bit... I don't especially want to
-            // go doubly-linked though...
-            ListNode *prev = NULL;
-            ListNode *test = full;
-
-            while (test) {
-                if (test->next == (ListNode *)slab) {
-                    prev = test;
-                    break;
-                }
-                test = test->next;
-            }
-
-            if (prev) {
-                prev->next = test->next;
-                test->next = partial;
-                partial = test;
-            } else {
-                // TODO warn about this, full slab wasn't in the full list!
-                // (or maybe just panic, since we're going to be in an indeterminite state now anyway...)
-            }
+        if (done) {
+            return;
         }
+
+        cached_clear(block);
     }
 
-    bitmap_clear(&slab->bitmap0, block_num);
-    spinlock_unlock(&slab_lock);
+    free_to_slab(slab, block_num);
 }
@@ -0,0 +1,324 @@
+/*
+ * stage3 - Slab caches
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fba/alloc.h"
+#include "ktypes.h"
+#include "slab/cache.h"
+#include "spinlock.h"
+#include "structs/bitmap.h"
+#include "vmm/vmconfig.h"
+
+#define NULL (((void *)0))
+
+#define FBA_BLOCKS_PER_SLAB ((BYTES_PER_SLAB / VM_PAGE_SIZE))
+
+static inline uint64_t round_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static inline uint64_t header_size_for(uint64_t objects, uint64_t align) {
+    return round_up(sizeof(CacheSlab) + ((objects + 63) >> 6) * 8, align);
+}
+
+static bool cache_init(SlabCache *cache, const char *name, uint32_t object_size,
+                       uint32_t align, SlabCacheCtor ctor) {
+    if (align == 0) {
+        align = SLAB_CACHE_MIN_ALIGN;
+    }
+
+    if (object_size == 0 || object_size > SLAB_CACHE_MAX_OBJECT_SIZE ||
+        align > SLAB_CACHE_MAX_ALIGN || (align & (align - 1))) {
+        return false;
+    }
+
+    if (align < SLAB_CACHE_MIN_ALIGN) {
+        align = SLAB_CACHE_MIN_ALIGN;
+    }
+
+    object_size = round_up(object_size, align);
+
+    // Header must keep the first object aligned too
+    uint64_t header_align =
+            align > SLAB_CACHE_HEADER_ALIGN ? align : SLAB_CACHE_HEADER_ALIGN;
+
+    // As many objects as will fit alongside a header with a bitmap
+    // big enough for them...
+    uint64_t objects = BYTES_PER_SLAB / object_size;
+
+    while (objects > 0 && header_size_for(objects, header_align) +
+                                          objects * object_size >
+                                  BYTES_PER_SLAB) {
+        objects--;
+    }
+
+    if (objects == 0) {
+        return false;
+    }
+
+    uint64_t header_size = header_size_for(objects, header_align);
+    uint64_t slack = BYTES_PER_SLAB - header_size - objects * object_size;
+    uint64_t colour_step =
+            align > SLAB_CACHE_COLOUR_STEP ? align : SLAB_CACHE_COLOUR_STEP;
+
+    spinlock_init(&cache->lock);
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->name = name;
+    cache->ctor = ctor;
+    cache->empty_count = 0;
+    cache->object_size = object_size;
+    cache->objects_per_slab = objects;
+    cache->header_size = header_size;
+    cache->bitmap_quads = (objects + 63) >> 6;
+    cache->align = align;
+    cache->colour_step = colour_step;
+    cache->colour_max = (slack / colour_step) * colour_step;
+    cache->colour_next = 0;
+    cache->slab_count = 0;
+
+    return true;
+}
+
+bool slab_cache_init(SlabCache *cache, uint32_t object_size) {
+    return cache_init(cache, NULL, object_size, 0, NULL);
+}
+
+static inline void slab_push(CacheSlab **list, CacheSlab *slab) {
+    slab->prev = NULL;
+    slab->this.next = (ListNode *)*list;
+
+    if (*list) {
+        (*list)->prev = slab;
+    }
+
+    *list = slab;
+}
+
+static inline void slab_unlink(CacheSlab **list, CacheSlab *slab) {
+    CacheSlab *next = (CacheSlab *)slab->this.next;
+
+    if (slab->prev) {
+        slab->prev->this.next = (ListNode *)next;
+    } else {
+        *list = next;
+    }
+
+    if (next) {
+        next->prev = slab->prev;
+    }
+
+    slab->this.next = NULL;
+    slab->prev = NULL;
+}
+
+// Allocate and set up a new (empty) slab. Caller must hold the lock.
+static CacheSlab *new_slab(SlabCache *cache) {
+    CacheSlab *slab = (CacheSlab *)fba_alloc_blocks_aligned(
+            FBA_BLOCKS_PER_SLAB, FBA_BLOCKS_PER_SLAB);
+
+    if (slab == NULL) {
+        return NULL;
+    }
+
+    slab->this.type = KTYPE_SLAB_CACHE_HEADER;
+    slab->this.size = cache->header_size;
+    slab->cache = cache;
+    slab->used = 0;
+    slab->colour = cache->colour_next;
+
+    cache->colour_next += cache->colour_step;
+    if (cache->colour_next > cache->colour_max) {
+        cache->colour_next = 0;
+    }
+
+    for (int i = 0; i < cache->bitmap_quads; i++) {
+        slab->bitmap[i] = 0;
+    }
+
+    // Bits past the last object are never free
+    uint8_t spare = cache->objects_per_slab & 63;
+    if (spare) {
+        slab->bitmap[cache->bitmap_quads - 1] = ~0ULL << spare;
+    }
+
+    if (cache->ctor) {
+        uintptr_t object = (uintptr_t)slab + cache->header_size + slab->colour;
+
+        for (int i = 0; i < cache->objects_per_slab; i++) {
+            cache->ctor((void *)object);
+            object += cache->object_size;
+        }
+    }
+
+    cache->slab_count++;
+
+    return slab;
+}
+
+void *slab_cache_alloc(SlabCache *cache) {
+    uint64_t flags = spinlock_lock_irqsave(&cache->lock);
+
+    CacheSlab *slab = cache->partial;
+
+    if (slab == NULL) {
+        if (cache->empty) {
+            slab = cache->empty;
+            slab_unlink(&cache->empty, slab);
+            cache->empty_count--;
+        } else {
+            slab = new_slab(cache);
+
+            if (slab == NULL) {
+                spinlock_unlock_irqrestore(&cache->lock, flags);
+                return NULL;
+            }
+        }
+
+        slab_push(&cache->partial, slab);
+    }
+
+    int quad = 0;
+    while (slab->bitmap[quad] == 0xffffffffffffffff) {
+        quad++;
+    }
+
+    uint64_t object = (quad << 6) + __builtin_ctzll(~slab->bitmap[quad]);
+    bitmap_set(slab->bitmap, object);
+
+    if (++slab->used == cache->objects_per_slab) {
+        // Full - move it over to the full list
+        slab_unlink(&cache->partial, slab);
+        slab_push(&cache->full, slab);
+    }
+
+    spinlock_unlock_irqrestore(&cache->lock, flags);
+
+    return (void *)((uintptr_t)slab + cache->header_size + slab->colour +
+                    object * cache->object_size);
+}
+
+void slab_cache_free(void *object) {
+    if (object == NULL) {
+        return;
+    }
+
+    CacheSlab *slab = cache_slab_base(object);
+    SlabCache *cache = slab->cache;
+
+    uint64_t offset = (uintptr_t)object - (uintptr_t)slab;
+    uint64_t first = cache->header_size + slab->colour;
+
+    if (offset < first) {
+        // Not an object - we can't free the header (or the colour)!
+        return;
+    }
+
+    uint64_t index = (offset - first) / cache->object_size;
+
+    if (index >= cache->objects_per_slab) {
+        // In the slack at the end of the slab
+        return;
+    }
+
+    uint64_t flags = spinlock_lock_irqsave(&cache->lock);
+
+    if (!bitmap_check(slab->bitmap, index)) {
+        // Not allocated
+        spinlock_unlock_irqrestore(&cache->lock, flags);
+        return;
+    }
+
+    if (slab->used == cache->objects_per_slab) {
+        // Won't be full any more, so back to the partial list
+        slab_unlink(&cache->full, slab);
+        slab_push(&cache->partial, slab);
+    }
+
+    bitmap_clear(slab->bitmap, index);
+
+    CacheSlab *release = NULL;
+
+    if (--slab->used == 0) {
+        // Keep a few empty slabs around, return the rest to the FBA
+        slab_unlink(&cache->partial, slab);
+
+        if (cache->empty_count < SLAB_EMPTY_WATERMARK) {
+            slab_push(&cache->empty, slab);
+            cache->empty_count++;
+        } else {
+            cache->slab_count--;
+            release = slab;
+        }
+    }
+
+    spinlock_unlock_irqrestore(&cache->lock, flags);
+
+    if (release) {
+        fba_free_blocks(release, FBA_BLOCKS_PER_SLAB);
+    }
+}
+
+static SlabCache cache_cache;
+static SpinLock cache_cache_lock;
+static bool cache_cache_ready;
+
+SlabCache *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+                             SlabCacheCtor ctor) {
+    spinlock_lock(&cache_cache_lock);
+
+    if (!cache_cache_ready) {
+        // Caches for caches come from a cache...
+        cache_init(&cache_cache, "kmem_cache", sizeof(SlabCache),
+                   SLAB_CACHE_COLOUR_STEP, NULL);
+        cache_cache_ready = true;
+    }
+
+    spinlock_unlock(&cache_cache_lock);
+
+    SlabCache *cache = slab_cache_alloc(&cache_cache);
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    if (!cache_init(cache, name, size, align, ctor)) {
+        slab_cache_free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+bool kmem_cache_destroy(SlabCache *cache) {
+    spinlock_lock(&cache->lock);
+
+    if (cache->partial || cache->full) {
+        // Still in use
+        spinlock_unlock(&cache->lock);
+        return false;
+    }
+
+    CacheSlab *slab = cache->empty;
+    cache->empty = NULL;
+    cache->empty_count = 0;
+    cache->slab_count = 0;
+
+    spinlock_unlock(&cache->lock);
+
+    while (slab) {
+        CacheSlab *next = (CacheSlab *)slab->this.next;
+        fba_free_blocks(slab, FBA_BLOCKS_PER_SLAB);
+        slab = next;
+    }
+
+    slab_cache_free(cache);
+    return true;
+}
@@ -0,0 +1,183 @@
+/*
+ * stage3 - General-purpose kernel allocation
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Large allocations are aligned to a slab boundary in the FBA, which
+ * a slab-cache object never is (that's where its slab's header is) -
+ * so `kfree` can tell them apart by address alone. Their size is kept
+ * in a small hash table of records (themselves kmalloc'd).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fba/alloc.h"
+#include "ktypes.h"
+#include "slab/cache.h"
+#include "slab/kmalloc.h"
+#include "spinlock.h"
+#include "structs/list.h"
+#include "vmm/vmconfig.h"
+
+#define NULL (((void *)0))
+
+// Number of hash buckets for large allocation records
+#define KMALLOC_LARGE_BUCKETS 64
+
+#define FBA_BLOCKS_PER_SLAB ((BYTES_PER_SLAB / VM_PAGE_SIZE))
+
+typedef struct {
+    ListNode this; // size is the number of blocks
+    uintptr_t base;
+} LargeAlloc;
+
+static const uint32_t class_sizes[KMALLOC_CLASS_COUNT] = {
+        16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+
+static SlabCache class_caches[KMALLOC_CLASS_COUNT];
+
+// Index of the class for each 16-byte step of request size
+static uint8_t class_index[KMALLOC_MAX_CLASS_SIZE / SLAB_CACHE_MIN_ALIGN];
+
+static ListNode *large_allocs[KMALLOC_LARGE_BUCKETS];
+static SpinLock large_lock;
+
+bool kmalloc_init(void) {
+    uint8_t class = 0;
+
+    for (int i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+        if (!slab_cache_init(&class_caches[i], class_sizes[i])) {
+            return false;
+        }
+    }
+
+    for (int i = 0; i < KMALLOC_MAX_CLASS_SIZE / SLAB_CACHE_MIN_ALIGN; i++) {
+        if ((i + 1) * SLAB_CACHE_MIN_ALIGN > class_sizes[class]) {
+            class++;
+        }
+
+        class_index[i] = class;
+    }
+
+    for (int i = 0; i < KMALLOC_LARGE_BUCKETS; i++) {
+        large_allocs[i] = NULL;
+    }
+
+    spinlock_init(&large_lock);
+
+    return true;
+}
+
+static inline uint8_t class_for(uint64_t size) {
+    return class_index[(size - 1) / SLAB_CACHE_MIN_ALIGN];
+}
+
+uint32_t kmalloc_class_size(uint64_t size) {
+    if (size == 0 || size > KMALLOC_MAX_CLASS_SIZE) {
+        return 0;
+    }
+
+    return class_sizes[class_for(size)];
+}
+
+static inline ListNode **large_bucket(uintptr_t base) {
+    return &large_allocs[(base / BYTES_PER_SLAB) % KMALLOC_LARGE_BUCKETS];
+}
+
+static void *kmalloc_large(uint64_t size) {
+    uint64_t blocks = (size + VM_PAGE_SIZE - 1) / VM_PAGE_SIZE;
+
+    if (blocks > 0xffffffff) {
+        return NULL;
+    }
+
+    LargeAlloc *record = slab_cache_alloc(&class_caches[class_for(
+            sizeof(LargeAlloc))]);
+
+    if (record == NULL) {
+        return NULL;
+    }
+
+    void *base = fba_alloc_blocks_aligned(blocks, FBA_BLOCKS_PER_SLAB);
+
+    if (base == NULL) {
+        slab_cache_free(record);
+        return NULL;
+    }
+
+    record->this.type = KTYPE_KMALLOC_LARGE;
+    record->this.size = blocks;
+    record->base = (uintptr_t)base;
+
+    uint64_t flags = spinlock_lock_irqsave(&large_lock);
+    ListNode **bucket = large_bucket(record->base);
+    record->this.next = *bucket;
+    *bucket = (ListNode *)record;
+    spinlock_unlock_irqrestore(&large_lock, flags);
+
+    return base;
+}
+
+static void kfree_large(uintptr_t base) {
+    uint64_t flags = spinlock_lock_irqsave(&large_lock);
+
+    ListNode **link = large_bucket(base);
+
+    while (*link && ((LargeAlloc *)*link)->base != base) {
+        link = &(*link)->next;
+    }
+
+    LargeAlloc *record = (LargeAlloc *)*link;
+
+    if (record) {
+        *link = record->this.next;
+    }
+
+    spinlock_unlock_irqrestore(&large_lock, flags);
+
+    if (record == NULL) {
+        // Not something we allocated...
+        return;
+    }
+
+    fba_free_blocks((void *)base, record->this.size);
+    slab_cache_free(record);
+}
+
+void *kmalloc(uint64_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (size > KMALLOC_MAX_CLASS_SIZE) {
+        return kmalloc_large(size);
+    }
+
+    return slab_cache_alloc(&class_caches[class_for(size)]);
+}
+
+void *kzalloc(uint64_t size) {
+    uint64_t *ptr = kmalloc(size);
+
+    if (ptr) {
+        for (uint64_t i = 0; i < (size + 7) / 8; i++) {
+            ptr[i] = 0;
+        }
+    }
+
+    return ptr;
+}
+
+void kfree(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    if (((uintptr_t)ptr & ~SLAB_BASE_MASK) == 0) {
+        kfree_large((uintptr_t)ptr);
+    } else {
+        slab_cache_free(ptr);
+    }
+}
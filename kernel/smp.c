@@ -0,0 +1,352 @@
+/*
+ * stage3 - SMP (application processor) startup
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * APs are started one at a time with the usual INIT-SIPI-SIPI dance,
+ * and come up through the trampoline (see smp_trampoline.asm) on a
+ * stack we allocate for them here.
+ *
+ * Once an AP has started it just idles, until it finds work to steal
+ * from a busier CPU's run queue (see sched.c).
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdnoreturn.h>
+
+#include "acpitables.h"
+#include "cpu.h"
+#include "debugprint.h"
+#include "fba/alloc.h"
+#include "gdt.h"
+#include "interrupts.h"
+#include "kdrivers/local_apic.h"
+#include "kdrivers/pit.h"
+#include "printhex.h"
+#include "sched.h"
+#include "slab/kmalloc.h"
+#include "smp.h"
+#include "syscalls.h"
+#include "vmm/pcid.h"
+#include "vmm/vmmapper.h"
+
+#define SMP_TRAMPOLINE_VIRT                                                    \
+    ((uint8_t *)(0xFFFFFFFF80000000 + SMP_TRAMPOLINE_PHYS))
+
+#define TSC_CALIBRATE_MS 10
+
+#define INIT_DELAY_US 10000
+#define SIPI_DELAY_US 200
+#define START_TIMEOUT_US 100000
+
+#define CR4_PCIDE (1 << 17)
+#define MSR_EFER 0xC0000080
+
+// Must match the data block at the end of smp_trampoline.asm!
+typedef struct {
+    uint64_t cr0;
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t efer;
+    uint64_t stack_top;
+    PerCPUState *cpu;
+} SmpTrampolineData;
+
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_data[];
+extern uint8_t smp_trampoline_end[];
+
+// Stage2 leaves the BSP on this stack
+#define BSP_KERNEL_STACK_TOP 0xFFFFFFFF80110000
+
+static PerCPUState bsp_state;
+static PerCPUState *cpu_states[MAX_CPU_COUNT];
+static uint8_t cpu_count = 1;
+static uint64_t tsc_ticks_per_ms;
+static BIOS_SDTHeader *smp_madt;
+
+static void init_cpu_gdt(PerCPUState *cpu);
+static void load_cpu_gdt(PerCPUState *cpu);
+
+uint8_t smp_cpu_count(void) {
+    return __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+}
+
+PerCPUState *smp_cpu_state(uint8_t cpu_id) {
+    if (cpu_id >= smp_cpu_count()) {
+        return NULL;
+    }
+
+    return cpu_states[cpu_id];
+}
+
+void smp_init_bsp(void) {
+    bsp_state.self = &bsp_state;
+    bsp_state.kernel_rsp = BSP_KERNEL_STACK_TOP;
+    bsp_state.cpu_id = 0;
+    bsp_state.started = true;
+
+    // Move off stage2's GDT (which is only reachable through the low
+    // identity mapping, and won't be for much longer) onto our own,
+    // with a TSS we can change
+    init_cpu_gdt(&bsp_state);
+    load_cpu_gdt(&bsp_state);
+
+    cpu_states[0] = &bsp_state;
+    cpu_init_data(&bsp_state);
+}
+
+static inline uint64_t read_cr0(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint64_t read_cr3(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint64_t read_msr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t tsc_to_us(uint64_t ticks) {
+    return ticks * 1000 / tsc_ticks_per_ms;
+}
+
+static void delay_us(uint64_t us) {
+    uint64_t end = cpu_read_tsc() + us * tsc_ticks_per_ms / 1000;
+
+    while (cpu_read_tsc() < end) {
+        cpu_relax();
+    }
+}
+
+static bool wait_started(PerCPUState *cpu, uint64_t timeout_us) {
+    uint64_t end = cpu_read_tsc() + timeout_us * tsc_ticks_per_ms / 1000;
+
+    while (!__atomic_load_n(&cpu->started, __ATOMIC_ACQUIRE)) {
+        if (cpu_read_tsc() >= end) {
+            return false;
+        }
+        cpu_relax();
+    }
+
+    return true;
+}
+
+/*
+ * Set up a CPU's own GDT (the current kernel segments, plus a TSS for
+ * that CPU) ready for `load_cpu_gdt`. For APs, the BSP does this and
+ * the AP just loads it when it starts.
+ */
+static void init_cpu_gdt(PerCPUState *cpu) {
+    GDTR current_gdtr;
+    store_gdtr(&current_gdtr);
+
+    for (int i = 0; i < 5; i++) {
+        cpu->gdt[i] = *get_gdt_entry(&current_gdtr, i);
+    }
+
+    cpu->tss.rsp0 = cpu->kernel_rsp;
+    cpu->tss.iopb = sizeof(TaskStateSegment);
+
+    uint64_t tss_addr = (uint64_t)&cpu->tss;
+    init_gdt_entry(&cpu->gdt[5], (uint32_t)tss_addr,
+                   sizeof(TaskStateSegment) - 1,
+                   GDT_ENTRY_ACCESS_PRESENT | GDT_ENTRY_ACCESS_TSS_AVAILABLE,
+                   0);
+
+    // Second slot is just the top half of the base
+    *((uint64_t *)&cpu->gdt[6]) = tss_addr >> 32;
+
+    cpu->gdtr.limit = sizeof(cpu->gdt) - 1;
+    cpu->gdtr.base = (uint64_t)cpu->gdt;
+}
+
+static void load_cpu_gdt(PerCPUState *cpu) {
+    load_gdtr(&cpu->gdtr);
+
+    // N.B. GS is left alone - loading it would zero the GS base
+    __asm__ volatile("mov $0x10, %%ax\n\t"
+                     "mov %%ax, %%ds\n\t"
+                     "mov %%ax, %%es\n\t"
+                     "mov %%ax, %%ss\n\t"
+                     "mov $0x28, %%ax\n\t"
+                     "ltr %%ax\n\t"
+                     :
+                     :
+                     : "rax", "memory");
+}
+
+noreturn void smp_ap_main(PerCPUState *cpu) {
+    load_cpu_gdt(cpu);
+    cpu_init_data(cpu);
+
+    idt_install_ap();
+    syscall_init();
+    init_local_apic(smp_madt);
+    vmm_pcid_init();
+
+    // This becomes the idle task - real work gets stolen from the
+    // other CPUs when there's some to spare
+    Task *idle = task_adopt_current();
+    if (idle) {
+        sched_init_cpu(idle);
+    }
+
+    __atomic_store_n(&cpu->started, true, __ATOMIC_RELEASE);
+
+    sched_idle();
+}
+
+static bool start_ap(PerCPUState *cpu, SmpTrampolineData *data) {
+    data->stack_top = cpu->kernel_rsp;
+    data->cpu = cpu;
+
+    uint64_t start = cpu_read_tsc();
+
+    local_apic_send_init(cpu->apic_id);
+    delay_us(INIT_DELAY_US);
+
+    local_apic_send_startup(cpu->apic_id, SMP_TRAMPOLINE_PHYS >> 12);
+
+    // Older CPUs can miss the first one, so have another go if it
+    // isn't up yet...
+    if (!wait_started(cpu, SIPI_DELAY_US)) {
+        local_apic_send_startup(cpu->apic_id, SMP_TRAMPOLINE_PHYS >> 12);
+
+        if (!wait_started(cpu, START_TIMEOUT_US)) {
+            // Put it back in wait-for-SIPI, so it can't turn up late
+            // (on a trampoline that's been reused or unmapped by then)
+            local_apic_send_init(cpu->apic_id);
+            delay_us(INIT_DELAY_US);
+            return false;
+        }
+    }
+
+    cpu->startup_us = tsc_to_us(cpu_read_tsc() - start);
+    return true;
+}
+
+uint8_t smp_start_aps(BIOS_SDTHeader *rsdt) {
+    uint8_t apic_ids[MAX_CPU_COUNT];
+
+    smp_madt = find_acpi_table(rsdt, "APIC");
+    if (smp_madt == NULL) {
+        debugstr("WARN: No MADT; running on the BSP only\n");
+        return cpu_count;
+    }
+
+    uint8_t found = acpi_madt_cpus(smp_madt, apic_ids, MAX_CPU_COUNT);
+    if (found < 2) {
+        return cpu_count;
+    }
+
+    uint64_t cr3 = read_cr3() & ~0xfffULL;
+    if (cr3 > 0xffffffff) {
+        // Trampoline only loads the low half...
+        debugstr("WARN: PML4 above 4GiB; can't start APs\n");
+        return cpu_count;
+    }
+
+    uint64_t flags = cpu_save_disable_interrupts();
+    tsc_ticks_per_ms = pit_measure_tsc(TSC_CALIBRATE_MS) / TSC_CALIBRATE_MS;
+    cpu_restore_interrupts(flags);
+
+    // The trampoline runs at its physical address for a bit before
+    // it gets to the kernel, so it needs identity mapping meanwhile
+    if (!vmm_map_page(SMP_TRAMPOLINE_PHYS, SMP_TRAMPOLINE_PHYS,
+                      PRESENT | WRITE)) {
+        debugstr("WARN: Failed to map AP trampoline; can't start APs\n");
+        return cpu_count;
+    }
+
+    uint64_t trampoline_size = smp_trampoline_end - smp_trampoline_start;
+    for (uint64_t i = 0; i < trampoline_size; i++) {
+        SMP_TRAMPOLINE_VIRT[i] = smp_trampoline_start[i];
+    }
+
+    SmpTrampolineData *data =
+            (SmpTrampolineData *)(SMP_TRAMPOLINE_VIRT +
+                                  (smp_trampoline_data - smp_trampoline_start));
+
+    data->cr0 = read_cr0();
+    data->cr3 = cr3;
+    data->cr4 = read_cr4() & ~CR4_PCIDE; // Can't enable PCID with 32-bit CR3
+    data->efer = read_msr(MSR_EFER);
+
+    uint8_t bsp_apic_id = local_apic_id();
+    bsp_state.apic_id = bsp_apic_id;
+
+    for (int i = 0; i < found && cpu_count < MAX_CPU_COUNT; i++) {
+        if (apic_ids[i] == bsp_apic_id) {
+            continue;
+        }
+
+        PerCPUState *cpu = kzalloc(sizeof(PerCPUState));
+        void *stack = fba_alloc_blocks(SMP_AP_STACK_BLOCKS);
+
+        if (cpu == NULL || stack == NULL) {
+            debugstr("WARN: Out of memory starting APs\n");
+            kfree(cpu);
+            if (stack) {
+                fba_free_blocks(stack, SMP_AP_STACK_BLOCKS);
+            }
+            break;
+        }
+
+        cpu->self = cpu;
+        cpu->stack = stack;
+        cpu->kernel_rsp = (uint64_t)stack + SMP_AP_STACK_BLOCKS * VM_PAGE_SIZE;
+        cpu->cpu_id = cpu_count;
+        cpu->apic_id = apic_ids[i];
+        init_cpu_gdt(cpu);
+
+        if (!start_ap(cpu, data)) {
+            // It's held in INIT now, but may have got part way into the
+            // kernel first (and stashed its state somewhere), so leave
+            // that be - and don't risk the rest going the same way.
+            debugstr("WARN: AP with LAPIC ID ");
+            printhex8(cpu->apic_id, debugchar);
+            debugstr(" didn't start; not starting any more\n");
+            break;
+        }
+
+        // Make sure its state's there before anyone (a shootdown, say)
+        // can see it in the count
+        cpu_states[cpu_count] = cpu;
+        __atomic_store_n(&cpu_count, cpu_count + 1, __ATOMIC_RELEASE);
+
+        debugstr("CPU #");
+        printhex8(cpu->cpu_id, debugchar);
+        debugstr(" (LAPIC ID ");
+        printhex8(cpu->apic_id, debugchar);
+        debugstr(") started in ");
+        printhex32(cpu->startup_us, debugchar);
+        debugstr("us\n");
+    }
+
+    // Every AP is either running in the kernel proper or held in INIT
+    // by now, so nothing's left on the trampoline
+    vmm_unmap_page(SMP_TRAMPOLINE_PHYS);
+
+    debugstr("Running on ");
+    printhex8(cpu_count, debugchar);
+    debugstr(" CPU(s)\n");
+
+    return cpu_count;
+}
@@ -0,0 +1,124 @@
+; stage3 - AP startup trampoline
+; anos - An Operating System
+;
+; Copyright (c) 2024 Ross Bamford
+;
+; Application processors start in real mode at the SIPI vector, so this
+; gets copied down to SMP_TRAMPOLINE_BASE (in low memory) before they're
+; started, and is never run where it's linked. Hence all the absolute
+; addresses are worked out relative to the base with the ABS macro.
+;
+; It takes the AP straight from real mode to long mode, using the BSP's
+; control registers and page tables (which the BSP fills into the data
+; block at the end before each start), then jumps up to `smp_ap_main`
+; in the kernel proper.
+;
+
+global smp_trampoline_start
+global smp_trampoline_data
+global smp_trampoline_end
+extern smp_ap_main
+
+SMP_TRAMPOLINE_BASE equ 0x1000            ; Must match SMP_TRAMPOLINE_PHYS in smp.h!
+
+%define ABS(label) (label - smp_trampoline_start + SMP_TRAMPOLINE_BASE)
+
+bits 16
+
+smp_trampoline_start:
+  cli
+  cld
+  xor   ax,ax                             ; CS is the SIPI vector, base from zero for the rest
+  mov   ds,ax
+
+  o32 lgdt [ABS(TRAMPOLINE_GDT_DESC)]     ; Load our GDT (same layout as stage2's)
+
+  mov   eax,cr0                           ; Enable protected mode
+  or    al,1
+  mov   cr0,eax
+
+  jmp   dword 0x18:ABS(trampoline32)      ; Far jump to 32-bit code (GDT selector 0x18)
+
+
+bits 32
+
+trampoline32:
+  mov   ax,0x20                           ; 32-bit data segment
+  mov   ds,ax
+  mov   es,ax
+  mov   ss,ax
+
+  mov   eax,[ABS(smp_trampoline_data) + 16]
+  mov   cr4,eax                           ; CR4 as the BSP has it (PAE, PGE etc)
+
+  mov   eax,[ABS(smp_trampoline_data) + 8]
+  mov   cr3,eax                           ; Same PML4 as the BSP (must be below 4GiB)
+
+  mov   ecx,0xC0000080                    ; EFER as the BSP has it (LME, NXE etc)
+  mov   eax,[ABS(smp_trampoline_data) + 24]
+  xor   edx,edx
+  wrmsr
+
+  mov   eax,[ABS(smp_trampoline_data)]
+  mov   cr0,eax                           ; CR0 as the BSP has it, which enables paging
+
+  jmp   0x08:ABS(trampoline64)            ; And go long
+
+
+bits 64
+
+trampoline64:
+  mov   ax,0x10                           ; 64-bit data segment
+  mov   ds,ax
+  mov   es,ax
+  mov   ss,ax
+
+  mov   rsp,[ABS(smp_trampoline_data) + 32] ; This AP's kernel stack
+  mov   rdi,[ABS(smp_trampoline_data) + 40] ; This AP's PerCPUState, for smp_ap_main
+
+  mov   rax,smp_ap_main                   ; Up into the kernel proper
+  call  rax                               ; (which doesn't return...)
+
+.die:
+  cli
+  hlt
+  jmp   .die
+
+
+align 8
+TRAMPOLINE_GDT:
+  ; segment 0 - null
+  dq 0
+
+  ; segment 1 - 64-bit code
+  dw 0, 0
+  db 0, 0b10011010, 0b10100000, 0
+
+  ; segment 2 - 64-bit data
+  dw 0, 0
+  db 0, 0b10010010, 0b00100000, 0
+
+  ; segment 3 - 32-bit code
+  dw 0xFFFF, 0
+  db 0, 0b10011010, 0b11001111, 0
+
+  ; segment 4 - 32-bit data
+  dw 0xFFFF, 0
+  db 0, 0b10010010, 0b11001111, 0
+
+TRAMPOLINE_GDT_DESC:
+  dw  TRAMPOLINE_GDT_DESC-TRAMPOLINE_GDT-1
+  dd  ABS(TRAMPOLINE_GDT)
+
+
+; Filled in by the BSP - must match SmpTrampolineData in smp.c!
+align 8
+smp_trampoline_data:
+  dq  0                                   ; +0  CR0
+  dq  0                                   ; +8  CR3
+  dq  0                                   ; +16 CR4
+  dq  0                                   ; +24 EFER
+  dq  0                                   ; +32 Stack top
+  dq  0                                   ; +40 PerCPUState
+
+smp_trampoline_end:
@@ -10,8 +10,13 @@
 %define FUNC(name) name
 %endif
 
-global FUNC(spinlock_init), FUNC(spinlock_lock), FUNC(spinlock_unlock)
+global FUNC(spinlock_init), FUNC(spinlock_lock), FUNC(spinlock_try_lock), FUNC(spinlock_unlock)
 global FUNC(spinlock_reentrant_init), FUNC(spinlock_reentrant_lock), FUNC(spinlock_reentrant_unlock)
+global FUNC(spinlock_mcs_init), FUNC(spinlock_mcs_lock), FUNC(spinlock_mcs_unlock)
+
+; Plain spinlocks are ticket locks - the low dword of the lock is the
+; next ticket to hand out, the high dword is the ticket being served.
+; Waiters get the lock in the order they asked for it.
 
 ; args:
 ;   rdi - *lock
@@ -23,22 +28,49 @@ FUNC(spinlock_init):
 ; args:
 ;   rdi - *lock
 ; 
+; modifies:
+;   eax - our ticket
+;
 FUNC(spinlock_lock):
-    lock bts qword [rdi], 0
-    jc .wait
+    mov eax, 1
+    lock xadd dword [rdi], eax      ; Take a ticket...
+    cmp dword [rdi+4], eax          ; ... and if it's being served, done
+    jne .wait
     ret
 
 .wait:
-    test qword [rdi], 1
-    jz FUNC(spinlock_lock)
-    jmp .wait
+    pause
+    cmp dword [rdi+4], eax          ; Our turn yet?
+    jne .wait
+    ret
+
+; args:
+;   rdi - *lock
+;
+; modifies:
+;   rax - 1 if lock taken, 0 otherwise
+;   ecx - our ticket
+;
+FUNC(spinlock_try_lock):
+    mov eax, dword [rdi]            ; Next ticket...
+    cmp eax, dword [rdi+4]          ; ... only free if it's being served
+    jne .busy
+    lea ecx, [eax+1]                ; Take it, as long as nobody else
+    lock cmpxchg dword [rdi], ecx   ; has in the meantime
+    jne .busy
+    mov rax, 1
+    ret
+
+.busy:
+    xor rax, rax                    ; Held (or contended) - don't wait
+    ret
 
 ; args:
 ;   rdi - *lock
 ;
 FUNC(spinlock_unlock):
-    lock btr qword [rdi], 0         ; keeping the lock as it feels like requiring
-    ret                             ; alignment of the lock will lead to subtle bugs..
+    lock inc dword [rdi+4]          ; Serve the next ticket. Only the holder
+    ret                             ; writes this, but keep the prefix anyway..
 
 ; args:
 ;   rdi - *lock
@@ -69,6 +101,7 @@ FUNC(spinlock_reentrant_lock):
     ret
 
 .wait:
+    pause
     test qword [rdi], 1             ; Does it look unlocked now?
     jz .trylock                     ; yes - go try to lock it
     jmp .wait                       ; else no - spin
@@ -97,3 +130,69 @@ FUNC(spinlock_reentrant_unlock):
 .no_unlock:
     xor rax,rax                     ; No unlock - return 0...
     ret
+
+; MCS locks - each waiter spins on the `locked` flag in its own node
+; (which should be on its own cache line), and the holder hands over
+; directly to the next in the queue on unlock.
+
+; args:
+;   rdi - *lock
+;
+FUNC(spinlock_mcs_init):
+    mov     qword [rdi], 0
+    ret
+
+; args:
+;   rdi - *lock
+;   rsi - *node (caller's, must stay put until unlock)
+;
+; modifies:
+;   rax - previous tail
+;
+FUNC(spinlock_mcs_lock):
+    mov qword [rsi], 0              ; node->next = NULL
+    mov qword [rsi+8], 1            ; node->locked = 1 (waiting)
+
+    mov rax, rsi
+    xchg qword [rdi], rax           ; Put ourselves at the tail (xchg is locked)
+    test rax, rax                   ; Was there anyone before us?
+    jz .acquired                    ; No - we have the lock
+
+    mov qword [rax], rsi            ; Yes - link in after them...
+
+.spin:
+    pause
+    cmp qword [rsi+8], 0            ; ... and wait to be handed the lock
+    jne .spin
+
+.acquired:
+    ret
+
+; args:
+;   rdi - *lock
+;   rsi - *node (the one passed to lock)
+;
+; modifies:
+;   rax, rcx, rdx
+;
+FUNC(spinlock_mcs_unlock):
+    mov rdx, qword [rsi]            ; Anyone waiting after us?
+    test rdx, rdx
+    jnz .handoff                    ; Yes - hand over
+
+    mov rax, rsi                    ; No - if we're still the tail,
+    xor ecx, ecx                    ; the lock is now free
+    lock cmpxchg qword [rdi], rcx
+    je .done
+
+.wait_next:                         ; Someone's queueing but hasn't linked
+    pause                           ; in after us yet - wait for them
+    mov rdx, qword [rsi]
+    test rdx, rdx
+    jz .wait_next
+
+.handoff:
+    mov qword [rdx+8], 0            ; next->locked = 0
+
+.done:
+    ret
@@ -7,8 +7,12 @@
 
 #include "syscalls.h"
 #include "debugprint.h"
+#include "kdrivers/local_apic.h"
 #include "printhex.h"
+#include "sched.h"
+#include "smp.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
 static SyscallResult handle_testcall(SyscallArg arg0, SyscallArg arg1,
@@ -37,6 +41,44 @@ static SyscallResult handle_debugprint(char *message) {
     return SYSCALL_OK;
 }
 
+static SyscallResult handle_yield(void) {
+    sched_yield();
+    return SYSCALL_OK;
+}
+
+static SyscallResult handle_sched_stats(SyscallSchedStats *stats) {
+    if (((uint64_t)stats & 0xf000000000000000) != 0) {
+        return SYSCALL_BAD_ARGS;
+    }
+
+    stats->context_switches = sched_context_switches();
+    stats->timer_ticks = smp_cpu_state(0)->timer_ticks;
+    stats->timer_hz = LAPIC_TIMER_HZ;
+
+    return SYSCALL_OK;
+}
+
+static SyscallResult handle_sched_cpu_stats(uint64_t cpu_id,
+                                           SyscallSchedCpuStats *stats) {
+    if (((uint64_t)stats & 0xf000000000000000) != 0) {
+        return SYSCALL_BAD_ARGS;
+    }
+
+    PerCPUState *cpu = cpu_id < smp_cpu_count() ? smp_cpu_state(cpu_id) : NULL;
+
+    if (cpu == NULL) {
+        return SYSCALL_BAD_ARGS;
+    }
+
+    stats->timer_ticks = __atomic_load_n(&cpu->timer_ticks, __ATOMIC_RELAXED);
+    stats->context_switches =
+            __atomic_load_n(&cpu->context_switches, __ATOMIC_RELAXED);
+    stats->steals = __atomic_load_n(&cpu->steals, __ATOMIC_RELAXED);
+    stats->migrations = __atomic_load_n(&cpu->migrations, __ATOMIC_RELAXED);
+
+    return SYSCALL_OK;
+}
+
 SyscallResult handle_syscall_69(SyscallArg arg0, SyscallArg arg1,
                                 SyscallArg arg2, SyscallArg arg3,
                                 SyscallArg arg4, SyscallArg syscall_num) {
@@ -45,6 +87,12 @@ SyscallResult handle_syscall_69(SyscallArg arg0, SyscallArg arg1,
         return handle_testcall(arg0, arg1, arg2, arg3, arg4);
     case 1:
         return handle_debugprint((char *)arg0);
+    case 2:
+        return handle_yield();
+    case 3:
+        return handle_sched_stats((SyscallSchedStats *)arg0);
+    case 4:
+        return handle_sched_cpu_stats(arg0, (SyscallSchedCpuStats *)arg1);
     default:
         return SYSCALL_BAD_NUMBER;
     }
@@ -6,21 +6,208 @@
  */
 
 #include "task.h"
+#include "cpu.h"
 #include "debugprint.h"
+#include "fba/alloc.h"
+#include "sched.h"
+#include "slab/kmalloc.h"
+#include "vmm/vmconfig.h"
+#include <stddef.h>
 #include <stdint.h>
 
-// not static, ASM needs it...
-Task *task_current_ptr;
+// Callee-saved registers task_do_switch pops
+#define TASK_SWITCH_FRAME_QWORDS 6
+
+static uint64_t next_tid = 1;
 
 void task_do_switch(Task *next);
+void task_do_switch_full(Task *next);
+void task_start(void);
+void task_exit(void);
+
+Task *task_current() {
+    Task *task;
+    __asm__ volatile("mov %%gs:%c1, %0\n\t"
+                     : "=r"(task)
+                     : "i"(offsetof(PerCPUState, task_current)));
+    return task;
+}
 
-Task *task_current() { return task_current_ptr; }
+static inline void prepare_switch(Task *next) {
+    PerCPUState *cpu = cpu_get_data();
+
+    if (next->rsp0) {
+        cpu->kernel_rsp = next->rsp0;
+        cpu->tss.rsp0 = next->rsp0;
+    }
+
+    cpu->context_switches++;
+}
 
 void task_switch(Task *next) {
-    debugstr("Switching task\n");
+    uint64_t flags = cpu_save_disable_interrupts();
+
+    // N.B. we might not come back on the same CPU, so don't hang on
+    // to anything per-CPU across this!
+    prepare_switch(next);
     task_do_switch(next);
+
+    cpu_restore_interrupts(flags);
+}
+
+void task_switch_from_interrupt(Task *next) {
+    prepare_switch(next);
+    task_do_switch_full(next);
+}
+
+Task *task_create_kernel(TaskEntrypoint entry) {
+    Task *task = kzalloc(sizeof(Task));
+    uint64_t *stack = fba_alloc_blocks(TASK_KERNEL_STACK_BLOCKS);
+
+    if (task == NULL || stack == NULL) {
+        kfree(task);
+        if (stack) {
+            fba_free_blocks(stack, TASK_KERNEL_STACK_BLOCKS);
+        }
+        return NULL;
+    }
+
+    uint64_t *top =
+            stack + (TASK_KERNEL_STACK_BLOCKS * VM_PAGE_SIZE) / sizeof(uint64_t);
+
+    // The first switch "returns" into `task_start`, which enables
+    // interrupts and goes on to `entry` - and if that returns it goes
+    // to `task_exit`, which calls `sched_exit`. Registers start zeroed.
+    *--top = (uint64_t)task_exit;
+    *--top = (uint64_t)entry;
+    *--top = (uint64_t)task_start;
+
+    for (int i = 0; i < TASK_SWITCH_FRAME_QWORDS; i++) {
+        *--top = 0;
+    }
+
+    task->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+    task->sp = (uintptr_t)top;
+    task->rsp0 = (uintptr_t)stack + TASK_KERNEL_STACK_BLOCKS * VM_PAGE_SIZE;
+    task->cpu = TASK_CPU_NONE;
+    task->stack = stack;
+
+    return task;
 }
 
+void task_destroy(Task *task) {
+    if (task->stack) {
+        fba_free_blocks(task->stack, TASK_KERNEL_STACK_BLOCKS);
+    }
+
+    kfree(task);
+}
+
+Task *task_adopt_current(void) {
+    Task *task = kzalloc(sizeof(Task));
+
+    if (task == NULL) {
+        return NULL;
+    }
+
+    uint64_t flags = cpu_save_disable_interrupts();
+    PerCPUState *cpu = cpu_get_data();
+
+    task->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+    task->rsp0 = cpu->kernel_rsp;
+    task->cpu = cpu->cpu_id;
+    cpu->task_current = task;
+
+    cpu_restore_interrupts(flags);
+
+    return task;
+}
+
+#ifdef DEBUG_SWITCH_BENCH
+#include "printhex.h"
+#include <stdbool.h>
+#include <stdnoreturn.h>
+
+#define SWITCH_BENCH_ROUNDS 100000
+#define SWITCH_BENCH_STACK_QWORDS 512
+
+static uint64_t bench_stack[SWITCH_BENCH_STACK_QWORDS]
+        __attribute__((aligned(16)));
+static Task bench_partner;
+static Task *bench_main;
+static bool bench_full;
+
+// Just switches straight back, the same way it was switched to
+static noreturn void switch_bench_partner(void) {
+    while (true) {
+        if (bench_full) {
+            task_do_switch_full(bench_main);
+        } else {
+            task_do_switch(bench_main);
+        }
+    }
+}
+
+// Bounce back and forth with the partner task, and return the average
+// cycles per switch. This is just the raw switch - no scheduler, TSS
+// etc - so only the register save / restore differs.
+static uint64_t bench_switches(bool full) {
+    bench_full = full;
+
+    uint64_t start = cpu_read_tsc();
+
+    for (int i = 0; i < SWITCH_BENCH_ROUNDS; i++) {
+        if (full) {
+            task_do_switch_full(&bench_partner);
+        } else {
+            task_do_switch(&bench_partner);
+        }
+    }
+
+    return (cpu_read_tsc() - start) / (SWITCH_BENCH_ROUNDS * 2);
+}
+
+static void print_result(char *label, uint64_t cycles) {
+    debugstr(label);
+    printhex64(cycles, debugchar);
+    debugstr(" cycles/switch\n");
+}
+
+void debug_switch_bench(void) {
+    bench_main = task_current();
+
+    if (bench_main == NULL) {
+        debugstr("Switch bench: no current task\n");
+        return;
+    }
+
+    // Partner starts in its loop with interrupts still off (so not via
+    // `task_start`), and is never queued so the scheduler can't see it
+    uint64_t *top = bench_stack + SWITCH_BENCH_STACK_QWORDS;
+    *--top = 0;
+    *--top = (uint64_t)switch_bench_partner;
+
+    for (int i = 0; i < TASK_SWITCH_FRAME_QWORDS; i++) {
+        *--top = 0;
+    }
+
+    bench_partner.sp = (uintptr_t)top;
+
+    uint64_t flags = cpu_save_disable_interrupts();
+
+    // First one gets the partner into its loop, and warms things up
+    bench_switches(false);
+
+    uint64_t full = bench_switches(true);
+    uint64_t minimal = bench_switches(false);
+
+    cpu_restore_interrupts(flags);
+
+    print_result("Switch bench: full frame (before): ", full);
+    print_result("Switch bench: callee-saved (after): ", minimal);
+}
+#endif // DEBUG_SWITCH_BENCH
+
 #ifdef DEBUG_TEST_TASKS
 // TODO remove all this!
 #include "debugprint.h"
@@ -67,16 +254,19 @@ noreturn void debug_test_tasks() {
     vmm_map_page((uint64_t)task1_stack, p_task1_stack, WRITE | PRESENT);
     vmm_map_page((uint64_t)task2_stack, p_task2_stack, WRITE | PRESENT);
 
-    task1_stack[0] = 0x10;    // tid 0x10
-    task1_stack[1] = 0x10f78; // top of stack - 136 bytes already allocated
+    task1_struct = (Task *)task1_stack;
+    task1_struct->tid = 0x10;
+    task1_struct->sp = 0x10fc0; // top of stack - 64 bytes already allocated
+    task1_struct->rsp0 = 0;
+    task1_stack[510] = (uint64_t)&task_start;
     task1_stack[511] = (uint64_t)&task1;
 
-    task2_stack[0] = 0x20;    // tid 0x20
-    task2_stack[1] = 0x20f78; // top of stack - 136 bytes already allocated
-    task2_stack[511] = (uint64_t)&task2;
-
-    task1_struct = (Task *)task1_stack;
     task2_struct = (Task *)task2_stack;
+    task2_struct->tid = 0x20;
+    task2_struct->sp = 0x20fc0; // top of stack - 64 bytes already allocated
+    task2_struct->rsp0 = 0;
+    task2_stack[510] = (uint64_t)&task_start;
+    task2_stack[511] = (uint64_t)&task2;
 
     task_switch(task1_struct);
 
@@ -5,64 +5,101 @@
 ;
 
 bits 64
-global task_do_switch
-extern task_current_ptr
+global task_do_switch, task_do_switch_full, task_start, task_exit
+extern sched_finish_switch, sched_exit
 
-%define TASK_TID    0
-%define TASK_SP     8
+; Must match Task in task.h (after its 24-byte list node)
+%define TASK_TID    24
+%define TASK_SP     32
 
-task_do_switch:
-    cli                                     ; Disable interrupts
+; Must match PerCPUState in percpu.h
+%define PERCPU_TASK_CURRENT     24
 
-    mov     [temp_rsi],rsi
-    mov     rsi,[task_current_ptr]          ; Get current task struct
-    test    rsi,rsi
-    jz      .next
-    mov     rsi,[temp_rsi]
+; Voluntary switch to the task in rdi, called from C. Anything the
+; SysV ABI lets a call clobber is already dead as far as the caller is
+; concerned, so only the callee-saved registers (and rsp) are saved.
+;
+; Flags aren't saved either - call with interrupts disabled (task_switch
+; does), and the caller puts its own back once it's switched back to.
+;
+; The old task isn't fully switched out until we're on the new stack,
+; so that's when the scheduler gets to requeue it (where other CPUs
+; could steal it), or free it if it's exited.
+task_do_switch:
+    mov     rsi,[gs:PERCPU_TASK_CURRENT]    ; Get current task struct
+    test    rsi,rsi                         ; Is there one on this CPU?
+    jz      .next                           ; If not, nothing to save
 
-    push    rax                             ; Push all GP registers
+    push    rbp                             ; Push callee-saved registers
     push    rbx
-    push    rcx
-    push    rdx
-    push    rbp
-    push    rsi
-    push    rdi
-    push    r8
-    push    r9
-    push    r10
-    push    r11
     push    r12
     push    r13
     push    r14
     push    r15
-    pushfq                                  ; Push flags
 
-    mov     rsi,[task_current_ptr]          ; Get current task struct
     mov     [rsi+TASK_SP],rsp               ; Save stack pointer
 
 .next:
-    mov     [task_current_ptr],rdi          ; Load new task into variable
+    mov     [gs:PERCPU_TASK_CURRENT],rdi    ; Load new task into per-CPU data
     mov     rsp,[rdi+TASK_SP]               ; Restore stack pointer
 
-    popfq                                   ; Pop flags
-    pop     r15                             ; Pop all GP registers
+    mov     rbx,rsp                         ; Now we're off the old task's stack,
+    and     rsp,-16                         ; it can go back on the run queue
+    call    sched_finish_switch             ; (rbx is popped right after, and
+    mov     rsp,rbx                         ; the rest are scratch anyway)
+
+    pop     r15                             ; Pop callee-saved registers
     pop     r14
     pop     r13
     pop     r12
-    pop     r11
+    pop     rbx
+    pop     rbp
+
+    ret                                     ; Back to wherever it switched out
+
+; Full-frame switch to the task in rdi, for switching away from an
+; interrupted task (i.e. preemption from the timer ISR). Saves the
+; scratch registers and flags as well, then does a voluntary switch -
+; which "returns" here when this task is next switched to, to put them
+; back. Tasks can be resumed by either kind of switch, whichever way
+; they were switched out.
+task_do_switch_full:
+    push    rax                             ; Push scratch registers
+    push    rcx
+    push    rdx
+    push    rsi
+    push    rdi
+    push    r8
+    push    r9
+    push    r10
+    push    r11
+    pushfq                                  ; Push flags
+    cli                                     ; and disable interrupts
+
+    call    task_do_switch
+
+    popfq                                   ; Pop flags
+    pop     r11                             ; Pop scratch registers
     pop     r10
     pop     r9
     pop     r8
     pop     rdi
     pop     rsi
-    pop     rbp
     pop     rdx
     pop     rcx
-    pop     rbx
     pop     rax
 
-    sti                                     ; Re-enable interrupts and return
     ret
 
-    section .bss
-temp_rsi    resq  1
\ No newline at end of file
+; New tasks "return" here from their first switch (see task_create_kernel),
+; with their entrypoint next on the stack.
+task_start:
+    sti                                     ; New tasks start with interrupts on
+    ret                                     ; Into the entrypoint
+
+; ...and come here if the entrypoint returns. Returning straight into
+; sched_exit would leave the stack misaligned by 8 for it, so call it
+; (on an aligned stack) instead - it doesn't return.
+task_exit:
+    and     rsp,-16                         ; Align for the call
+    call    sched_exit
@@ -1,5 +1,5 @@
 /*
- * stage3 - LAPIC timer ISR (heartbeat)
+ * stage3 - LAPIC timer ISR (heartbeat and scheduler tick)
  * anos - An Operating System
  *
  * Copyright (c) 2024 Ross Bamford
@@ -8,12 +8,17 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "cpu.h"
 #include "kdrivers/local_apic.h"
+#include "sched.h"
 
 // TODO Obviously doesn't belong here, just a hack for proof of life...
 #define VRAM_VIRTUAL_HEART 0xffffffff800b809e
+#define HEART_TICKS (LAPIC_TIMER_HZ / 2)
+
 static bool heart_state = false;
-void handle_timer_interrupt(void) {
+
+static void heartbeat(void) {
     uint8_t *vram = (uint8_t *)VRAM_VIRTUAL_HEART;
 
     vram[0] = 0x03; // heart
@@ -25,5 +30,20 @@ void handle_timer_interrupt(void) {
     }
 
     heart_state = !heart_state;
+}
+
+void handle_timer_interrupt(void) {
+    PerCPUState *cpu = cpu_get_data();
+
+    cpu->timer_ticks++;
+
+    if (cpu->cpu_id == 0 && cpu->timer_ticks % HEART_TICKS == 0) {
+        heartbeat();
+    }
+
     local_apic_eoe();
-}
\ No newline at end of file
+
+    // Might switch task, in which case this returns (and so does the
+    // interrupt) when this task is next scheduled
+    sched_tick();
+}
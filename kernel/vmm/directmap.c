@@ -0,0 +1,168 @@
+/*
+ * stage3 - The direct physical memory map
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * This builds the tables directly, through the recursive mapping,
+ * rather than with the mapper - the mapper needs the direct map to get
+ * at new tables, which (if they're above the low 4MiB) the direct map
+ * would need first...
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "machine.h"
+#include "pmm/pagealloc.h"
+#include "vmm/directmap.h"
+#include "vmm/recursive.h"
+#include "vmm/vmmapper.h"
+
+#ifdef DEBUG_VMM
+#include "debugprint.h"
+#include "printhex.h"
+#define C_DEBUGSTR debugstr
+#define C_PRINTHEX64 printhex64
+#else
+#define C_DEBUGSTR(...)
+#define C_PRINTHEX64(...)
+#endif
+
+#define NULL (((void *)0))
+
+#define DIRECT_MAP_FLAGS ((PRESENT | WRITE))
+#define DIRECT_MAP_PAGE_FLAGS ((DIRECT_MAP_FLAGS | GLOBAL | LARGE_PAGE))
+
+#ifndef UNIT_TESTS
+uintptr_t vmm_phys_window_base = STATIC_KERNEL_SPACE;
+#endif
+
+extern MemoryRegion *physical_region;
+
+static E820h_MemMap *direct_memmap;
+
+// Work out the page-aligned range of physical memory from this entry
+// that goes in the direct map (if any).
+static bool direct_map_range(E820h_MemMapEntry *entry, uint64_t *start,
+                             uint64_t *end) {
+    if (entry->type != MEM_MAP_ENTRY_AVAILABLE &&
+        entry->type != MEM_MAP_ENTRY_ACPI) {
+        return false;
+    }
+
+    // Only whole pages, rounding inward - mapping part of whatever's
+    // next door could be a problem if it's e.g. device memory...
+    *start = (entry->base + VM_PAGE_SIZE - 1) & PAGE_ALIGN_MASK;
+    *end = (entry->base + entry->length) & PAGE_ALIGN_MASK;
+
+    if (*end > DIRECT_MAP_SIZE) {
+        *end = DIRECT_MAP_SIZE;
+    }
+
+    return *end > *start;
+}
+
+// Make sure there's a table under the given (recursively-mapped)
+// entry, so the next level down can be reached.
+static bool ensure_table(uint64_t *entry, PageTable *next_level) {
+    if (*entry & PRESENT) {
+        return true;
+    }
+
+    uint64_t page = page_alloc(physical_region);
+
+    if (page & 0xff) {
+        C_DEBUGSTR("===> vmm_direct_map_init failed [table alloc]\n");
+        return false;
+    }
+
+    *entry = page | DIRECT_MAP_FLAGS;
+    vmm_invalidate_page((uintptr_t)next_level);
+
+    for (int i = 0; i < 0x200; i++) {
+        next_level->entries[i] = 0;
+    }
+
+    return true;
+}
+
+// Map the biggest page that fits at `phys`, returning its size (or
+// zero if a table couldn't be allocated).
+static uint64_t map_next(uint64_t phys, uint64_t end, bool huge_ok) {
+    uintptr_t virt = DIRECT_MAP_BASE + phys;
+    uint64_t remain = end - phys;
+
+    if (!ensure_table(vmm_virt_to_pml4e(virt), vmm_virt_to_pdpt(virt))) {
+        return 0;
+    }
+
+    if (huge_ok && (phys & ~HUGE_PAGE_ALIGN_MASK) == 0 &&
+        remain >= HUGE_PAGE_SIZE) {
+        *vmm_virt_to_pdpte(virt) = phys | DIRECT_MAP_PAGE_FLAGS;
+        return HUGE_PAGE_SIZE;
+    }
+
+    if (!ensure_table(vmm_virt_to_pdpte(virt), vmm_virt_to_pd(virt))) {
+        return 0;
+    }
+
+    if ((phys & ~LARGE_PAGE_ALIGN_MASK) == 0 && remain >= LARGE_PAGE_SIZE) {
+        *vmm_virt_to_pde(virt) = phys | DIRECT_MAP_PAGE_FLAGS;
+        return LARGE_PAGE_SIZE;
+    }
+
+    if (!ensure_table(vmm_virt_to_pde(virt), vmm_virt_to_pt(virt))) {
+        return 0;
+    }
+
+    *vmm_virt_to_pte(virt) = phys | DIRECT_MAP_FLAGS | GLOBAL;
+    return VM_PAGE_SIZE;
+}
+
+bool vmm_direct_map_init(E820h_MemMap *memmap) {
+    bool huge_ok = vmm_huge_pages_supported();
+
+    for (int i = 0; i < memmap->num_entries; i++) {
+        uint64_t start, end;
+
+        if (!direct_map_range(&memmap->entries[i], &start, &end)) {
+            continue;
+        }
+
+        for (uint64_t phys = start; phys < end;) {
+            uint64_t size = map_next(phys, end, huge_ok);
+
+            if (size == 0) {
+                return false;
+            }
+
+            phys += size;
+        }
+    }
+
+    direct_memmap = memmap;
+
+#ifndef UNIT_TESTS
+    vmm_phys_window_base = DIRECT_MAP_BASE;
+#endif
+
+    return true;
+}
+
+bool vmm_direct_map_covers(uint64_t phys) {
+    if (direct_memmap == NULL) {
+        return false;
+    }
+
+    for (int i = 0; i < direct_memmap->num_entries; i++) {
+        uint64_t start, end;
+
+        if (direct_map_range(&direct_memmap->entries[i], &start, &end) &&
+            phys >= start && phys < end) {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,347 @@
+/*
+ * stage3 - Process-context identifiers (PCIDs)
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Each CPU has its own allocator state, only ever touched by that CPU
+ * with interrupts disabled, so there's no locking in here.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "vmm/pcid.h"
+
+#define NULL (((void *)0))
+
+// CR4 bit to enable PCIDs
+#define CR4_PCIDE ((1ULL << 17))
+
+// CPUID.01H:ECX - PCID supported
+#define CPUID_1_ECX_PCID ((1 << 17))
+
+// CPUID.(EAX=07H,ECX=0):EBX - INVPCID supported
+#define CPUID_7_EBX_INVPCID ((1 << 10))
+
+// INVPCID types we use
+#define INVPCID_ADDRESS 0        // One address, one PCID
+#define INVPCID_ALL_NON_GLOBAL 3 // Everything but globals, all PCIDs
+
+typedef struct {
+    uint64_t generation; // Tags from any other generation are stale
+    uint16_t next;       // Next PCID to hand out in this generation
+    bool enabled;
+    bool invpcid;
+} PcidCpuState;
+
+static PcidCpuState pcid_cpus[MAX_CPU_COUNT];
+
+#ifdef UNIT_TESTS
+static bool test_has_pcid;
+static bool test_has_invpcid;
+static uint64_t test_cr3;
+static uint64_t test_cr3_loads;
+static uint64_t test_invpcids[4];
+
+void test_pcid_reset(bool has_pcid, bool has_invpcid) {
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        pcid_cpus[i] = (PcidCpuState){0};
+    }
+
+    for (int i = 0; i < 4; i++) {
+        test_invpcids[i] = 0;
+    }
+
+    test_has_pcid = has_pcid;
+    test_has_invpcid = has_invpcid;
+    test_cr3 = test_cr3_loads = 0;
+}
+
+uint64_t test_pcid_last_cr3(void) { return test_cr3; }
+uint64_t test_pcid_cr3_loads(void) { return test_cr3_loads; }
+uint64_t test_pcid_invpcids(uint8_t type) { return test_invpcids[type]; }
+
+static inline void load_cr3(uint64_t value) {
+    test_cr3 = value;
+    test_cr3_loads++;
+}
+
+static inline uint64_t read_cr3(void) { return test_cr3 & ~CR3_NO_FLUSH; }
+
+static inline void invpcid(uint64_t type, uint16_t pcid, uintptr_t addr) {
+    test_invpcids[type]++;
+}
+
+static inline bool cpu_supports_pcid(bool *has_invpcid) {
+    *has_invpcid = test_has_invpcid;
+    return test_has_pcid;
+}
+
+static inline void enable_pcide(void) {}
+#else
+static inline void load_cr3(uint64_t value) {
+    __asm__ volatile("mov %0, %%cr3\n\t" : : "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr3(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr3, %0\n\t" : "=r"(value));
+    return value;
+}
+
+static inline void invpcid(uint64_t type, uint16_t pcid, uintptr_t addr) {
+    struct {
+        uint64_t pcid;
+        uint64_t addr;
+    } descriptor = {pcid, addr};
+
+    __asm__ volatile("invpcid %0, %1\n\t"
+                     :
+                     : "m"(descriptor), "r"(type)
+                     : "memory");
+}
+
+static inline bool cpu_supports_pcid(bool *has_invpcid) {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpu_cpuid(0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+
+    cpu_cpuid(1, &eax, &ebx, &ecx, &edx);
+    if ((ecx & CPUID_1_ECX_PCID) == 0) {
+        return false;
+    }
+
+    *has_invpcid = false;
+
+    if (max_leaf >= 7) {
+        cpu_cpuid(7, &eax, &ebx, &ecx, &edx);
+        *has_invpcid = (ebx & CPUID_7_EBX_INVPCID) != 0;
+    }
+
+    return true;
+}
+
+static inline void enable_pcide(void) {
+    __asm__ volatile("mov %%cr4, %%rax\n\t"
+                     "or %0, %%rax\n\t"
+                     "mov %%rax, %%cr4\n\t"
+                     :
+                     : "r"(CR4_PCIDE)
+                     : "rax", "memory");
+}
+#endif
+
+static inline PcidCpuState *this_cpu(void) {
+    return &pcid_cpus[cpu_current_id()];
+}
+
+// Start a new generation, making every tag handed out so far stale.
+static inline void new_generation(PcidCpuState *cpu) {
+    cpu->generation++;
+    cpu->next = 1;
+}
+
+bool vmm_pcid_init(void) {
+    PcidCpuState *cpu = this_cpu();
+    bool has_invpcid;
+
+    if (!cpu_supports_pcid(&has_invpcid)) {
+        return false;
+    }
+
+    // Setting CR4.PCIDE with a non-zero PCID in CR3 is a #GP
+    if (read_cr3() & CR3_PCID_MASK) {
+        return false;
+    }
+
+    enable_pcide();
+
+    cpu->generation = 0;
+    new_generation(cpu);
+    cpu->invpcid = has_invpcid;
+    cpu->enabled = true;
+
+    return true;
+}
+
+bool vmm_pcid_enabled(void) { return this_cpu()->enabled; }
+
+uint64_t vmm_pcid_cr3(PcidTag *tag, uint64_t pml4_phys) {
+    PcidCpuState *cpu = this_cpu();
+
+    if (!cpu->enabled) {
+        return pml4_phys;
+    }
+
+    uint8_t id = cpu_current_id();
+
+    if (tag->generation[id] == cpu->generation) {
+        return pml4_phys | tag->pcid[id] | CR3_NO_FLUSH;
+    }
+
+    if (cpu->next > PCID_MAX) {
+        new_generation(cpu);
+    }
+
+    tag->generation[id] = cpu->generation;
+    tag->pcid[id] = cpu->next++;
+
+    // Whoever had this PCID before may have left entries behind, so
+    // this first load has to flush...
+    return pml4_phys | tag->pcid[id];
+}
+
+void vmm_switch_address_space(PcidTag *tag, uint64_t pml4_phys) {
+    uint64_t flags = cpu_save_disable_interrupts();
+    load_cr3(vmm_pcid_cr3(tag, pml4_phys));
+    cpu_restore_interrupts(flags);
+}
+
+void vmm_pcid_retire(PcidTag *tag) {
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        tag->generation[i] = 0;
+    }
+}
+
+void vmm_pcid_retire_all(void) {
+    PcidCpuState *cpu = this_cpu();
+
+    if (cpu->enabled) {
+        new_generation(cpu);
+    }
+}
+
+void vmm_pcid_invalidate_page_in(PcidTag *tag, uintptr_t virt_addr) {
+    PcidCpuState *cpu = this_cpu();
+    uint8_t id = cpu_current_id();
+
+    if (!cpu->enabled || tag->generation[id] != cpu->generation) {
+        // Nothing cached under a PCID for it here
+        return;
+    }
+
+    if (cpu->invpcid) {
+        invpcid(INVPCID_ADDRESS, tag->pcid[id], virt_addr);
+    } else {
+        tag->generation[id] = 0;
+    }
+}
+
+void vmm_pcid_flush_all(void) {
+    PcidCpuState *cpu = this_cpu();
+
+    if (cpu->invpcid) {
+        invpcid(INVPCID_ALL_NON_GLOBAL, 0, 0);
+        return;
+    }
+
+    // Reloading CR3 (without CR3_NO_FLUSH) flushes the current PCID...
+    load_cr3(read_cr3());
+
+    // ... and the rest will be flushed when they're next assigned.
+    if (cpu->enabled) {
+        new_generation(cpu);
+    }
+}
+
+#ifdef DEBUG_PCID_BENCH
+#include "debugprint.h"
+#include "pmm/pagealloc.h"
+#include "printhex.h"
+#include "vmm/recursive.h"
+#include "vmm/vmmapper.h"
+
+#define BENCH_VIRT_BASE 0x500000000
+#define BENCH_PAGES 32
+#define BENCH_ROUNDS 1000
+
+extern MemoryRegion *physical_region;
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc\n\t" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void touch_bench_pages(void) {
+    volatile uint64_t *base = (volatile uint64_t *)BENCH_VIRT_BASE;
+
+    for (int i = 0; i < BENCH_PAGES; i++) {
+        (void)base[i << 9];
+    }
+}
+
+// Switch back and forth between the two address spaces, touching the
+// bench pages in each, and return the average cycles per switch.
+static uint64_t bench_switches(PcidTag *tag_a, uint64_t pml4_a, PcidTag *tag_b,
+                               uint64_t pml4_b) {
+    uint64_t flags = cpu_save_disable_interrupts();
+    uint64_t start = rdtsc();
+
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        load_cr3(tag_b ? vmm_pcid_cr3(tag_b, pml4_b) : pml4_b);
+        touch_bench_pages();
+        load_cr3(tag_a ? vmm_pcid_cr3(tag_a, pml4_a) : pml4_a);
+        touch_bench_pages();
+    }
+
+    uint64_t cycles = rdtsc() - start;
+    cpu_restore_interrupts(flags);
+
+    return cycles / (BENCH_ROUNDS * 2);
+}
+
+static void print_result(char *label, uint64_t cycles) {
+    debugstr(label);
+    printhex64(cycles, debugchar);
+    debugstr(" cycles/switch\n");
+}
+
+void debug_pcid_switch_bench(void) {
+    uint64_t pml4_a = read_cr3() & ~CR3_PCID_MASK;
+    uint64_t pml4_b = page_alloc(physical_region);
+    uint64_t data = page_alloc_m(physical_region, BENCH_PAGES);
+
+    if ((pml4_b & 0xff) || (data & 0xff)) {
+        debugstr("PCID bench: allocation failed\n");
+        return;
+    }
+
+    if (!vmm_map_range(BENCH_VIRT_BASE, data, BENCH_PAGES, PRESENT | WRITE)) {
+        debugstr("PCID bench: mapping failed\n");
+        return;
+    }
+
+    // The second address space shares the kernel half, and (just for
+    // the bench) the tables under the bench pages too...
+    uint64_t *pml4 = (uint64_t *)vmm_recursive_find_pml4();
+    uint64_t *dst = vmm_init_address_space(pml4, pml4_b);
+
+    dst[PML4ENTRY(BENCH_VIRT_BASE)] = pml4[PML4ENTRY(BENCH_VIRT_BASE)];
+
+    PcidTag tag_a = {0}, tag_b = {0};
+
+    debugstr("PCID bench: ");
+    debugstr(vmm_pcid_enabled() ? "PCIDs enabled" : "no PCIDs");
+    debugstr(", ");
+    printhex16(BENCH_PAGES, debugchar);
+    debugstr(" pages touched per switch\n");
+
+    print_result("    Untagged: ", bench_switches(NULL, pml4_a, NULL, pml4_b));
+    print_result("    Tagged:   ",
+                 bench_switches(&tag_a, pml4_a, &tag_b, pml4_b));
+
+    // Back to PCID zero, which is what everything else still expects
+    load_cr3(pml4_a);
+
+    vmm_unmap_range(BENCH_VIRT_BASE, BENCH_PAGES, NULL);
+    page_free(physical_region, pml4_b);
+
+    for (int i = 0; i < BENCH_PAGES; i++) {
+        page_free(physical_region, data + (i << 12));
+    }
+}
+#endif
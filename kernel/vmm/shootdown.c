@@ -0,0 +1,145 @@
+/*
+ * stage3 - TLB shootdown
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * One shootdown is in flight at a time. The sender fills in the request
+ * under the lock, sets a pending bit for each CPU it's sending to (by
+ * local APIC ID), sends the NMIs and waits for every bit to clear. Each
+ * CPU clears its own once it's flushed.
+ *
+ * A CPU waiting for the lock is spinning with interrupts disabled, but
+ * still takes the NMI - so two CPUs shooting down at once can't wait
+ * on each other.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "kdrivers/local_apic.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "vmm/directmap.h"
+#include "vmm/shootdown.h"
+#include "vmm/vmmapper.h"
+
+#define NULL (((void *)0))
+
+// Enough bits for every possible local APIC ID
+#define PENDING_QUADS 4
+
+static SpinLock shootdown_lock;
+
+// The request - only changed by the lock holder, once nothing's pending
+static uintptr_t request_addr;
+static const uintptr_t *request_addrs;
+static uint64_t request_count; // Zero flushes everything
+
+static uint64_t pending[PENDING_QUADS];
+
+static inline uintptr_t request_page(uint64_t i) {
+    return request_addrs ? request_addrs[i] : request_addr + (i << 12);
+}
+
+// Flush this CPU's TLB for the current request. This runs in the NMI
+// handler, which can land anywhere (even on the way in from user mode,
+// before the swapgs) so it mustn't go near the per-CPU data.
+static void flush_request(void) {
+    bool all = request_count == 0 || request_count > VMM_RANGE_FLUSH_THRESHOLD;
+
+    // User-half pages could be cached under any PCID here, not just
+    // the current one, and invlpg only covers that...
+    for (uint64_t i = 0; i < request_count && !all; i++) {
+        all = request_page(i) < DIRECT_MAP_BASE;
+    }
+
+    if (all) {
+        vmm_flush_tlb_global();
+        return;
+    }
+
+    for (uint64_t i = 0; i < request_count; i++) {
+        vmm_invalidate_page(request_page(i));
+    }
+}
+
+static inline bool any_pending(void) {
+    for (int i = 0; i < PENDING_QUADS; i++) {
+        if (__atomic_load_n(&pending[i], __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void shootdown(uintptr_t virt_addr, const uintptr_t *virt_addrs,
+                      uint64_t num_pages) {
+    uint8_t cpus = smp_cpu_count();
+
+    if (cpus < 2) {
+        return;
+    }
+
+    uint64_t flags = spinlock_lock_irqsave(&shootdown_lock);
+    uint8_t self = cpu_current_id();
+
+    request_addr = virt_addr;
+    request_addrs = virt_addrs;
+    request_count = num_pages;
+
+    for (uint8_t i = 0; i < cpus; i++) {
+        PerCPUState *cpu = smp_cpu_state(i);
+
+        if (cpu == NULL || i == self) {
+            continue;
+        }
+
+        __atomic_fetch_or(&pending[cpu->apic_id >> 6],
+                          1ULL << (cpu->apic_id & 63), __ATOMIC_RELEASE);
+        local_apic_send_nmi(cpu->apic_id);
+    }
+
+    while (any_pending()) {
+        cpu_relax();
+    }
+
+    spinlock_unlock_irqrestore(&shootdown_lock, flags);
+}
+
+void vmm_shootdown_range(uintptr_t virt_addr, uint64_t num_pages) {
+    if (num_pages) {
+        shootdown(virt_addr, NULL, num_pages);
+    }
+}
+
+void vmm_shootdown_pages(const uintptr_t *virt_addrs, uint64_t num_pages) {
+    if (num_pages) {
+        shootdown(0, virt_addrs, num_pages);
+    }
+}
+
+void vmm_shootdown_all(void) { shootdown(0, NULL, 0); }
+
+bool vmm_shootdown_handle_nmi(void) {
+    // Check there's one in flight before going near the LAPIC, which
+    // might not be mapped yet if this is some other NMI early on
+    if (!any_pending()) {
+        return false;
+    }
+
+    uint8_t apic_id = local_apic_id();
+    uint64_t *word = &pending[apic_id >> 6];
+    uint64_t bit = 1ULL << (apic_id & 63);
+
+    if ((__atomic_load_n(word, __ATOMIC_ACQUIRE) & bit) == 0) {
+        return false;
+    }
+
+    flush_request();
+
+    __atomic_fetch_and(word, ~bit, __ATOMIC_RELEASE);
+    return true;
+}
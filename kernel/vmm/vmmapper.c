@@ -8,8 +8,12 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "cpu.h"
 #include "pmm/pagealloc.h"
+#include "vmm/directmap.h"
+#include "vmm/pcid.h"
 #include "vmm/recursive.h"
+#include "vmm/shootdown.h"
 #include "vmm/vmmapper.h"
 
 #ifdef DEBUG_VMM
@@ -25,72 +29,391 @@
 #define C_PRINTHEX64(...)
 #endif
 
-#ifdef UNIT_TESTS
-#define PAGE_TO_V(page) ((uint64_t *)page)
-#define ENTRY_TO_V(entry) ((uint64_t *)(entry & PAGE_ALIGN_MASK))
-#else
-#define PAGE_TO_V(page) ((uint64_t *)(page | STATIC_KERNEL_SPACE))
-#define ENTRY_TO_V(entry)                                                      \
-    ((uint64_t *)((entry | STATIC_KERNEL_SPACE) & PAGE_ALIGN_MASK))
-#endif
+#define PAGE_TO_V(page) ((uint64_t *)phys_to_virt(page))
+#define ENTRY_TO_V(entry) ((uint64_t *)phys_to_virt((entry) & ENTRY_ADDR_MASK))
 
-#define SPIN_LOCK()                                                            \
-    do {                                                                       \
-        spinlock_lock(&vmm_map_lock);                                          \
-    } while (0)
+#define SPIN_LOCK(lock) uint64_t lock_flags = spinlock_lock_irqsave(lock)
 
-#define SPIN_UNLOCK_RET(retval)                                                \
+#define SPIN_UNLOCK_RET(lock, retval)                                          \
     do {                                                                       \
-        spinlock_unlock(&vmm_map_lock);                                        \
+        spinlock_unlock_irqrestore(lock, lock_flags);                          \
         return (retval);                                                       \
     } while (0)
 
 #define NULL (((void *)0))
 
 extern MemoryRegion *physical_region;
-static SpinLock vmm_map_lock;
+static SpinLock vmm_address_space_locks[VMM_ADDRESS_SPACE_LOCK_COUNT];
+
+#ifdef UNIT_TESTS
+static uint64_t test_invalidated_pages;
+static uint64_t test_tlb_flushes;
+static uint64_t test_shootdowns;
+
+uint64_t test_vmm_mapper_invalidated_pages() { return test_invalidated_pages; }
+uint64_t test_vmm_mapper_tlb_flushes() { return test_tlb_flushes; }
+uint64_t test_vmm_mapper_shootdowns() { return test_shootdowns; }
+
+void test_vmm_mapper_reset_flush_counts() {
+    test_invalidated_pages = test_tlb_flushes = test_shootdowns = 0;
+}
+#endif
 
-// TODO locking in here is very coarse-grained - it could be done based
-//      on the top-level table instead, for example...
+// Each address space has its own lock, so mapping in one doesn't hold
+// up mapping in another. There's no address space structure (yet) to
+// keep the lock in, so it's picked from a fixed set of locks by the
+// physical address of the PML4 - found via the recursive entry, which
+// always points back at the PML4 itself (whichever virtual address
+// the caller is using for it).
+//
+// Upper-level tables can still be shared between address spaces (the
+// kernel half, for example) so new tables are installed with cmpxchg,
+// and never under the assumption that the lock is enough...
+//
+static inline SpinLock *address_space_lock(uint64_t *pml4) {
+    uint64_t id = pml4[RECURSIVE_ENTRY] & PAGE_ALIGN_MASK;
+
+    if (id == 0) {
+        // No recursive entry (yet) - just go by the pointer instead
+        id = (uint64_t)pml4;
+    }
+
+    return &vmm_address_space_locks[(id >> 12) &
+                                    (VMM_ADDRESS_SPACE_LOCK_COUNT - 1)];
+}
+
+
+// Tables the mapper allocates keep a count of their live (non-zero)
+// entries, so they can be given back to the PMM once they're empty.
+// The count lives in the (ignored) high bits of the entry pointing at
+// the table, with a flag to say it's being kept - tables set up some
+// other way (by the bootloader, or the direct map) don't have one, and
+// are never freed.
+//
+// PDPTs in the kernel half are never counted - every address space
+// links to the same ones (see `vmm_kernel_half_init`), so they must
+// stay put for everyone else.
+//
+// Tables under an uncounted PML4 entry might be shared with other
+// address spaces (which have their own locks) so anyone walking through
+// those holds a "pin" (one extra on the count) until they're done, so
+// the table can't be freed from under them. Everything else belongs to
+// this address space alone, and the address space lock is enough.
 //
+// Leaf entries are counted without atomics, so two address spaces
+// shouldn't be mapping and unmapping the *same* shared page at once
+// (which would be a bug anyway).
+#define TABLE_COUNTED ((1 << 9))
+#define TABLE_COUNT_SHIFT 52
+#define TABLE_COUNT_ONE ((1ULL << TABLE_COUNT_SHIFT))
+#define TABLE_COUNT_MASK ((0x3FFULL << TABLE_COUNT_SHIFT))
 
+#define KERNEL_HALF_PML4ENTRY 256
+
+// Most tables a single walk can empty (PT, PD and PDPT)
+#define WALK_MAX_RECLAIM 3
+
+// The tables walked through for one address - the entries (PML4E,
+// PDPTE, PDE) that point at each, and the change in the number of live
+// entries in each along the way.
+typedef struct {
+    uint64_t *entries[3];
+    int32_t live[3];
+    uint8_t depth;
+    bool shared; // Below an uncounted PML4 entry, so tables are pinned
+} TableWalk;
+
+// Tables emptied by an update, to be freed once the TLB's been flushed
+typedef struct {
+    uint64_t pages[VMM_RECLAIM_BATCH];
+    uint8_t count;
+} ReclaimBatch;
+
+// The pin taken on a table at the current depth of the walk
+static inline uint64_t walk_pin(TableWalk *walk) {
+    return (walk->depth > 0 && walk->shared) ? TABLE_COUNT_ONE : 0;
+}
+
+static inline void walk_push(TableWalk *walk, uint64_t *slot, uint64_t entry,
+                             bool created) {
+    if (walk->depth == 0) {
+        walk->shared = (entry & TABLE_COUNTED) == 0;
+    } else if (created) {
+        // New table is a new live entry in the one above
+        walk->live[walk->depth - 1]++;
+    }
+
+    walk->entries[walk->depth] = slot;
+    walk->live[walk->depth] = 0;
+    walk->depth++;
+}
+
+// Leaf entries in the shared part of the kernel half are global, so
+// they survive address-space switches. Table entries never are - the
+// bit's ignored there, except when a table is reached through the
+// recursive mapping, which mustn't be global (it's per address space).
+static inline uint16_t leaf_flags(uintptr_t virt_addr, uint16_t flags) {
+    return virt_addr >= DIRECT_MAP_BASE ? flags | GLOBAL : flags;
+}
+
+// Find (or create) the table under `table[index]`, pinning it for the
+// walk if need be. Returns NULL if a table couldn't be allocated, or
+// the entry maps a large / huge page.
 static inline uint64_t *ensure_table_entry(uint64_t *table, uint16_t index,
-                                           uint16_t flags) {
-    uint64_t entry = table[index];
-    if ((entry & PRESENT) == 0) {
-        uint64_t page = page_alloc(physical_region);
+                                           uint16_t flags, TableWalk *walk) {
+    uint64_t *slot = &table[index];
+    uint64_t entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    uint64_t page = 0xff;
+    uint64_t pin = walk_pin(walk);
 
-        if (page & 0xff) {
-            // No page alloc - fail
-            C_DEBUGSTR("===> FAIL to allocate new table\n");
-            return NULL;
-        }
+    flags &= ~GLOBAL;
+
+    // Fast path - the table's there, and there's nothing to update
+    if ((entry & (PRESENT | LARGE_PAGE)) == PRESENT &&
+        (entry | flags) == entry &&
+        (pin == 0 || (entry & TABLE_COUNTED) == 0)) {
+        walk_push(walk, slot, entry, false);
+        return ENTRY_TO_V(entry);
+    }
+
+    // New tables start out (pinned, if need be) with no live entries
+    uint64_t counted = (walk->depth > 0 || index < KERNEL_HALF_PML4ENTRY)
+                               ? TABLE_COUNTED | pin
+                               : 0;
+
+    while (true) {
+        if ((entry & PRESENT) == 0) {
+            if (page & 0xff) {
+                page = page_alloc(physical_region);
+
+                if (page & 0xff) {
+                    // No page alloc - fail
+                    C_DEBUGSTR("===> FAIL to allocate new table\n");
+                    return NULL;
+                }
 
 #ifdef VERY_NOISY_VMM
-        C_DEBUGSTR("===> New table at ");
-        C_PRINTHEX64(pdpte_page, debugchar);
-        C_DEBUGSTR("\n");
+                C_DEBUGSTR("===> New table at ");
+                C_PRINTHEX64(page, debugchar);
+                C_DEBUGSTR("\n");
 #endif
 
-        uint64_t *page_v = PAGE_TO_V(page);
-        for (int i = 0; i < 0x200; i++) {
-            page_v[i] = 0;
+                uint64_t *page_v = PAGE_TO_V(page);
+                for (int i = 0; i < 0x200; i++) {
+                    page_v[i] = 0;
+                }
+            }
+
+            // Force present since we allocated a page...
+            uint64_t new_entry = page | flags | PRESENT | counted;
+
+            if (__atomic_compare_exchange_n(slot, &entry, new_entry, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                walk_push(walk, slot, new_entry, true);
+                return PAGE_TO_V(page);
+            }
+
+            // else someone else got an entry in first, and `entry` is now
+            // whatever they put there...
+            continue;
         }
-        table[index] = page | flags |
-                       PRESENT; // Force present since we allocated a page...
-    } else {
-        // Table already mapped, but flags might not be correct, so let's merge
+
+        if (entry & LARGE_PAGE) {
+            // This maps a large / huge page, there's no table to return
+            C_DEBUGSTR("===> FAIL entry is a large page, not a table\n");
+            break;
+        }
+
+        // Table already mapped, but flags might not be correct, so let's
+        // merge them while we pin it.
         // TODO I'm not certain this is a good idea but it'll work for now...
-        table[index] = entry | flags | PRESENT;
+        uint64_t pinned = entry | flags;
+        if (entry & TABLE_COUNTED) {
+            pinned += pin;
+        }
+
+        if (pinned == entry ||
+            __atomic_compare_exchange_n(slot, &entry, pinned, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if ((page & 0xff) == 0) {
+                // ... so we don't need the table we allocated
+                page_free(physical_region, page);
+            }
+
+            walk_push(walk, slot, entry, false);
+            return ENTRY_TO_V(entry);
+        }
+
+        // else the entry changed under us (maybe the table was freed) so
+        // go round again with whatever's there now...
+    }
+
+    if ((page & 0xff) == 0) {
+        page_free(physical_region, page);
     }
 
-    return ENTRY_TO_V(table[index]);
+    return NULL;
+}
+
+// Find the table under `table[index]` without creating it, pinning it
+// for the walk if need be. Returns NULL if there isn't one, or the
+// entry maps a large / huge page.
+static inline uint64_t *find_table_entry(uint64_t *table, uint16_t index,
+                                         TableWalk *walk) {
+    uint64_t *slot = &table[index];
+    uint64_t entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    uint64_t pin = walk_pin(walk);
+
+    do {
+        if ((entry & (PRESENT | LARGE_PAGE)) != PRESENT) {
+            return NULL;
+        }
+    } while (pin && (entry & TABLE_COUNTED) &&
+             !__atomic_compare_exchange_n(slot, &entry, entry + pin, false,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    walk_push(walk, slot, entry, false);
+    return ENTRY_TO_V(entry);
+}
+
+// Done with a walk - apply the change in live entries to each table
+// (bottom-up) and drop any pins, unlinking any table that's now empty
+// and adding it to the batch to be freed after the next flush.
+static inline void walk_release(TableWalk *walk, ReclaimBatch *batch) {
+    while (walk->depth) {
+        walk->depth--;
+
+        uint64_t *slot = walk->entries[walk->depth];
+        uint64_t pin = walk_pin(walk);
+        uint64_t entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+        if ((entry & TABLE_COUNTED) == 0) {
+            continue;
+        }
+
+        uint64_t change = (uint64_t)(int64_t)walk->live[walk->depth]
+                          << TABLE_COUNT_SHIFT;
+
+        if (pin) {
+            // Once the pin's dropped someone else might pin it again
+            // before we can unlink it, in which case it stays.
+            entry = __atomic_add_fetch(slot, change - pin, __ATOMIC_ACQ_REL);
+
+            if ((entry & TABLE_COUNT_MASK) != 0 ||
+                !__atomic_compare_exchange_n(slot, &entry, 0, false,
+                                             __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+        } else {
+            entry += change;
+
+            if (entry & TABLE_COUNT_MASK) {
+                if (change) {
+                    __atomic_store_n(slot, entry, __ATOMIC_RELEASE);
+                }
+                continue;
+            }
+
+            __atomic_store_n(slot, 0, __ATOMIC_RELEASE);
+        }
+
+        batch->pages[batch->count++] = entry & ENTRY_ADDR_MASK;
+
+        if (walk->depth > 0) {
+            walk->live[walk->depth - 1]--;
+        }
+    }
+}
+
+// Free the tables in the batch. Paging-structure caches might still
+// point at them until the TLB's been flushed, so callers that haven't
+// flushed anything get an invlpg here (which drops those caches too).
+static void reclaim_tables(ReclaimBatch *batch, uintptr_t virt_addr,
+                           bool flushed) {
+    if (batch->count == 0) {
+        return;
+    }
+
+    if (!flushed) {
+        vmm_invalidate_page(virt_addr);
+    }
+
+#ifdef UNIT_TESTS
+    test_shootdowns++;
+#else
+    // That only covers the current PCID, but the kernel half's tables
+    // can be cached under any of them...
+    if (virt_addr >= DIRECT_MAP_BASE) {
+        vmm_pcid_retire_all();
+    }
+
+    // ... and on any other CPU, too
+    vmm_shootdown_all();
+#endif
+
+    for (int i = 0; i < batch->count; i++) {
+        page_free(physical_region, batch->pages[i]);
+    }
+
+    batch->count = 0;
+}
+
+// Find (or create) the page table covering the given address, making
+// sure the tables above it exist along the way, and pinning them all
+// for the walk. Caller must hold the address space lock.
+static inline uint64_t *ensure_page_table(uint64_t *pml4, uintptr_t virt_addr,
+                                          uint16_t flags, TableWalk *walk) {
+    uint64_t *pdpt =
+            ensure_table_entry(pml4, PML4ENTRY(virt_addr), flags, walk);
+    if (pdpt == NULL) {
+        return NULL;
+    }
+
+    uint64_t *pd = ensure_table_entry(pdpt, PDPTENTRY(virt_addr), flags, walk);
+    if (pd == NULL) {
+        return NULL;
+    }
+
+    return ensure_table_entry(pd, PDENTRY(virt_addr), flags, walk);
+}
+
+// Find the page table covering the given address, without creating
+// anything, and pinning the tables for the walk. Returns NULL if there
+// isn't one, or if the address is covered by a large or huge page.
+// Caller must hold the address space lock.
+static inline uint64_t *find_page_table(uint64_t *pml4, uintptr_t virt_addr,
+                                        TableWalk *walk) {
+    uint64_t *pdpt = find_table_entry(pml4, PML4ENTRY(virt_addr), walk);
+    if (pdpt == NULL) {
+        return NULL;
+    }
+
+    uint64_t *pd = find_table_entry(pdpt, PDPTENTRY(virt_addr), walk);
+    if (pd == NULL) {
+        return NULL;
+    }
+
+    return find_table_entry(pd, PDENTRY(virt_addr), walk);
+}
+
+// Set an entry in the last table of a walk, keeping its live count
+static inline uint64_t set_walk_entry(TableWalk *walk, uint64_t *entry,
+                                      uint64_t value) {
+    uint64_t old = *entry;
+    *entry = value;
+    walk->live[walk->depth - 1] += (value != 0) - (old != 0);
+    return old;
 }
 
 inline bool vmm_map_page_in(uint64_t *pml4, uintptr_t virt_addr, uint64_t page,
                             uint16_t flags) {
+    TableWalk walk = {.depth = 0};
+    ReclaimBatch batch = {.count = 0};
 
-    SPIN_LOCK();
+    SpinLock *lock = address_space_lock(pml4);
+    SPIN_LOCK(lock);
 
     C_DEBUGSTR("PML4 @ ");
     C_PRINTHEX64((uint64_t)pml4, debugchar);
@@ -98,77 +421,289 @@ inline bool vmm_map_page_in(uint64_t *pml4, uintptr_t virt_addr, uint64_t page,
     C_PRINTHEX64(PML4ENTRY(virt_addr), debugchar);
     C_DEBUGSTR("]\n");
 
-    // If we don't have a PML4 entry at this index - create one, and a PDPT for
-    // it to point to
-    uint64_t *pdpt = ensure_table_entry(pml4, PML4ENTRY(virt_addr), flags);
-    if (pdpt == NULL) {
-        C_DEBUGSTR("===> vmm_map_page failed [PDPT alloc] for\n");
+    // Create any tables that don't exist yet on the way down
+    uint64_t *pt = ensure_page_table(pml4, virt_addr, flags, &walk);
+
+    if (pt == NULL) {
+        C_DEBUGSTR("===> vmm_map_page failed [table alloc] for\n");
         C_PRINTHEX64(virt_addr, debugchar);
         C_DEBUGSTR(" => ");
         C_PRINTHEX64(page, debugchar);
         C_DEBUGSTR("\n");
+    } else {
+        C_DEBUGSTR("PT   @ ");
+        C_PRINTHEX64((uint64_t)pt, debugchar);
+        C_DEBUGSTR(" [Entry ");
+        C_PRINTHEX64(PTENTRY(virt_addr), debugchar);
+        C_DEBUGSTR("]\n");
+
+#ifdef VERY_NOISY_VMM
+        C_DEBUGSTR("Mapping PT entry ");
+        C_PRINTHEX16(PTENTRY(virt_addr), debugchar);
+        C_DEBUGSTR(" in page table at ");
+        C_PRINTHEX64((uint64_t)pt, debugchar);
+        C_DEBUGSTR(" to phys ");
+        C_PRINTHEX64(page, debugchar);
+        C_DEBUGSTR("\n");
+#endif
 
-        SPIN_UNLOCK_RET(false);
+        set_walk_entry(&walk, &pt[PTENTRY(virt_addr)],
+                       page | leaf_flags(virt_addr, flags));
     }
 
-    C_DEBUGSTR("PDPT @ ");
-    C_PRINTHEX64((uint64_t)pdpt, debugchar);
-    C_DEBUGSTR(" [Entry ");
-    C_PRINTHEX64(PDPTENTRY(virt_addr), debugchar);
-    C_DEBUGSTR("]\n");
+    walk_release(&walk, &batch);
 
-    // If we don't have a PDPT entry at this index - create one, and a PD for it
-    // to point to
-    uint64_t *pd = ensure_table_entry(pdpt, PDPTENTRY(virt_addr), flags);
-    if (pd == NULL) {
-        C_DEBUGSTR("===> vmm_map_page failed [PD alloc] for\n");
-        C_PRINTHEX64(virt_addr, debugchar);
-        C_DEBUGSTR(" => ");
-        C_PRINTHEX64(page, debugchar);
-        C_DEBUGSTR("\n");
+    if (pt != NULL) {
+        vmm_invalidate_page(virt_addr);
+    }
 
-        SPIN_UNLOCK_RET(false);
+    reclaim_tables(&batch, virt_addr, pt != NULL);
+
+    SPIN_UNLOCK_RET(lock, pt != NULL);
+}
+
+// Flush the TLB for a range of pages once the whole range has been
+// changed - page-by-page for small ranges, or the whole TLB for bigger
+// ones, where that works out cheaper (including global entries, if the
+// range is in the kernel half).
+static inline void flush_range(uintptr_t virt_addr, uint64_t num_pages) {
+    if (num_pages > VMM_RANGE_FLUSH_THRESHOLD) {
+        if (virt_addr >= DIRECT_MAP_BASE) {
+            vmm_flush_tlb_global();
+        } else {
+            vmm_flush_tlb();
+        }
+    } else {
+        for (uint64_t i = 0; i < num_pages; i++) {
+            vmm_invalidate_page(virt_addr + (i << 12));
+        }
     }
+}
 
-    C_DEBUGSTR("PD   @ ");
-    C_PRINTHEX64((uint64_t)pd, debugchar);
-    C_DEBUGSTR(" [Entry ");
-    C_PRINTHEX64(PDENTRY(virt_addr), debugchar);
-    C_DEBUGSTR("]\n");
+// As flush_range, but for pages that needn't be consecutive.
+static inline void flush_pages(const uintptr_t *virt_addrs,
+                               uint64_t num_pages) {
+    if (num_pages > VMM_RANGE_FLUSH_THRESHOLD) {
+        for (uint64_t i = 0; i < num_pages; i++) {
+            if (virt_addrs[i] >= DIRECT_MAP_BASE) {
+                vmm_flush_tlb_global();
+                return;
+            }
+        }
 
-    // If we don't have a PD entry at this index - create one, and a PT for it
-    // to point to
-    uint64_t *pt = ensure_table_entry(pd, PDENTRY(virt_addr), flags);
-    if (pt == NULL) {
-        C_DEBUGSTR("===> vmm_map_page failed [PT alloc] for\n");
-        C_PRINTHEX64(virt_addr, debugchar);
-        C_DEBUGSTR(" => ");
-        C_PRINTHEX64(page, debugchar);
-        C_DEBUGSTR("\n");
+        vmm_flush_tlb();
+    } else {
+        for (uint64_t i = 0; i < num_pages; i++) {
+            vmm_invalidate_page(virt_addrs[i]);
+        }
+    }
+}
+
+// Unmapped pages have to be flushed from the other CPUs' TLBs as well,
+// before the caller can free them (see vmm/shootdown.h).
+static inline void shootdown_range(uintptr_t virt_addr, uint64_t num_pages) {
+#ifdef UNIT_TESTS
+    test_shootdowns++;
+#else
+    vmm_shootdown_range(virt_addr, num_pages);
+#endif
+}
+
+static inline void shootdown_pages(const uintptr_t *virt_addrs,
+                                   uint64_t num_pages) {
+#ifdef UNIT_TESTS
+    test_shootdowns++;
+#else
+    vmm_shootdown_pages(virt_addrs, num_pages);
+#endif
+}
+
+// Map a run of pages, either to physically-contiguous memory starting
+// at `phys_addr` or (if `pages` isn't NULL) to the pages in that array.
+//
+// The tables are only walked once per page table covered, and the TLB
+// is flushed once at the end.
+static bool map_range(uint64_t *pml4, uintptr_t virt_addr, uint64_t phys_addr,
+                      const uint64_t *pages, uint64_t num_pages,
+                      uint16_t flags) {
+    ReclaimBatch batch = {.count = 0};
+    uint16_t leaf = leaf_flags(virt_addr, flags);
+    uint64_t done = 0;
+
+    SpinLock *lock = address_space_lock(pml4);
+    SPIN_LOCK(lock);
+
+    while (done < num_pages) {
+        TableWalk walk = {.depth = 0};
+        uintptr_t virt = virt_addr + (done << 12);
+        uint64_t *pt = ensure_page_table(pml4, virt, flags, &walk);
 
-        SPIN_UNLOCK_RET(false);
+        if (pt == NULL) {
+            C_DEBUGSTR("===> vmm_map_range failed [table alloc] at ");
+            C_PRINTHEX64(virt, debugchar);
+            C_DEBUGSTR("\n");
+
+            walk_release(&walk, &batch);
+            break;
+        }
+
+        // Fill in entries up to the end of this table (or the range)
+        for (uint16_t entry = PTENTRY(virt); entry < 0x200 && done < num_pages;
+             entry++, done++) {
+            uint64_t page = pages ? pages[done] : phys_addr + (done << 12);
+            set_walk_entry(&walk, &pt[entry], page | leaf);
+        }
+
+        walk_release(&walk, &batch);
+
+        if (batch.count > VMM_RECLAIM_BATCH - WALK_MAX_RECLAIM) {
+            flush_range(virt_addr, done);
+            reclaim_tables(&batch, virt_addr, true);
+        }
     }
 
-    C_DEBUGSTR("PT   @ ");
-    C_PRINTHEX64((uint64_t)pt, debugchar);
-    C_DEBUGSTR(" [Entry ");
-    C_PRINTHEX64(PTENTRY(virt_addr), debugchar);
-    C_DEBUGSTR("]\n");
+    flush_range(virt_addr, done);
+    reclaim_tables(&batch, virt_addr, done > 0);
 
-#ifdef VERY_NOISY_VMM
-    C_DEBUGSTR("Mapping PT entry ");
-    C_PRINTHEX16(PTENTRY(virt_addr), debugchar);
-    C_DEBUGSTR(" in page table at ");
-    C_PRINTHEX64((uint64_t)pt, debugchar);
-    C_DEBUGSTR(" to phys ");
-    C_PRINTHEX64(page, debugchar);
-    C_DEBUGSTR("\n");
+    SPIN_UNLOCK_RET(lock, done == num_pages);
+}
+
+bool vmm_map_range_in(uint64_t *pml4, uintptr_t virt_addr, uint64_t phys_addr,
+                      uint64_t num_pages, uint16_t flags) {
+    return map_range(pml4, virt_addr, phys_addr, NULL, num_pages, flags);
+}
+
+bool vmm_map_range(uintptr_t virt_addr, uint64_t phys_addr, uint64_t num_pages,
+                   uint16_t flags) {
+    return vmm_map_range_in((uint64_t *)vmm_recursive_find_pml4(), virt_addr,
+                            phys_addr, num_pages, flags);
+}
+
+bool vmm_map_pages_in(uint64_t *pml4, uintptr_t virt_addr,
+                      const uint64_t *pages, uint64_t num_pages,
+                      uint16_t flags) {
+    if (pages == NULL) {
+        return false;
+    }
+
+    return map_range(pml4, virt_addr, 0, pages, num_pages, flags);
+}
+
+bool vmm_huge_pages_supported(void) {
+#ifdef UNIT_TESTS
+    return true;
+#else
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+
+    // Page1GB feature bit
+    return (edx & (1 << 26)) != 0;
 #endif
+}
+
+// Install a large or huge page entry in the last table of the walk,
+// unless there's a table there already. Caller must hold the address
+// space lock.
+static inline bool map_large_entry(uint64_t *table, uint16_t index,
+                                   uintptr_t virt_addr, uint64_t page,
+                                   uint16_t flags, TableWalk *walk) {
+    uint64_t entry = __atomic_load_n(&table[index], __ATOMIC_ACQUIRE);
+
+    do {
+        if ((entry & PRESENT) && (entry & LARGE_PAGE) == 0) {
+            // There's a table here, and (potentially) mappings in it -
+            // don't clobber them...
+            C_DEBUGSTR("===> vmm_map_large_page failed [table present] for ");
+            C_PRINTHEX64(virt_addr, debugchar);
+            C_DEBUGSTR("\n");
+
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&table[index], &entry,
+                                          page | leaf_flags(virt_addr, flags) |
+                                                  LARGE_PAGE,
+                                          false,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    if (entry == 0) {
+        walk->live[walk->depth - 1]++;
+    }
 
-    pt[PTENTRY(virt_addr)] = page | flags;
     vmm_invalidate_page(virt_addr);
 
-    SPIN_UNLOCK_RET(true);
+    return true;
+}
+
+bool vmm_map_large_page_in(uint64_t *pml4, uintptr_t virt_addr, uint64_t page,
+                           uint16_t flags) {
+    if ((virt_addr | page) & ~LARGE_PAGE_ALIGN_MASK) {
+        return false;
+    }
+
+    TableWalk walk = {.depth = 0};
+    ReclaimBatch batch = {.count = 0};
+    bool result = false;
+
+    SpinLock *lock = address_space_lock(pml4);
+    SPIN_LOCK(lock);
+
+    uint64_t *pdpt =
+            ensure_table_entry(pml4, PML4ENTRY(virt_addr), flags, &walk);
+    uint64_t *pd =
+            pdpt ? ensure_table_entry(pdpt, PDPTENTRY(virt_addr), flags, &walk)
+                 : NULL;
+
+    if (pd != NULL) {
+        result = map_large_entry(pd, PDENTRY(virt_addr), virt_addr, page,
+                                 flags, &walk);
+    }
+
+    walk_release(&walk, &batch);
+    reclaim_tables(&batch, virt_addr, result);
+
+    SPIN_UNLOCK_RET(lock, result);
+}
+
+bool vmm_map_huge_page_in(uint64_t *pml4, uintptr_t virt_addr, uint64_t page,
+                          uint16_t flags) {
+    if ((virt_addr | page) & ~HUGE_PAGE_ALIGN_MASK) {
+        return false;
+    }
+
+    if (!vmm_huge_pages_supported()) {
+        C_DEBUGSTR("===> vmm_map_huge_page failed [unsupported]\n");
+        return false;
+    }
+
+    TableWalk walk = {.depth = 0};
+    ReclaimBatch batch = {.count = 0};
+    bool result = false;
+
+    SpinLock *lock = address_space_lock(pml4);
+    SPIN_LOCK(lock);
+
+    uint64_t *pdpt =
+            ensure_table_entry(pml4, PML4ENTRY(virt_addr), flags, &walk);
+
+    if (pdpt != NULL) {
+        result = map_large_entry(pdpt, PDPTENTRY(virt_addr), virt_addr, page,
+                                 flags, &walk);
+    }
+
+    walk_release(&walk, &batch);
+    reclaim_tables(&batch, virt_addr, result);
+
+    SPIN_UNLOCK_RET(lock, result);
+}
+
+bool vmm_map_large_page(uintptr_t virt_addr, uint64_t page, uint16_t flags) {
+    return vmm_map_large_page_in((uint64_t *)vmm_recursive_find_pml4(),
+                                 virt_addr, page, flags);
+}
+
+bool vmm_map_huge_page(uintptr_t virt_addr, uint64_t page, uint16_t flags) {
+    return vmm_map_huge_page_in((uint64_t *)vmm_recursive_find_pml4(),
+                                virt_addr, page, flags);
 }
 
 bool vmm_map_page(uintptr_t virt_addr, uint64_t page, uint16_t flags) {
@@ -186,8 +721,58 @@ bool vmm_map_page_containing_in(uint64_t *pml4, uintptr_t virt_addr,
     return vmm_map_page_in(pml4, virt_addr, phys_addr & PAGE_ALIGN_MASK, flags);
 }
 
+static inline bool is_large_entry(uint64_t entry) {
+    return (entry & (PRESENT | LARGE_PAGE)) == (PRESENT | LARGE_PAGE);
+}
+
+// Find the entry that maps the given address, at whichever level it's
+// at, pinning the tables above it for the walk. Returns NULL if there's
+// no table it could be in, otherwise puts the mask for the address in
+// the entry in `*mask`. Caller must hold the address space lock.
+static inline uint64_t *find_leaf_entry(uint64_t *pml4, uintptr_t virt_addr,
+                                        TableWalk *walk, uint64_t *mask) {
+    uint64_t *pdpt = find_table_entry(pml4, PML4ENTRY(virt_addr), walk);
+    if (pdpt == NULL) {
+        C_DEBUGSTR("No PDPT - Bailing\n");
+        return NULL;
+    }
+
+    if (is_large_entry(pdpt[PDPTENTRY(virt_addr)])) {
+        C_DEBUGSTR("Unmapping huge page\n");
+        *mask = HUGE_PAGE_ALIGN_MASK;
+        return &pdpt[PDPTENTRY(virt_addr)];
+    }
+
+    uint64_t *pd = find_table_entry(pdpt, PDPTENTRY(virt_addr), walk);
+    if (pd == NULL) {
+        C_DEBUGSTR("No PD - Bailing\n");
+        return NULL;
+    }
+
+    if (is_large_entry(pd[PDENTRY(virt_addr)])) {
+        C_DEBUGSTR("Unmapping large page\n");
+        *mask = LARGE_PAGE_ALIGN_MASK;
+        return &pd[PDENTRY(virt_addr)];
+    }
+
+    uint64_t *pt = find_table_entry(pd, PDENTRY(virt_addr), walk);
+    if (pt == NULL) {
+        C_DEBUGSTR("No PT - Bailing\n");
+        return NULL;
+    }
+
+    *mask = PAGE_ALIGN_MASK;
+    return &pt[PTENTRY(virt_addr)];
+}
+
 uintptr_t vmm_unmap_page_in(uint64_t *pml4, uintptr_t virt_addr) {
-    SPIN_LOCK();
+    TableWalk walk = {.depth = 0};
+    ReclaimBatch batch = {.count = 0};
+    uint64_t mask = 0;
+    uintptr_t phys = 0;
+
+    SpinLock *lock = address_space_lock(pml4);
+    SPIN_LOCK(lock);
 
     C_DEBUGSTR("Unmap virtual ");
     C_PRINTHEX64((uint64_t)virt_addr, debugchar);
@@ -197,81 +782,153 @@ uintptr_t vmm_unmap_page_in(uint64_t *pml4, uintptr_t virt_addr) {
     C_PRINTHEX64(PML4ENTRY(virt_addr), debugchar);
     C_DEBUGSTR("]\n");
 
-    uintptr_t pdpt = (uintptr_t)PAGE_TO_V(pml4[PML4ENTRY(virt_addr)]);
+    uint64_t *entry = find_leaf_entry(pml4, virt_addr, &walk, &mask);
 
-    C_DEBUGSTR("PDPT @ ");
-    C_PRINTHEX64((uintptr_t)ENTRY_TO_V(pdpt), debugchar);
-    C_DEBUGSTR(" [Entry ");
-    C_PRINTHEX64(PDPTENTRY(virt_addr), debugchar);
-    C_DEBUGSTR("]\n");
+    if (entry != NULL) {
+#ifdef VERY_NOISY_VMM
+        C_DEBUGSTR("zeroing entry @ ");
+        C_PRINTHEX64((uintptr_t)entry, debugchar);
+        C_DEBUGSTR(" (== ");
+        C_PRINTHEX64(*entry, debugchar);
+        C_DEBUGSTR(")\n");
+#endif
+
+        phys = set_walk_entry(&walk, entry, 0) & mask;
+    }
 
-    if ((pdpt & PRESENT) == 0) {
-        // No present PDPT, just bail
-        C_DEBUGSTR("No PDPT (");
-        C_PRINTHEX64(pdpt, debugchar);
-        C_DEBUGSTR(") - Bailing\n");
+    // Any tables this emptied are unlinked here, then freed once the
+    // invalidation's done...
+    walk_release(&walk, &batch);
 
-        SPIN_UNLOCK_RET(0);
+    if (entry != NULL) {
+        vmm_invalidate_page(virt_addr);
+        shootdown_range(virt_addr, 1);
     }
 
-    uintptr_t pd = (uintptr_t)PAGE_TO_V(ENTRY_TO_V(pdpt)[PDPTENTRY(virt_addr)]);
+    reclaim_tables(&batch, virt_addr, entry != NULL);
 
-    C_DEBUGSTR("PD   @ ");
-    C_PRINTHEX64((uintptr_t)ENTRY_TO_V(pd), debugchar);
-    C_DEBUGSTR(" [Entry ");
-    C_PRINTHEX64(PDENTRY(virt_addr), debugchar);
-    C_DEBUGSTR("]\n");
+    SPIN_UNLOCK_RET(lock, phys);
+}
 
-    if ((pd & PRESENT) == 0) {
-        // No present PD, just bail
-        C_DEBUGSTR("No PD (");
-        C_PRINTHEX64(pd, debugchar);
-        C_DEBUGSTR(") - Bailing\n");
+uintptr_t vmm_unmap_page(uintptr_t virt_addr) {
+    return vmm_unmap_page_in((uint64_t *)vmm_recursive_find_pml4(), virt_addr);
+}
 
-        SPIN_UNLOCK_RET(0);
-    }
+uint64_t vmm_unmap_range_in(uint64_t *pml4, uintptr_t virt_addr,
+                            uint64_t num_pages, uintptr_t *phys_out) {
+    ReclaimBatch batch = {.count = 0};
+    uint64_t unmapped = 0;
+    uint64_t done = 0;
 
-    uintptr_t pt = (uintptr_t)PAGE_TO_V(ENTRY_TO_V(pd)[PDENTRY(virt_addr)]);
+    SpinLock *lock = address_space_lock(pml4);
+    SPIN_LOCK(lock);
 
-    C_DEBUGSTR("PT   @ ");
-    C_PRINTHEX64((uintptr_t)ENTRY_TO_V(pt), debugchar);
-    C_DEBUGSTR(" [Entry ");
-    C_PRINTHEX64(PTENTRY(virt_addr), debugchar);
-    C_DEBUGSTR("]\n");
+    while (done < num_pages) {
+        TableWalk walk = {.depth = 0};
+        uintptr_t virt = virt_addr + (done << 12);
+        uint64_t *pt = find_page_table(pml4, virt, &walk);
+
+        for (uint16_t entry = PTENTRY(virt); entry < 0x200 && done < num_pages;
+             entry++, done++) {
+            uint64_t pte = 0;
+
+            if (pt && pt[entry]) {
+                pte = set_walk_entry(&walk, &pt[entry], 0);
+            }
 
-    if ((pt & PRESENT) == 0) {
-        // No present PT, just bail
-        C_DEBUGSTR("No PT (");
-        C_PRINTHEX64(pt, debugchar);
-        C_DEBUGSTR(") - Bailing\n");
+            if (pte) {
+                unmapped++;
+            }
+
+            if (phys_out) {
+                phys_out[done] = pte & PAGE_ALIGN_MASK;
+            }
+        }
 
-        SPIN_UNLOCK_RET(0);
+        walk_release(&walk, &batch);
+
+        // Don't let emptied tables pile up past the batch - flush what
+        // we've done so far, and free them now
+        if (batch.count > VMM_RECLAIM_BATCH - WALK_MAX_RECLAIM) {
+            flush_range(virt_addr, done);
+            shootdown_range(virt_addr, done);
+            reclaim_tables(&batch, virt_addr, true);
+        }
     }
 
-    uintptr_t phys = (ENTRY_TO_V(pt)[PTENTRY(virt_addr)] & PAGE_ALIGN_MASK);
+    if (unmapped || batch.count) {
+        flush_range(virt_addr, num_pages);
+        shootdown_range(virt_addr, num_pages);
+    }
 
-#ifdef VERY_NOISY_VMM
-    C_DEBUGSTR("zeroing entry: ");
-    C_PRINTHEX64(PTENTRY(virt_addr), debugchar);
-    C_DEBUGSTR(" @ ");
-    C_PRINTHEX64((uintptr_t)&ENTRY_TO_V(pt)[PTENTRY(virt_addr)], debugchar);
-    C_DEBUGSTR(" (== ");
-    C_PRINTHEX64((uintptr_t)ENTRY_TO_V(pt)[PTENTRY(virt_addr)], debugchar);
-    C_DEBUGSTR(")\n");
-#endif
+    reclaim_tables(&batch, virt_addr, true);
 
-    ENTRY_TO_V(pt)[PTENTRY(virt_addr)] = 0;
-    vmm_invalidate_page(virt_addr);
+    SPIN_UNLOCK_RET(lock, unmapped);
+}
 
-    SPIN_UNLOCK_RET(phys);
+uint64_t vmm_unmap_range(uintptr_t virt_addr, uint64_t num_pages,
+                         uintptr_t *phys_out) {
+    return vmm_unmap_range_in((uint64_t *)vmm_recursive_find_pml4(), virt_addr,
+                              num_pages, phys_out);
 }
 
-uintptr_t vmm_unmap_page(uintptr_t virt_addr) {
-    return vmm_unmap_page_in((uint64_t *)vmm_recursive_find_pml4(), virt_addr);
+uint64_t vmm_unmap_pages_in(uint64_t *pml4, const uintptr_t *virt_addrs,
+                            uint64_t num_pages, uintptr_t *phys_out) {
+    ReclaimBatch batch = {.count = 0};
+    uint64_t unmapped = 0;
+    uint64_t flushed = 0;
+
+    if (num_pages == 0) {
+        return 0;
+    }
+
+    SpinLock *lock = address_space_lock(pml4);
+    SPIN_LOCK(lock);
+
+    for (uint64_t i = 0; i < num_pages; i++) {
+        TableWalk walk = {.depth = 0};
+        uintptr_t virt = virt_addrs[i];
+        uint64_t *pt = find_page_table(pml4, virt, &walk);
+        uint64_t pte = 0;
+
+        if (pt && pt[PTENTRY(virt)]) {
+            pte = set_walk_entry(&walk, &pt[PTENTRY(virt)], 0);
+        }
+
+        if (pte) {
+            unmapped++;
+        }
+
+        if (phys_out) {
+            phys_out[i] = pte & PAGE_ALIGN_MASK;
+        }
+
+        walk_release(&walk, &batch);
+
+        // As with ranges, flush early rather than let emptied tables
+        // pile up past the batch
+        if (batch.count > VMM_RECLAIM_BATCH - WALK_MAX_RECLAIM) {
+            flush_pages(virt_addrs + flushed, i + 1 - flushed);
+            shootdown_pages(virt_addrs + flushed, i + 1 - flushed);
+            reclaim_tables(&batch, virt, true);
+            flushed = i + 1;
+        }
+    }
+
+    if (unmapped || batch.count) {
+        flush_pages(virt_addrs + flushed, num_pages - flushed);
+        shootdown_pages(virt_addrs + flushed, num_pages - flushed);
+    }
+
+    reclaim_tables(&batch, virt_addrs[0], true);
+
+    SPIN_UNLOCK_RET(lock, unmapped);
 }
 
 void vmm_invalidate_page(uintptr_t virt_addr) {
-#ifndef UNIT_TESTS
+#ifdef UNIT_TESTS
+    test_invalidated_pages++;
+#else
 #ifdef VERY_NOISY_VMM
     C_DEBUGSTR("INVALIDATE PAGE ");
     C_PRINTHEX64(virt_addr, debugchar);
@@ -280,3 +937,89 @@ void vmm_invalidate_page(uintptr_t virt_addr) {
     __asm__ volatile("invlpg (%0)\n\t" : : "r"(virt_addr) : "memory");
 #endif
 }
+
+void vmm_flush_tlb(void) {
+#ifdef UNIT_TESTS
+    test_tlb_flushes++;
+#else
+#ifdef VERY_NOISY_VMM
+    C_DEBUGSTR("FLUSH TLB\n");
+#endif
+    if (vmm_pcid_enabled()) {
+        vmm_pcid_flush_all();
+        return;
+    }
+
+    __asm__ volatile("mov %%cr3, %%rax\n\t"
+                     "mov %%rax, %%cr3\n\t"
+                     :
+                     :
+                     : "rax", "memory");
+#endif
+}
+
+void vmm_flush_tlb_global(void) {
+#ifdef UNIT_TESTS
+    test_tlb_flushes++;
+#else
+#ifdef VERY_NOISY_VMM
+    C_DEBUGSTR("FLUSH TLB (GLOBAL)\n");
+#endif
+    uint64_t flags = cpu_save_disable_interrupts();
+
+    __asm__ volatile("mov %%cr4, %%rax\n\t"
+                     "mov %%rax, %%rcx\n\t"
+                     "and $~0x80, %%rcx\n\t"
+                     "mov %%rcx, %%cr4\n\t"
+                     "mov %%rax, %%cr4\n\t"
+                     :
+                     :
+                     : "rax", "rcx", "memory");
+
+    cpu_restore_interrupts(flags);
+#endif
+}
+
+bool vmm_kernel_half_init(uint64_t *pml4) {
+    SpinLock *lock = address_space_lock(pml4);
+    SPIN_LOCK(lock);
+
+    for (int i = KERNEL_HALF_PML4ENTRY; i < 0x200; i++) {
+        if (i == RECURSIVE_ENTRY || (pml4[i] & PRESENT)) {
+            continue;
+        }
+
+        uint64_t page = page_alloc(physical_region);
+
+        if (page & 0xff) {
+            C_DEBUGSTR("===> vmm_kernel_half_init failed [table alloc]\n");
+            SPIN_UNLOCK_RET(lock, false);
+        }
+
+        uint64_t *page_v = PAGE_TO_V(page);
+        for (int j = 0; j < 0x200; j++) {
+            page_v[j] = 0;
+        }
+
+        // Uncounted, so it'll never be freed
+        pml4[i] = page | PRESENT | WRITE;
+    }
+
+    SPIN_UNLOCK_RET(lock, true);
+}
+
+uint64_t *vmm_init_address_space(uint64_t *kernel_pml4, uint64_t pml4_phys) {
+    uint64_t *pml4 = PAGE_TO_V(pml4_phys);
+
+    for (int i = 0; i < KERNEL_HALF_PML4ENTRY; i++) {
+        pml4[i] = 0;
+    }
+
+    for (int i = KERNEL_HALF_PML4ENTRY; i < 0x200; i++) {
+        pml4[i] = kernel_pml4[i];
+    }
+
+    pml4[RECURSIVE_ENTRY] = pml4_phys | PRESENT | WRITE;
+
+    return pml4;
+}
@@ -5,6 +5,8 @@
 ;
 
 global testcall_int, testcall_syscall, kprint_int, kprint_syscall
+global yield_int, yield_syscall, sched_stats_int, sched_stats_syscall
+global sched_cpu_stats_int, sched_cpu_stats_syscall
 
 
 ; args:
@@ -73,4 +75,75 @@ kprint_int:
     ret
 
 
+; mods:
+;   rax - result
+;   r11 - trashed
+;   rcx - trashed
+;
+yield_syscall:
+    mov r9, $2
+    syscall
+    ret
+
+
+; mods:
+;   rax - result
+;
+yield_int:
+    mov r9, $2
+    int 0x69
+    ret
 
+
+; args:
+;   rdi - pointer to stats struct to fill
+;
+; mods:
+;   rax - result
+;   r11 - trashed
+;   rcx - trashed
+;
+sched_stats_syscall:
+    mov r9, $3
+    syscall
+    ret
+
+
+; args:
+;   rdi - pointer to stats struct to fill
+;
+; mods:
+;   rax - result
+;
+sched_stats_int:
+    mov r9, $3
+    int 0x69
+    ret
+
+
+; args:
+;   rdi - CPU number
+;   rsi - pointer to CPU stats struct to fill
+;
+; mods:
+;   rax - result
+;   r11 - trashed
+;   rcx - trashed
+;
+sched_cpu_stats_syscall:
+    mov r9, $4
+    syscall
+    ret
+
+
+; args:
+;   rdi - CPU number
+;   rsi - pointer to CPU stats struct to fill
+;
+; mods:
+;   rax - result
+;
+sched_cpu_stats_int:
+    mov r9, $4
+    int 0x69
+    ret
@@ -18,6 +18,23 @@
 
 static const char *MSG = VERSION "\n";
 
+// Must match SyscallSchedStats in the kernel's syscalls.h
+typedef struct {
+    uint64_t context_switches;
+    uint64_t timer_ticks;
+    uint64_t timer_hz;
+} SchedStats;
+
+// Must match SyscallSchedCpuStats in the kernel's syscalls.h
+typedef struct {
+    uint64_t timer_ticks;
+    uint64_t context_switches;
+    uint64_t steals;
+    uint64_t migrations;
+} SchedCpuStats;
+
+#define BENCH_YIELDS 100000
+
 volatile int num;
 
 int testcall_int(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3,
@@ -28,10 +45,25 @@ int testcall_syscall(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3,
 int kprint_int(const char *msg);
 int kprint_syscall(const char *msg);
 
+int yield_int(void);
+int yield_syscall(void);
+
+int sched_stats_int(SchedStats *stats);
+int sched_stats_syscall(SchedStats *stats);
+
+int sched_cpu_stats_int(uint64_t cpu, SchedCpuStats *stats);
+int sched_cpu_stats_syscall(uint64_t cpu, SchedCpuStats *stats);
+
 #ifdef DEBUG_INT_SYSCALLS
 #define kprint kprint_int
+#define yield yield_int
+#define sched_stats sched_stats_int
+#define sched_cpu_stats sched_cpu_stats_int
 #else
 #define kprint kprint_syscall
+#define yield yield_syscall
+#define sched_stats sched_stats_syscall
+#define sched_cpu_stats sched_cpu_stats_syscall
 #endif
 
 int subroutine(int in) { return in * 2; }
@@ -42,6 +74,71 @@ static inline void banner() {
     kprint("\n");
 }
 
+static void kprint_dec(uint64_t num) {
+    char buf[21];
+    char *ptr = buf + sizeof(buf) - 1;
+
+    *ptr = 0;
+
+    do {
+        *--ptr = '0' + (num % 10);
+        num /= 10;
+    } while (num);
+
+    kprint(ptr);
+}
+
+// Yield a bunch of times, and see how many context switches per
+// second the kernel manages.
+static void bench_context_switches() {
+    SchedStats before, after;
+
+    if (sched_stats(&before) != 0) {
+        kprint("Context switch bench: no stats\n");
+        return;
+    }
+
+    for (int i = 0; i < BENCH_YIELDS; i++) {
+        yield();
+    }
+
+    sched_stats(&after);
+
+    uint64_t switches = after.context_switches - before.context_switches;
+    uint64_t ticks = after.timer_ticks - before.timer_ticks;
+
+    kprint("Context switch bench: ");
+    kprint_dec(switches);
+    kprint(" switches in ");
+    kprint_dec(ticks);
+    kprint(" ticks");
+
+    if (ticks) {
+        kprint(" = ");
+        kprint_dec(switches * after.timer_hz / ticks);
+        kprint(" switches/sec");
+    }
+
+    kprint("\n");
+}
+
+// Show how the scheduler's been spreading work across the CPUs
+static void print_cpu_stats() {
+    SchedCpuStats stats;
+
+    for (uint64_t cpu = 0; sched_cpu_stats(cpu, &stats) == 0; cpu++) {
+        kprint("CPU ");
+        kprint_dec(cpu);
+        kprint(": ");
+        kprint_dec(stats.context_switches);
+        kprint(" switches, ");
+        kprint_dec(stats.steals);
+        kprint(" steals, ");
+        kprint_dec(stats.migrations);
+        kprint(" migrations\n");
+    }
+}
+
 int main(int argc, char **argv) {
     banner();
 
@@ -59,6 +156,9 @@ int main(int argc, char **argv) {
         kprint("BAD\n");
     }
 
+    bench_context_switches();
+    print_cpu_stats();
+
     num = 1;
     int count = 0;
 
@@ -42,11 +42,83 @@ static MunitResult test_map_bad_checksum_r0(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+// A MADT with a LAPIC for each of four processors (the third disabled),
+// with an IOAPIC and an override mixed in
+typedef struct {
+    BIOS_SDTHeader header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+    uint8_t entries[54];
+} __attribute__((packed)) TestMadt;
+
+static TestMadt test_madt = {
+        .header = {.signature = {'A', 'P', 'I', 'C'}},
+        .lapic_addr = 0xfee00000,
+        .entries = {0, 8,  0, 0x00, 1, 0,    0,    0,          // CPU 0
+                    1, 12, 0, 0,    0, 0xc0, 0xfe, 0, 0, 0, 0, 0, // IOAPIC
+                    0, 8,  1, 0x02, 1, 0,    0,    0,          // CPU 1
+                    0, 8,  2, 0x04, 0, 0,    0,    0,          // CPU 2 (off)
+                    2, 10, 0, 0,    2, 0,    0,    0, 0, 0,    // Override
+                    0, 8,  3, 0x06, 1, 0,    0,    0},         // CPU 3
+};
+
+static MunitResult test_madt_cpus(const MunitParameter params[],
+                                  void *param) {
+    uint8_t ids[8] = {0};
+
+    test_madt.header.length = sizeof(TestMadt);
+
+    uint8_t count = acpi_madt_cpus(&test_madt.header, ids, 8);
+
+    munit_assert_uint8(count, ==, 3);
+    munit_assert_uint8(ids[0], ==, 0x00);
+    munit_assert_uint8(ids[1], ==, 0x02);
+    munit_assert_uint8(ids[2], ==, 0x06);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_madt_cpus_max(const MunitParameter params[],
+                                      void *param) {
+    uint8_t ids[8] = {0};
+
+    test_madt.header.length = sizeof(TestMadt);
+
+    uint8_t count = acpi_madt_cpus(&test_madt.header, ids, 2);
+
+    munit_assert_uint8(count, ==, 2);
+    munit_assert_uint8(ids[1], ==, 0x02);
+    munit_assert_uint8(ids[2], ==, 0x00);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_madt_cpus_truncated(const MunitParameter params[],
+                                            void *param) {
+    uint8_t ids[8] = {0};
+
+    // Cuts CPU 1's entry in half - it's ignored, as is the rest
+    test_madt.header.length = sizeof(BIOS_SDTHeader) + 8 + 24;
+
+    uint8_t count = acpi_madt_cpus(&test_madt.header, ids, 8);
+
+    munit_assert_uint8(count, ==, 1);
+    munit_assert_uint8(ids[0], ==, 0x00);
+
+    return MUNIT_OK;
+}
+
 static MunitTest test_suite_tests[] = {
         {(char *)"/acpitables/map_null", test_map_null, NULL, NULL,
          MUNIT_TEST_OPTION_NONE, NULL},
         {(char *)"/acpitables/bad_checksum_r0", test_map_bad_checksum_r0, NULL,
          NULL, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/acpitables/madt_cpus", test_madt_cpus, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/acpitables/madt_cpus_max", test_madt_cpus_max, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/acpitables/madt_cpus_truncated", test_madt_cpus_truncated,
+         NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
         {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
 };
 
@@ -8,12 +8,16 @@
  * do a lot of implementation testing...
  */
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include "cpu.h"
 #include "fba/alloc.h"
 #include "munit.h"
 #include "structs/bitmap.h"
+#include "test_cpu.h"
 #include "test_pmm.h"
 #include "test_vmm.h"
 #include "vmm/vmmapper.h"
@@ -21,12 +25,17 @@
 #define TEST_PML4_ADDR (((uint64_t *)0x100000))
 #define TEST_PAGE_COUNT ((4)) // only need allocated mem for the bitmap...
 
+#define BENCH_BLOCKS ((FBA_MAX_BLOCKS))
+#define BENCH_BITMAP_PAGES ((BENCH_BLOCKS >> 15))
+
 // These are conditionally defined in the main code, which sucks, but works "for
 // now"...
 uintptr_t test_fba_check_begin();
 uintptr_t test_fba_check_size();
 uint64_t *test_fba_bitmap();
 uint64_t *test_fba_bitmap_end();
+uint64_t *test_fba_summary();
+uint64_t *test_fba_summary_top();
 
 static void *test_setup(const MunitParameter params[], void *user_data) {
     void *page_area_ptr;
@@ -34,12 +43,21 @@ static void *test_setup(const MunitParameter params[], void *user_data) {
     return page_area_ptr;
 }
 
+static PerCPUBlockMagazine magazines[MAX_CPU_COUNT];
+static uint64_t cached_bitmap[FBA_CACHED_BITMAP_QUADS];
+
 static void test_teardown(void *page_area_ptr) {
+    test_cpu_set_current_id(0);
     free(page_area_ptr);
     test_pmm_reset();
     test_vmm_reset();
 }
 
+static void test_teardown_bench(void *param) {
+    test_pmm_reset();
+    test_vmm_reset();
+}
+
 static MunitResult test_fba_init_zero(const MunitParameter params[],
                                       void *param) {
     bool result = fba_init(0, 0, 0);
@@ -525,6 +543,11 @@ static MunitResult test_fba_free_single_block(const MunitParameter params[],
 
     fba_free(alloc);
 
+    // Nothing happens until the lazy-free list is flushed
+    munit_assert_true(bitmap_check(test_fba_bitmap(), 1));
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 0);
+    munit_assert_uint64(fba_flush_lazy_frees(), ==, 1);
+
     // Verify that the block is marked as free
     munit_assert_false(bitmap_check(test_fba_bitmap(), 1));
 
@@ -552,12 +575,16 @@ static MunitResult test_fba_free_multiple_blocks(const MunitParameter params[],
     fba_free(alloc1);
     fba_free(alloc2);
 
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 0);
+    munit_assert_uint64(fba_flush_lazy_frees(), ==, 2);
+
     // Verify that the blocks are marked as free
     munit_assert_false(bitmap_check(test_fba_bitmap(), 1));
     munit_assert_false(bitmap_check(test_fba_bitmap(), 2));
 
-    // Verify that the pages are unmapped
+    // Verify that the pages are unmapped, in one go
     munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 2);
+    munit_assert_uint32(test_vmm_get_total_unmap_calls(), ==, 1);
 
     // Verify that the physical pages were freed
     munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 2);
@@ -573,6 +600,7 @@ test_fba_free_unallocated_block(const MunitParameter params[],
 
     // Attempt to free a block that was not allocated
     fba_free((void *)((uint64_t)test_page_area + 0x1000));
+    munit_assert_uint64(fba_flush_lazy_frees(), ==, 0);
 
     // Verify that the state remains unchanged
     munit_assert_uint32(test_pmm_get_total_page_allocs(), ==, 1);
@@ -589,6 +617,7 @@ static MunitResult test_fba_free_invalid_address(const MunitParameter params[],
 
     // Attempt to free a block with an address outside the allocated range
     fba_free((void *)((uint64_t)test_page_area + 0x10000));
+    munit_assert_uint64(fba_flush_lazy_frees(), ==, 0);
 
     // Verify that the state remains unchanged
     munit_assert_uint32(test_pmm_get_total_page_allocs(), ==, 1);
@@ -598,6 +627,690 @@ static MunitResult test_fba_free_invalid_address(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+static MunitResult test_fba_free_blocks_range(const MunitParameter params[],
+                                              void *test_page_area) {
+    bool result = fba_init(TEST_PML4_ADDR, (uintptr_t)test_page_area, 32768);
+    munit_assert_true(result);
+
+    void *alloc1 = fba_alloc_blocks(2);
+    void *alloc2 = fba_alloc_block();
+    munit_assert_ptr_equal(alloc1,
+                           (uint64_t *)((uint64_t)test_page_area + 0x1000));
+    munit_assert_ptr_equal(alloc2,
+                           (uint64_t *)((uint64_t)test_page_area + 0x3000));
+
+    // Free all three blocks (and one that isn't allocated) in one go
+    fba_free_blocks(alloc1, 4);
+    munit_assert_uint64(fba_flush_lazy_frees(), ==, 3);
+
+    for (int i = 1; i < 5; i++) {
+        munit_assert_false(bitmap_check(test_fba_bitmap(), i));
+    }
+
+    // Only the allocated blocks were unmapped and freed
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 3);
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 3);
+
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_fba_free_blocks_past_end(const MunitParameter params[],
+                              void *test_page_area) {
+    bool result = fba_init(TEST_PML4_ADDR, (uintptr_t)test_page_area, 32768);
+    munit_assert_true(result);
+
+    fba_alloc_blocks(32767);
+
+    // Count runs off the end of the FBA, the rest is just ignored
+    fba_free_blocks((void *)((uint64_t)test_page_area + 0x7fff000), 16);
+    munit_assert_uint64(fba_flush_lazy_frees(), ==, 1);
+
+    munit_assert_false(bitmap_check(test_fba_bitmap(), 32767));
+    munit_assert_true(bitmap_check(test_fba_bitmap(), 32766));
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_summary_init(const MunitParameter params[],
+                                         void *test_page_area) {
+    bool result = fba_init(TEST_PML4_ADDR, (uintptr_t)test_page_area, 65536);
+    munit_assert_true(result);
+
+    // 1024 bitmap words, all with space, so 16 summary words all set...
+    for (int i = 0; i < 16; i++) {
+        munit_assert_uint64(test_fba_summary()[i], ==, 0xffffffffffffffff);
+    }
+
+    // ... and 16 bits set in the top level
+    munit_assert_uint64(test_fba_summary_top()[0], ==, 0xffff);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_summary_tracks_full(const MunitParameter params[],
+                                                void *test_page_area) {
+    bool result = fba_init(TEST_PML4_ADDR, (uintptr_t)test_page_area, 32768);
+    munit_assert_true(result);
+
+    // Fill the first 64 words (one whole summary word)...
+    void *blocks = fba_alloc_blocks(4095);
+    munit_assert_not_null(blocks);
+
+    munit_assert_uint64(test_fba_summary()[0], ==, 0);
+    munit_assert_uint64(test_fba_summary()[1], ==, 0xffffffffffffffff);
+    munit_assert_uint64(test_fba_summary_top()[0], ==, 0xfe);
+
+    // ... and free one block back in the middle
+    fba_free((void *)((uint64_t)test_page_area + (2000 << 12)));
+    fba_flush_lazy_frees();
+
+    munit_assert_uint64(test_fba_summary()[0], ==, 1ULL << (2000 / 64));
+    munit_assert_uint64(test_fba_summary_top()[0], ==, 0xff);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_alloc_block_skips_full(const MunitParameter params[],
+                                                   void *test_page_area) {
+    bool result = fba_init(TEST_PML4_ADDR, (uintptr_t)test_page_area, 32768);
+    munit_assert_true(result);
+
+    fba_alloc_blocks(8191);
+
+    // First free block is past all the full words
+    munit_assert_ptr_equal(fba_alloc_block(),
+                           (uint64_t *)((uint64_t)test_page_area + 0x2000000));
+
+    // And one freed back lower down gets used next
+    fba_free((void *)((uint64_t)test_page_area + 0x5000));
+    fba_flush_lazy_frees();
+
+    munit_assert_ptr_equal(fba_alloc_block(),
+                           (uint64_t *)((uint64_t)test_page_area + 0x5000));
+
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_fba_alloc_blocks_skips_full(const MunitParameter params[],
+                                 void *test_page_area) {
+    bool result = fba_init(TEST_PML4_ADDR, (uintptr_t)test_page_area, 32768);
+    munit_assert_true(result);
+
+    fba_alloc_blocks(8191);
+
+    // Leave a gap too small for the next request
+    fba_free_blocks((void *)((uint64_t)test_page_area + 0x5000), 2);
+    fba_flush_lazy_frees();
+
+    munit_assert_ptr_equal(fba_alloc_blocks_aligned(4, 4),
+                           (uint64_t *)((uint64_t)test_page_area + 0x2000000));
+    munit_assert_ptr_equal(fba_alloc_blocks(2),
+                           (uint64_t *)((uint64_t)test_page_area + 0x5000));
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_magazine_alloc_refills(const MunitParameter params[],
+                                                   void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+    fba_init_cpu_magazines(magazines, cached_bitmap);
+
+    void *block = fba_alloc_block();
+
+    // A whole batch was taken and mapped, and the last one handed out
+    munit_assert_ptr_equal(block,
+                           (void *)(area + (FBA_CPU_MAGAZINE_BATCH << 12)));
+    munit_assert_uint64(magazines[0].count, ==, FBA_CPU_MAGAZINE_BATCH - 1);
+    munit_assert_uint32(test_pmm_get_total_page_allocs(), ==,
+                        1 + FBA_CPU_MAGAZINE_BATCH);
+    munit_assert_uint32(test_vmm_get_total_page_maps(), ==,
+                        1 + FBA_CPU_MAGAZINE_BATCH);
+
+    for (int i = 1; i <= FBA_CPU_MAGAZINE_BATCH; i++) {
+        munit_assert_true(bitmap_check(test_fba_bitmap(), i));
+    }
+
+    munit_assert_false(
+            bitmap_check(test_fba_bitmap(), FBA_CPU_MAGAZINE_BATCH + 1));
+
+    // The next comes straight from the magazine, with no mapping
+    munit_assert_ptr_equal(fba_alloc_block(),
+                           (void *)(area + ((FBA_CPU_MAGAZINE_BATCH - 1)
+                                            << 12)));
+    munit_assert_uint32(test_vmm_get_total_page_maps(), ==,
+                        1 + FBA_CPU_MAGAZINE_BATCH);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_magazine_free_keeps(const MunitParameter params[],
+                                                void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+    fba_init_cpu_magazines(magazines, cached_bitmap);
+
+    void *block = fba_alloc_block();
+    fba_free(block);
+
+    // Still allocated, still mapped, back in the magazine
+    munit_assert_uint64(magazines[0].count, ==, FBA_CPU_MAGAZINE_BATCH);
+    munit_assert_true(
+            bitmap_check(test_fba_bitmap(), ((uintptr_t)block - area) >> 12));
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 0);
+
+    // And it's the one we get back next
+    munit_assert_ptr_equal(fba_alloc_block(), block);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_magazine_free_flushes(const MunitParameter params[],
+                                                  void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+
+    // Allocated without magazines, so they start out empty
+    void *blocks = fba_alloc_blocks(FBA_CPU_MAGAZINE_SIZE + 1);
+    fba_init_cpu_magazines(magazines, cached_bitmap);
+
+    for (int i = 0; i < FBA_CPU_MAGAZINE_SIZE; i++) {
+        fba_free(blocks + (i << 12));
+    }
+
+    munit_assert_uint64(magazines[0].count, ==, FBA_CPU_MAGAZINE_SIZE);
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 0);
+
+    // Magazine is full, so this flushes the oldest batch (to the
+    // lazy-free list) first
+    fba_free(blocks + (FBA_CPU_MAGAZINE_SIZE << 12));
+
+    munit_assert_uint64(magazines[0].count, ==,
+                        FBA_CPU_MAGAZINE_SIZE - FBA_CPU_MAGAZINE_BATCH + 1);
+    munit_assert_uint64(fba_flush_lazy_frees(), ==, FBA_CPU_MAGAZINE_BATCH);
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==,
+                        FBA_CPU_MAGAZINE_BATCH);
+
+    for (int i = 0; i <= FBA_CPU_MAGAZINE_SIZE; i++) {
+        munit_assert_int(bitmap_check(test_fba_bitmap(), i + 1), ==,
+                         i >= FBA_CPU_MAGAZINE_BATCH);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_magazine_free_unallocated(
+        const MunitParameter params[], void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+    fba_init_cpu_magazines(magazines, cached_bitmap);
+
+    fba_free((void *)(area + 0x100000));
+
+    munit_assert_uint64(magazines[0].count, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_magazine_double_free(const MunitParameter params[],
+                                                 void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+    fba_init_cpu_magazines(magazines, cached_bitmap);
+
+    void *block = fba_alloc_block();
+    fba_free(block);
+    fba_free(block);
+
+    // Second free was ignored, so it's only in the magazine once...
+    munit_assert_uint64(magazines[0].count, ==, FBA_CPU_MAGAZINE_BATCH);
+    munit_assert_ptr_equal(fba_alloc_block(), block);
+    munit_assert_ptr_not_equal(fba_alloc_block(), block);
+
+    // ... and blocks from a refill that were never handed out can't be
+    // freed either
+    void *cached = (void *)magazines[0].blocks[0];
+    fba_free(cached);
+    fba_free_blocks(cached, 1);
+
+    munit_assert_uint64(magazines[0].count, ==, FBA_CPU_MAGAZINE_BATCH - 2);
+    munit_assert_uint64(fba_flush_lazy_frees(), ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_magazine_double_free_lazy(
+        const MunitParameter params[], void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+
+    void *blocks = fba_alloc_blocks(FBA_CPU_MAGAZINE_SIZE + 1);
+    fba_init_cpu_magazines(magazines, cached_bitmap);
+
+    // Fill the magazine, and flush the oldest batch to the lazy list
+    for (int i = 0; i <= FBA_CPU_MAGAZINE_SIZE; i++) {
+        fba_free(blocks + (i << 12));
+    }
+
+    uint64_t count = magazines[0].count;
+
+    // The first is on the lazy list, the last in the magazine - freeing
+    // either again (either way) does nothing
+    fba_free(blocks);
+    fba_free_blocks(blocks, 1);
+    fba_free(blocks + (FBA_CPU_MAGAZINE_SIZE << 12));
+    fba_free_blocks(blocks + (FBA_CPU_MAGAZINE_SIZE << 12), 1);
+
+    munit_assert_uint64(magazines[0].count, ==, count);
+    munit_assert_uint64(fba_flush_lazy_frees(), ==, FBA_CPU_MAGAZINE_BATCH);
+
+    // Once it's really free, it can be allocated (and freed) again
+    munit_assert_false(bitmap_check(test_fba_bitmap(), 1));
+    munit_assert_ptr_equal(fba_alloc_blocks(1), blocks);
+    fba_free(blocks);
+    munit_assert_uint64(magazines[0].count, ==, count + 1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_magazine_unchecked(const MunitParameter params[],
+                                               void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+    fba_init_cpu_magazines(magazines, NULL);
+
+    // Without a cached bitmap, magazines work just the same (but repeat
+    // frees aren't caught)
+    void *block = fba_alloc_block();
+    munit_assert_not_null(block);
+    munit_assert_uint64(magazines[0].count, ==, FBA_CPU_MAGAZINE_BATCH - 1);
+
+    fba_free(block);
+    munit_assert_uint64(magazines[0].count, ==, FBA_CPU_MAGAZINE_BATCH);
+    munit_assert_ptr_equal(fba_alloc_block(), block);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_magazine_per_cpu(const MunitParameter params[],
+                                             void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+    fba_init_cpu_magazines(magazines, cached_bitmap);
+
+    void *block0 = fba_alloc_block();
+
+    test_cpu_set_current_id(1);
+    void *block1 = fba_alloc_block();
+
+    // CPU 1 got its own batch, after CPU 0's
+    munit_assert_ptr_equal(block1,
+                           (void *)(area + ((FBA_CPU_MAGAZINE_BATCH * 2) << 12)));
+    munit_assert_uint64(magazines[0].count, ==, FBA_CPU_MAGAZINE_BATCH - 1);
+    munit_assert_uint64(magazines[1].count, ==, FBA_CPU_MAGAZINE_BATCH - 1);
+
+    // Freeing CPU 0's block here puts it in CPU 1's magazine
+    fba_free(block0);
+
+    munit_assert_uint64(magazines[0].count, ==, FBA_CPU_MAGAZINE_BATCH - 1);
+    munit_assert_uint64(magazines[1].count, ==, FBA_CPU_MAGAZINE_BATCH);
+    munit_assert_ptr_equal(fba_alloc_block(), block0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_magazine_shrink(const MunitParameter params[],
+                                            void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+
+    munit_assert_uint64(fba_shrink_cpu_magazine(), ==, 0);
+
+    fba_init_cpu_magazines(magazines, cached_bitmap);
+    fba_alloc_block();
+
+    munit_assert_uint64(fba_shrink_cpu_magazine(), ==,
+                        FBA_CPU_MAGAZINE_BATCH - 1);
+    munit_assert_uint64(magazines[0].count, ==, 0);
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==,
+                        FBA_CPU_MAGAZINE_BATCH - 1);
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==,
+                        FBA_CPU_MAGAZINE_BATCH - 1);
+
+    // Only the block we still have is allocated
+    for (int i = 1; i <= FBA_CPU_MAGAZINE_BATCH; i++) {
+        munit_assert_int(bitmap_check(test_fba_bitmap(), i), ==,
+                         i == FBA_CPU_MAGAZINE_BATCH);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_magazine_alloc_blocks_shrinks(
+        const MunitParameter params[], void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+    fba_init_cpu_magazines(magazines, cached_bitmap);
+
+    // Magazine gets blocks 1 - 16 (and we get 16), then everything
+    // after that is taken...
+    fba_alloc_block();
+    munit_assert_not_null(fba_alloc_blocks(32768 - FBA_CPU_MAGAZINE_BATCH - 1));
+
+    // ... so this only works once the magazine gives its blocks back
+    munit_assert_ptr_equal(fba_alloc_blocks(FBA_CPU_MAGAZINE_BATCH - 1),
+                           (void *)(area + 0x1000));
+    munit_assert_uint64(magazines[0].count, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_lazy_free_defers(const MunitParameter params[],
+                                             void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+
+    void *block1 = fba_alloc_block();
+    void *block2 = fba_alloc_block();
+    fba_free(block1);
+    fba_free(block2);
+
+    // Freed blocks aren't reused until they've been unmapped...
+    munit_assert_ptr_equal(fba_alloc_block(), (void *)(area + 0x3000));
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 0);
+
+    // ... which happens in one go
+    munit_assert_uint64(fba_flush_lazy_frees(), ==, 2);
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 2);
+    munit_assert_uint32(test_vmm_get_total_unmap_calls(), ==, 1);
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 2);
+
+    munit_assert_ptr_equal(fba_alloc_block(), block1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_lazy_free_batch(const MunitParameter params[],
+                                            void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+
+    void *blocks = fba_alloc_blocks(FBA_LAZY_FREE_BATCH * 2);
+
+    // Every other block, so they can't be unmapped as a range
+    for (int i = 0; i < FBA_LAZY_FREE_BATCH - 1; i++) {
+        fba_free(blocks + (i << 13));
+    }
+
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 0);
+
+    // The batch is full, so it's all unmapped together
+    fba_free(blocks + ((FBA_LAZY_FREE_BATCH - 1) << 13));
+
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==,
+                        FBA_LAZY_FREE_BATCH);
+    munit_assert_uint32(test_vmm_get_total_unmap_calls(), ==, 1);
+    munit_assert_uint64(fba_flush_lazy_frees(), ==, 0);
+
+    for (int i = 0; i < FBA_LAZY_FREE_BATCH * 2; i++) {
+        munit_assert_int(bitmap_check(test_fba_bitmap(), i + 1), ==, i & 1);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fba_lazy_free_alloc_full(const MunitParameter params[],
+                                                 void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+    munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+
+    fba_alloc_blocks(32767);
+    fba_free((void *)(area + 0x5000));
+    fba_free_blocks((void *)(area + 0x8000), 2);
+
+    // Everything's in use or waiting to be unmapped, so these have to
+    // flush the lazy-free list to work
+    munit_assert_ptr_equal(fba_alloc_block(), (void *)(area + 0x5000));
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 3);
+
+    fba_free((void *)(area + 0x5000));
+
+    munit_assert_ptr_equal(fba_alloc_blocks(3), NULL);
+    munit_assert_ptr_equal(fba_alloc_blocks(2), (void *)(area + 0x8000));
+    munit_assert_uint32(test_vmm_get_total_page_unmaps(), ==, 4);
+
+    return MUNIT_OK;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Fill the whole FBA (of `blocks` blocks), then free `free_count` random
+// blocks again.
+static void fill_and_free_random(uintptr_t area, uint64_t blocks,
+                                 uint64_t free_count) {
+    uint64_t freed = 0;
+
+    while (fba_alloc_block()) {
+    }
+
+    while (freed < free_count) {
+        uint64_t block = munit_rand_int_range(blocks >> 15, blocks - 1);
+
+        if (bitmap_check(test_fba_bitmap(), block)) {
+            fba_free((void *)(area + (block << 12)));
+            fba_flush_lazy_frees();
+            freed++;
+        }
+    }
+}
+
+// A simple bit-at-a-time run search (as the FBA used to do for mixed
+// words), as a reference for the word-at-a-time one. Returns
+// num_quads << 6 if there's no run.
+static uint64_t reference_find_unset_run(uint64_t *bitmap,
+                                         uint64_t num_quads,
+                                         uint8_t align_page_count, uint64_t n) {
+    uint64_t align_mask = align_page_count - 1;
+    uint64_t consec_zeroes = 0;
+    uint64_t start_bit = 0;
+
+    for (uint64_t bit = 0; bit < num_quads << 6; bit++) {
+        if (bitmap_check(bitmap, bit)) {
+            consec_zeroes = 0;
+            continue;
+        }
+
+        if (consec_zeroes == 0) {
+            if (bit & align_mask) {
+                continue;
+            }
+
+            start_bit = bit;
+        }
+
+        if (++consec_zeroes == n) {
+            return start_bit;
+        }
+    }
+
+    return num_quads << 6;
+}
+
+static uint8_t random_align(void) {
+    return 1 << munit_rand_int_range(0, 6);
+}
+
+/*
+ * Fill the FBA to random levels, and check every allocation lands where
+ * the reference (bit-at-a-time) search says it should.
+ */
+static MunitResult test_fba_alloc_blocks_differential(
+        const MunitParameter params[], void *test_page_area) {
+    uintptr_t area = (uintptr_t)test_page_area;
+
+    for (int round = 0; round < 16; round++) {
+        munit_assert_true(fba_init(TEST_PML4_ADDR, area, 32768));
+
+        fill_and_free_random(area, 32768, munit_rand_int_range(1, 32767));
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t count = munit_rand_int_range(1, 200);
+            uint8_t align = random_align();
+
+            uint64_t expected =
+                    reference_find_unset_run(test_fba_bitmap(), 512, align,
+                                             count);
+
+            void *blocks = fba_alloc_blocks_aligned(count, align);
+
+            if (expected == 32768) {
+                munit_assert_null(blocks);
+            } else {
+                munit_assert_ptr_equal(blocks,
+                                       (void *)(area + (expected << 12)));
+                fba_free_blocks(blocks, count);
+                fba_flush_lazy_frees();
+            }
+        }
+
+        test_pmm_reset();
+        test_vmm_reset();
+    }
+
+    return MUNIT_OK;
+}
+
+/*
+ * With the FBA 90% full (with the free blocks scattered through it),
+ * allocate all the free blocks one at a time. Run with `--show-stderr`
+ * to see the numbers.
+ */
+static MunitResult test_fba_bench_90_percent(const MunitParameter params[],
+                                             void *param) {
+    void *area;
+    posix_memalign(&area, 0x40000, BENCH_BITMAP_PAGES << 12);
+    munit_assert_true(fba_init(TEST_PML4_ADDR, (uintptr_t)area, BENCH_BLOCKS));
+
+    void **blocks = munit_malloc(BENCH_BLOCKS / 10 * sizeof(void *));
+
+    // Single blocks, via fba_alloc_block
+    uint64_t free_count = BENCH_BLOCKS / 10;
+    fill_and_free_random((uintptr_t)area, BENCH_BLOCKS, free_count);
+
+    double start = now_ns();
+
+    for (uint64_t i = 0; i < free_count; i++) {
+        blocks[i] = fba_alloc_block();
+    }
+
+    double single = (now_ns() - start) / free_count;
+
+    for (uint64_t i = 0; i < free_count; i++) {
+        munit_assert_not_null(blocks[i]);
+    }
+
+    munit_assert_null(fba_alloc_block());
+
+    // Same again via fba_alloc_blocks (the run search)
+    for (uint64_t i = 0; i < free_count; i++) {
+        fba_free(blocks[i]);
+    }
+
+    fba_flush_lazy_frees();
+
+    start = now_ns();
+
+    for (uint64_t i = 0; i < free_count; i++) {
+        blocks[i] = fba_alloc_blocks(1);
+    }
+
+    double run = (now_ns() - start) / free_count;
+
+    for (uint64_t i = 0; i < free_count; i++) {
+        munit_assert_not_null(blocks[i]);
+    }
+
+    munit_logf(MUNIT_LOG_INFO,
+               "90%% full, %" PRIu64 " free: fba_alloc_block %6.1f ns/op; "
+               "fba_alloc_blocks(1) %6.1f ns/op",
+               free_count, single, run);
+
+    free(blocks);
+    free(area);
+    return MUNIT_OK;
+}
+
+/*
+ * Time run searches with the FBA filled to various levels, against
+ * the bit-at-a-time reference search on the same bitmap. Run with
+ * `--show-stderr` to see the numbers.
+ */
+static MunitResult test_fba_bench_fill_levels(const MunitParameter params[],
+                                              void *param) {
+    static const int percents[] = {0, 50, 75, 90, 99};
+    static const struct {
+        uint32_t count;
+        uint8_t align;
+    } requests[] = {{1, 1}, {4, 4}, {16, 1}, {100, 64}};
+
+    void *area;
+    posix_memalign(&area, 0x40000, BENCH_BITMAP_PAGES << 12);
+
+    for (int p = 0; p < sizeof(percents) / sizeof(percents[0]); p++) {
+        munit_assert_true(
+                fba_init(TEST_PML4_ADDR, (uintptr_t)area, BENCH_BLOCKS));
+
+        if (percents[p]) {
+            fill_and_free_random((uintptr_t)area, BENCH_BLOCKS,
+                                 BENCH_BLOCKS * (100 - percents[p]) / 100);
+        }
+
+        for (int r = 0; r < sizeof(requests) / sizeof(requests[0]); r++) {
+            uint32_t count = requests[r].count;
+            uint8_t align = requests[r].align;
+
+            // Search and free straight away, so the bitmap is the
+            // same every time round
+            double start = now_ns();
+
+            for (int i = 0; i < 100; i++) {
+                fba_free_blocks(fba_alloc_blocks_aligned(count, align), count);
+            }
+
+            double words = (now_ns() - start) / 100;
+            fba_flush_lazy_frees();
+
+            volatile uint64_t sink = 0;
+            start = now_ns();
+
+            for (int i = 0; i < 100; i++) {
+                sink += reference_find_unset_run(
+                        test_fba_bitmap(), BENCH_BLOCKS >> 6, align, count);
+            }
+
+            double bits = (now_ns() - start) / 100;
+
+            munit_logf(MUNIT_LOG_INFO,
+                       "%2d%% full, %3d blocks (align %2d): alloc+free "
+                       "%9.1f ns/op; bitwise search %9.1f ns/op",
+                       percents[p], count, align, words, bits);
+        }
+
+        test_pmm_reset();
+        test_vmm_reset();
+    }
+
+    free(area);
+    return MUNIT_OK;
+}
+
 static MunitTest test_suite_tests[] = {
         {(char *)"/init/zero", test_fba_init_zero, NULL, NULL,
          MUNIT_TEST_OPTION_NONE, NULL},
@@ -649,6 +1362,16 @@ static MunitTest test_suite_tests[] = {
          test_fba_alloc_blocks_aligned_invalid, test_setup, test_teardown,
          MUNIT_TEST_OPTION_NONE, NULL},
 
+        {(char *)"/summary/init", test_fba_summary_init, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/summary/tracks_full", test_fba_summary_tracks_full,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/summary/block_skips_full", test_fba_alloc_block_skips_full,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/summary/blocks_skips_full",
+         test_fba_alloc_blocks_skips_full, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
         {(char *)"/free/single_block", test_fba_free_single_block, test_setup,
          test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
         {(char *)"/free/multiple_blocks", test_fba_free_multiple_blocks,
@@ -657,6 +1380,50 @@ static MunitTest test_suite_tests[] = {
          test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
         {(char *)"/free/invalid_address", test_fba_free_invalid_address,
          test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/free/blocks_range", test_fba_free_blocks_range, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/free/blocks_past_end", test_fba_free_blocks_past_end,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/magazine/alloc_refills", test_fba_magazine_alloc_refills,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/free_keeps", test_fba_magazine_free_keeps,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/free_flushes", test_fba_magazine_free_flushes,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/free_unallocated",
+         test_fba_magazine_free_unallocated, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/double_free", test_fba_magazine_double_free,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/double_free_lazy",
+         test_fba_magazine_double_free_lazy, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/unchecked", test_fba_magazine_unchecked,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/per_cpu", test_fba_magazine_per_cpu, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/shrink", test_fba_magazine_shrink, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/alloc_blocks_shrinks",
+         test_fba_magazine_alloc_blocks_shrinks, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/lazy_free/defers", test_fba_lazy_free_defers, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/lazy_free/batch", test_fba_lazy_free_batch, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/lazy_free/alloc_full", test_fba_lazy_free_alloc_full,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/alloc_blocks/differential",
+         test_fba_alloc_blocks_differential, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/bench/fill_levels", test_fba_bench_fill_levels, NULL,
+         test_teardown_bench, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/bench/90_percent", test_fba_bench_90_percent, NULL,
+         test_teardown_bench, MUNIT_TEST_OPTION_NONE, NULL},
 
         {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
 };
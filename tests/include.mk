@@ -1,4 +1,4 @@
-CLEAN_ARTIFACTS+=tests/*.o tests/pmm/*.o tests/vmm/*.o tests/structs/*.o tests/pci/*.o tests/fba/*.o tests/slab/*.o tests/build
+CLEAN_ARTIFACTS+=tests/*.o tests/pmm/*.o tests/vmm/*.o tests/structs/*.o tests/pci/*.o tests/fba/*.o tests/slab/*.o tests/sched/*.o tests/build
 UBSAN_CFLAGS=-fsanitize=undefined -fno-sanitize-recover=all
 TEST_CFLAGS=-g -Ikernel/include -Itests/include -O3 $(UBSAN_CFLAGS)
 HOST_ARCH=$(shell uname -p)
@@ -7,7 +7,7 @@ ifeq ($(HOST_ARCH),arm)
 TEST_CFLAGS+=-arch x86_64
 endif
 
-TEST_BUILD_DIRS=tests/build tests/build/pmm tests/build/vmm tests/build/structs tests/build/pci tests/build/fba tests/build/slab
+TEST_BUILD_DIRS=tests/build tests/build/pmm tests/build/vmm tests/build/structs tests/build/pci tests/build/fba tests/build/slab tests/build/sched
 
 tests/%.o: tests/%.c tests/munit.h
 	$(CC) -DUNIT_TESTS $(TEST_CFLAGS) -Itests -c -o $@ $<
@@ -33,6 +33,9 @@ tests/build/fba:
 tests/build/slab:
 	mkdir -p tests/build/slab
 
+tests/build/sched:
+	mkdir -p tests/build/sched
+
 tests/build/%.o: kernel/%.c $(TEST_BUILD_DIRS)
 	$(CC) -DUNIT_TESTS $(TEST_CFLAGS) -c -o $@ $<
 
@@ -45,10 +48,25 @@ tests/build/interrupts: tests/munit.o tests/interrupts.o tests/build/interrupts.
 tests/build/structs/bitmap: tests/munit.o tests/structs/bitmap.o
 	$(CC) $(TEST_CFLAGS) -o $@ $^
 
-tests/build/pmm/pagealloc: tests/munit.o tests/pmm/pagealloc.o tests/build/pmm/pagealloc.o tests/build/spinlock.o
+tests/build/pmm/pagealloc: tests/munit.o tests/pmm/pagealloc.o tests/build/pmm/pagealloc.o tests/build/pmm/stack.o tests/build/spinlock.o tests/test_cpu.o
+	$(CC) $(TEST_CFLAGS) -o $@ $^
+
+tests/build/pmm/buddy: tests/munit.o tests/pmm/buddy.o tests/build/pmm/pagealloc.o tests/build/pmm/buddy.o tests/build/spinlock.o tests/test_cpu.o
+	$(CC) $(TEST_CFLAGS) -o $@ $^
+
+tests/pmm/fragmentation_%.o: tests/pmm/fragmentation.c tests/munit.h
+	$(CC) -DUNIT_TESTS -DPMM_BACKEND_NAME=\"$*\" $(TEST_CFLAGS) -Itests -c -o $@ $<
+
+tests/build/pmm/fragmentation_%: tests/munit.o tests/pmm/fragmentation_%.o tests/build/pmm/pagealloc.o tests/build/pmm/%.o tests/build/spinlock.o tests/test_cpu.o
+	$(CC) $(TEST_CFLAGS) -o $@ $^
+
+tests/build/vmm/vmmapper: tests/munit.o tests/vmm/vmmapper.o tests/build/vmm/vmmapper.o tests/test_pmm_malloc.o tests/build/spinlock.o tests/test_cpu.o
+	$(CC) $(TEST_CFLAGS) -o $@ $^
+
+tests/build/vmm/map_range_bench: tests/munit.o tests/vmm/map_range_bench.o tests/build/vmm/vmmapper.o tests/test_pmm_malloc.o tests/build/spinlock.o tests/test_cpu.o
 	$(CC) $(TEST_CFLAGS) -o $@ $^
 
-tests/build/vmm/vmmapper: tests/munit.o tests/vmm/vmmapper.o tests/build/vmm/vmmapper.o tests/test_pmm_malloc.o tests/build/spinlock.o
+tests/build/vmm/pcid: tests/munit.o tests/vmm/pcid.o tests/build/vmm/pcid.o tests/test_cpu.o
 	$(CC) $(TEST_CFLAGS) -o $@ $^
 
 tests/build/vmm/vmalloc_linkedlist: tests/munit.o tests/vmm/vmalloc_linkedlist.o tests/build/vmm/vmalloc_linkedlist.o tests/build/spinlock.o
@@ -69,13 +87,28 @@ tests/build/gdt: tests/munit.o tests/gdt.o tests/build/gdt.o
 tests/build/pci/bus: tests/munit.o tests/pci/bus.o tests/build/pci/bus.o tests/test_machine.o
 	$(CC) $(TEST_CFLAGS) -o $@ $^
 
-tests/build/fba/alloc: tests/munit.o tests/fba/alloc.o tests/build/fba/alloc.o tests/test_pmm_noalloc.o tests/test_vmm.o tests/build/spinlock.o
+tests/build/fba/alloc: tests/munit.o tests/fba/alloc.o tests/build/fba/alloc.o tests/test_pmm_noalloc.o tests/test_vmm.o tests/build/spinlock.o tests/test_cpu.o
+	$(CC) $(TEST_CFLAGS) -o $@ $^
+
+tests/build/spinlock: tests/munit.o tests/spinlock.o tests/build/spinlock.o tests/test_cpu.o
+	$(CC) $(TEST_CFLAGS) -o $@ $^
+
+tests/build/rwlock: tests/munit.o tests/rwlock.o tests/build/rwlock.o tests/build/spinlock.o tests/test_cpu.o
+	$(CC) $(TEST_CFLAGS) -o $@ $^
+
+tests/build/seqlock: tests/munit.o tests/seqlock.o tests/build/spinlock.o tests/test_cpu.o
+	$(CC) $(TEST_CFLAGS) -o $@ $^
+
+tests/build/slab/alloc: tests/munit.o tests/slab/alloc.o tests/build/slab/alloc.o tests/build/fba/alloc.o tests/build/spinlock.o tests/build/structs/list.o tests/test_pmm_noalloc.o tests/test_vmm.o tests/test_cpu.o
+	$(CC) $(TEST_CFLAGS) -o $@ $^
+
+tests/build/slab/cache: tests/munit.o tests/slab/cache.o tests/build/slab/cache.o tests/build/fba/alloc.o tests/build/spinlock.o tests/test_pmm_noalloc.o tests/test_vmm.o tests/test_cpu.o
 	$(CC) $(TEST_CFLAGS) -o $@ $^
 
-tests/build/spinlock: tests/munit.o tests/spinlock.o tests/build/spinlock.o
+tests/build/slab/kmalloc: tests/munit.o tests/slab/kmalloc.o tests/build/slab/kmalloc.o tests/build/slab/cache.o tests/build/fba/alloc.o tests/build/spinlock.o tests/test_pmm_noalloc.o tests/test_vmm.o tests/test_cpu.o
 	$(CC) $(TEST_CFLAGS) -o $@ $^
 
-tests/build/slab/alloc: tests/munit.o tests/slab/alloc.o tests/build/slab/alloc.o tests/build/fba/alloc.o tests/build/spinlock.o tests/build/structs/list.o tests/test_pmm_noalloc.o tests/test_vmm.o
+tests/build/sched/runqueue: tests/munit.o tests/sched/runqueue.o tests/build/sched/runqueue.o tests/build/spinlock.o tests/test_cpu.o
 	$(CC) $(TEST_CFLAGS) -o $@ $^
 
 tests/build/vmm/recursive: tests/munit.o tests/vmm/recursive.o $(TEST_BUILD_DIRS)
@@ -84,7 +117,12 @@ tests/build/vmm/recursive: tests/munit.o tests/vmm/recursive.o $(TEST_BUILD_DIRS
 ALL_TESTS=tests/build/interrupts 										\
 			tests/build/structs/bitmap									\
 			tests/build/pmm/pagealloc									\
+			tests/build/pmm/buddy										\
+			tests/build/pmm/fragmentation_stack							\
+			tests/build/pmm/fragmentation_buddy							\
 			tests/build/vmm/vmmapper									\
+			tests/build/vmm/map_range_bench								\
+			tests/build/vmm/pcid										\
 			tests/build/vmm/vmalloc_linkedlist							\
 			tests/build/debugprint										\
 			tests/build/acpitables										\
@@ -93,7 +131,12 @@ ALL_TESTS=tests/build/interrupts 										\
 			tests/build/pci/bus											\
 			tests/build/fba/alloc										\
 			tests/build/spinlock										\
+			tests/build/rwlock											\
+			tests/build/seqlock											\
 			tests/build/slab/alloc										\
+			tests/build/slab/cache										\
+			tests/build/slab/kmalloc									\
+			tests/build/sched/runqueue									\
 			tests/build/vmm/recursive
 
 test: $(ALL_TESTS)
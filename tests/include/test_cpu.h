@@ -0,0 +1,26 @@
+/*
+ * Test interface to mock per-CPU helpers for tests
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#ifndef __ANOS_TESTS_TEST_CPU_H
+#define __ANOS_TESTS_TEST_CPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Set the CPU ID that `cpu_current_id` will report for the
+ * calling thread (defaults to zero).
+ */
+void test_cpu_set_current_id(uint8_t id);
+
+/*
+ * Whether the (pretend) interrupt flag is set for the calling
+ * thread. It starts out set.
+ */
+bool test_cpu_interrupts_enabled(void);
+
+#endif //__ANOS_TESTS_TEST_CPU_H
@@ -13,6 +13,7 @@
 
 uint32_t test_vmm_get_total_page_maps();
 uint32_t test_vmm_get_total_page_unmaps();
+uint32_t test_vmm_get_total_unmap_calls();
 
 uint64_t test_vmm_get_last_page_map_pml4();
 uint64_t test_vmm_get_last_page_map_paddr();
@@ -0,0 +1,468 @@
+/*
+ * Tests for the buddy page allocator backend
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#include "munit.h"
+#include "pmm/pagealloc.h"
+
+#define MAX_BLOCK_PAGES ((1ULL << (PMM_BUDDY_MAX_ORDER)))
+
+#define RANDOM_PAGE_COUNT 0x1000
+#define RANDOM_SLOTS 256
+#define RANDOM_ITERATIONS 100000
+
+static void *region_buffer;
+static PerCPUPageCache cpu_caches[MAX_CPU_COUNT];
+
+static E820h_MemMap *create_mem_map(int num_entries) {
+    E820h_MemMap *map = munit_malloc(sizeof(E820h_MemMap) +
+                                     sizeof(E820h_MemMapEntry) * num_entries);
+    map->num_entries = num_entries;
+    return map;
+}
+
+static E820h_MemMap *create_single_block_map(uint64_t base, uint64_t pages) {
+    E820h_MemMap *map = create_mem_map(1);
+    map->entries[0].type = MEM_MAP_ENTRY_AVAILABLE;
+    map->entries[0].base = base;
+    map->entries[0].length = pages << 12;
+    map->entries[0].attrs = 0;
+    return map;
+}
+
+static MunitResult test_init_empty(const MunitParameter params[], void *param) {
+    E820h_MemMap map = {.num_entries = 0};
+
+    MemoryRegion *region = page_alloc_init(&map, 0, region_buffer);
+
+    munit_assert_uint64(region->size, ==, 0);
+    munit_assert_uint64(region->free, ==, 0);
+
+    uint64_t page = page_alloc(region);
+    munit_assert_uint64(page & 0xFF, ==, 0xFF);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_init_reserved(const MunitParameter params[],
+                                      void *param) {
+    E820h_MemMap *map = create_single_block_map(0, 0x100);
+    map->entries[0].type = MEM_MAP_ENTRY_RESERVED;
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    munit_assert_uint64(region->size, ==, 0);
+    munit_assert_uint64(region->free, ==, 0);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_init_unaligned(const MunitParameter params[],
+                                       void *param) {
+    E820h_MemMap *map = create_single_block_map(0x1800, 4);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    // Partial pages at either end are dropped
+    munit_assert_uint64(region->size, ==, 0x3000);
+    munit_assert_uint64(region->free, ==, 0x3000);
+
+    for (int i = 0; i < 3; i++) {
+        uint64_t page = page_alloc(region);
+        munit_assert_uint64(page, >=, 0x2000);
+        munit_assert_uint64(page, <, 0x5000);
+    }
+
+    munit_assert_uint64(page_alloc(region) & 0xFF, ==, 0xFF);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_init_managed_base(const MunitParameter params[],
+                                          void *param) {
+    E820h_MemMap *map = create_single_block_map(0, 0x100);
+
+    MemoryRegion *region = page_alloc_init(map, 0x80000, region_buffer);
+
+    munit_assert_uint64(region->size, ==, 0x80000);
+    munit_assert_uint64(region->free, ==, 0x80000);
+
+    // Nothing below the managed base is handed out
+    for (int i = 0; i < 0x80; i++) {
+        munit_assert_uint64(page_alloc(region), >=, 0x80000);
+    }
+
+    munit_assert_uint64(page_alloc(region) & 0xFF, ==, 0xFF);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_init_two_regions(const MunitParameter params[],
+                                         void *param) {
+    E820h_MemMap *map = create_mem_map(2);
+    map->entries[0].type = MEM_MAP_ENTRY_AVAILABLE;
+    map->entries[0].base = 0x100000;
+    map->entries[0].length = 0x3000;
+    map->entries[1].type = MEM_MAP_ENTRY_AVAILABLE;
+    map->entries[1].base = 0x10000000;
+    map->entries[1].length = 0x5000;
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    munit_assert_uint64(region->size, ==, 0x8000);
+    munit_assert_uint64(region->free, ==, 0x8000);
+
+    for (int i = 0; i < 8; i++) {
+        uint64_t page = page_alloc(region);
+        munit_assert_uint64(page & 0xFF, ==, 0);
+        munit_assert_true((page >= 0x100000 && page < 0x103000) ||
+                          (page >= 0x10000000 && page < 0x10005000));
+    }
+
+    munit_assert_uint64(page_alloc(region) & 0xFF, ==, 0xFF);
+    munit_assert_uint64(region->free, ==, 0);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_init_too_big(const MunitParameter params[],
+                                     void *param) {
+    // Far more than the bitmaps have room for - the rest is ignored
+    E820h_MemMap *map = create_single_block_map(0, 0x10000000);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    munit_assert_uint64(region->size, >, 0);
+    munit_assert_uint64(region->size, <, 0x10000000ULL << 12);
+    munit_assert_uint64(region->size % (MAX_BLOCK_PAGES << 12), ==, 0);
+    munit_assert_uint64(region->free, ==, region->size);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_alloc_all(const MunitParameter params[], void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, 0x20);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    // Lowest page first, every page exactly once
+    for (int i = 0; i < 0x20; i++) {
+        munit_assert_uint64(page_alloc(region), ==, 0x100000 + (i << 12));
+    }
+
+    munit_assert_uint64(page_alloc(region) & 0xFF, ==, 0xFF);
+    munit_assert_uint64(region->free, ==, 0);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_free_coalesces(const MunitParameter params[],
+                                       void *param) {
+    E820h_MemMap *map = create_single_block_map(0, MAX_BLOCK_PAGES);
+    uint64_t pages[MAX_BLOCK_PAGES];
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    for (int i = 0; i < MAX_BLOCK_PAGES; i++) {
+        pages[i] = page_alloc(region);
+    }
+
+    // Free in a scattered order - odds, then evens
+    for (int i = 1; i < MAX_BLOCK_PAGES; i += 2) {
+        page_free(region, pages[i]);
+    }
+
+    // Nothing has a free buddy yet, so no two-page blocks
+    munit_assert_uint64(page_alloc_m(region, 2) & 0xFF, ==, 0xFF);
+
+    for (int i = 0; i < MAX_BLOCK_PAGES; i += 2) {
+        page_free(region, pages[i]);
+    }
+
+    munit_assert_uint64(region->free, ==, MAX_BLOCK_PAGES << 12);
+
+    // ... and it should all be back together
+    munit_assert_uint64(page_alloc_m(region, MAX_BLOCK_PAGES), ==, 0);
+    munit_assert_uint64(region->free, ==, 0);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_free_out_of_range(const MunitParameter params[],
+                                          void *param) {
+    E820h_MemMap *map = create_single_block_map(0x400000, 0x10);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    page_free(region, 0x1000000000);
+    page_free(region, 0x1000);
+
+    munit_assert_uint64(region->free, ==, 0x10000);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_free_unaligned(const MunitParameter params[],
+                                       void *param) {
+    E820h_MemMap *map = create_single_block_map(0, 0x10);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+    uint64_t page = page_alloc(region);
+
+    page_free(region, page + 0x10);
+    munit_assert_uint64(region->free, ==, 0xF000);
+
+    page_free(region, page);
+    munit_assert_uint64(region->free, ==, 0x10000);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_alloc_m_zero(const MunitParameter params[],
+                                     void *param) {
+    E820h_MemMap *map = create_single_block_map(0, 0x10);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    munit_assert_uint64(page_alloc_m(region, 0) & 0xFF, ==, 0xFF);
+    munit_assert_uint64(region->free, ==, 0x10000);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_alloc_m_too_big(const MunitParameter params[],
+                                        void *param) {
+    E820h_MemMap *map = create_single_block_map(0, MAX_BLOCK_PAGES * 4);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    uint64_t page = page_alloc_m(region, MAX_BLOCK_PAGES + 1);
+    munit_assert_uint64(page & 0xFF, ==, 0xFF);
+
+    page = page_alloc_m(region, MAX_BLOCK_PAGES);
+    munit_assert_uint64(page & 0xFF, ==, 0);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_alloc_m_aligned(const MunitParameter params[],
+                                        void *param) {
+    // Start one page in, so the first 2MiB boundary isn't at the base
+    E820h_MemMap *map = create_single_block_map(0x1000, 0x800);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    uint64_t page = page_alloc_m(region, 0x200);
+    munit_assert_uint64(page, ==, 0x200000);
+
+    page = page_alloc_m(region, 0x200);
+    munit_assert_uint64(page, ==, 0x400000);
+
+    munit_assert_uint64(region->free, ==, 0x400 << 12);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_alloc_m_returns_tail(const MunitParameter params[],
+                                             void *param) {
+    E820h_MemMap *map = create_single_block_map(0, 8);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    // Five pages comes from an eight page block...
+    uint64_t page = page_alloc_m(region, 5);
+    munit_assert_uint64(page, ==, 0);
+    munit_assert_uint64(region->free, ==, 0x3000);
+
+    // ... and the other three go back
+    munit_assert_uint64(page_alloc_m(region, 2), ==, 0x6000);
+    munit_assert_uint64(page_alloc(region), ==, 0x5000);
+    munit_assert_uint64(page_alloc(region) & 0xFF, ==, 0xFF);
+
+    // Freeing it all puts the eight page block back together
+    for (int i = 0; i < 8; i++) {
+        page_free(region, i << 12);
+    }
+
+    munit_assert_uint64(page_alloc_m(region, 8), ==, 0);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_alloc_aligned(const MunitParameter params[],
+                                      void *param) {
+    E820h_MemMap *map = create_single_block_map(0x1000, 0x800);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    // Even a single page can be 2MiB aligned
+    uint64_t page = page_alloc_aligned(region, 1, 0x200000);
+    munit_assert_uint64(page, ==, 0x200000);
+
+    page = page_alloc_aligned(region, 0x200, 0x200000);
+    munit_assert_uint64(page, ==, 0x400000);
+
+    // Only the pages asked for were taken
+    munit_assert_uint64(region->free, ==, (0x800 - 0x201) << 12);
+
+    // Can't do better than max-order alignment, or bad alignments
+    page = page_alloc_aligned(region, 1, MAX_BLOCK_PAGES << 13);
+    munit_assert_uint64(page & 0xFF, ==, 0xFF);
+    page = page_alloc_aligned(region, 1, 0x1800);
+    munit_assert_uint64(page & 0xFF, ==, 0xFF);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_cpu_cache(const MunitParameter params[], void *param) {
+    E820h_MemMap *map = create_single_block_map(0, MAX_BLOCK_PAGES);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+    page_alloc_init_cpu_caches(region, cpu_caches);
+
+    uint64_t page = page_alloc(region);
+    munit_assert_uint64(page & 0xFF, ==, 0);
+    munit_assert_uint64(cpu_caches[0].count, ==, PMM_CPU_CACHE_BATCH - 1);
+
+    page_free(region, page);
+    page_alloc_drain_cpu_cache(region);
+
+    munit_assert_uint64(cpu_caches[0].count, ==, 0);
+    munit_assert_uint64(region->free, ==, MAX_BLOCK_PAGES << 12);
+
+    // Drained pages get coalesced like any others
+    munit_assert_uint64(page_alloc_m(region, MAX_BLOCK_PAGES), ==, 0);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_random(const MunitParameter params[], void *param) {
+    E820h_MemMap *map = create_single_block_map(0, RANDOM_PAGE_COUNT);
+    uint64_t slot_page[RANDOM_SLOTS] = {0};
+    uint64_t slot_count[RANDOM_SLOTS] = {0};
+    uint8_t *owned = munit_calloc(RANDOM_PAGE_COUNT, 1);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    for (int i = 0; i < RANDOM_ITERATIONS; i++) {
+        int slot = munit_rand_int_range(0, RANDOM_SLOTS - 1);
+
+        if (slot_count[slot]) {
+            for (uint64_t j = 0; j < slot_count[slot]; j++) {
+                uint64_t page = slot_page[slot] + (j << 12);
+                owned[page >> 12] = 0;
+                page_free(region, page);
+            }
+
+            slot_count[slot] = 0;
+        } else {
+            uint64_t count = munit_rand_int_range(1, 64);
+            uint64_t page = page_alloc_m(region, count);
+
+            if ((page & 0xFF) == 0) {
+                for (uint64_t j = 0; j < count; j++) {
+                    munit_assert_uint8(owned[(page >> 12) + j], ==, 0);
+                    owned[(page >> 12) + j] = 1;
+                }
+
+                slot_page[slot] = page;
+                slot_count[slot] = count;
+            }
+        }
+    }
+
+    for (int slot = 0; slot < RANDOM_SLOTS; slot++) {
+        for (uint64_t j = 0; j < slot_count[slot]; j++) {
+            page_free(region, slot_page[slot] + (j << 12));
+        }
+    }
+
+    // Everything should have coalesced back to max-order blocks
+    munit_assert_uint64(region->free, ==, RANDOM_PAGE_COUNT << 12);
+
+    for (int i = 0; i < RANDOM_PAGE_COUNT / MAX_BLOCK_PAGES; i++) {
+        munit_assert_uint64(page_alloc_m(region, MAX_BLOCK_PAGES) & 0xFF, ==,
+                            0);
+    }
+
+    munit_assert_uint64(region->free, ==, 0);
+
+    free(owned);
+    free(map);
+    return MUNIT_OK;
+}
+
+static void *setup(const MunitParameter params[], void *user_data) {
+    region_buffer = malloc(PMM_BUDDY_BUFFER_SIZE);
+    return NULL;
+}
+
+static void teardown(void *param) { free(region_buffer); }
+
+static MunitTest test_suite_tests[] = {
+        {(char *)"/init_empty", test_init_empty, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/init_reserved", test_init_reserved, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/init_unaligned", test_init_unaligned, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/init_managed_base", test_init_managed_base, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/init_two_regions", test_init_two_regions, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/init_too_big", test_init_too_big, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/alloc_all", test_alloc_all, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/free_coalesces", test_free_coalesces, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/free_out_of_range", test_free_out_of_range, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/free_unaligned", test_free_unaligned, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/alloc_m_zero", test_alloc_m_zero, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/alloc_m_too_big", test_alloc_m_too_big, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/alloc_m_aligned", test_alloc_m_aligned, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/alloc_m_returns_tail", test_alloc_m_returns_tail, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/alloc_aligned", test_alloc_aligned, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/cpu_cache", test_cpu_cache, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/random", test_random, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+};
+
+static const MunitSuite test_suite = {(char *)"/pmm/buddy", test_suite_tests,
+                                      NULL, 1, MUNIT_SUITE_OPTION_NONE};
+
+int main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&test_suite, (void *)"µnit", argc, argv);
+}
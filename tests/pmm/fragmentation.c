@@ -0,0 +1,211 @@
+/*
+ * Fragmentation benchmarks for the page allocator
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Built once per PMM backend (with PMM_BACKEND_NAME set to match) so
+ * the numbers can be compared - run with `--show-stderr` to see them.
+ */
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "munit.h"
+#include "pmm/pagealloc.h"
+
+#ifndef PMM_BACKEND_NAME
+#define PMM_BACKEND_NAME "unknown"
+#endif
+
+#define BENCH_PAGE_COUNT 0x4000
+#define BENCH_BUFFER_SIZE 0x100000
+#define BENCH_MULTI_PAGES 16
+#define BENCH_SLOTS 1024
+#define BENCH_ITERATIONS 200000
+
+static void *region_buffer;
+
+static E820h_MemMap *create_single_block_map(uint64_t base, uint64_t pages) {
+    E820h_MemMap *map =
+            munit_malloc(sizeof(E820h_MemMap) + sizeof(E820h_MemMapEntry));
+    map->num_entries = 1;
+    map->entries[0].type = MEM_MAP_ENTRY_AVAILABLE;
+    map->entries[0].base = base;
+    map->entries[0].length = pages << 12;
+    map->entries[0].attrs = 0;
+    return map;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void shuffle(uint64_t *pages, int count) {
+    for (int i = count - 1; i > 0; i--) {
+        int j = munit_rand_int_range(0, i);
+        uint64_t tmp = pages[i];
+        pages[i] = pages[j];
+        pages[j] = tmp;
+    }
+}
+
+/*
+ * Allocate every page, free them all again in random order, then see
+ * how many multi-page blocks can be had (and how quickly) from what is
+ * now a completely free - but fragmented - region.
+ */
+static MunitResult test_scattered_free(const MunitParameter params[],
+                                       void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, BENCH_PAGE_COUNT);
+    uint64_t *pages = munit_malloc(BENCH_PAGE_COUNT * sizeof(uint64_t));
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    for (int i = 0; i < BENCH_PAGE_COUNT; i++) {
+        pages[i] = page_alloc(region);
+        munit_assert_uint64(pages[i] & 0xFF, ==, 0);
+    }
+
+    shuffle(pages, BENCH_PAGE_COUNT);
+
+    double start = now_ns();
+
+    for (int i = 0; i < BENCH_PAGE_COUNT; i++) {
+        page_free(region, pages[i]);
+    }
+
+    double freed = now_ns();
+
+    munit_assert_uint64(region->free, ==, BENCH_PAGE_COUNT << 12);
+
+    int attempts = BENCH_PAGE_COUNT / BENCH_MULTI_PAGES;
+    int allocated = 0;
+
+    for (int i = 0; i < attempts; i++) {
+        if ((page_alloc_m(region, BENCH_MULTI_PAGES) & 0xFF) == 0) {
+            allocated++;
+        }
+    }
+
+    double end = now_ns();
+
+    munit_logf(MUNIT_LOG_INFO,
+               "%s: free %6.1f ns/page; alloc_m(%d) %8.1f ns/op, %d of %d "
+               "satisfied",
+               PMM_BACKEND_NAME, (freed - start) / BENCH_PAGE_COUNT,
+               BENCH_MULTI_PAGES, (end - freed) / attempts, allocated,
+               attempts);
+
+    free(pages);
+    free(map);
+    return MUNIT_OK;
+}
+
+/*
+ * Random mix of single and multi-page allocations and frees, keeping
+ * the region around half full - checks nothing is handed out twice,
+ * and reports how often multi-page requests fail.
+ */
+static MunitResult test_mixed_churn(const MunitParameter params[],
+                                    void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, BENCH_PAGE_COUNT);
+    uint64_t *slot_page = munit_calloc(BENCH_SLOTS, sizeof(uint64_t));
+    uint64_t *slot_count = munit_calloc(BENCH_SLOTS, sizeof(uint64_t));
+    uint8_t *owned = munit_calloc(BENCH_PAGE_COUNT, 1);
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    uint64_t multi_attempts = 0, multi_failures = 0, ops = 0;
+    double time = 0;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        int slot = munit_rand_int_range(0, BENCH_SLOTS - 1);
+
+        if (slot_count[slot]) {
+            for (uint64_t j = 0; j < slot_count[slot]; j++) {
+                uint64_t page = slot_page[slot] + (j << 12);
+                owned[(page - 0x100000) >> 12] = 0;
+
+                double start = now_ns();
+                page_free(region, page);
+                time += now_ns() - start;
+                ops++;
+            }
+
+            slot_count[slot] = 0;
+        } else {
+            // Mostly single pages, with the occasional bigger block
+            uint64_t count = munit_rand_int_range(0, 3)
+                                     ? 1
+                                     : 1 << munit_rand_int_range(1, 4);
+
+            double start = now_ns();
+            uint64_t page = count == 1 ? page_alloc(region)
+                                       : page_alloc_m(region, count);
+            time += now_ns() - start;
+            ops++;
+
+            if (count > 1) {
+                multi_attempts++;
+            }
+
+            if (page & 0xFF) {
+                if (count > 1) {
+                    multi_failures++;
+                }
+                continue;
+            }
+
+            for (uint64_t j = 0; j < count; j++) {
+                uint64_t idx = ((page - 0x100000) >> 12) + j;
+                munit_assert_uint64(idx, <, BENCH_PAGE_COUNT);
+                munit_assert_uint8(owned[idx], ==, 0);
+                owned[idx] = 1;
+            }
+
+            slot_page[slot] = page;
+            slot_count[slot] = count;
+        }
+    }
+
+    munit_logf(MUNIT_LOG_INFO,
+               "%s: %6.1f ns/op over %" PRIu64 " ops; %" PRIu64 " of %" PRIu64
+               " multi-page allocations failed",
+               PMM_BACKEND_NAME, time / ops, ops, multi_failures,
+               multi_attempts);
+
+    free(owned);
+    free(slot_count);
+    free(slot_page);
+    free(map);
+    return MUNIT_OK;
+}
+
+static void *setup(const MunitParameter params[], void *user_data) {
+    region_buffer = malloc(BENCH_BUFFER_SIZE > PMM_BUDDY_BUFFER_SIZE
+                                   ? BENCH_BUFFER_SIZE
+                                   : PMM_BUDDY_BUFFER_SIZE);
+    return NULL;
+}
+
+static void teardown(void *param) { free(region_buffer); }
+
+static MunitTest test_suite_tests[] = {
+        {(char *)"/scattered_free", test_scattered_free, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/mixed_churn", test_mixed_churn, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+};
+
+static const MunitSuite test_suite = {
+        (char *)"/pmm/fragmentation/" PMM_BACKEND_NAME, test_suite_tests, NULL,
+        1, MUNIT_SUITE_OPTION_NONE};
+
+int main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&test_suite, (void *)"µnit", argc, argv);
+}
@@ -5,10 +5,24 @@
  * Copyright (c) 2023 Ross Bamford
  */
 
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "pmm/pagealloc.h"
 #include "munit.h"
+#include "test_cpu.h"
+
+uint64_t test_pmm_region_locks();
+void test_pmm_reset_region_locks();
+
+#define STRESS_MAX_THREADS 8
+#define STRESS_PAGE_COUNT 0x1000
+#define STRESS_BURST 8
+#define STRESS_ITERATIONS 50000
 
 static void *region_buffer;
+static PerCPUPageCache cpu_caches[MAX_CPU_COUNT];
 
 static E820h_MemMap *create_mem_map(int num_entries) {
     E820h_MemMap *map = munit_malloc(sizeof(E820h_MemMap) +
@@ -816,7 +830,7 @@ test_alloc_page_m_not_top_split(const MunitParameter params[], void *param) {
     munit_assert_uint64(region->sp->size, ==, 0x1);
 
     // Alloc came from second entry, and split the remainder so one left
-    munit_assert_uint64((region->sp - 1)->base, ==, 0x9000);
+    munit_assert_uint64((region->sp - 1)->base, ==, 0xa000);
     munit_assert_uint64((region->sp - 1)->size, ==, 0x1);
 
     // Third entry is still at 0, still one page
@@ -913,6 +927,83 @@ static MunitResult test_alloc_page_m_top_remove(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+static MunitResult test_alloc_aligned_split(const MunitParameter params[],
+                                            void *param) {
+    E820h_MemMapEntry entry0 = {.type = MEM_MAP_ENTRY_AVAILABLE,
+                                .base = 0x0000000000001000,
+                                .length = 0x0000000000400000,
+                                .attrs = 0};
+    E820h_MemMap *map = create_mem_map(1);
+    map->entries[0] = entry0;
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    uint64_t page = page_alloc_aligned(region, 0x200, 0x200000);
+    munit_assert_uint64(page, ==, 0x200000);
+
+    munit_assert_uint64(region->size, ==, 0x400000);
+    munit_assert_uint64(region->free, ==, 0x200000);
+
+    // Tail after the allocation was stacked as a new block...
+    munit_assert_uint64(region->sp->base, ==, 0x400000);
+    munit_assert_uint64(region->sp->size, ==, 0x1);
+
+    // ... and the head stays where it was
+    munit_assert_uint64((region->sp - 1)->base, ==, 0x1000);
+    munit_assert_uint64((region->sp - 1)->size, ==, 0x1ff);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_alloc_aligned_exact(const MunitParameter params[],
+                                            void *param) {
+    E820h_MemMapEntry entry0 = {.type = MEM_MAP_ENTRY_AVAILABLE,
+                                .base = 0x0000000000200000,
+                                .length = 0x0000000000200000,
+                                .attrs = 0};
+    E820h_MemMap *map = create_mem_map(1);
+    map->entries[0] = entry0;
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    uint64_t page = page_alloc_aligned(region, 0x200, 0x200000);
+    munit_assert_uint64(page, ==, 0x200000);
+
+    // Stack is now empty
+    munit_assert_ptr_equal(region->sp, stack_base(region));
+    munit_assert_uint64(region->free, ==, 0);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_alloc_aligned_none(const MunitParameter params[],
+                                           void *param) {
+    E820h_MemMapEntry entry0 = {.type = MEM_MAP_ENTRY_AVAILABLE,
+                                .base = 0x0000000000001000,
+                                .length = 0x0000000000200000,
+                                .attrs = 0};
+    E820h_MemMap *map = create_mem_map(1);
+    map->entries[0] = entry0;
+
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    // 2MiB of pages, but not 2MiB aligned
+    uint64_t page = page_alloc_aligned(region, 0x200, 0x200000);
+    munit_assert_uint64(page & 0xFF, ==, 0xFF);
+    munit_assert_uint64(region->free, ==, 0x200000);
+
+    // Bad alignments are rejected
+    page = page_alloc_aligned(region, 1, 0x1800);
+    munit_assert_uint64(page & 0xFF, ==, 0xFF);
+    page = page_alloc_aligned(region, 1, 0x800);
+    munit_assert_uint64(page & 0xFF, ==, 0xFF);
+
+    free(map);
+    return MUNIT_OK;
+}
+
 static MunitResult test_free_page(const MunitParameter params[], void *param) {
     E820h_MemMapEntry entry0 = {.type = MEM_MAP_ENTRY_AVAILABLE,
                                 .base = 0x0000000000000000,
@@ -1088,6 +1179,375 @@ test_free_contig_pages_backward(const MunitParameter params[], void *param) {
     return MUNIT_OK;
 }
 
+static E820h_MemMap *create_single_block_map(uint64_t base,
+                                             uint64_t page_count) {
+    E820h_MemMap *map = create_mem_map(1);
+    map->entries[0].type = MEM_MAP_ENTRY_AVAILABLE;
+    map->entries[0].base = base;
+    map->entries[0].length = page_count << 12;
+    map->entries[0].attrs = 0;
+    return map;
+}
+
+static MunitResult test_cpu_cache_init(const MunitParameter params[],
+                                       void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, 64);
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    // No caches by default
+    munit_assert_ptr_null(region->cpu_caches);
+
+    cpu_caches[3].count = 10;
+    page_alloc_init_cpu_caches(region, cpu_caches);
+
+    // Caches are hooked up, and all empty
+    munit_assert_ptr_equal(region->cpu_caches, cpu_caches);
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        munit_assert_uint64(cpu_caches[i].count, ==, 0);
+    }
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_cpu_cache_alloc_refills(const MunitParameter params[],
+                                                void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, 64);
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+    page_alloc_init_cpu_caches(region, cpu_caches);
+
+    uint64_t page = page_alloc(region);
+
+    // A page was allocated...
+    munit_assert_uint64(page & 0xFFF, ==, 0);
+    munit_assert_uint64(page, >=, 0x100000);
+    munit_assert_uint64(page, <, 0x140000);
+
+    // ... and a whole batch came off the shared stack
+    munit_assert_uint64(region->free, ==,
+                        (64 - PMM_CPU_CACHE_BATCH) << 12);
+    munit_assert_uint64(cpu_caches[0].count, ==, PMM_CPU_CACHE_BATCH - 1);
+
+    // Next allocations come from the cache, shared stack is untouched
+    for (int i = 0; i < PMM_CPU_CACHE_BATCH - 1; i++) {
+        uint64_t next = page_alloc(region);
+        munit_assert_uint64(next & 0xFFF, ==, 0);
+        munit_assert_uint64(next, !=, page);
+    }
+
+    munit_assert_uint64(cpu_caches[0].count, ==, 0);
+    munit_assert_uint64(region->free, ==,
+                        (64 - PMM_CPU_CACHE_BATCH) << 12);
+
+    // And the one after that refills again
+    page_alloc(region);
+    munit_assert_uint64(region->free, ==,
+                        (64 - PMM_CPU_CACHE_BATCH * 2) << 12);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_cpu_cache_free_to_cache(const MunitParameter params[],
+                                                void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, 64);
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+    page_alloc_init_cpu_caches(region, cpu_caches);
+
+    uint64_t page = page_alloc(region);
+    uint64_t free_before = region->free;
+    MemoryBlock *sp_before = region->sp;
+
+    page_free(region, page);
+
+    // Went to the cache, not the shared stack
+    munit_assert_uint64(cpu_caches[0].count, ==, PMM_CPU_CACHE_BATCH);
+    munit_assert_uint64(region->free, ==, free_before);
+    munit_assert_ptr_equal(region->sp, sp_before);
+
+    // And is the next one handed out (it's hot...)
+    munit_assert_uint64(page_alloc(region), ==, page);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_cpu_cache_drain_when_full(const MunitParameter params[],
+                                                  void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, 64);
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+    page_alloc_init_cpu_caches(region, cpu_caches);
+
+    uint64_t pages[64];
+    for (int i = 0; i < 64; i++) {
+        pages[i] = page_alloc(region);
+        munit_assert_uint64(pages[i] & 0xFFF, ==, 0);
+    }
+
+    // Everything is allocated
+    munit_assert_uint64(region->free, ==, 0);
+    munit_assert_uint64(cpu_caches[0].count, ==, 0);
+    munit_assert_uint64(page_alloc(region) & 0xFF, ==, 0xFF);
+
+    // Fill the cache
+    for (int i = 0; i < PMM_CPU_CACHE_SIZE; i++) {
+        page_free(region, pages[i]);
+    }
+
+    munit_assert_uint64(cpu_caches[0].count, ==, PMM_CPU_CACHE_SIZE);
+    munit_assert_uint64(region->free, ==, 0);
+
+    // One more drains a batch back to the shared stack
+    page_free(region, pages[PMM_CPU_CACHE_SIZE]);
+
+    munit_assert_uint64(cpu_caches[0].count, ==,
+                        PMM_CPU_CACHE_SIZE - PMM_CPU_CACHE_BATCH + 1);
+    munit_assert_uint64(region->free, ==, PMM_CPU_CACHE_BATCH << 12);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_cpu_cache_per_cpu(const MunitParameter params[],
+                                          void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, 64);
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+    page_alloc_init_cpu_caches(region, cpu_caches);
+
+    test_cpu_set_current_id(0);
+    uint64_t page0 = page_alloc(region);
+
+    test_cpu_set_current_id(1);
+    uint64_t page1 = page_alloc(region);
+
+    test_cpu_set_current_id(0);
+
+    // Each CPU refilled its own cache
+    munit_assert_uint64(page0, !=, page1);
+    munit_assert_uint64(cpu_caches[0].count, ==, PMM_CPU_CACHE_BATCH - 1);
+    munit_assert_uint64(cpu_caches[1].count, ==, PMM_CPU_CACHE_BATCH - 1);
+    munit_assert_uint64(region->free, ==,
+                        (64 - PMM_CPU_CACHE_BATCH * 2) << 12);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_cpu_cache_starved(const MunitParameter params[],
+                                          void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000,
+                                                PMM_CPU_CACHE_BATCH * 2);
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+    page_alloc_init_cpu_caches(region, cpu_caches);
+
+    test_cpu_set_current_id(1);
+    uint64_t page1 = page_alloc(region);
+
+    // CPU 0 takes everything else the backend has...
+    test_cpu_set_current_id(0);
+    for (int i = 0; i < PMM_CPU_CACHE_BATCH; i++) {
+        munit_assert_uint64(page_alloc(region) & 0xFF, ==, 0);
+    }
+
+    // ... so can't get any more while CPU 1 is sitting on some, but asks
+    // it to give them back
+    munit_assert_uint64(page_alloc(region), ==, 0xFF);
+    munit_assert_true(cpu_caches[1].drain);
+    munit_assert_false(cpu_caches[0].drain);
+
+    // Which it does, next time it frees (or allocates)
+    test_cpu_set_current_id(1);
+    page_free(region, page1);
+
+    munit_assert_false(cpu_caches[1].drain);
+    munit_assert_uint64(cpu_caches[1].count, ==, 0);
+    munit_assert_uint64(region->free, ==, PMM_CPU_CACHE_BATCH << 12);
+
+    test_cpu_set_current_id(0);
+    munit_assert_uint64(page_alloc(region) & 0xFF, ==, 0);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_cpu_cache_drain(const MunitParameter params[],
+                                        void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, 64);
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+    page_alloc_init_cpu_caches(region, cpu_caches);
+
+    uint64_t page = page_alloc(region);
+    page_free(region, page);
+
+    page_alloc_drain_cpu_cache(region);
+
+    // Everything is back on the shared stack, and coalesced back
+    // into a single block
+    munit_assert_uint64(cpu_caches[0].count, ==, 0);
+    munit_assert_uint64(region->free, ==, 64 << 12);
+    munit_assert_ptr_equal(region->sp, region + 1);
+    munit_assert_uint64(region->sp->base, ==, 0x100000);
+    munit_assert_uint64(region->sp->size, ==, 64);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_cpu_cache_drain_none(const MunitParameter params[],
+                                             void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, 64);
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+
+    // Noop without caches
+    page_alloc_drain_cpu_cache(region);
+    munit_assert_uint64(region->free, ==, 64 << 12);
+
+    free(map);
+    return MUNIT_OK;
+}
+
+typedef struct {
+    MemoryRegion *region;
+    uint8_t cpu;
+    uint8_t *owners;
+    uint64_t iterations;
+    bool failed;
+} StressThreadArgs;
+
+static void *stress_thread_func(void *arg) {
+    StressThreadArgs *args = (StressThreadArgs *)arg;
+    uint64_t pages[STRESS_BURST];
+
+    test_cpu_set_current_id(args->cpu);
+
+    for (uint64_t i = 0; i < args->iterations; i++) {
+        for (int j = 0; j < STRESS_BURST; j++) {
+            pages[j] = page_alloc(args->region);
+
+            if (pages[j] & 0xFF) {
+                args->failed = true;
+                return NULL;
+            }
+
+            if (args->owners) {
+                uint8_t *owner = &args->owners[(pages[j] >> 12) -
+                                                (0x100000 >> 12)];
+                if (__atomic_exchange_n(owner, 1, __ATOMIC_RELAXED) != 0) {
+                    // Page handed out twice!
+                    args->failed = true;
+                    return NULL;
+                }
+            }
+        }
+
+        for (int j = 0; j < STRESS_BURST; j++) {
+            if (args->owners) {
+                __atomic_store_n(&args->owners[(pages[j] >> 12) -
+                                               (0x100000 >> 12)],
+                                 0, __ATOMIC_RELAXED);
+            }
+
+            page_free(args->region, pages[j]);
+        }
+    }
+
+    page_alloc_drain_cpu_cache(args->region);
+    return NULL;
+}
+
+// Runs the stress workload, returns elapsed time in seconds
+static double run_stress(MemoryRegion *region, int thread_count,
+                         uint8_t *owners, uint64_t iterations) {
+    pthread_t threads[STRESS_MAX_THREADS];
+    StressThreadArgs args[STRESS_MAX_THREADS];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < thread_count; i++) {
+        args[i].region = region;
+        args[i].cpu = i;
+        args[i].owners = owners;
+        args[i].iterations = iterations;
+        args[i].failed = false;
+        pthread_create(&threads[i], NULL, stress_thread_func, &args[i]);
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+        munit_assert_false(args[i].failed);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static MunitResult test_cpu_cache_stress_correct(const MunitParameter params[],
+                                                 void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, STRESS_PAGE_COUNT);
+    MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+    page_alloc_init_cpu_caches(region, cpu_caches);
+
+    uint8_t *owners = calloc(STRESS_PAGE_COUNT, 1);
+
+    run_stress(region, STRESS_MAX_THREADS, owners, STRESS_ITERATIONS / 10);
+
+    // Every page came back once all the caches were drained
+    munit_assert_uint64(region->free, ==, STRESS_PAGE_COUNT << 12);
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        munit_assert_uint64(cpu_caches[i].count, ==, 0);
+    }
+
+    free(owners);
+    free(map);
+    return MUNIT_OK;
+}
+
+static MunitResult test_cpu_cache_stress_scaling(const MunitParameter params[],
+                                                 void *param) {
+    E820h_MemMap *map = create_single_block_map(0x100000, STRESS_PAGE_COUNT);
+
+    // More spinning threads than CPUs just measures the host scheduler
+    // (and with a fair lock, one descheduled waiter holds up everyone
+    // queued behind it), so only go up to the number we've actually got
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus < STRESS_MAX_THREADS ? cpus : STRESS_MAX_THREADS;
+
+    for (int threads = 1; threads <= max_threads; threads <<= 1) {
+        double ops = (double)threads * STRESS_ITERATIONS * STRESS_BURST * 2;
+
+        MemoryRegion *region = page_alloc_init(map, 0, region_buffer);
+        test_pmm_reset_region_locks();
+        double locked = run_stress(region, threads, NULL, STRESS_ITERATIONS);
+        uint64_t locked_locks = test_pmm_region_locks();
+        munit_assert_uint64(region->free, ==, STRESS_PAGE_COUNT << 12);
+
+        region = page_alloc_init(map, 0, region_buffer);
+        page_alloc_init_cpu_caches(region, cpu_caches);
+        test_pmm_reset_region_locks();
+        double cached = run_stress(region, threads, NULL, STRESS_ITERATIONS);
+        uint64_t cached_locks = test_pmm_region_locks();
+        munit_assert_uint64(region->free, ==, STRESS_PAGE_COUNT << 12);
+
+        // Timings are just for information (they're at the mercy of the
+        // host) - what the caches are for is taking the lock less...
+        munit_logf(MUNIT_LOG_INFO,
+                   "%d thread(s): shared stack %7.2f Mops/s (%lu locks); "
+                   "per-CPU cache %7.2f Mops/s (%lu locks)",
+                   threads, ops / locked / 1e6, locked_locks,
+                   ops / cached / 1e6, cached_locks);
+
+        // ... which, at worst, they take once per batch
+        munit_assert_uint64(locked_locks, ==, (uint64_t)ops);
+        munit_assert_uint64(cached_locks * PMM_CPU_CACHE_BATCH, <=,
+                            locked_locks);
+    }
+
+    free(map);
+    return MUNIT_OK;
+}
+
 static void *setup(const MunitParameter params[], void *user_data) {
     region_buffer = malloc(0x100000);
     return NULL;
@@ -1169,6 +1629,13 @@ static MunitTest test_suite_tests[] = {
         {(char *)"/alloc_m_top_remove", test_alloc_page_m_top_remove, setup,
          teardown, MUNIT_TEST_OPTION_NONE, NULL},
 
+        {(char *)"/alloc_aligned_split", test_alloc_aligned_split, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/alloc_aligned_exact", test_alloc_aligned_exact, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/alloc_aligned_none", test_alloc_aligned_none, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
         {(char *)"/free_page", test_free_page, setup, teardown,
          MUNIT_TEST_OPTION_NONE, NULL},
         {(char *)"/free_unaligned", test_free_unaligned_page, setup, teardown,
@@ -1178,6 +1645,27 @@ static MunitTest test_suite_tests[] = {
         {(char *)"/free_contig_bwd", test_free_contig_pages_backward, setup,
          teardown, MUNIT_TEST_OPTION_NONE, NULL},
 
+        {(char *)"/cpu_cache/init", test_cpu_cache_init, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cpu_cache/alloc_refills", test_cpu_cache_alloc_refills,
+         setup, teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cpu_cache/free_to_cache", test_cpu_cache_free_to_cache,
+         setup, teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cpu_cache/drain_when_full", test_cpu_cache_drain_when_full,
+         setup, teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cpu_cache/per_cpu", test_cpu_cache_per_cpu, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cpu_cache/starved", test_cpu_cache_starved, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cpu_cache/drain", test_cpu_cache_drain, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cpu_cache/drain_none", test_cpu_cache_drain_none, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cpu_cache/stress_correct", test_cpu_cache_stress_correct,
+         setup, teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cpu_cache/stress_scaling", test_cpu_cache_stress_scaling,
+         setup, teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
         {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
 };
 
@@ -0,0 +1,295 @@
+/*
+ * Tests for reader-writer spinlocks
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "munit.h"
+#include "rwlock.h"
+#include "spinlock.h"
+#include "test_cpu.h"
+
+#define THREAD_COUNT 8
+#define THREAD_ITERATIONS 500
+
+#define BENCH_MAX_THREADS 8
+#define BENCH_OPS 200000
+
+typedef struct {
+    RwSpinLock lock;
+    uint64_t a;
+    uint64_t b;
+} Shared;
+
+typedef struct {
+    Shared *shared;
+    uint8_t cpu;
+    bool writer;
+    bool failed;
+} ThreadArgs;
+
+static MunitResult test_rwlock_init(const MunitParameter params[],
+                                    void *param) {
+    static RwSpinLock lock;
+
+    lock.writer.lock = 0xffffffffffffffff;
+    lock.writing = 1;
+    lock.readers[3].count = 42;
+
+    rwlock_init(&lock);
+
+    munit_assert_uint64(lock.writer.lock, ==, 0);
+    munit_assert_uint64(lock.writing, ==, 0);
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        munit_assert_uint64(lock.readers[i].count, ==, 0);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_rwlock_read_lock_unlock(const MunitParameter params[],
+                                                void *param) {
+    static RwSpinLock lock;
+
+    test_cpu_set_current_id(2);
+
+    uint64_t flags = rwlock_read_lock(&lock);
+
+    // Counted on this CPU only, and interrupts are off
+    munit_assert_false(test_cpu_interrupts_enabled());
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        munit_assert_uint64(lock.readers[i].count, ==, i == 2 ? 1 : 0);
+    }
+
+    rwlock_read_unlock(&lock, flags);
+
+    munit_assert_true(test_cpu_interrupts_enabled());
+    munit_assert_uint64(lock.readers[2].count, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_rwlock_many_readers(const MunitParameter params[],
+                                            void *param) {
+    static RwSpinLock lock;
+    uint64_t flags[MAX_CPU_COUNT];
+
+    // Every CPU can read at once
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        test_cpu_set_current_id(i);
+        flags[i] = rwlock_read_lock(&lock);
+        munit_assert_uint64(lock.readers[i].count, ==, 1);
+    }
+
+    for (int i = MAX_CPU_COUNT - 1; i >= 0; i--) {
+        test_cpu_set_current_id(i);
+        rwlock_read_unlock(&lock, flags[i]);
+        munit_assert_uint64(lock.readers[i].count, ==, 0);
+    }
+
+    munit_assert_true(test_cpu_interrupts_enabled());
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_rwlock_write_lock_unlock(const MunitParameter params[],
+                                                 void *param) {
+    static RwSpinLock lock;
+
+    uint64_t flags = rwlock_write_lock(&lock);
+
+    munit_assert_false(test_cpu_interrupts_enabled());
+    munit_assert_uint64(lock.writing, ==, 1);
+
+    rwlock_write_unlock(&lock, flags);
+
+    munit_assert_true(test_cpu_interrupts_enabled());
+    munit_assert_uint64(lock.writing, ==, 0);
+
+    // And again, to check the writer lock was released
+    flags = rwlock_write_lock(&lock);
+    rwlock_write_unlock(&lock, flags);
+
+    munit_assert_uint64(lock.writing, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static void *rwlock_thread_func(void *arg) {
+    ThreadArgs *args = (ThreadArgs *)arg;
+    Shared *shared = args->shared;
+
+    test_cpu_set_current_id(args->cpu);
+
+    for (int i = 0; i < THREAD_ITERATIONS; i++) {
+        if (args->writer) {
+            uint64_t flags = rwlock_write_lock(&shared->lock);
+            shared->a++;
+            shared->b++;
+            rwlock_write_unlock(&shared->lock, flags);
+        } else {
+            uint64_t flags = rwlock_read_lock(&shared->lock);
+            uint64_t a = shared->a;
+            sched_yield(); // give a writer the chance to try its luck
+            uint64_t b = shared->b;
+            rwlock_read_unlock(&shared->lock, flags);
+
+            if (a != b) {
+                // Saw a write half-done!
+                args->failed = true;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static MunitResult test_rwlock_multithreaded(const MunitParameter params[],
+                                             void *param) {
+    static Shared shared;
+    pthread_t threads[THREAD_COUNT];
+    ThreadArgs args[THREAD_COUNT];
+
+    // Two writers, the rest readers, each on its own "CPU"
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        args[i].shared = &shared;
+        args[i].cpu = i;
+        args[i].writer = i < 2;
+        args[i].failed = false;
+        pthread_create(&threads[i], NULL, rwlock_thread_func, &args[i]);
+    }
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+        munit_assert_false(args[i].failed);
+    }
+
+    munit_assert_uint64(shared.a, ==, 2 * THREAD_ITERATIONS);
+    munit_assert_uint64(shared.b, ==, 2 * THREAD_ITERATIONS);
+    munit_assert_uint64(shared.lock.writing, ==, 0);
+    for (int i = 0; i < MAX_CPU_COUNT; i++) {
+        munit_assert_uint64(shared.lock.readers[i].count, ==, 0);
+    }
+
+    return MUNIT_OK;
+}
+
+typedef struct {
+    RwSpinLock rwlock;
+    SpinLock spinlock;
+    bool use_rwlock;
+    uint64_t value;
+} BenchLock;
+
+typedef struct {
+    BenchLock *lock;
+    uint8_t cpu;
+    uint64_t sum;
+} BenchThread;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *bench_thread_func(void *arg) {
+    BenchThread *thread = (BenchThread *)arg;
+    BenchLock *lock = thread->lock;
+
+    test_cpu_set_current_id(thread->cpu);
+
+    for (int i = 0; i < BENCH_OPS; i++) {
+        if (lock->use_rwlock) {
+            uint64_t flags = rwlock_read_lock(&lock->rwlock);
+            thread->sum += lock->value;
+            rwlock_read_unlock(&lock->rwlock, flags);
+        } else {
+            spinlock_lock(&lock->spinlock);
+            thread->sum += lock->value;
+            spinlock_unlock(&lock->spinlock);
+        }
+    }
+
+    return NULL;
+}
+
+static double bench_readers(BenchLock *lock, int count) {
+    pthread_t threads[BENCH_MAX_THREADS];
+    BenchThread args[BENCH_MAX_THREADS];
+
+    double start = now_ns();
+
+    for (int i = 0; i < count; i++) {
+        args[i].lock = lock;
+        args[i].cpu = i;
+        args[i].sum = 0;
+        pthread_create(&threads[i], NULL, bench_thread_func, &args[i]);
+    }
+
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+        munit_assert_uint64(args[i].sum, ==, lock->value * BENCH_OPS);
+    }
+
+    return (double)count * BENCH_OPS / ((now_ns() - start) / 1e3);
+}
+
+static MunitResult test_rwlock_bench_readers(const MunitParameter params[],
+                                             void *param) {
+    static BenchLock lock;
+    lock.value = 7;
+
+    // More spinning threads than CPUs just measures the host scheduler,
+    // so only go up to the number we've actually got...
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus < BENCH_MAX_THREADS ? cpus : BENCH_MAX_THREADS;
+
+    for (int count = 1; count <= max_threads; count *= 2) {
+        lock.use_rwlock = false;
+        double exclusive = bench_readers(&lock, count);
+
+        lock.use_rwlock = true;
+        double shared = bench_readers(&lock, count);
+
+        munit_logf(MUNIT_LOG_INFO,
+                   "%d reader(s): spinlock %7.2f reads/us; rwlock %7.2f "
+                   "reads/us",
+                   count, exclusive, shared);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitTest test_suite_tests[] = {
+        {(char *)"/init", test_rwlock_init, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+         NULL},
+        {(char *)"/read_lock_unlock", test_rwlock_read_lock_unlock, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/many_readers", test_rwlock_many_readers, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/write_lock_unlock", test_rwlock_write_lock_unlock, NULL,
+         NULL, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/multithreaded", test_rwlock_multithreaded, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/bench/readers", test_rwlock_bench_readers, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+};
+
+static const MunitSuite test_suite = {(char *)"/rwlock", test_suite_tests,
+                                      NULL, 1, MUNIT_SUITE_OPTION_NONE};
+
+int main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&test_suite, (void *)"µnit", argc, argv);
+}
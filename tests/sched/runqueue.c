@@ -0,0 +1,346 @@
+/*
+ * Tests for the scheduler run queues
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "munit.h"
+#include "sched/runqueue.h"
+#include "task.h"
+
+#define THREAD_COUNT 4
+#define TASKS_PER_THREAD 1000
+
+static MunitResult test_runqueue_init(const MunitParameter params[],
+                                      void *param) {
+    RunQueue queue;
+    Task task;
+
+    queue.head = &task;
+    queue.tail = &task;
+    queue.count = 42;
+
+    runqueue_init(&queue);
+
+    munit_assert_ptr_null(queue.head);
+    munit_assert_ptr_null(queue.tail);
+    munit_assert_uint64(queue.count, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_runqueue_dequeue_empty(const MunitParameter params[],
+                                               void *param) {
+    RunQueue queue = {0};
+
+    munit_assert_ptr_null(runqueue_dequeue(&queue));
+    munit_assert_uint64(queue.count, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_runqueue_enqueue_one(const MunitParameter params[],
+                                             void *param) {
+    RunQueue queue = {0};
+    Task task = {0};
+
+    // Stale link shouldn't end up in the queue
+    task.this.next = (ListNode *)&queue;
+
+    runqueue_enqueue(&queue, &task);
+
+    munit_assert_ptr_equal(queue.head, &task);
+    munit_assert_ptr_equal(queue.tail, &task);
+    munit_assert_ptr_null(task.this.next);
+    munit_assert_uint64(queue.count, ==, 1);
+
+    munit_assert_ptr_equal(runqueue_dequeue(&queue), &task);
+
+    munit_assert_ptr_null(queue.head);
+    munit_assert_ptr_null(queue.tail);
+    munit_assert_uint64(queue.count, ==, 0);
+
+    munit_assert_ptr_null(runqueue_dequeue(&queue));
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_runqueue_fifo(const MunitParameter params[],
+                                      void *param) {
+    RunQueue queue = {0};
+    Task tasks[5] = {0};
+
+    for (int i = 0; i < 5; i++) {
+        runqueue_enqueue(&queue, &tasks[i]);
+        munit_assert_uint64(queue.count, ==, i + 1);
+    }
+
+    munit_assert_ptr_equal(queue.head, &tasks[0]);
+    munit_assert_ptr_equal(queue.tail, &tasks[4]);
+
+    for (int i = 0; i < 5; i++) {
+        Task *task = runqueue_dequeue(&queue);
+        munit_assert_ptr_equal(task, &tasks[i]);
+        munit_assert_ptr_null(task->this.next);
+    }
+
+    munit_assert_uint64(queue.count, ==, 0);
+    munit_assert_ptr_null(runqueue_dequeue(&queue));
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_runqueue_round_robin(const MunitParameter params[],
+                                             void *param) {
+    RunQueue queue = {0};
+    Task tasks[3] = {0};
+
+    for (int i = 0; i < 3; i++) {
+        runqueue_enqueue(&queue, &tasks[i]);
+    }
+
+    // Taking from the head and putting back at the tail goes round
+    for (int i = 0; i < 10; i++) {
+        Task *task = runqueue_dequeue(&queue);
+        munit_assert_ptr_equal(task, &tasks[i % 3]);
+        runqueue_enqueue(&queue, task);
+        munit_assert_uint64(queue.count, ==, 3);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_runqueue_steal_empty(const MunitParameter params[],
+                                             void *param) {
+    RunQueue queue = {0};
+
+    munit_assert_ptr_null(runqueue_try_steal(&queue, UINT64_MAX));
+    munit_assert_uint64(queue.count, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_runqueue_steal_head(const MunitParameter params[],
+                                            void *param) {
+    RunQueue queue = {0};
+    Task tasks[3] = {0};
+
+    for (int i = 0; i < 3; i++) {
+        runqueue_enqueue(&queue, &tasks[i]);
+    }
+
+    // Thieves take the one that's waited longest, same as the owner
+    Task *task = runqueue_try_steal(&queue, UINT64_MAX);
+    munit_assert_ptr_equal(task, &tasks[0]);
+    munit_assert_ptr_null(task->this.next);
+    munit_assert_uint64(runqueue_length(&queue), ==, 2);
+
+    munit_assert_ptr_equal(runqueue_dequeue(&queue), &tasks[1]);
+    munit_assert_ptr_equal(runqueue_try_steal(&queue, UINT64_MAX), &tasks[2]);
+
+    munit_assert_ptr_null(queue.head);
+    munit_assert_ptr_null(queue.tail);
+    munit_assert_uint64(runqueue_length(&queue), ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_runqueue_steal_hot(const MunitParameter params[],
+                                           void *param) {
+    RunQueue queue = {0};
+    Task task = {0};
+
+    task.last_ran = 100;
+    runqueue_enqueue(&queue, &task);
+
+    // Ran too recently, so it stays put
+    munit_assert_ptr_null(runqueue_try_steal(&queue, 99));
+    munit_assert_uint64(runqueue_length(&queue), ==, 1);
+
+    munit_assert_ptr_equal(runqueue_try_steal(&queue, 100), &task);
+    munit_assert_uint64(runqueue_length(&queue), ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_runqueue_steal_locked(const MunitParameter params[],
+                                              void *param) {
+    RunQueue queue = {0};
+    Task task = {0};
+
+    runqueue_enqueue(&queue, &task);
+
+    // Owner has the lock - thief gives up rather than wait
+    spinlock_lock(&queue.lock);
+    munit_assert_ptr_null(runqueue_try_steal(&queue, UINT64_MAX));
+    spinlock_unlock(&queue.lock);
+
+    munit_assert_ptr_equal(runqueue_try_steal(&queue, UINT64_MAX), &task);
+
+    return MUNIT_OK;
+}
+
+typedef struct {
+    RunQueue *queue;
+    Task *tasks;
+    uint64_t taken;
+} ThreadArgs;
+
+static void *runqueue_thread_func(void *arg) {
+    ThreadArgs *args = (ThreadArgs *)arg;
+
+    for (int i = 0; i < TASKS_PER_THREAD; i++) {
+        runqueue_enqueue(args->queue, &args->tasks[i]);
+
+        if (i & 1) {
+            if (runqueue_dequeue(args->queue)) {
+                args->taken++;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static MunitResult test_runqueue_multithreaded(const MunitParameter params[],
+                                               void *param) {
+    static RunQueue queue;
+    static Task tasks[THREAD_COUNT][TASKS_PER_THREAD];
+    pthread_t threads[THREAD_COUNT];
+    ThreadArgs args[THREAD_COUNT];
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        args[i].queue = &queue;
+        args[i].tasks = tasks[i];
+        args[i].taken = 0;
+        pthread_create(&threads[i], NULL, runqueue_thread_func, &args[i]);
+    }
+
+    uint64_t taken = 0;
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+        taken += args[i].taken;
+    }
+
+    // Everything put in is either taken already, or still queued
+    uint64_t remaining = 0;
+    while (runqueue_dequeue(&queue)) {
+        remaining++;
+    }
+
+    munit_assert_uint64(taken + remaining, ==,
+                        THREAD_COUNT * TASKS_PER_THREAD);
+    munit_assert_uint64(queue.count, ==, 0);
+    munit_assert_ptr_null(queue.tail);
+
+    return MUNIT_OK;
+}
+
+static bool thieves_stop;
+
+static void *runqueue_thief_func(void *arg) {
+    ThreadArgs *args = (ThreadArgs *)arg;
+
+    while (!__atomic_load_n(&thieves_stop, __ATOMIC_ACQUIRE)) {
+        if (runqueue_try_steal(args->queue, UINT64_MAX)) {
+            args->taken++;
+        }
+    }
+
+    return NULL;
+}
+
+static MunitResult test_runqueue_steal_multithreaded(
+        const MunitParameter params[], void *param) {
+    static RunQueue queue;
+    static Task tasks[TASKS_PER_THREAD];
+    pthread_t threads[THREAD_COUNT];
+    ThreadArgs args[THREAD_COUNT];
+
+    runqueue_init(&queue);
+    thieves_stop = false;
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        args[i].queue = &queue;
+        args[i].tasks = NULL;
+        args[i].taken = 0;
+        pthread_create(&threads[i], NULL, runqueue_thief_func, &args[i]);
+    }
+
+    // Owner keeps going round while the thieves pick tasks off
+    uint64_t taken = 0;
+
+    for (int i = 0; i < TASKS_PER_THREAD; i++) {
+        runqueue_enqueue(&queue, &tasks[i]);
+
+        Task *task = runqueue_dequeue(&queue);
+        if (task) {
+            if (i & 1) {
+                taken++;
+            } else {
+                runqueue_enqueue(&queue, task);
+            }
+        }
+    }
+
+    __atomic_store_n(&thieves_stop, true, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+        taken += args[i].taken;
+    }
+
+    uint64_t remaining = 0;
+    while (runqueue_dequeue(&queue)) {
+        remaining++;
+    }
+
+    // Nothing lost, nothing taken twice
+    munit_assert_uint64(taken + remaining, ==, TASKS_PER_THREAD);
+    munit_assert_uint64(queue.count, ==, 0);
+    munit_assert_ptr_null(queue.tail);
+
+    return MUNIT_OK;
+}
+
+static MunitTest test_suite_tests[] = {
+        {(char *)"/init", test_runqueue_init, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/dequeue_empty", test_runqueue_dequeue_empty, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/enqueue_one", test_runqueue_enqueue_one, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/fifo", test_runqueue_fifo, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/round_robin", test_runqueue_round_robin, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/multithreaded", test_runqueue_multithreaded, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/steal_empty", test_runqueue_steal_empty, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/steal_head", test_runqueue_steal_head, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/steal_hot", test_runqueue_steal_hot, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/steal_locked", test_runqueue_steal_locked, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/steal_multithreaded", test_runqueue_steal_multithreaded,
+         NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+};
+
+static const MunitSuite test_suite = {(char *)"/sched/runqueue",
+                                      test_suite_tests, NULL, 1,
+                                      MUNIT_SUITE_OPTION_NONE};
+
+int main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&test_suite, (void *)"µnit", argc, argv);
+}
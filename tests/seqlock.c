@@ -0,0 +1,208 @@
+/*
+ * Tests for sequence locks
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+
+#include "munit.h"
+#include "seqlock.h"
+#include "test_cpu.h"
+
+#define READER_COUNT 4
+#define WRITER_ITERATIONS 20000
+
+typedef struct {
+    SeqLock lock;
+    uint64_t a;
+    uint64_t b;
+    bool done;
+} Record;
+
+typedef struct {
+    Record *record;
+    uint64_t reads;
+    uint64_t retries;
+    bool failed;
+} ReaderArgs;
+
+static MunitResult test_seqlock_init(const MunitParameter params[],
+                                     void *param) {
+    SeqLock lock;
+
+    lock.sequence = 0xffffffffffffffff;
+    lock.writer.lock = 0xffffffffffffffff;
+
+    seqlock_init(&lock);
+
+    munit_assert_uint64(lock.sequence, ==, 0);
+    munit_assert_uint64(lock.writer.lock, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_seqlock_read_no_writer(const MunitParameter params[],
+                                               void *param) {
+    SeqLock lock = {0};
+
+    uint64_t seq = seqlock_read_begin(&lock);
+
+    munit_assert_uint64(seq, ==, 0);
+    munit_assert_false(seqlock_read_retry(&lock, seq));
+
+    // Reading didn't write anything
+    munit_assert_uint64(lock.sequence, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_seqlock_write(const MunitParameter params[],
+                                      void *param) {
+    SeqLock lock = {0};
+
+    uint64_t flags = seqlock_write_begin(&lock);
+
+    // Odd while writing, with interrupts off
+    munit_assert_uint64(lock.sequence, ==, 1);
+    munit_assert_false(test_cpu_interrupts_enabled());
+
+    seqlock_write_end(&lock, flags);
+
+    munit_assert_uint64(lock.sequence, ==, 2);
+    munit_assert_true(test_cpu_interrupts_enabled());
+
+    // Writer lock was released
+    flags = seqlock_write_begin(&lock);
+    seqlock_write_end(&lock, flags);
+
+    munit_assert_uint64(lock.sequence, ==, 4);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_seqlock_read_retry(const MunitParameter params[],
+                                           void *param) {
+    SeqLock lock = {0};
+
+    uint64_t seq = seqlock_read_begin(&lock);
+
+    // A write lands mid-read...
+    uint64_t flags = seqlock_write_begin(&lock);
+    seqlock_write_end(&lock, flags);
+
+    // ... so the read has to go again
+    munit_assert_true(seqlock_read_retry(&lock, seq));
+
+    seq = seqlock_read_begin(&lock);
+    munit_assert_uint64(seq, ==, 2);
+    munit_assert_false(seqlock_read_retry(&lock, seq));
+
+    return MUNIT_OK;
+}
+
+static void *reader_thread_func(void *arg) {
+    ReaderArgs *args = (ReaderArgs *)arg;
+    Record *record = args->record;
+
+    while (!__atomic_load_n(&record->done, __ATOMIC_ACQUIRE)) {
+        uint64_t seq, a, b;
+
+        do {
+            seq = seqlock_read_begin(&record->lock);
+            a = __atomic_load_n(&record->a, __ATOMIC_RELAXED);
+            b = __atomic_load_n(&record->b, __ATOMIC_RELAXED);
+            args->retries++;
+        } while (seqlock_read_retry(&record->lock, seq));
+
+        args->retries--;
+        args->reads++;
+
+        if (a != b) {
+            // Got a torn read past the retry check!
+            args->failed = true;
+        }
+
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+static MunitResult test_seqlock_multithreaded(const MunitParameter params[],
+                                              void *param) {
+    static Record record;
+    pthread_t threads[READER_COUNT];
+    ReaderArgs args[READER_COUNT];
+
+    for (int i = 0; i < READER_COUNT; i++) {
+        args[i].record = &record;
+        args[i].reads = 0;
+        args[i].retries = 0;
+        args[i].failed = false;
+        pthread_create(&threads[i], NULL, reader_thread_func, &args[i]);
+    }
+
+    for (int i = 0; i < WRITER_ITERATIONS; i++) {
+        uint64_t flags = seqlock_write_begin(&record.lock);
+        __atomic_store_n(&record.a, record.a + 1, __ATOMIC_RELAXED);
+
+        if ((i & 0xff) == 0) {
+            // Give readers a chance to catch us mid-write
+            sched_yield();
+        }
+
+        __atomic_store_n(&record.b, record.b + 1, __ATOMIC_RELAXED);
+        seqlock_write_end(&record.lock, flags);
+
+        if ((i & 0xf) == 0) {
+            // and to read in between
+            sched_yield();
+        }
+    }
+
+    __atomic_store_n(&record.done, true, __ATOMIC_RELEASE);
+
+    uint64_t reads = 0, retries = 0;
+
+    for (int i = 0; i < READER_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+        munit_assert_false(args[i].failed);
+        reads += args[i].reads;
+        retries += args[i].retries;
+    }
+
+    munit_assert_uint64(record.a, ==, WRITER_ITERATIONS);
+    munit_assert_uint64(record.b, ==, WRITER_ITERATIONS);
+    munit_assert_uint64(record.lock.sequence, ==, WRITER_ITERATIONS * 2);
+
+    munit_logf(MUNIT_LOG_INFO, "%lu consistent reads, %lu retried", reads,
+               retries);
+
+    return MUNIT_OK;
+}
+
+static MunitTest test_suite_tests[] = {
+        {(char *)"/init", test_seqlock_init, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+         NULL},
+        {(char *)"/read_no_writer", test_seqlock_read_no_writer, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/write", test_seqlock_write, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/read_retry", test_seqlock_read_retry, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/multithreaded", test_seqlock_multithreaded, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+};
+
+static const MunitSuite test_suite = {(char *)"/seqlock", test_suite_tests,
+                                      NULL, 1, MUNIT_SUITE_OPTION_NONE};
+
+int main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&test_suite, (void *)"µnit", argc, argv);
+}
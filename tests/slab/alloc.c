@@ -5,13 +5,19 @@
  * Copyright (c) 2024 Ross Bamford
  */
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "cpu.h"
 #include "fba/alloc.h"
 #include "ktypes.h"
 #include "munit.h"
 #include "slab/alloc.h"
+#include "structs/bitmap.h"
+#include "test_cpu.h"
 #include "test_pmm.h"
 #include "test_vmm.h"
 #include "vmm/vmconfig.h"
@@ -19,6 +25,17 @@
 #define TEST_PML4_ADDR (((uint64_t *)0x100000))
 #define TEST_PAGE_COUNT ((32768))
 
+#define BENCH_MAX_THREADS ((8))
+#define BENCH_BATCH ((16))
+#define BENCH_ITERATIONS ((20000))
+
+// Conditionally defined in the main code
+uint64_t test_slab_depot_full_count();
+uint64_t test_slab_empty_count();
+
+static PerCPUSlabMagazines magazines[MAX_CPU_COUNT];
+static uint64_t cached_bitmap[SLAB_CACHED_BITMAP_QUADS];
+
 static const int PAGES_PER_SLAB = BYTES_PER_SLAB / VM_PAGE_SIZE;
 
 static void *test_setup(const MunitParameter params[], void *user_data) {
@@ -495,6 +512,376 @@ static MunitResult test_slab_free_from_full(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+static MunitResult test_slab_free_from_full_middle(const MunitParameter params[],
+                                                   void *page_area_ptr) {
+    void *results[255 * 3];
+
+    for (int i = 0; i < 255 * 3; i++) {
+        results[i] = slab_alloc_block();
+    }
+
+    Slab *first_slab = slab_base(results[0]);
+    Slab *second_slab = slab_base(results[255]);
+    Slab *third_slab = slab_base(results[510]);
+
+    // All full, newest at the head of the full list
+    munit_assert_ptr(third_slab->this.next, ==, second_slab);
+    munit_assert_ptr(second_slab->prev, ==, third_slab);
+    munit_assert_ptr(second_slab->this.next, ==, first_slab);
+    munit_assert_ptr(first_slab->prev, ==, second_slab);
+
+    // Freeing from the middle one unlinks it directly...
+    slab_free_block(results[300]);
+
+    munit_assert_ptr(third_slab->this.next, ==, first_slab);
+    munit_assert_ptr(first_slab->prev, ==, third_slab);
+    munit_assert_null(second_slab->this.next);
+    munit_assert_null(second_slab->prev);
+
+    // ... and the partial slab is used next
+    munit_assert_ptr(slab_alloc_block(), ==, results[300]);
+    munit_assert_ptr(second_slab->this.next, ==, third_slab);
+    munit_assert_ptr(third_slab->prev, ==, second_slab);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_slab_free_empty_watermark(const MunitParameter params[],
+                                                  void *page_area_ptr) {
+    const int slabs = SLAB_EMPTY_WATERMARK + 1;
+    void *results[255 * (SLAB_EMPTY_WATERMARK + 1)];
+
+    for (int i = 0; i < 255 * slabs; i++) {
+        results[i] = slab_alloc_block();
+    }
+
+    // And one in a partial slab, so that isn't the one emptied
+    slab_alloc_block();
+
+    uint32_t page_allocs = test_pmm_get_total_page_allocs();
+    uint32_t unmaps = test_vmm_get_total_unmap_calls();
+
+    for (int i = 0; i < 255 * slabs; i++) {
+        slab_free_block(results[i]);
+    }
+
+    fba_flush_lazy_frees();
+
+    // Up to the watermark are kept, the last went back to the FBA
+    munit_assert_uint64(test_slab_empty_count(), ==, SLAB_EMPTY_WATERMARK);
+    munit_assert_uint32(test_vmm_get_total_unmap_calls(), >, unmaps);
+
+    // Filling the partial slab, then one more, reuses an empty one
+    for (int i = 0; i < 255; i++) {
+        slab_alloc_block();
+    }
+
+    munit_assert_uint64(test_slab_empty_count(), ==, SLAB_EMPTY_WATERMARK - 1);
+    munit_assert_uint32(test_pmm_get_total_page_allocs(), ==, page_allocs);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_slab_magazine_free_alloc(const MunitParameter params[],
+                                                 void *page_area_ptr) {
+    slab_alloc_init_cpu_magazines(magazines, cached_bitmap);
+
+    void *block = slab_alloc_block();
+    Slab *slab = (Slab *)slab_area_base(page_area_ptr);
+
+    munit_assert_uint64(slab->bitmap0, ==, 0x0000000000000003);
+
+    slab_free_block(block);
+
+    // Block went into a magazine (carved from a new FBA block), so it's
+    // still allocated in the slab...
+    munit_assert_uint32(test_pmm_get_total_page_allocs(), ==,
+                        PAGES_PER_SLAB + 2);
+    munit_assert_uint64(slab->bitmap0, ==, 0x0000000000000003);
+    munit_assert_not_null(magazines[0].loaded);
+    munit_assert_uint64(magazines[0].loaded->rounds, ==, 1);
+
+    // ... and comes straight back out again
+    munit_assert_ptr_equal(slab_alloc_block(), block);
+    munit_assert_uint64(magazines[0].loaded->rounds, ==, 0);
+    munit_assert_uint64(slab->bitmap0, ==, 0x0000000000000003);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_slab_magazine_free_bad(const MunitParameter params[],
+                                               void *page_area_ptr) {
+    slab_alloc_init_cpu_magazines(magazines, cached_bitmap);
+
+    slab_alloc_block();
+    Slab *slab = (Slab *)slab_area_base(page_area_ptr);
+
+    // Neither the bitmap nor an unallocated block go in a magazine
+    slab_free_block(slab);
+    slab_free_block(slab + 2);
+
+    munit_assert_null(magazines[0].loaded);
+    munit_assert_uint64(slab->bitmap0, ==, 0x0000000000000003);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_slab_magazine_double_free(const MunitParameter params[],
+                                                  void *page_area_ptr) {
+    slab_alloc_init_cpu_magazines(magazines, cached_bitmap);
+
+    void *block = slab_alloc_block();
+    slab_free_block(block);
+    slab_free_block(block);
+
+    // Second free was ignored, so it's only in the magazine once...
+    munit_assert_uint64(magazines[0].loaded->rounds, ==, 1);
+    munit_assert_ptr_equal(slab_alloc_block(), block);
+    munit_assert_ptr_not_equal(slab_alloc_block(), block);
+
+    // ... and once it's handed out again, it can be freed again
+    slab_free_block(block);
+    munit_assert_uint64(magazines[0].loaded->rounds, ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_slab_magazine_double_free_depot(const MunitParameter params[],
+                                     void *page_area_ptr) {
+    slab_alloc_init_cpu_magazines(magazines, cached_bitmap);
+
+    void *blocks[SLAB_MAGAZINE_ROUNDS * 2 + 1];
+
+    for (int i = 0; i < SLAB_MAGAZINE_ROUNDS * 2 + 1; i++) {
+        blocks[i] = slab_alloc_block();
+    }
+
+    for (int i = 0; i < SLAB_MAGAZINE_ROUNDS * 2 + 1; i++) {
+        slab_free_block(blocks[i]);
+    }
+
+    // The first is in a depot magazine now - freeing it again does nothing
+    slab_free_block(blocks[0]);
+
+    munit_assert_uint64(magazines[0].loaded->rounds, ==, 1);
+    munit_assert_uint64(test_slab_depot_full_count(), ==, 1);
+
+    // Reclaiming returns it to its slab, after which it really is free...
+    munit_assert_uint64(slab_reclaim_depot(), ==, SLAB_MAGAZINE_ROUNDS);
+
+    Slab *slab = (Slab *)slab_area_base(page_area_ptr);
+    munit_assert_false(bitmap_check(&slab->bitmap0, 1));
+
+    // ... so a repeat free is ignored by the slab instead
+    slab_free_block(blocks[0]);
+    munit_assert_uint64(magazines[0].loaded->rounds, ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_slab_magazine_unchecked(const MunitParameter params[],
+                                                void *page_area_ptr) {
+    slab_alloc_init_cpu_magazines(magazines, NULL);
+
+    // Without a cached bitmap, magazines work just the same (but repeat
+    // frees aren't caught)
+    void *block = slab_alloc_block();
+    slab_free_block(block);
+
+    munit_assert_uint64(magazines[0].loaded->rounds, ==, 1);
+    munit_assert_ptr_equal(slab_alloc_block(), block);
+    munit_assert_uint64(magazines[0].loaded->rounds, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_slab_magazine_depot(const MunitParameter params[],
+                                            void *page_area_ptr) {
+    slab_alloc_init_cpu_magazines(magazines, cached_bitmap);
+
+    void *blocks[SLAB_MAGAZINE_ROUNDS * 2 + 1];
+
+    for (int i = 0; i < SLAB_MAGAZINE_ROUNDS * 2 + 1; i++) {
+        blocks[i] = slab_alloc_block();
+    }
+
+    for (int i = 0; i < SLAB_MAGAZINE_ROUNDS * 2; i++) {
+        slab_free_block(blocks[i]);
+    }
+
+    // Loaded and previous are both full...
+    munit_assert_uint64(magazines[0].loaded->rounds, ==, SLAB_MAGAZINE_ROUNDS);
+    munit_assert_uint64(magazines[0].previous->rounds, ==,
+                        SLAB_MAGAZINE_ROUNDS);
+    munit_assert_uint64(test_slab_depot_full_count(), ==, 0);
+
+    // ... so the next free sends one to the depot
+    slab_free_block(blocks[SLAB_MAGAZINE_ROUNDS * 2]);
+
+    munit_assert_uint64(magazines[0].loaded->rounds, ==, 1);
+    munit_assert_uint64(magazines[0].previous->rounds, ==,
+                        SLAB_MAGAZINE_ROUNDS);
+    munit_assert_uint64(test_slab_depot_full_count(), ==, 1);
+
+    // Everything comes back (most recently freed first) without touching
+    // the slabs
+    Slab *slab = (Slab *)slab_area_base(page_area_ptr);
+    uint64_t bitmap0 = slab->bitmap0;
+
+    for (int i = SLAB_MAGAZINE_ROUNDS * 2; i >= 0; i--) {
+        munit_assert_ptr_equal(slab_alloc_block(), blocks[i]);
+    }
+
+    munit_assert_uint64(test_slab_depot_full_count(), ==, 0);
+    munit_assert_uint64(slab->bitmap0, ==, bitmap0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_slab_magazine_per_cpu(const MunitParameter params[],
+                                              void *page_area_ptr) {
+    slab_alloc_init_cpu_magazines(magazines, cached_bitmap);
+
+    void *block = slab_alloc_block();
+    slab_free_block(block);
+
+    // Another CPU doesn't see this one's magazine...
+    test_cpu_set_current_id(1);
+    void *other = slab_alloc_block();
+    munit_assert_ptr_not_equal(other, block);
+    munit_assert_null(magazines[1].loaded);
+
+    // ... but this one does
+    test_cpu_set_current_id(0);
+    munit_assert_ptr_equal(slab_alloc_block(), block);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_slab_magazine_reclaim(const MunitParameter params[],
+                                              void *page_area_ptr) {
+    munit_assert_uint64(slab_reclaim_depot(), ==, 0);
+
+    slab_alloc_init_cpu_magazines(magazines, cached_bitmap);
+
+    void *blocks[SLAB_MAGAZINE_ROUNDS * 3];
+
+    for (int i = 0; i < SLAB_MAGAZINE_ROUNDS * 3; i++) {
+        blocks[i] = slab_alloc_block();
+    }
+
+    for (int i = 0; i < SLAB_MAGAZINE_ROUNDS * 3; i++) {
+        slab_free_block(blocks[i]);
+    }
+
+    // First magazine went to the depot, so its blocks are returned
+    munit_assert_uint64(test_slab_depot_full_count(), ==, 1);
+    munit_assert_uint64(slab_reclaim_depot(), ==, SLAB_MAGAZINE_ROUNDS);
+    munit_assert_uint64(test_slab_depot_full_count(), ==, 0);
+
+    // (the rest are still in this CPU's magazines)
+    Slab *slab = (Slab *)slab_area_base(page_area_ptr);
+    munit_assert_uint64(slab->bitmap0, ==,
+                        ((1ULL << (SLAB_MAGAZINE_ROUNDS * 3 + 1)) - 1) &
+                                ~((1ULL << (SLAB_MAGAZINE_ROUNDS + 1)) - 2));
+
+    return MUNIT_OK;
+}
+
+typedef struct {
+    uint8_t cpu;
+    bool ok;
+} BenchThread;
+
+static void *bench_thread_func(void *arg) {
+    BenchThread *thread = arg;
+    uint64_t *blocks[BENCH_BATCH];
+
+    test_cpu_set_current_id(thread->cpu);
+    thread->ok = true;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        for (int j = 0; j < BENCH_BATCH; j++) {
+            blocks[j] = slab_alloc_block();
+
+            if (blocks[j] == NULL) {
+                thread->ok = false;
+                return NULL;
+            }
+
+            *blocks[j] = ((uint64_t)thread->cpu << 32) | j;
+        }
+
+        for (int j = 0; j < BENCH_BATCH; j++) {
+            if (*blocks[j] != (((uint64_t)thread->cpu << 32) | j)) {
+                // Someone else has this block too!
+                thread->ok = false;
+            }
+
+            slab_free_block(blocks[j]);
+        }
+    }
+
+    return NULL;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_scaling(const char *name) {
+    pthread_t threads[BENCH_MAX_THREADS];
+    BenchThread args[BENCH_MAX_THREADS];
+    double single = 0;
+
+    // As in the spinlock bench, more spinning threads than CPUs just
+    // measures the host scheduler (or stalls behind a descheduled
+    // waiter, with a fair lock)...
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus < BENCH_MAX_THREADS ? cpus : BENCH_MAX_THREADS;
+
+    for (int count = 1; count <= max_threads; count *= 2) {
+        double start = now_ns();
+
+        for (int i = 0; i < count; i++) {
+            args[i].cpu = i;
+            pthread_create(&threads[i], NULL, bench_thread_func, &args[i]);
+        }
+
+        for (int i = 0; i < count; i++) {
+            pthread_join(threads[i], NULL);
+            munit_assert_true(args[i].ok);
+        }
+
+        double ops = (double)count * BENCH_ITERATIONS * BENCH_BATCH * 2;
+        double rate = ops / ((now_ns() - start) / 1000);
+
+        if (count == 1) {
+            single = rate;
+        }
+
+        munit_logf(MUNIT_LOG_INFO,
+                   "%s: %d thread(s), %.1f ops/us (%.2fx single)", name, count,
+                   rate, rate / single);
+    }
+}
+
+static MunitResult test_slab_bench_global(const MunitParameter params[],
+                                          void *page_area_ptr) {
+    bench_scaling("global lock");
+    return MUNIT_OK;
+}
+
+static MunitResult test_slab_bench_magazines(const MunitParameter params[],
+                                             void *page_area_ptr) {
+    slab_alloc_init_cpu_magazines(magazines, cached_bitmap);
+    bench_scaling("magazines");
+    return MUNIT_OK;
+}
+
 static MunitTest test_suite_tests[] = {
         {(char *)"/init", test_slab_init, NULL, NULL, MUNIT_TEST_OPTION_NONE,
          NULL},
@@ -522,6 +909,34 @@ static MunitTest test_suite_tests[] = {
          test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
         {(char *)"/alloc/free_two", test_slab_free_from_full, test_setup,
          test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/alloc/free_from_full_middle",
+         test_slab_free_from_full_middle, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/alloc/free_empty_watermark", test_slab_free_empty_watermark,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/magazine/free_alloc", test_slab_magazine_free_alloc,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/free_bad", test_slab_magazine_free_bad, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/double_free", test_slab_magazine_double_free,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/double_free_depot",
+         test_slab_magazine_double_free_depot, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/unchecked", test_slab_magazine_unchecked,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/depot", test_slab_magazine_depot, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/per_cpu", test_slab_magazine_per_cpu, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/magazine/reclaim", test_slab_magazine_reclaim, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/bench/scaling_global", test_slab_bench_global, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/bench/scaling_magazines", test_slab_bench_magazines,
+         test_setup, test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
 
         {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
 };
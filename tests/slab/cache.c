@@ -0,0 +1,456 @@
+/*
+ * Tests for slab caches
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fba/alloc.h"
+#include "ktypes.h"
+#include "munit.h"
+#include "slab/cache.h"
+#include "test_pmm.h"
+#include "test_vmm.h"
+#include "vmm/vmconfig.h"
+
+#define TEST_PML4_ADDR (((uint64_t *)0x100000))
+#define TEST_PAGE_COUNT ((32768))
+
+static const int PAGES_PER_SLAB = BYTES_PER_SLAB / VM_PAGE_SIZE;
+
+static void *test_setup(const MunitParameter params[], void *user_data) {
+    void *page_area_ptr;
+    posix_memalign(&page_area_ptr, 0x40000, TEST_PAGE_COUNT << 12);
+    fba_init(TEST_PML4_ADDR, (uintptr_t)page_area_ptr, 32768);
+    return page_area_ptr;
+}
+
+static void test_teardown(void *page_area_ptr) {
+    free(page_area_ptr);
+    test_pmm_reset();
+    test_vmm_reset();
+}
+
+static inline void *slab_area_base(void *page_area_ptr) {
+    // skip one page used by FBA, and three unused by slab alignment
+    return (void *)((uint64_t)page_area_ptr + 0x4000);
+}
+
+static MunitResult test_cache_init(const MunitParameter params[],
+                                   void *param) {
+    SlabCache cache;
+
+    munit_assert_false(slab_cache_init(&cache, 0));
+    munit_assert_false(
+            slab_cache_init(&cache, SLAB_CACHE_MAX_OBJECT_SIZE + 1));
+
+    // Smallest objects need the biggest bitmap (16 quads) - the header
+    // takes 192 bytes, leaving room for 1012 objects
+    munit_assert_true(slab_cache_init(&cache, 16));
+    munit_assert_uint32(cache.object_size, ==, 16);
+    munit_assert_uint16(cache.objects_per_slab, ==, 1012);
+    munit_assert_uint16(cache.header_size, ==, 192);
+    munit_assert_uint16(cache.bitmap_quads, ==, 16);
+
+    // Sizes are rounded up...
+    munit_assert_true(slab_cache_init(&cache, 100));
+    munit_assert_uint32(cache.object_size, ==, 112);
+    munit_assert_uint16(cache.objects_per_slab, ==, 145);
+    munit_assert_uint16(cache.header_size, ==, 128);
+    munit_assert_uint16(cache.bitmap_quads, ==, 3);
+
+    // ... and big objects get a one-line header
+    munit_assert_true(slab_cache_init(&cache, 2048));
+    munit_assert_uint16(cache.objects_per_slab, ==, 7);
+    munit_assert_uint16(cache.header_size, ==, 64);
+    munit_assert_uint16(cache.bitmap_quads, ==, 1);
+
+    // Nothing allocated yet
+    munit_assert_uint64(cache.slab_count, ==, 0);
+    munit_assert_null(cache.partial);
+    munit_assert_null(cache.full);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cache_alloc_first(const MunitParameter params[],
+                                          void *page_area_ptr) {
+    SlabCache cache;
+    slab_cache_init(&cache, 100);
+
+    void *object = slab_cache_alloc(&cache);
+
+    // New slab from the FBA, object just past the header
+    munit_assert_uint32(test_pmm_get_total_page_allocs(), ==,
+                        PAGES_PER_SLAB + 1);
+    munit_assert_ptr_equal(object, slab_area_base(page_area_ptr) + 128);
+
+    CacheSlab *slab = cache_slab_base(object);
+    munit_assert_ptr_equal(slab, slab_area_base(page_area_ptr));
+    munit_assert_ptr_equal(slab->cache, &cache);
+    munit_assert_uint64(slab->this.type, ==, KTYPE_SLAB_CACHE_HEADER);
+    munit_assert_uint64(slab->used, ==, 1);
+
+    // Bits past the 145th object are never free
+    munit_assert_uint64(slab->bitmap[0], ==, 1);
+    munit_assert_uint64(slab->bitmap[1], ==, 0);
+    munit_assert_uint64(slab->bitmap[2], ==, ~0ULL << 17);
+
+    munit_assert_ptr_equal(cache.partial, slab);
+    munit_assert_null(cache.full);
+    munit_assert_uint64(cache.slab_count, ==, 1);
+
+    // Next one is right after it
+    munit_assert_ptr_equal(slab_cache_alloc(&cache),
+                           slab_area_base(page_area_ptr) + 128 + 112);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cache_alloc_fills(const MunitParameter params[],
+                                          void *page_area_ptr) {
+    SlabCache cache;
+    slab_cache_init(&cache, 2048);
+
+    void *objects[8];
+
+    for (int i = 0; i < 7; i++) {
+        objects[i] = slab_cache_alloc(&cache);
+    }
+
+    // First slab is now full
+    CacheSlab *first = cache_slab_base(objects[0]);
+    munit_assert_ptr_equal(objects[6],
+                           (void *)first + 64 + 6 * 2048);
+    munit_assert_null(cache.partial);
+    munit_assert_ptr_equal(cache.full, first);
+
+    // So the next comes from a new one
+    objects[7] = slab_cache_alloc(&cache);
+    CacheSlab *second = cache_slab_base(objects[7]);
+
+    munit_assert_ptr_equal(second, (void *)first + BYTES_PER_SLAB);
+    munit_assert_ptr_equal(cache.partial, second);
+    munit_assert_uint64(cache.slab_count, ==, 2);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cache_free(const MunitParameter params[],
+                                   void *page_area_ptr) {
+    SlabCache cache;
+    slab_cache_init(&cache, 64);
+
+    void *object1 = slab_cache_alloc(&cache);
+    void *object2 = slab_cache_alloc(&cache);
+
+    slab_cache_free(object1);
+
+    CacheSlab *slab = cache_slab_base(object1);
+    munit_assert_uint64(slab->used, ==, 1);
+    munit_assert_uint64(slab->bitmap[0], ==, 2);
+
+    // Freed object is the next one handed out
+    munit_assert_ptr_equal(slab_cache_alloc(&cache), object1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cache_free_bad(const MunitParameter params[],
+                                       void *page_area_ptr) {
+    SlabCache cache;
+    slab_cache_init(&cache, 2048);
+
+    void *object = slab_cache_alloc(&cache);
+    CacheSlab *slab = cache_slab_base(object);
+
+    // Header, unallocated object, slack at the end - all ignored
+    slab_cache_free((void *)slab + 32);
+    slab_cache_free(object + 2048);
+    slab_cache_free((void *)slab + BYTES_PER_SLAB - 16);
+    slab_cache_free(NULL);
+
+    munit_assert_uint64(slab->used, ==, 1);
+    munit_assert_uint64(slab->bitmap[0], ==, 0xffffffffffffff81);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cache_free_from_full(const MunitParameter params[],
+                                             void *page_area_ptr) {
+    SlabCache cache;
+    slab_cache_init(&cache, 2048);
+
+    void *objects[21];
+
+    for (int i = 0; i < 21; i++) {
+        objects[i] = slab_cache_alloc(&cache);
+    }
+
+    // Three full slabs...
+    CacheSlab *first = cache_slab_base(objects[0]);
+    CacheSlab *second = cache_slab_base(objects[7]);
+    CacheSlab *third = cache_slab_base(objects[14]);
+
+    munit_assert_null(cache.partial);
+    munit_assert_ptr_equal(cache.full, third);
+
+    // Freeing from the middle one moves it back to partial
+    slab_cache_free(objects[8]);
+
+    munit_assert_ptr_equal(cache.partial, second);
+    munit_assert_null(second->this.next);
+    munit_assert_ptr_equal(cache.full, third);
+    munit_assert_ptr_equal(third->this.next, first);
+
+    munit_assert_ptr_equal(slab_cache_alloc(&cache), objects[8]);
+    munit_assert_ptr_equal(cache.full, second);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cache_free_empty(const MunitParameter params[],
+                                         void *page_area_ptr) {
+    SlabCache cache;
+    slab_cache_init(&cache, 2048);
+
+    const int slabs = SLAB_EMPTY_WATERMARK + 1;
+    void *objects[7 * (SLAB_EMPTY_WATERMARK + 1)];
+
+    for (int i = 0; i < 7 * slabs; i++) {
+        objects[i] = slab_cache_alloc(&cache);
+    }
+
+    munit_assert_uint64(cache.slab_count, ==, slabs);
+
+    uint32_t unmaps = test_vmm_get_total_unmap_calls();
+
+    for (int i = 0; i < 7 * slabs; i++) {
+        slab_cache_free(objects[i]);
+    }
+
+    fba_flush_lazy_frees();
+
+    // Up to the watermark are kept, the last went back to the FBA
+    munit_assert_null(cache.partial);
+    munit_assert_null(cache.full);
+    munit_assert_uint16(cache.empty_count, ==, SLAB_EMPTY_WATERMARK);
+    munit_assert_uint64(cache.slab_count, ==, SLAB_EMPTY_WATERMARK);
+    munit_assert_uint32(test_vmm_get_total_unmap_calls(), >, unmaps);
+
+    // Kept ones are reused before asking the FBA for more
+    uint32_t page_allocs = test_pmm_get_total_page_allocs();
+    CacheSlab *reused = cache.empty;
+
+    munit_assert_ptr_equal(cache_slab_base(slab_cache_alloc(&cache)), reused);
+    munit_assert_uint16(cache.empty_count, ==, SLAB_EMPTY_WATERMARK - 1);
+    munit_assert_ptr_equal(cache.partial, reused);
+    munit_assert_uint32(test_pmm_get_total_page_allocs(), ==, page_allocs);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cache_colour(const MunitParameter params[],
+                                     void *page_area_ptr) {
+    SlabCache cache;
+    slab_cache_init(&cache, 2048);
+
+    // Seven objects leave 1984 bytes of slack, so 32 colours
+    munit_assert_uint16(cache.colour_step, ==, 64);
+    munit_assert_uint16(cache.colour_max, ==, 1984);
+
+    void *objects[21];
+
+    for (int i = 0; i < 21; i++) {
+        objects[i] = slab_cache_alloc(&cache);
+    }
+
+    // Each new slab starts its objects a cache line further in
+    for (int i = 0; i < 3; i++) {
+        CacheSlab *slab = cache_slab_base(objects[i * 7]);
+
+        munit_assert_uint32(slab->colour, ==, i * 64);
+        munit_assert_ptr_equal(objects[i * 7], (void *)slab + 64 + i * 64);
+        munit_assert_ptr_equal(objects[i * 7 + 6],
+                               (void *)slab + 64 + i * 64 + 6 * 2048);
+    }
+
+    // Frees take the colour into account
+    slab_cache_free(objects[8]);
+    munit_assert_uint32(cache_slab_base(objects[8])->used, ==, 6);
+    munit_assert_ptr_equal(slab_cache_alloc(&cache), objects[8]);
+
+    // And it wraps when the slack runs out
+    cache.colour_next = cache.colour_max;
+    void *last = slab_cache_alloc(&cache);
+    munit_assert_uint32(cache_slab_base(last)->colour, ==, 1984);
+    munit_assert_uint16(cache.colour_next, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_kmem_cache_create(const MunitParameter params[],
+                                          void *page_area_ptr) {
+    munit_assert_null(kmem_cache_create("bad", 0, 0, NULL));
+    munit_assert_null(kmem_cache_create("bad", 64, 48, NULL));
+    munit_assert_null(kmem_cache_create("bad", 64, 8192, NULL));
+
+    // Cache-line aligned, say for something with a lock in it
+    SlabCache *cache = kmem_cache_create("locked_thing", 40, 64, NULL);
+
+    munit_assert_not_null(cache);
+    munit_assert_string_equal(cache->name, "locked_thing");
+    munit_assert_uint32(cache->object_size, ==, 64);
+    munit_assert_uint16(cache->align, ==, 64);
+
+    void *object1 = kmem_cache_alloc(cache);
+    void *object2 = kmem_cache_alloc(cache);
+
+    munit_assert_uint64((uintptr_t)object1 & 63, ==, 0);
+    munit_assert_ptr_equal(object2, object1 + 64);
+
+    // Default alignment is the minimum
+    SlabCache *small = kmem_cache_create("small", 24, 0, NULL);
+    munit_assert_uint32(small->object_size, ==, 32);
+    munit_assert_uint16(small->align, ==, SLAB_CACHE_MIN_ALIGN);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_kmem_cache_big_align(const MunitParameter params[],
+                                             void *page_area_ptr) {
+    SlabCache *cache = kmem_cache_create("big_align", 200, 256, NULL);
+
+    munit_assert_uint32(cache->object_size, ==, 256);
+    munit_assert_uint16(cache->header_size, ==, 256);
+    munit_assert_uint16(cache->objects_per_slab, ==, 63);
+
+    // Colours step by the alignment, not just a cache line
+    munit_assert_uint16(cache->colour_step, ==, 256);
+
+    for (int i = 0; i < 200; i++) {
+        munit_assert_uint64((uintptr_t)kmem_cache_alloc(cache) & 255, ==, 0);
+    }
+
+    return MUNIT_OK;
+}
+
+static int ctor_calls;
+
+static void test_ctor(void *object) {
+    ctor_calls++;
+    *(uint64_t *)object = 0x0b1ec7;
+}
+
+static MunitResult test_kmem_cache_ctor(const MunitParameter params[],
+                                        void *page_area_ptr) {
+    ctor_calls = 0;
+
+    SlabCache *cache = kmem_cache_create("ctor", 128, 0, test_ctor);
+    munit_assert_int(ctor_calls, ==, 0);
+
+    uint64_t *object = kmem_cache_alloc(cache);
+
+    // Whole slab was constructed
+    munit_assert_int(ctor_calls, ==, cache->objects_per_slab);
+    munit_assert_uint64(*object, ==, 0x0b1ec7);
+    munit_assert_uint64(*(object + 16), ==, 0x0b1ec7);
+
+    // Freed objects aren't constructed again
+    kmem_cache_free(object);
+    munit_assert_ptr_equal(kmem_cache_alloc(cache), object);
+    munit_assert_int(ctor_calls, ==, cache->objects_per_slab);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_kmem_cache_destroy(const MunitParameter params[],
+                                           void *page_area_ptr) {
+    SlabCache *cache = kmem_cache_create("destroy", 512, 0, NULL);
+    void *object = kmem_cache_alloc(cache);
+
+    // Not while it's in use...
+    munit_assert_false(kmem_cache_destroy(cache));
+
+    kmem_cache_free(object);
+
+    uint32_t unmaps = test_vmm_get_total_unmap_calls();
+
+    munit_assert_true(kmem_cache_destroy(cache));
+    fba_flush_lazy_frees();
+
+    // The kept empty slab went back to the FBA
+    munit_assert_uint32(test_vmm_get_total_unmap_calls(), >, unmaps);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cache_separate(const MunitParameter params[],
+                                       void *page_area_ptr) {
+    SlabCache small, big;
+    slab_cache_init(&small, 16);
+    slab_cache_init(&big, 512);
+
+    void *small_object = slab_cache_alloc(&small);
+    void *big_object = slab_cache_alloc(&big);
+
+    // Each cache has its own slabs
+    munit_assert_ptr_not_equal(cache_slab_base(small_object),
+                               cache_slab_base(big_object));
+    munit_assert_ptr_equal(cache_slab_base(small_object)->cache, &small);
+    munit_assert_ptr_equal(cache_slab_base(big_object)->cache, &big);
+
+    slab_cache_free(big_object);
+
+    munit_assert_uint64(cache_slab_base(big_object)->used, ==, 0);
+    munit_assert_uint64(cache_slab_base(small_object)->used, ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitTest test_suite_tests[] = {
+        {(char *)"/init", test_cache_init, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+         NULL},
+
+        {(char *)"/alloc/first", test_cache_alloc_first, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/alloc/fills", test_cache_alloc_fills, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/free/one", test_cache_free, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/free/bad", test_cache_free_bad, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/free/from_full", test_cache_free_from_full, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/free/empty", test_cache_free_empty, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/colour", test_cache_colour, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/kmem/create", test_kmem_cache_create, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/kmem/big_align", test_kmem_cache_big_align, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/kmem/ctor", test_kmem_cache_ctor, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/kmem/destroy", test_kmem_cache_destroy, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/separate", test_cache_separate, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+};
+
+static const MunitSuite test_suite = {(char *)"/slab_cache", test_suite_tests,
+                                      NULL, 1, MUNIT_SUITE_OPTION_NONE};
+
+int main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&test_suite, (void *)"µnit", argc, argv);
+}
@@ -0,0 +1,294 @@
+/*
+ * Tests for the general-purpose kernel allocator
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fba/alloc.h"
+#include "munit.h"
+#include "slab/cache.h"
+#include "slab/kmalloc.h"
+#include "test_pmm.h"
+#include "test_vmm.h"
+#include "vmm/vmconfig.h"
+
+#define TEST_PML4_ADDR (((uint64_t *)0x100000))
+#define TEST_PAGE_COUNT ((32768))
+
+#define BENCH_LIVE_SLOTS ((4096))
+#define BENCH_OPS ((200000))
+
+static void *test_setup(const MunitParameter params[], void *user_data) {
+    void *page_area_ptr;
+    posix_memalign(&page_area_ptr, 0x40000, TEST_PAGE_COUNT << 12);
+    fba_init(TEST_PML4_ADDR, (uintptr_t)page_area_ptr, TEST_PAGE_COUNT);
+    kmalloc_init();
+    return page_area_ptr;
+}
+
+static void test_teardown(void *page_area_ptr) {
+    free(page_area_ptr);
+    test_pmm_reset();
+    test_vmm_reset();
+}
+
+static MunitResult test_kmalloc_class_size(const MunitParameter params[],
+                                           void *page_area_ptr) {
+    munit_assert_uint32(kmalloc_class_size(0), ==, 0);
+    munit_assert_uint32(kmalloc_class_size(1), ==, 16);
+    munit_assert_uint32(kmalloc_class_size(16), ==, 16);
+    munit_assert_uint32(kmalloc_class_size(17), ==, 32);
+    munit_assert_uint32(kmalloc_class_size(33), ==, 48);
+    munit_assert_uint32(kmalloc_class_size(65), ==, 96);
+    munit_assert_uint32(kmalloc_class_size(129), ==, 192);
+    munit_assert_uint32(kmalloc_class_size(256), ==, 256);
+    munit_assert_uint32(kmalloc_class_size(257), ==, 384);
+    munit_assert_uint32(kmalloc_class_size(1025), ==, 1536);
+    munit_assert_uint32(kmalloc_class_size(1537), ==, 2048);
+    munit_assert_uint32(kmalloc_class_size(2048), ==, 2048);
+    munit_assert_uint32(kmalloc_class_size(2049), ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_kmalloc_zero(const MunitParameter params[],
+                                     void *page_area_ptr) {
+    munit_assert_null(kmalloc(0));
+
+    // Only the FBA's bitmap page is allocated
+    munit_assert_uint32(test_pmm_get_total_page_allocs(), ==, 1);
+
+    // and this is a no-op
+    kfree(NULL);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_kmalloc_small(const MunitParameter params[],
+                                      void *page_area_ptr) {
+    void *ptr = kmalloc(100);
+
+    munit_assert_not_null(ptr);
+    munit_assert_uint64((uintptr_t)ptr & (SLAB_CACHE_MIN_ALIGN - 1), ==, 0);
+
+    CacheSlab *slab = cache_slab_base(ptr);
+    munit_assert_uint32(slab->cache->object_size, ==, 128);
+    munit_assert_uint64(slab->used, ==, 1);
+
+    // Same class, same slab
+    void *ptr2 = kmalloc(128);
+    munit_assert_ptr_equal(cache_slab_base(ptr2), slab);
+    munit_assert_ptr_equal(ptr2, ptr + 128);
+
+    kfree(ptr);
+    munit_assert_uint64(slab->used, ==, 1);
+
+    kfree(ptr2);
+    munit_assert_uint64(slab->used, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_kmalloc_classes(const MunitParameter params[],
+                                        void *page_area_ptr) {
+    void *ptrs[KMALLOC_CLASS_COUNT];
+    uint64_t size = 16;
+
+    // Every class gets its own cache, so its own slab
+    for (int i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+        size = i == 0 ? 16 : kmalloc_class_size(size + 1);
+        ptrs[i] = kmalloc(size);
+
+        munit_assert_not_null(ptrs[i]);
+        munit_assert_uint32(cache_slab_base(ptrs[i])->cache->object_size, ==,
+                            size);
+
+        for (int j = 0; j < i; j++) {
+            munit_assert_ptr_not_equal(cache_slab_base(ptrs[i]),
+                                       cache_slab_base(ptrs[j]));
+        }
+    }
+
+    munit_assert_uint64(size, ==, KMALLOC_MAX_CLASS_SIZE);
+
+    for (int i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+        kfree(ptrs[i]);
+        munit_assert_uint64(cache_slab_base(ptrs[i])->used, ==, 0);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_kzalloc(const MunitParameter params[],
+                                void *page_area_ptr) {
+    uint8_t *ptr = kmalloc(200);
+
+    for (int i = 0; i < 200; i++) {
+        ptr[i] = 0xa5;
+    }
+
+    kfree(ptr);
+
+    // Gets the same object back, but cleared
+    uint8_t *zeroed = kzalloc(200);
+    munit_assert_ptr_equal(zeroed, ptr);
+
+    for (int i = 0; i < 200; i++) {
+        munit_assert_uint8(zeroed[i], ==, 0);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_kmalloc_large(const MunitParameter params[],
+                                      void *page_area_ptr) {
+    uint8_t *ptr = kmalloc(KMALLOC_MAX_CLASS_SIZE + 1);
+
+    munit_assert_not_null(ptr);
+    munit_assert_uint64((uintptr_t)ptr & ~SLAB_BASE_MASK, ==, 0);
+
+    // Whole page is usable
+    for (int i = 0; i < VM_PAGE_SIZE; i++) {
+        ptr[i] = 0xa5;
+    }
+
+    uint8_t *ptr2 = kmalloc(10000);
+    munit_assert_not_null(ptr2);
+    munit_assert_uint64((uintptr_t)ptr2 & ~SLAB_BASE_MASK, ==, 0);
+    munit_assert_ptr_not_equal(ptr2, ptr);
+
+    uint32_t unmaps = test_vmm_get_total_unmap_calls();
+
+    kfree(ptr2);
+    kfree(ptr);
+    fba_flush_lazy_frees();
+
+    // Both went back to the FBA
+    munit_assert_uint32(test_vmm_get_total_unmap_calls(), >, unmaps);
+    munit_assert_ptr_equal(fba_alloc_blocks_aligned(3, 4), ptr);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_kfree_large_unknown(const MunitParameter params[],
+                                            void *page_area_ptr) {
+    void *ptr = kmalloc(4096);
+    void *slab_aligned = (void *)((uintptr_t)ptr + BYTES_PER_SLAB);
+
+    uint32_t unmaps = test_vmm_get_total_unmap_calls();
+
+    // Not from kmalloc, so ignored
+    kfree(slab_aligned);
+    fba_flush_lazy_frees();
+
+    munit_assert_uint32(test_vmm_get_total_unmap_calls(), ==, unmaps);
+
+    kfree(ptr);
+
+    return MUNIT_OK;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Mostly small, some medium, and a few large - roughly the shape of
+// kernel allocation traffic...
+static uint64_t bench_size(void) {
+    int kind = munit_rand_int_range(0, 99);
+
+    if (kind < 70) {
+        return munit_rand_int_range(1, 256);
+    } else if (kind < 95) {
+        return munit_rand_int_range(257, 2048);
+    } else {
+        return munit_rand_int_range(2049, 16384);
+    }
+}
+
+static MunitResult test_kmalloc_bench_mixed(const MunitParameter params[],
+                                            void *page_area_ptr) {
+    static uint64_t sizes[BENCH_OPS];
+    static uint16_t slots[BENCH_OPS];
+    static void *live[BENCH_LIVE_SLOTS];
+
+    for (int i = 0; i < BENCH_OPS; i++) {
+        sizes[i] = bench_size();
+        slots[i] = munit_rand_int_range(0, BENCH_LIVE_SLOTS - 1);
+    }
+
+    // Same trace for both: each op frees whatever is in a random slot,
+    // and allocates a new one into it
+    double start = now_ns();
+
+    for (int i = 0; i < BENCH_OPS; i++) {
+        kfree(live[slots[i]]);
+        live[slots[i]] = kmalloc(sizes[i]);
+        munit_assert_not_null(live[slots[i]]);
+    }
+
+    double kernel = (now_ns() - start) / BENCH_OPS;
+
+    for (int i = 0; i < BENCH_LIVE_SLOTS; i++) {
+        kfree(live[i]);
+        live[i] = NULL;
+    }
+
+    start = now_ns();
+
+    for (int i = 0; i < BENCH_OPS; i++) {
+        free(live[slots[i]]);
+        live[slots[i]] = malloc(sizes[i]);
+        munit_assert_not_null(live[slots[i]]);
+    }
+
+    double libc = (now_ns() - start) / BENCH_OPS;
+
+    for (int i = 0; i < BENCH_LIVE_SLOTS; i++) {
+        free(live[i]);
+        live[i] = NULL;
+    }
+
+    munit_logf(MUNIT_LOG_INFO,
+               "mixed trace, %d live: kmalloc+kfree %.1fns, "
+               "malloc+free %.1fns",
+               BENCH_LIVE_SLOTS, kernel, libc);
+
+    return MUNIT_OK;
+}
+
+static MunitTest test_suite_tests[] = {
+        {(char *)"/class_size", test_kmalloc_class_size, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/zero", test_kmalloc_zero, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/small", test_kmalloc_small, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/classes", test_kmalloc_classes, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/kzalloc", test_kzalloc, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/large", test_kmalloc_large, test_setup, test_teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/large/unknown", test_kfree_large_unknown, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/bench/mixed", test_kmalloc_bench_mixed, test_setup,
+         test_teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+};
+
+static const MunitSuite test_suite = {(char *)"/kmalloc", test_suite_tests,
+                                      NULL, 1, MUNIT_SUITE_OPTION_NONE};
+
+int main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&test_suite, (void *)"µnit", argc, argv);
+}
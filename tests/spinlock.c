@@ -7,14 +7,24 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "munit.h"
 #include "spinlock.h"
+#include "test_cpu.h"
 
 #define THREAD_COUNT 10
 #define THREAD_NUM_COUNT 256
 
+#define BENCH_MAX_THREADS 8
+#define BENCH_OPS 20000
+
+// Ticket halves of a SpinLock's lock word
+#define NEXT_TICKET(lock) (((uint32_t)(lock).lock))
+#define NOW_SERVING(lock) (((uint32_t)((lock).lock >> 32)))
+
 static uint64_t thread_nums[THREAD_NUM_COUNT];
 
 static MunitResult test_spinlock_init(const MunitParameter params[],
@@ -34,11 +44,116 @@ static MunitResult test_spinlock_lock_unlock(const MunitParameter params[],
 
     spinlock_lock(&lock);
 
-    munit_assert_int64(lock.lock, ==, 1);
+    // Took ticket zero, which is being served
+    munit_assert_uint32(NEXT_TICKET(lock), ==, 1);
+    munit_assert_uint32(NOW_SERVING(lock), ==, 0);
 
     spinlock_unlock(&lock);
 
-    munit_assert_int64(lock.lock, ==, 0);
+    // Nobody waiting, free again
+    munit_assert_uint32(NEXT_TICKET(lock), ==, 1);
+    munit_assert_uint32(NOW_SERVING(lock), ==, 1);
+
+    // And can be locked again
+    spinlock_lock(&lock);
+    munit_assert_uint32(NEXT_TICKET(lock), ==, 2);
+    munit_assert_uint32(NOW_SERVING(lock), ==, 1);
+    spinlock_unlock(&lock);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_spinlock_ticket_wrap(const MunitParameter params[],
+                                             void *param) {
+    SpinLock lock = {0xffffffffffffffff};
+
+    spinlock_lock(&lock);
+
+    munit_assert_uint32(NEXT_TICKET(lock), ==, 0);
+    munit_assert_uint32(NOW_SERVING(lock), ==, 0xffffffff);
+
+    spinlock_unlock(&lock);
+
+    munit_assert_uint32(NEXT_TICKET(lock), ==, 0);
+    munit_assert_uint32(NOW_SERVING(lock), ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_spinlock_try_lock(const MunitParameter params[],
+                                          void *param) {
+    SpinLock lock = {0x0, 0x0};
+
+    // Free, so we get it
+    munit_assert_true(spinlock_try_lock(&lock));
+    munit_assert_uint32(NEXT_TICKET(lock), ==, 1);
+    munit_assert_uint32(NOW_SERVING(lock), ==, 0);
+
+    // Held, so we don't - and no ticket was taken
+    munit_assert_false(spinlock_try_lock(&lock));
+    munit_assert_uint32(NEXT_TICKET(lock), ==, 1);
+
+    spinlock_unlock(&lock);
+
+    // Free again
+    munit_assert_true(spinlock_try_lock(&lock));
+    munit_assert_uint32(NEXT_TICKET(lock), ==, 2);
+    munit_assert_uint32(NOW_SERVING(lock), ==, 1);
+    spinlock_unlock(&lock);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_spinlock_try_lock_waiter(const MunitParameter params[],
+                                                 void *param) {
+    // Held, with another ticket already handed out to a waiter
+    SpinLock lock = {0x0000000000000002, 0x0};
+
+    munit_assert_false(spinlock_try_lock(&lock));
+    munit_assert_uint32(NEXT_TICKET(lock), ==, 2);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_spinlock_irqsave(const MunitParameter params[],
+                                         void *param) {
+    SpinLock lock = {0x0, 0x0};
+
+    munit_assert_true(test_cpu_interrupts_enabled());
+
+    uint64_t flags = spinlock_lock_irqsave(&lock);
+
+    // Locked with interrupts off
+    munit_assert_false(test_cpu_interrupts_enabled());
+    munit_assert_uint32(NEXT_TICKET(lock), ==, 1);
+    munit_assert_uint32(NOW_SERVING(lock), ==, 0);
+
+    spinlock_unlock_irqrestore(&lock, flags);
+
+    // Unlocked, and they're back on
+    munit_assert_true(test_cpu_interrupts_enabled());
+    munit_assert_uint32(NOW_SERVING(lock), ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_spinlock_irqsave_nested(const MunitParameter params[],
+                                                void *param) {
+    SpinLock outer = {0x0, 0x0};
+    SpinLock inner = {0x0, 0x0};
+
+    uint64_t outer_flags = spinlock_lock_irqsave(&outer);
+    uint64_t inner_flags = spinlock_lock_irqsave(&inner);
+
+    spinlock_unlock_irqrestore(&inner, inner_flags);
+
+    // Inner unlock mustn't turn them back on under the outer lock...
+    munit_assert_false(test_cpu_interrupts_enabled());
+
+    spinlock_unlock_irqrestore(&outer, outer_flags);
+
+    // ... but the outer one does
+    munit_assert_true(test_cpu_interrupts_enabled());
 
     return MUNIT_OK;
 }
@@ -70,7 +185,8 @@ static MunitResult test_spinlock_multithreaded(const MunitParameter params[],
         pthread_join(threads[i], NULL);
     }
 
-    munit_assert_uint64(lock.lock, ==, 0);
+    munit_assert_uint32(NEXT_TICKET(lock), ==, THREAD_COUNT);
+    munit_assert_uint32(NOW_SERVING(lock), ==, THREAD_COUNT);
     munit_assert_uint64(thread_nums[0], !=, 0);
     for (int i = 1; i < THREAD_NUM_COUNT; i++) {
         munit_assert_uint64(thread_nums[i], ==, thread_nums[0]);
@@ -168,11 +284,193 @@ static MunitResult test_reentrant_multithreaded(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+static MunitResult test_spinlock_mcs_init(const MunitParameter params[],
+                                          void *param) {
+    McsSpinLock lock = {(McsSpinNode *)0xffffffffffffffff};
+
+    spinlock_mcs_init(&lock);
+
+    munit_assert_null(lock.tail);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_spinlock_mcs_lock_unlock(const MunitParameter params[],
+                                                 void *param) {
+    McsSpinLock lock = {NULL};
+    McsSpinNode node;
+
+    spinlock_mcs_lock(&lock, &node);
+
+    // Uncontended, so we're the tail and never had to wait
+    munit_assert_ptr_equal(lock.tail, &node);
+    munit_assert_null(node.next);
+
+    spinlock_mcs_unlock(&lock, &node);
+
+    munit_assert_null(lock.tail);
+
+    return MUNIT_OK;
+}
+
+static void *spinlock_mcs_thread_func(void *arg) {
+    McsSpinLock *lock = (McsSpinLock *)arg;
+    uint64_t thread_id = (uint64_t)pthread_self();
+    McsSpinNode node;
+
+    spinlock_mcs_lock(lock, &node);
+    for (int i = 0; i < THREAD_NUM_COUNT; i++) {
+        thread_nums[i] = thread_id;
+        usleep(500);
+    }
+    spinlock_mcs_unlock(lock, &node);
+
+    return NULL;
+}
+
+static MunitResult test_spinlock_mcs_multithreaded(const MunitParameter params[],
+                                                   void *param) {
+    McsSpinLock lock = {NULL};
+    pthread_t threads[THREAD_COUNT];
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        pthread_create(&threads[i], NULL, spinlock_mcs_thread_func, &lock);
+    }
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    munit_assert_null(lock.tail);
+    munit_assert_uint64(thread_nums[0], !=, 0);
+    for (int i = 1; i < THREAD_NUM_COUNT; i++) {
+        munit_assert_uint64(thread_nums[i], ==, thread_nums[0]);
+    }
+
+    return MUNIT_OK;
+}
+
+typedef struct {
+    SpinLock ticket;
+    McsSpinLock mcs;
+    bool use_mcs;
+    uint64_t counter;
+} BenchLock;
+
+typedef struct {
+    BenchLock *lock;
+    double *waits;
+} BenchThread;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *bench_thread_func(void *arg) {
+    BenchThread *thread = (BenchThread *)arg;
+    BenchLock *lock = thread->lock;
+    McsSpinNode node;
+
+    for (int i = 0; i < BENCH_OPS; i++) {
+        double start = now_ns();
+
+        if (lock->use_mcs) {
+            spinlock_mcs_lock(&lock->mcs, &node);
+        } else {
+            spinlock_lock(&lock->ticket);
+        }
+
+        thread->waits[i] = now_ns() - start;
+        lock->counter++;
+
+        if (lock->use_mcs) {
+            spinlock_mcs_unlock(&lock->mcs, &node);
+        } else {
+            spinlock_unlock(&lock->ticket);
+        }
+    }
+
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+static void bench_contention(bool use_mcs) {
+    pthread_t threads[BENCH_MAX_THREADS];
+    BenchThread args[BENCH_MAX_THREADS];
+    double *waits = malloc(sizeof(double) * BENCH_OPS * BENCH_MAX_THREADS);
+
+    // More spinning threads than CPUs just measures the host scheduler,
+    // so only go up to the number we've actually got...
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus < BENCH_MAX_THREADS ? cpus : BENCH_MAX_THREADS;
+
+    for (int count = 1; count <= max_threads; count *= 2) {
+        BenchLock lock = {{0}, {NULL}, use_mcs, 0};
+        double start = now_ns();
+
+        for (int i = 0; i < count; i++) {
+            args[i].lock = &lock;
+            args[i].waits = waits + i * BENCH_OPS;
+            pthread_create(&threads[i], NULL, bench_thread_func, &args[i]);
+        }
+
+        for (int i = 0; i < count; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        double elapsed = now_ns() - start;
+
+        munit_assert_uint64(lock.counter, ==, (uint64_t)count * BENCH_OPS);
+
+        qsort(waits, count * BENCH_OPS, sizeof(double), compare_doubles);
+
+        munit_logf(MUNIT_LOG_INFO,
+                   "%s: %d thread(s), %.1f locks/us, wait p50 %.0fns, "
+                   "p99 %.0fns, max %.0fns",
+                   use_mcs ? "mcs" : "ticket", count,
+                   count * BENCH_OPS / (elapsed / 1000),
+                   waits[count * BENCH_OPS / 2],
+                   waits[count * BENCH_OPS * 99 / 100],
+                   waits[count * BENCH_OPS - 1]);
+    }
+
+    free(waits);
+}
+
+static MunitResult test_spinlock_bench_ticket(const MunitParameter params[],
+                                              void *param) {
+    bench_contention(false);
+    return MUNIT_OK;
+}
+
+static MunitResult test_spinlock_bench_mcs(const MunitParameter params[],
+                                           void *param) {
+    bench_contention(true);
+    return MUNIT_OK;
+}
+
 static MunitTest test_suite_tests[] = {
         {(char *)"/init", test_spinlock_init, NULL, NULL,
          MUNIT_TEST_OPTION_NONE, NULL},
         {(char *)"/lock_unlock", test_spinlock_lock_unlock, NULL, NULL,
          MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/ticket_wrap", test_spinlock_ticket_wrap, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/try_lock", test_spinlock_try_lock, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/try_lock_waiter", test_spinlock_try_lock_waiter, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/irqsave", test_spinlock_irqsave, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/irqsave_nested", test_spinlock_irqsave_nested, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
         {(char *)"/spinlock_multithreaded", test_spinlock_multithreaded, NULL,
          NULL, MUNIT_TEST_OPTION_NONE, NULL},
 
@@ -183,6 +481,18 @@ static MunitTest test_suite_tests[] = {
         {(char *)"/reentrant_multithreaded", test_reentrant_multithreaded, NULL,
          NULL, MUNIT_TEST_OPTION_NONE, NULL},
 
+        {(char *)"/mcs_init", test_spinlock_mcs_init, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/mcs_lock_unlock", test_spinlock_mcs_lock_unlock, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/mcs_multithreaded", test_spinlock_mcs_multithreaded, NULL,
+         NULL, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/bench/ticket", test_spinlock_bench_ticket, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/bench/mcs", test_spinlock_bench_mcs, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
         {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
 };
 
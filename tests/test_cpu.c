@@ -0,0 +1,39 @@
+/*
+ * Mock implementation of the per-CPU helpers for hosted tests
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Each test thread gets its own "CPU", so per-CPU code can be
+ * exercised with pthreads.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+#define RFLAGS_IF ((0x200))
+
+static _Thread_local uint8_t current_cpu_id;
+
+// Pretend RFLAGS - just IF, which starts out set
+static _Thread_local uint64_t current_flags = RFLAGS_IF;
+
+void test_cpu_set_current_id(uint8_t id) { current_cpu_id = id; }
+
+bool test_cpu_interrupts_enabled(void) { return current_flags & RFLAGS_IF; }
+
+uint8_t cpu_current_id(void) { return current_cpu_id; }
+
+uint64_t cpu_save_disable_interrupts(void) {
+    uint64_t flags = current_flags;
+    current_flags &= ~RFLAGS_IF;
+    return flags;
+}
+
+void cpu_restore_interrupts(uint64_t flags) {
+    if (flags & RFLAGS_IF) {
+        current_flags |= RFLAGS_IF;
+    }
+}
@@ -5,6 +5,7 @@
  * Copyright (c) 2024 Ross Bamford
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,33 +18,75 @@
 MemoryRegion physical_region;
 
 static uint64_t *pages[MAX_PAGES];
-static uint8_t page_ptr = 0;
+static uint16_t page_ptr = 0;
+
+// Freed pages are handed out again, so tests that churn (e.g. page
+// tables being freed and reallocated) don't run out...
+static uint64_t *free_pages[MAX_PAGES];
+static uint16_t free_ptr = 0;
+static bool free_lock = false;
 static uint32_t total_page_allocs = 0;
 static uint32_t total_page_frees = 0;
 
 uint32_t test_pmm_get_total_page_allocs() { return total_page_allocs; }
+uint32_t test_pmm_get_total_page_frees() { return total_page_frees; }
+
+static void lock_free_pages() {
+    while (__atomic_test_and_set(&free_lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+static void unlock_free_pages() {
+    __atomic_clear(&free_lock, __ATOMIC_RELEASE);
+}
 
 void test_pmm_reset() {
     while (page_ptr > 0) {
         free(pages[--page_ptr]);
     }
 
+    free_ptr = 0;
+
     total_page_allocs = 0;
+    total_page_frees = 0;
 }
 
+// Atomic so tests can map from multiple threads...
 uint64_t page_alloc(MemoryRegion *region) {
-    if (page_ptr == (MAX_PAGES - 1)) {
+    lock_free_pages();
+
+    if (free_ptr > 0) {
+        uint64_t page = (uint64_t)free_pages[--free_ptr];
+        unlock_free_pages();
+
+        __atomic_fetch_add(&total_page_allocs, 1, __ATOMIC_RELAXED);
+        return page;
+    }
+
+    unlock_free_pages();
+
+    uint16_t slot = __atomic_fetch_add(&page_ptr, 1, __ATOMIC_RELAXED);
+
+    if (slot >= (MAX_PAGES - 1)) {
+        __atomic_fetch_sub(&page_ptr, 1, __ATOMIC_RELAXED);
         fprintf(stderr, "\n\nWARN: Mock page allocator is out of space 😱\n\n");
         return 0;
     }
 
-    total_page_allocs++;
-    posix_memalign((void **)&pages[page_ptr], 0x1000, 0x1000);
-    return (uint64_t)pages[page_ptr++];
+    __atomic_fetch_add(&total_page_allocs, 1, __ATOMIC_RELAXED);
+    posix_memalign((void **)&pages[slot], 0x1000, 0x1000);
+    return (uint64_t)pages[slot];
 }
 
 void page_free(MemoryRegion *region, uint64_t page) {
-    total_page_frees++;
+    __atomic_fetch_add(&total_page_frees, 1, __ATOMIC_RELAXED);
+
+    // Not actually freed until reset, just made available again
+    lock_free_pages();
+
+    if (free_ptr < MAX_PAGES) {
+        free_pages[free_ptr++] = (uint64_t *)page;
+    }
 
-    // don't bother freeing for now...
+    unlock_free_pages();
 }
@@ -9,11 +9,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "vmm/directmap.h"
 #include "vmm/recursive.h"
 #include "vmm/vmmapper.h"
 
 static uint32_t total_page_maps = 0;
 static uint32_t total_page_unmaps = 0;
+static uint32_t total_unmap_calls = 0;
 
 static uint64_t last_page_map_paddr = 0;
 static uint64_t last_page_map_vaddr = 0;
@@ -26,6 +28,7 @@ static uintptr_t last_page_unmap_virt = 0;
 void test_vmm_reset() {
     total_page_maps = 0;
     total_page_unmaps = 0;
+    total_unmap_calls = 0;
 }
 
 uint64_t test_vmm_get_last_page_map_paddr() { return last_page_map_paddr; }
@@ -40,6 +43,8 @@ uint32_t test_vmm_get_total_page_maps() { return total_page_maps; }
 
 uint32_t test_vmm_get_total_page_unmaps() { return total_page_unmaps; }
 
+uint32_t test_vmm_get_total_unmap_calls() { return total_unmap_calls; }
+
 uintptr_t test_vmm_get_last_page_unmap_pml4() { return last_page_unmap_pml4; }
 
 uintptr_t test_vmm_get_last_page_unmap_virt() { return last_page_unmap_virt; }
@@ -72,4 +77,67 @@ uintptr_t vmm_unmap_page_in(uint64_t *pml4, uintptr_t virt_addr) {
 
 uintptr_t vmm_unmap_page(uintptr_t virt_addr) {
     return vmm_unmap_page_in((uint64_t *)vmm_recursive_find_pml4(), virt_addr);
-}
\ No newline at end of file
+}
+
+bool vmm_map_pages_in(uint64_t *pml4, uintptr_t virt_addr,
+                      const uint64_t *pages, uint64_t num_pages,
+                      uint16_t flags) {
+    for (uint64_t i = 0; i < num_pages; i++) {
+        vmm_map_page_in(pml4, virt_addr + (i << 12), pages[i], flags);
+    }
+
+    return true;
+}
+
+bool vmm_map_range_in(uint64_t *pml4, uintptr_t virt_addr, uint64_t phys_addr,
+                      uint64_t num_pages, uint16_t flags) {
+    for (uint64_t i = 0; i < num_pages; i++) {
+        vmm_map_page_in(pml4, virt_addr + (i << 12), phys_addr + (i << 12),
+                        flags);
+    }
+
+    return true;
+}
+
+bool vmm_map_range(uintptr_t virt_addr, uint64_t phys_addr, uint64_t num_pages,
+                   uint16_t flags) {
+    return vmm_map_range_in((uint64_t *)vmm_recursive_find_pml4(), virt_addr,
+                            phys_addr, num_pages, flags);
+}
+
+uint64_t vmm_unmap_range_in(uint64_t *pml4, uintptr_t virt_addr,
+                            uint64_t num_pages, uintptr_t *phys_out) {
+    for (uint64_t i = 0; i < num_pages; i++) {
+        uintptr_t phys = vmm_unmap_page_in(pml4, virt_addr + (i << 12));
+
+        if (phys_out) {
+            phys_out[i] = phys;
+        }
+    }
+
+    total_unmap_calls++;
+    return num_pages;
+}
+
+uint64_t vmm_unmap_pages_in(uint64_t *pml4, const uintptr_t *virt_addrs,
+                            uint64_t num_pages, uintptr_t *phys_out) {
+    for (uint64_t i = 0; i < num_pages; i++) {
+        uintptr_t phys = vmm_unmap_page_in(pml4, virt_addrs[i]);
+
+        if (phys_out) {
+            phys_out[i] = phys;
+        }
+    }
+
+    total_unmap_calls++;
+    return num_pages;
+}
+
+uint64_t vmm_unmap_range(uintptr_t virt_addr, uint64_t num_pages,
+                         uintptr_t *phys_out) {
+    return vmm_unmap_range_in((uint64_t *)vmm_recursive_find_pml4(), virt_addr,
+                              num_pages, phys_out);
+}
+
+// Nothing is direct-mapped in tests (phys_to_virt is identity anyway)
+bool vmm_direct_map_covers(uint64_t phys) { return false; }
@@ -0,0 +1,139 @@
+/*
+ * Benchmarks for the range map / unmap functions
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ *
+ * Compares mapping (and unmapping) a run of pages one at a time with
+ * doing it as a single range - run with `--show-stderr` to see the
+ * numbers.
+ *
+ * The TLB flushes are no-ops in the hosted build, so this only really
+ * measures the table walks and locking - the flush counts are logged
+ * alongside so the saving there can be seen too.
+ */
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "munit.h"
+#include "test_pmm.h"
+#include "vmm/vmmapper.h"
+
+#define BENCH_PAGES 512
+#define BENCH_ITERATIONS 2000
+#define BENCH_VIRT_BASE 0x40000000
+#define BENCH_PHYS_BASE 0x100000
+
+// Provided by vmmapper.c under UNIT_TESTS
+uint64_t test_vmm_mapper_invalidated_pages();
+uint64_t test_vmm_mapper_tlb_flushes();
+void test_vmm_mapper_reset_flush_counts();
+
+static uint64_t *pml4;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct {
+    double time;
+    uint64_t invalidated_pages;
+    uint64_t tlb_flushes;
+} Phase;
+
+static double phase_begin(void) {
+    test_vmm_mapper_reset_flush_counts();
+    return now_ns();
+}
+
+static void phase_end(Phase *phase, double start) {
+    phase->time += now_ns() - start;
+    phase->invalidated_pages += test_vmm_mapper_invalidated_pages();
+    phase->tlb_flushes += test_vmm_mapper_tlb_flushes();
+}
+
+static void log_phase(const char *what, Phase *phase, uint64_t pages) {
+    munit_logf(MUNIT_LOG_INFO,
+               "%-15s %6.1f ns/page; %8" PRIu64 " invlpg, %5" PRIu64
+               " full flushes",
+               what, phase->time / pages, phase->invalidated_pages,
+               phase->tlb_flushes);
+}
+
+static MunitResult test_map_unmap(const MunitParameter params[], void *param) {
+    uint64_t pages = (uint64_t)BENCH_PAGES * BENCH_ITERATIONS;
+    Phase page_map = {0}, page_unmap = {0}, range_map = {0}, range_unmap = {0};
+    double start;
+
+    // Keep a page mapped just past the range, so the PD and PDPT stay
+    // put. The PT itself is freed each time the range is emptied (and
+    // allocated again next time) so that is part of what's timed...
+    vmm_map_page_in(pml4, BENCH_VIRT_BASE + LARGE_PAGE_SIZE, BENCH_PHYS_BASE,
+                    PRESENT);
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        start = phase_begin();
+        for (int j = 0; j < BENCH_PAGES; j++) {
+            vmm_map_page_in(pml4, BENCH_VIRT_BASE + (j << 12),
+                            BENCH_PHYS_BASE + (j << 12), PRESENT);
+        }
+        phase_end(&page_map, start);
+
+        start = phase_begin();
+        for (int j = 0; j < BENCH_PAGES; j++) {
+            vmm_unmap_page_in(pml4, BENCH_VIRT_BASE + (j << 12));
+        }
+        phase_end(&page_unmap, start);
+    }
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        start = phase_begin();
+        bool mapped = vmm_map_range_in(pml4, BENCH_VIRT_BASE, BENCH_PHYS_BASE,
+                                       BENCH_PAGES, PRESENT);
+        phase_end(&range_map, start);
+        munit_assert_true(mapped);
+
+        start = phase_begin();
+        uint64_t unmapped =
+                vmm_unmap_range_in(pml4, BENCH_VIRT_BASE, BENCH_PAGES, NULL);
+        phase_end(&range_unmap, start);
+        munit_assert_uint64(unmapped, ==, BENCH_PAGES);
+    }
+
+    log_phase("per-page map", &page_map, pages);
+    log_phase("per-page unmap", &page_unmap, pages);
+    log_phase("range map", &range_map, pages);
+    log_phase("range unmap", &range_unmap, pages);
+
+    return MUNIT_OK;
+}
+
+static void *setup(const MunitParameter params[], void *user_data) {
+    posix_memalign((void **)&pml4, 0x1000, 0x1000);
+    memset(pml4, 0, 0x1000);
+    test_vmm_mapper_reset_flush_counts();
+    return NULL;
+}
+
+static void teardown(void *param) {
+    test_pmm_reset();
+    free(pml4);
+}
+
+static MunitTest test_suite_tests[] = {
+        {(char *)"/map_unmap", test_map_unmap, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+};
+
+static const MunitSuite test_suite = {(char *)"/vmm/map_range_bench",
+                                      test_suite_tests, NULL, 1,
+                                      MUNIT_SUITE_OPTION_NONE};
+
+int main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&test_suite, (void *)"µnit", argc, argv);
+}
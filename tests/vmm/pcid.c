@@ -0,0 +1,345 @@
+/*
+ * Tests for the PCID allocator
+ * anos - An Operating System
+ *
+ * Copyright (c) 2024 Ross Bamford
+ */
+
+#include "munit.h"
+#include "vmm/pcid.h"
+
+#define PML4_A 0x1000
+#define PML4_B 0x2000
+
+// Provided by pcid.c under UNIT_TESTS
+void test_pcid_reset(bool has_pcid, bool has_invpcid);
+uint64_t test_pcid_last_cr3(void);
+uint64_t test_pcid_cr3_loads(void);
+uint64_t test_pcid_invpcids(uint8_t type);
+
+// Provided by test_cpu.c
+void test_cpu_set_current_id(uint8_t id);
+
+static MunitResult test_init_unsupported(const MunitParameter params[],
+                                         void *param) {
+    test_pcid_reset(false, false);
+
+    munit_assert_false(vmm_pcid_init());
+    munit_assert_false(vmm_pcid_enabled());
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_init_supported(const MunitParameter params[],
+                                       void *param) {
+    test_pcid_reset(true, false);
+
+    munit_assert_true(vmm_pcid_init());
+    munit_assert_true(vmm_pcid_enabled());
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cr3_disabled(const MunitParameter params[],
+                                     void *param) {
+    test_pcid_reset(false, false);
+    vmm_pcid_init();
+
+    PcidTag tag = {0};
+
+    // Without PCIDs, every load is just the PML4 (and flushes)
+    munit_assert_uint64(vmm_pcid_cr3(&tag, PML4_A), ==, PML4_A);
+    munit_assert_uint64(vmm_pcid_cr3(&tag, PML4_A), ==, PML4_A);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cr3_first_flushes(const MunitParameter params[],
+                                          void *param) {
+    test_pcid_reset(true, false);
+    vmm_pcid_init();
+
+    PcidTag tag = {0};
+
+    uint64_t cr3 = vmm_pcid_cr3(&tag, PML4_A);
+
+    munit_assert_uint64(cr3 & ~CR3_PCID_MASK, ==, PML4_A);
+    munit_assert_uint64(cr3 & CR3_PCID_MASK, !=, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cr3_then_no_flush(const MunitParameter params[],
+                                          void *param) {
+    test_pcid_reset(true, false);
+    vmm_pcid_init();
+
+    PcidTag tag = {0};
+
+    uint64_t first = vmm_pcid_cr3(&tag, PML4_A);
+    uint64_t second = vmm_pcid_cr3(&tag, PML4_A);
+
+    munit_assert_uint64(second, ==, first | CR3_NO_FLUSH);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cr3_distinct(const MunitParameter params[],
+                                     void *param) {
+    test_pcid_reset(true, false);
+    vmm_pcid_init();
+
+    PcidTag tag_a = {0}, tag_b = {0};
+
+    uint64_t a = vmm_pcid_cr3(&tag_a, PML4_A);
+    uint64_t b = vmm_pcid_cr3(&tag_b, PML4_B);
+
+    munit_assert_uint64(a & CR3_PCID_MASK, !=, b & CR3_PCID_MASK);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_generation_rollover(const MunitParameter params[],
+                                            void *param) {
+    test_pcid_reset(true, false);
+    vmm_pcid_init();
+
+    PcidTag first = {0};
+    PcidTag other = {0};
+
+    vmm_pcid_cr3(&first, PML4_A);
+
+    // Use up the rest of this generation...
+    for (int i = 1; i < PCID_MAX; i++) {
+        vmm_pcid_cr3(&other, PML4_B);
+        vmm_pcid_retire(&other);
+    }
+
+    // ... so the first is still current
+    munit_assert_uint64(vmm_pcid_cr3(&first, PML4_A) & CR3_NO_FLUSH, !=, 0);
+
+    // ... until the next assignment starts a new generation
+    uint64_t cr3 = vmm_pcid_cr3(&other, PML4_B);
+    munit_assert_uint64(cr3 & CR3_PCID_MASK, ==, 1);
+    munit_assert_uint64(cr3 & CR3_NO_FLUSH, ==, 0);
+
+    cr3 = vmm_pcid_cr3(&first, PML4_A);
+    munit_assert_uint64(cr3 & CR3_PCID_MASK, ==, 2);
+    munit_assert_uint64(cr3 & CR3_NO_FLUSH, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_retire(const MunitParameter params[], void *param) {
+    test_pcid_reset(true, false);
+    vmm_pcid_init();
+
+    PcidTag tag = {0};
+
+    vmm_pcid_cr3(&tag, PML4_A);
+    vmm_pcid_retire(&tag);
+
+    munit_assert_uint64(vmm_pcid_cr3(&tag, PML4_A) & CR3_NO_FLUSH, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_retire_all(const MunitParameter params[],
+                                   void *param) {
+    test_pcid_reset(true, false);
+    vmm_pcid_init();
+
+    PcidTag tag_a = {0}, tag_b = {0};
+
+    vmm_pcid_cr3(&tag_a, PML4_A);
+    vmm_pcid_cr3(&tag_b, PML4_B);
+    vmm_pcid_retire_all();
+
+    munit_assert_uint64(vmm_pcid_cr3(&tag_a, PML4_A) & CR3_NO_FLUSH, ==, 0);
+    munit_assert_uint64(vmm_pcid_cr3(&tag_b, PML4_B) & CR3_NO_FLUSH, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_per_cpu(const MunitParameter params[], void *param) {
+    test_pcid_reset(true, false);
+
+    test_cpu_set_current_id(0);
+    vmm_pcid_init();
+    test_cpu_set_current_id(1);
+    vmm_pcid_init();
+
+    PcidTag tag = {0};
+
+    test_cpu_set_current_id(0);
+    vmm_pcid_cr3(&tag, PML4_A);
+
+    // Having a PCID on CPU 0 doesn't mean it has one on CPU 1
+    test_cpu_set_current_id(1);
+    munit_assert_uint64(vmm_pcid_cr3(&tag, PML4_A) & CR3_NO_FLUSH, ==, 0);
+
+    // Retiring everything on CPU 1 doesn't affect CPU 0
+    vmm_pcid_retire_all();
+    test_cpu_set_current_id(0);
+    munit_assert_uint64(vmm_pcid_cr3(&tag, PML4_A) & CR3_NO_FLUSH, !=, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_switch(const MunitParameter params[], void *param) {
+    test_pcid_reset(true, false);
+    vmm_pcid_init();
+
+    PcidTag tag = {0};
+
+    vmm_switch_address_space(&tag, PML4_A);
+    uint64_t first = test_pcid_last_cr3();
+
+    vmm_switch_address_space(&tag, PML4_A);
+
+    munit_assert_uint64(test_pcid_cr3_loads(), ==, 2);
+    munit_assert_uint64(test_pcid_last_cr3(), ==, first | CR3_NO_FLUSH);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_invalidate_invpcid(const MunitParameter params[],
+                                           void *param) {
+    test_pcid_reset(true, true);
+    vmm_pcid_init();
+
+    PcidTag tag = {0};
+
+    vmm_pcid_cr3(&tag, PML4_A);
+    vmm_pcid_invalidate_page_in(&tag, 0x1000);
+
+    munit_assert_uint64(test_pcid_invpcids(0), ==, 1);
+
+    // Tag is still good, the page was invalidated in place
+    munit_assert_uint64(vmm_pcid_cr3(&tag, PML4_A) & CR3_NO_FLUSH, !=, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_invalidate_no_invpcid(const MunitParameter params[],
+                                              void *param) {
+    test_pcid_reset(true, false);
+    vmm_pcid_init();
+
+    PcidTag tag = {0};
+
+    vmm_pcid_cr3(&tag, PML4_A);
+    vmm_pcid_invalidate_page_in(&tag, 0x1000);
+
+    munit_assert_uint64(test_pcid_invpcids(0), ==, 0);
+
+    // No INVPCID, so the tag was retired instead
+    munit_assert_uint64(vmm_pcid_cr3(&tag, PML4_A) & CR3_NO_FLUSH, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_invalidate_stale(const MunitParameter params[],
+                                         void *param) {
+    test_pcid_reset(true, true);
+    vmm_pcid_init();
+
+    PcidTag tag = {0};
+
+    vmm_pcid_invalidate_page_in(&tag, 0x1000);
+
+    // Never had a PCID, so nothing to invalidate
+    munit_assert_uint64(test_pcid_invpcids(0), ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_flush_all_invpcid(const MunitParameter params[],
+                                          void *param) {
+    test_pcid_reset(true, true);
+    vmm_pcid_init();
+
+    PcidTag tag = {0};
+
+    vmm_pcid_cr3(&tag, PML4_A);
+    vmm_pcid_flush_all();
+
+    munit_assert_uint64(test_pcid_invpcids(3), ==, 1);
+    munit_assert_uint64(test_pcid_cr3_loads(), ==, 0);
+
+    // All flushed in place, so the tag is still good
+    munit_assert_uint64(vmm_pcid_cr3(&tag, PML4_A) & CR3_NO_FLUSH, !=, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_flush_all_no_invpcid(const MunitParameter params[],
+                                             void *param) {
+    test_pcid_reset(true, false);
+    vmm_pcid_init();
+
+    PcidTag tag = {0};
+
+    vmm_switch_address_space(&tag, PML4_A);
+    uint64_t cr3 = test_pcid_last_cr3();
+
+    vmm_pcid_flush_all();
+
+    // Current PCID flushed by a CR3 reload...
+    munit_assert_uint64(test_pcid_cr3_loads(), ==, 2);
+    munit_assert_uint64(test_pcid_last_cr3(), ==, cr3 & ~CR3_NO_FLUSH);
+
+    // ... and everything else retired
+    munit_assert_uint64(vmm_pcid_cr3(&tag, PML4_A) & CR3_NO_FLUSH, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitTest test_suite_tests[] = {
+        {(char *)"/init/unsupported", test_init_unsupported, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/init/supported", test_init_supported, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/cr3/disabled", test_cr3_disabled, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cr3/first_flushes", test_cr3_first_flushes, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cr3/then_no_flush", test_cr3_then_no_flush, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cr3/distinct", test_cr3_distinct, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cr3/generation_rollover", test_generation_rollover, NULL,
+         NULL, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/cr3/per_cpu", test_per_cpu, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/retire/one", test_retire, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/retire/all", test_retire_all, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/switch", test_switch, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+         NULL},
+
+        {(char *)"/invalidate/invpcid", test_invalidate_invpcid, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/invalidate/no_invpcid", test_invalidate_no_invpcid, NULL,
+         NULL, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/invalidate/stale", test_invalidate_stale, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/flush_all/invpcid", test_flush_all_invpcid, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/flush_all/no_invpcid", test_flush_all_no_invpcid, NULL,
+         NULL, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+};
+
+static const MunitSuite test_suite = {(char *)"/vmm/pcid", test_suite_tests,
+                                      NULL, 1, MUNIT_SUITE_OPTION_NONE};
+
+int main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&test_suite, (void *)"µnit", argc, argv);
+}
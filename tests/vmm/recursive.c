@@ -458,6 +458,20 @@ static MunitResult test_virt_to_pml4(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+static MunitResult test_is_page_entry(const MunitParameter params[],
+                                      void *fixture) {
+    // Present, with the page-size bit, is a large / huge page
+    munit_assert_true(vmm_recursive_is_page_entry(0x200000 | 0x80 | 0x1));
+    munit_assert_true(vmm_recursive_is_page_entry(0x40000000 | 0x80 | 0x3));
+
+    // Tables, or not present, are not
+    munit_assert_false(vmm_recursive_is_page_entry(0x1000 | 0x1));
+    munit_assert_false(vmm_recursive_is_page_entry(0x200000 | 0x80));
+    munit_assert_false(vmm_recursive_is_page_entry(0));
+
+    return MUNIT_OK;
+}
+
 static MunitTest vmm_tests[] = {
         {"/table_address_0", test_table_address_0, NULL, NULL,
          MUNIT_TEST_OPTION_NONE, NULL},
@@ -533,6 +547,9 @@ static MunitTest vmm_tests[] = {
         {"/virt_to_pml4", test_virt_to_pml4, NULL, NULL, MUNIT_TEST_OPTION_NONE,
          NULL},
 
+        {"/is_page_entry", test_is_page_entry, NULL, NULL,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
         {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
 
 static const MunitSuite test_suite = {"/vmm/∇", vmm_tests, NULL, 1,
@@ -5,10 +5,29 @@
  * Copyright (c) 2023 Ross Bamford
  */
 
+#include <pthread.h>
+
+#include "vmm/recursive.h"
 #include "vmm/vmmapper.h"
 #include "munit.h"
 #include "test_pmm.h"
 
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_REGIONS 32
+
+#define CHURN_ROUNDS 500
+#define CHURN_RANGES 16
+#define CHURN_MAX_PAGES 1024
+#define CHURN_SLOT_SIZE 0x4000000
+#define CHURN_USER_BASE 0x40000000
+#define CHURN_KERNEL_BASE 0xffffffffc0000000
+
+// Provided by vmmapper.c under UNIT_TESTS
+uint64_t test_vmm_mapper_invalidated_pages();
+uint64_t test_vmm_mapper_tlb_flushes();
+uint64_t test_vmm_mapper_shootdowns();
+void test_vmm_mapper_reset_flush_counts();
+
 static uint64_t *empty_pml4;
 
 static uint64_t *complete_pml4;
@@ -23,21 +42,21 @@ static MunitResult test_map_page_empty_pml4_0(const MunitParameter params[],
     munit_assert_uint64(empty_pml4[0], !=, 0);
 
     // pdpt was created and mapped
-    uint64_t *pdpt = (uint64_t *)(empty_pml4[0] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pdpt = (uint64_t *)(empty_pml4[0] & ENTRY_ADDR_MASK);
     munit_assert_uint64(pdpt[0], !=, 0);
     for (int i = 1; i < 512; i++) {
         munit_assert_uint64(pdpt[i], ==, 0);
     }
 
     // pd was created and mapped
-    uint64_t *pd = (uint64_t *)(pdpt[0] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pd = (uint64_t *)(pdpt[0] & ENTRY_ADDR_MASK);
     munit_assert_uint64(pd[0], !=, 0);
     for (int i = 1; i < 512; i++) {
         munit_assert_uint64(pd[i], ==, 0);
     }
 
     // pt was created and mapped
-    uint64_t *pt = (uint64_t *)(pd[0] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pt = (uint64_t *)(pd[0] & ENTRY_ADDR_MASK);
     munit_assert_uint64(pt[0], !=, 0);
     for (int i = 1; i < 512; i++) {
         munit_assert_uint64(pt[i], ==, 0);
@@ -59,14 +78,14 @@ static MunitResult test_map_page_empty_pml4_2M(const MunitParameter params[],
     munit_assert_uint64(empty_pml4[0], !=, 0);
 
     // pdpt was created and mapped
-    uint64_t *pdpt = (uint64_t *)(empty_pml4[0] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pdpt = (uint64_t *)(empty_pml4[0] & ENTRY_ADDR_MASK);
     munit_assert_uint64(pdpt[0], !=, 0);
     for (int i = 1; i < 512; i++) {
         munit_assert_uint64(pdpt[i], ==, 0);
     }
 
     // pd was created and mapped
-    uint64_t *pd = (uint64_t *)(pdpt[0] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pd = (uint64_t *)(pdpt[0] & ENTRY_ADDR_MASK);
 
     munit_assert_uint64(pd[0], ==, 0);
     munit_assert_uint64(pd[1], !=, 0);
@@ -76,7 +95,7 @@ static MunitResult test_map_page_empty_pml4_2M(const MunitParameter params[],
     }
 
     // pt was created and mapped at pde1
-    uint64_t *pt = (uint64_t *)(pd[1] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pt = (uint64_t *)(pd[1] & ENTRY_ADDR_MASK);
 
     munit_assert_uint64(pt[0], !=, 0);
 
@@ -100,7 +119,7 @@ static MunitResult test_map_page_empty_pml4_1G(const MunitParameter params[],
     munit_assert_uint64(empty_pml4[0], !=, 0);
 
     // pdpt was created and mapped
-    uint64_t *pdpt = (uint64_t *)(empty_pml4[0] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pdpt = (uint64_t *)(empty_pml4[0] & ENTRY_ADDR_MASK);
 
     munit_assert_uint64(pdpt[0], ==, 0);
     munit_assert_uint64(pdpt[1], !=, 0);
@@ -110,7 +129,7 @@ static MunitResult test_map_page_empty_pml4_1G(const MunitParameter params[],
     }
 
     // pd was created and mapped
-    uint64_t *pd = (uint64_t *)(pdpt[1] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pd = (uint64_t *)(pdpt[1] & ENTRY_ADDR_MASK);
 
     munit_assert_uint64(pd[0], !=, 0);
 
@@ -119,7 +138,7 @@ static MunitResult test_map_page_empty_pml4_1G(const MunitParameter params[],
     }
 
     // pt was created and mapped at pd0
-    uint64_t *pt = (uint64_t *)(pd[0] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pt = (uint64_t *)(pd[0] & ENTRY_ADDR_MASK);
 
     munit_assert_uint64(pt[0], !=, 0);
 
@@ -144,7 +163,7 @@ static MunitResult test_map_page_empty_pml4_512G(const MunitParameter params[],
     munit_assert_uint64(empty_pml4[1], !=, 0);
 
     // pdpt was created and mapped
-    uint64_t *pdpt = (uint64_t *)(empty_pml4[1] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pdpt = (uint64_t *)(empty_pml4[1] & ENTRY_ADDR_MASK);
 
     munit_assert_uint64(pdpt[0], !=, 0);
 
@@ -153,7 +172,7 @@ static MunitResult test_map_page_empty_pml4_512G(const MunitParameter params[],
     }
 
     // pd was created and mapped
-    uint64_t *pd = (uint64_t *)(pdpt[0] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pd = (uint64_t *)(pdpt[0] & ENTRY_ADDR_MASK);
 
     munit_assert_uint64(pd[0], !=, 0);
 
@@ -162,7 +181,7 @@ static MunitResult test_map_page_empty_pml4_512G(const MunitParameter params[],
     }
 
     // pt was created and mapped at pd0
-    uint64_t *pt = (uint64_t *)(pd[0] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pt = (uint64_t *)(pd[0] & ENTRY_ADDR_MASK);
 
     munit_assert_uint64(pt[0], !=, 0);
 
@@ -270,22 +289,22 @@ test_unmap_page_complete_pml4_2M(const MunitParameter params[], void *param) {
 
     vmm_map_page_in(complete_pml4, 0x200000, 0x1000, 0);
 
-    uint64_t *pdpt = (uint64_t *)(complete_pml4[0] & 0xFFFFFFFFFFFFF000);
-    uint64_t *pd = (uint64_t *)(pdpt[0] & 0xFFFFFFFFFFFFF000);
-    uint64_t *pt = (uint64_t *)(pd[1] & 0xFFFFFFFFFFFFF000);
+    uint64_t *pdpt = (uint64_t *)(complete_pml4[0] & ENTRY_ADDR_MASK);
+    uint64_t *pd = (uint64_t *)(pdpt[0] & ENTRY_ADDR_MASK);
+    uint64_t *pt = (uint64_t *)(pd[1] & ENTRY_ADDR_MASK);
 
     // Correct page was mapped
     munit_assert_uint64(pt[0], ==, 0x1000);
 
     uintptr_t unmapped_phys = vmm_unmap_page_in(complete_pml4, 0x200000);
 
-    // Higher-level tables are untouched
+    // Tables the mapper didn't create are untouched...
     munit_assert_uint64(complete_pml4[0], ==, (uint64_t)pdpt | PRESENT);
     munit_assert_uint64(pdpt[0], ==, (uint64_t)pd | PRESENT);
-    munit_assert_uint64(pd[1], ==, (uint64_t)pt | PRESENT);
 
-    // Correct page was unmapped in PT
-    munit_assert_uint64(pt[0], ==, 0);
+    // ... but the new PT is now empty, so it was unlinked and freed
+    munit_assert_uint64(pd[1], ==, 0);
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 1);
 
     // Physical address of previously-mapped page was returned
     munit_assert_uint64(unmapped_phys, ==, 0x1000);
@@ -293,7 +312,770 @@ test_unmap_page_complete_pml4_2M(const MunitParameter params[], void *param) {
     return MUNIT_OK;
 }
 
+static MunitResult test_map_large_page_empty_pml4(const MunitParameter params[],
+                                                  void *param) {
+    bool result = vmm_map_large_page_in(empty_pml4, 0x200000, 0x400000,
+                                        PRESENT | WRITE);
+    munit_assert_true(result);
+
+    // pdpt and pd were created and mapped
+    uint64_t *pdpt = (uint64_t *)(empty_pml4[0] & ENTRY_ADDR_MASK);
+    uint64_t *pd = (uint64_t *)(pdpt[0] & ENTRY_ADDR_MASK);
+
+    // Large page was mapped directly in the PD
+    munit_assert_uint64(pd[0], ==, 0);
+    munit_assert_uint64(pd[1], ==, 0x400000 | PRESENT | WRITE | LARGE_PAGE);
+
+    // We allocated two pages (no PT)
+    munit_assert_uint8(test_pmm_get_total_page_allocs(), ==, 2);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_map_large_page_unaligned(const MunitParameter params[],
+                                                 void *param) {
+    munit_assert_false(
+            vmm_map_large_page_in(empty_pml4, 0x201000, 0x400000, PRESENT));
+    munit_assert_false(
+            vmm_map_large_page_in(empty_pml4, 0x200000, 0x401000, PRESENT));
+
+    // Nothing was touched
+    munit_assert_uint64(empty_pml4[0], ==, 0);
+    munit_assert_uint8(test_pmm_get_total_page_allocs(), ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_map_large_page_over_table(const MunitParameter params[], void *param) {
+    // There's already a PT at PD entry 0, it shouldn't be replaced
+    bool result = vmm_map_large_page_in(complete_pml4, 0x0, 0x400000, PRESENT);
+    munit_assert_false(result);
+
+    munit_assert_uint64(complete_pd[0], ==, (uint64_t)complete_pt | PRESENT);
+
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_map_page_within_large_page(const MunitParameter params[], void *param) {
+    munit_assert_true(
+            vmm_map_large_page_in(empty_pml4, 0x200000, 0x400000, PRESENT));
+
+    // Can't put a 4KiB page inside the large page
+    munit_assert_false(vmm_map_page_in(empty_pml4, 0x201000, 0x1000, PRESENT));
+
+    uint64_t *pdpt = (uint64_t *)(empty_pml4[0] & ENTRY_ADDR_MASK);
+    uint64_t *pd = (uint64_t *)(pdpt[0] & ENTRY_ADDR_MASK);
+    munit_assert_uint64(pd[1], ==, 0x400000 | PRESENT | LARGE_PAGE);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_map_huge_page_empty_pml4(const MunitParameter params[],
+                                                 void *param) {
+    bool result = vmm_map_huge_page_in(empty_pml4, 0x40000000, 0x80000000,
+                                       PRESENT | WRITE);
+    munit_assert_true(result);
+
+    // Huge page was mapped directly in the PDPT
+    uint64_t *pdpt = (uint64_t *)(empty_pml4[0] & ENTRY_ADDR_MASK);
+    munit_assert_uint64(pdpt[0], ==, 0);
+    munit_assert_uint64(pdpt[1], ==,
+                        0x80000000 | PRESENT | WRITE | LARGE_PAGE);
+
+    // We allocated one page (just the PDPT)
+    munit_assert_uint8(test_pmm_get_total_page_allocs(), ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_map_huge_page_unaligned(const MunitParameter params[],
+                                                void *param) {
+    munit_assert_false(
+            vmm_map_huge_page_in(empty_pml4, 0x40200000, 0x80000000, PRESENT));
+    munit_assert_false(
+            vmm_map_huge_page_in(empty_pml4, 0x40000000, 0x80200000, PRESENT));
+
+    munit_assert_uint64(empty_pml4[0], ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_unmap_large_page(const MunitParameter params[],
+                                         void *param) {
+    vmm_map_large_page_in(empty_pml4, 0x200000, 0x400000, PRESENT);
+
+    // Unmapping anywhere inside unmaps the whole thing
+    uintptr_t unmapped_phys = vmm_unmap_page_in(empty_pml4, 0x234000);
+    munit_assert_uint64(unmapped_phys, ==, 0x400000);
+
+    // Which leaves the PD and PDPT empty, so they're freed
+    munit_assert_uint64(empty_pml4[0], ==, 0);
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 2);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_unmap_huge_page(const MunitParameter params[],
+                                        void *param) {
+    vmm_map_huge_page_in(empty_pml4, 0x40000000, 0x80000000, PRESENT);
+
+    uintptr_t unmapped_phys = vmm_unmap_page_in(empty_pml4, 0x40201000);
+    munit_assert_uint64(unmapped_phys, ==, 0x80000000);
+
+    // Which leaves the PDPT empty, so it's freed
+    munit_assert_uint64(empty_pml4[0], ==, 0);
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 1);
+
+    return MUNIT_OK;
+}
+
+static inline uint64_t *table_at(uint64_t *table, uint16_t index) {
+    return (uint64_t *)(table[index] & ENTRY_ADDR_MASK);
+}
+
+static MunitResult test_map_range_empty_pml4(const MunitParameter params[],
+                                             void *param) {
+    // Straddles the boundary between the first two page tables
+    munit_assert_true(vmm_map_range_in(empty_pml4, 0x1fe000, 0x10000, 4,
+                                       PRESENT | WRITE));
+
+    uint64_t *pd = table_at(table_at(empty_pml4, 0), 0);
+    uint64_t *pt0 = table_at(pd, 0);
+    uint64_t *pt1 = table_at(pd, 1);
+
+    munit_assert_uint64(pt0[510], ==, 0x10000 | PRESENT | WRITE);
+    munit_assert_uint64(pt0[511], ==, 0x11000 | PRESENT | WRITE);
+    munit_assert_uint64(pt1[0], ==, 0x12000 | PRESENT | WRITE);
+    munit_assert_uint64(pt1[1], ==, 0x13000 | PRESENT | WRITE);
+    munit_assert_uint64(pt1[2], ==, 0);
+
+    // PDPT, PD and two PTs
+    munit_assert_uint8(test_pmm_get_total_page_allocs(), ==, 4);
+
+    // Small range, so each page is invalidated individually, once
+    munit_assert_uint64(test_vmm_mapper_invalidated_pages(), ==, 4);
+    munit_assert_uint64(test_vmm_mapper_tlb_flushes(), ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_map_range_big(const MunitParameter params[],
+                                      void *param) {
+    munit_assert_true(
+            vmm_map_range_in(empty_pml4, 0x0, 0x100000, 512, PRESENT));
+
+    uint64_t *pt = table_at(table_at(table_at(empty_pml4, 0), 0), 0);
+
+    for (int i = 0; i < 512; i++) {
+        munit_assert_uint64(pt[i], ==, (0x100000 + (i << 12)) | PRESENT);
+    }
+
+    // Big range, so just one full flush at the end
+    munit_assert_uint64(test_vmm_mapper_invalidated_pages(), ==, 0);
+    munit_assert_uint64(test_vmm_mapper_tlb_flushes(), ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_map_pages_array(const MunitParameter params[],
+                                        void *param) {
+    uint64_t pages[] = {0x5000, 0x3000, 0x9000};
+
+    munit_assert_true(vmm_map_pages_in(empty_pml4, 0x2000, pages, 3, PRESENT));
+
+    uint64_t *pt = table_at(table_at(table_at(empty_pml4, 0), 0), 0);
+
+    munit_assert_uint64(pt[2], ==, 0x5000 | PRESENT);
+    munit_assert_uint64(pt[3], ==, 0x3000 | PRESENT);
+    munit_assert_uint64(pt[4], ==, 0x9000 | PRESENT);
+
+    munit_assert_false(vmm_map_pages_in(empty_pml4, 0x2000, NULL, 3, PRESENT));
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_map_range_over_large(const MunitParameter params[],
+                                             void *param) {
+    vmm_map_large_page_in(empty_pml4, 0x200000, 0x400000, PRESENT);
+
+    // Runs into the large page, so only the first part is mapped
+    munit_assert_false(
+            vmm_map_range_in(empty_pml4, 0x1ff000, 0x1000, 2, PRESENT));
+
+    uint64_t *pd = table_at(table_at(empty_pml4, 0), 0);
+    munit_assert_uint64(table_at(pd, 0)[511], ==, 0x1000 | PRESENT);
+    munit_assert_uint64(pd[1], ==, 0x400000 | PRESENT | LARGE_PAGE);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_unmap_range(const MunitParameter params[],
+                                    void *param) {
+    vmm_map_range_in(empty_pml4, 0x1fe000, 0x10000, 3, PRESENT);
+    test_vmm_mapper_reset_flush_counts();
+
+    // One unmapped page at the end
+    uintptr_t phys[4];
+    munit_assert_uint64(vmm_unmap_range_in(empty_pml4, 0x1fe000, 4, phys), ==,
+                        3);
+
+    munit_assert_uint64(phys[0], ==, 0x10000);
+    munit_assert_uint64(phys[1], ==, 0x11000);
+    munit_assert_uint64(phys[2], ==, 0x12000);
+    munit_assert_uint64(phys[3], ==, 0);
+
+    // Everything is empty now, so both PTs, the PD and the PDPT are freed
+    munit_assert_uint64(empty_pml4[0], ==, 0);
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 4);
+
+    // ... after the one flush - and a shootdown for the pages, plus
+    // one for the tables
+    munit_assert_uint64(test_vmm_mapper_invalidated_pages(), ==, 4);
+    munit_assert_uint64(test_vmm_mapper_tlb_flushes(), ==, 0);
+    munit_assert_uint64(test_vmm_mapper_shootdowns(), ==, 2);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_unmap_range_empty_pml4(const MunitParameter params[],
+                                               void *param) {
+    uintptr_t phys[2] = {0xdead, 0xbeef};
+
+    munit_assert_uint64(vmm_unmap_range_in(empty_pml4, 0x40000000, 2, phys),
+                        ==, 0);
+    munit_assert_uint64(phys[0], ==, 0);
+    munit_assert_uint64(phys[1], ==, 0);
+
+    // Nothing unmapped, so nothing to flush (anywhere)
+    munit_assert_uint64(test_vmm_mapper_invalidated_pages(), ==, 0);
+    munit_assert_uint64(test_vmm_mapper_tlb_flushes(), ==, 0);
+    munit_assert_uint64(test_vmm_mapper_shootdowns(), ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_unmap_range_skips_large(const MunitParameter params[],
+                                                void *param) {
+    vmm_map_large_page_in(empty_pml4, 0x200000, 0x400000, PRESENT);
+
+    munit_assert_uint64(vmm_unmap_range_in(empty_pml4, 0x200000, 2, NULL), ==,
+                        0);
+
+    uint64_t *pd = table_at(table_at(empty_pml4, 0), 0);
+    munit_assert_uint64(pd[1], ==, 0x400000 | PRESENT | LARGE_PAGE);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_unmap_pages(const MunitParameter params[],
+                                    void *param) {
+    vmm_map_page_in(empty_pml4, 0x1000, 0x10000, PRESENT);
+    vmm_map_page_in(empty_pml4, 0x5000, 0x11000, PRESENT);
+    vmm_map_page_in(empty_pml4, 0x40000000, 0x12000, PRESENT);
+    test_vmm_mapper_reset_flush_counts();
+
+    // Not consecutive, and one isn't mapped
+    uintptr_t virt[] = {0x5000, 0x40000000, 0x3000, 0x1000};
+    uintptr_t phys[4];
+    munit_assert_uint64(vmm_unmap_pages_in(empty_pml4, virt, 4, phys), ==, 3);
+
+    munit_assert_uint64(phys[0], ==, 0x11000);
+    munit_assert_uint64(phys[1], ==, 0x12000);
+    munit_assert_uint64(phys[2], ==, 0);
+    munit_assert_uint64(phys[3], ==, 0x10000);
+
+    // All the tables are freed, after the one flush (and shootdowns
+    // for the pages and the tables)
+    munit_assert_uint64(empty_pml4[0], ==, 0);
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 5);
+    munit_assert_uint64(test_vmm_mapper_invalidated_pages(), ==, 4);
+    munit_assert_uint64(test_vmm_mapper_tlb_flushes(), ==, 0);
+    munit_assert_uint64(test_vmm_mapper_shootdowns(), ==, 2);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_unmap_pages_big(const MunitParameter params[],
+                                        void *param) {
+    uintptr_t virt[VMM_RANGE_FLUSH_THRESHOLD + 1];
+
+    // Every other page, in the kernel half
+    for (int i = 0; i <= VMM_RANGE_FLUSH_THRESHOLD; i++) {
+        virt[i] = CHURN_KERNEL_BASE + (i << 13);
+        vmm_map_page_in(empty_pml4, virt[i], 0x10000 + (i << 12), PRESENT);
+    }
+
+    test_vmm_mapper_reset_flush_counts();
+
+    munit_assert_uint64(vmm_unmap_pages_in(empty_pml4, virt,
+                                           VMM_RANGE_FLUSH_THRESHOLD + 1,
+                                           NULL),
+                        ==, VMM_RANGE_FLUSH_THRESHOLD + 1);
+
+    // Too many to invalidate one at a time, so it's one whole flush
+    munit_assert_uint64(test_vmm_mapper_invalidated_pages(), ==, 0);
+    munit_assert_uint64(test_vmm_mapper_tlb_flushes(), ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_unmap_pages_shootdown(const MunitParameter params[],
+                                              void *param) {
+    uintptr_t virt[VMM_RANGE_FLUSH_THRESHOLD * 2];
+
+    // Lots of scattered kernel-half pages (like a batch of lazy FBA
+    // frees), plus one more to keep the table around
+    for (int i = 0; i < VMM_RANGE_FLUSH_THRESHOLD * 2; i++) {
+        virt[i] = CHURN_KERNEL_BASE + (i << 13);
+        vmm_map_page_in(empty_pml4, virt[i], 0x10000 + (i << 12), PRESENT);
+    }
+
+    vmm_map_page_in(empty_pml4, CHURN_KERNEL_BASE + 0x1000, 0x1000, PRESENT);
+    test_vmm_mapper_reset_flush_counts();
+
+    vmm_unmap_pages_in(empty_pml4, virt, VMM_RANGE_FLUSH_THRESHOLD * 2, NULL);
+
+    // No tables freed, so the whole batch is the one shootdown
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 0);
+    munit_assert_uint64(test_vmm_mapper_shootdowns(), ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_unmap_partial_keeps_tables(const MunitParameter params[], void *param) {
+    vmm_map_page_in(empty_pml4, 0x1000, 0x1000, PRESENT);
+    vmm_map_page_in(empty_pml4, 0x2000, 0x2000, PRESENT);
+
+    test_vmm_mapper_reset_flush_counts();
+
+    // Still one page mapped, so nothing is freed
+    vmm_unmap_page_in(empty_pml4, 0x1000);
+
+    uint64_t *pt = table_at(table_at(table_at(empty_pml4, 0), 0), 0);
+    munit_assert_uint64(pt[1], ==, 0);
+    munit_assert_uint64(pt[2], ==, 0x2000 | PRESENT);
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 0);
+
+    // ... so the page is the only thing to shoot down
+    munit_assert_uint64(test_vmm_mapper_shootdowns(), ==, 1);
+
+    // Now it's all empty
+    vmm_unmap_page_in(empty_pml4, 0x2000);
+
+    munit_assert_uint64(empty_pml4[0], ==, 0);
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 3);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_unmap_keeps_kernel_pdpt(const MunitParameter params[],
+                                                void *param) {
+    vmm_map_page_in(empty_pml4, CHURN_KERNEL_BASE, 0x1000, PRESENT);
+    vmm_unmap_page_in(empty_pml4, CHURN_KERNEL_BASE);
+
+    // The PT and PD are freed, but kernel-half PDPTs are shared between
+    // address spaces, so that has to stay
+    uint64_t *pdpt = table_at(empty_pml4, PML4ENTRY(CHURN_KERNEL_BASE));
+
+    munit_assert_not_null(pdpt);
+    munit_assert_uint64(pdpt[PDPTENTRY(CHURN_KERNEL_BASE)], ==, 0);
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 2);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_reclaim_failed_map(const MunitParameter params[],
+                                           void *param) {
+    vmm_map_large_page_in(empty_pml4, 0x200000, 0x400000, PRESENT);
+
+    // Fails at the large page, but tables it created on the way (the
+    // new PT for the first page) are kept, since they're in use
+    munit_assert_false(
+            vmm_map_range_in(empty_pml4, 0x1ff000, 0x1000, 2, PRESENT));
+    munit_assert_uint32(test_pmm_get_total_page_frees(), ==, 0);
+
+    // Unmapping both leaves everything empty again
+    vmm_unmap_page_in(empty_pml4, 0x1ff000);
+    vmm_unmap_page_in(empty_pml4, 0x200000);
+
+    munit_assert_uint64(empty_pml4[0], ==, 0);
+    munit_assert_uint32(test_pmm_get_total_page_allocs(), ==,
+                        test_pmm_get_total_page_frees());
+
+    return MUNIT_OK;
+}
+
+static inline uint32_t live_table_pages(void) {
+    return test_pmm_get_total_page_allocs() - test_pmm_get_total_page_frees();
+}
+
+/*
+ * Map and unmap lots of random ranges across user space and the FBA
+ * area, mixing the single-page and range calls, and check that the
+ * page-table memory goes back to where it started every time.
+ */
+static MunitResult test_reclaim_churn(const MunitParameter params[],
+                                      void *param) {
+    uintptr_t virt[CHURN_RANGES];
+    uint64_t count[CHURN_RANGES];
+    uint32_t peak = 0;
+
+    // The kernel-half PDPT is never freed, so get that in up front
+    vmm_map_page_in(empty_pml4, CHURN_KERNEL_BASE, 0x1000, PRESENT);
+    vmm_unmap_page_in(empty_pml4, CHURN_KERNEL_BASE);
+
+    uint32_t baseline = live_table_pages();
+    munit_assert_uint32(baseline, ==, 1);
+
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        for (int i = 0; i < CHURN_RANGES; i++) {
+            uintptr_t base = (i & 1) ? CHURN_KERNEL_BASE : CHURN_USER_BASE;
+            int offset = munit_rand_int_range(
+                    0, (CHURN_SLOT_SIZE >> 12) - CHURN_MAX_PAGES);
+
+            // Each range has a slot to itself, so they never overlap
+            virt[i] = base + (i >> 1) * CHURN_SLOT_SIZE + (offset << 12);
+            count[i] = munit_rand_int_range(1, CHURN_MAX_PAGES);
+
+            if (munit_rand_int_range(0, 3) == 0) {
+                for (uint64_t j = 0; j < count[i]; j++) {
+                    munit_assert_true(vmm_map_page_in(empty_pml4,
+                                                      virt[i] + (j << 12),
+                                                      0x1000 + (j << 12),
+                                                      PRESENT));
+                }
+            } else {
+                munit_assert_true(vmm_map_range_in(empty_pml4, virt[i], 0x1000,
+                                                   count[i], PRESENT));
+            }
+        }
+
+        if (live_table_pages() > peak) {
+            peak = live_table_pages();
+        }
+
+        for (int i = CHURN_RANGES - 1; i >= 0; i--) {
+            if (munit_rand_int_range(0, 3) == 0) {
+                for (uint64_t j = 0; j < count[i]; j++) {
+                    munit_assert_uint64(
+                            vmm_unmap_page_in(empty_pml4, virt[i] + (j << 12)),
+                            ==, 0x1000 + (j << 12));
+                }
+            } else {
+                munit_assert_uint64(
+                        vmm_unmap_range_in(empty_pml4, virt[i], count[i], NULL),
+                        ==, count[i]);
+            }
+        }
+
+        munit_assert_uint32(live_table_pages(), ==, baseline);
+    }
+
+    munit_assert_uint64(empty_pml4[0], ==, 0);
+
+    munit_logf(MUNIT_LOG_INFO,
+               "%d rounds: peak %u table pages, back to %u after each",
+               CHURN_ROUNDS, peak, live_table_pages());
+
+    return MUNIT_OK;
+}
+
+typedef struct {
+    uint64_t *pml4;
+    int thread;
+    bool failed;
+} ConcurrentMapArgs;
+
+static void *concurrent_map_thread(void *arg) {
+    ConcurrentMapArgs *args = (ConcurrentMapArgs *)arg;
+
+    // Every thread maps a page in each region, so they all race to
+    // create the same page tables...
+    for (int i = 0; i < CONCURRENT_REGIONS; i++) {
+        uintptr_t virt = (i * LARGE_PAGE_SIZE) + (args->thread << 12);
+        uint64_t phys = 0x100000 + ((i * CONCURRENT_THREADS + args->thread)
+                                    << 12);
+
+        if (!vmm_map_page_in(args->pml4, virt, phys, PRESENT)) {
+            args->failed = true;
+        }
+    }
+
+    return NULL;
+}
+
+static MunitResult test_map_concurrent_shared(const MunitParameter params[],
+                                              void *param) {
+    uint64_t *pml4s[CONCURRENT_THREADS];
+    pthread_t threads[CONCURRENT_THREADS];
+    ConcurrentMapArgs args[CONCURRENT_THREADS];
+
+    uint64_t *pdpt;
+
+    // Separate address spaces (so separate locks) sharing a PDPT, the
+    // way they'd share the kernel half...
+    posix_memalign((void **)&pdpt, 0x1000, 0x1000);
+    memset(pdpt, 0, 0x1000);
+
+    for (int i = 0; i < CONCURRENT_THREADS; i++) {
+        posix_memalign((void **)&pml4s[i], 0x1000, 0x1000);
+        memset(pml4s[i], 0, 0x1000);
+        pml4s[i][0] = (uint64_t)pdpt | PRESENT;
+    }
+
+    for (int i = 0; i < CONCURRENT_THREADS; i++) {
+        args[i].pml4 = pml4s[i];
+        args[i].thread = i;
+        args[i].failed = false;
+        pthread_create(&threads[i], NULL, concurrent_map_thread, &args[i]);
+    }
+
+    for (int i = 0; i < CONCURRENT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        munit_assert_false(args[i].failed);
+    }
+
+    // Exactly one PD and one PT per region survived, and nobody's
+    // mappings were lost in a table that got replaced
+    munit_assert_uint32(test_pmm_get_total_page_allocs() -
+                                test_pmm_get_total_page_frees(),
+                        ==, 1 + CONCURRENT_REGIONS);
+
+    uint64_t *pd = table_at(pdpt, 0);
+
+    for (int i = 0; i < CONCURRENT_REGIONS; i++) {
+        uint64_t *pt = table_at(pd, i);
+
+        for (int t = 0; t < CONCURRENT_THREADS; t++) {
+            munit_assert_uint64(
+                    pt[t], ==,
+                    (0x100000 + ((i * CONCURRENT_THREADS + t) << 12)) |
+                            PRESENT);
+        }
+    }
+
+    for (int i = 0; i < CONCURRENT_THREADS; i++) {
+        free(pml4s[i]);
+    }
+
+    free(pdpt);
+    return MUNIT_OK;
+}
+
+static void *concurrent_churn_thread(void *arg) {
+    ConcurrentMapArgs *args = (ConcurrentMapArgs *)arg;
+
+    // Every thread maps and unmaps its own page in each region, so the
+    // tables are being emptied (and freed) while others are using them
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        for (int i = 0; i < CONCURRENT_REGIONS; i++) {
+            uintptr_t virt = (i * LARGE_PAGE_SIZE) + (args->thread << 12);
+
+            if (!vmm_map_page_in(args->pml4, virt, 0x1000, PRESENT)) {
+                args->failed = true;
+            }
+        }
+
+        for (int i = 0; i < CONCURRENT_REGIONS; i++) {
+            uintptr_t virt = (i * LARGE_PAGE_SIZE) + (args->thread << 12);
+
+            if (vmm_unmap_page_in(args->pml4, virt) != 0x1000) {
+                args->failed = true;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static MunitResult test_reclaim_concurrent_shared(const MunitParameter params[],
+                                                  void *param) {
+    uint64_t *pml4s[CONCURRENT_THREADS];
+    pthread_t threads[CONCURRENT_THREADS];
+    ConcurrentMapArgs args[CONCURRENT_THREADS];
+
+    uint64_t *pdpt;
+
+    posix_memalign((void **)&pdpt, 0x1000, 0x1000);
+    memset(pdpt, 0, 0x1000);
+
+    for (int i = 0; i < CONCURRENT_THREADS; i++) {
+        posix_memalign((void **)&pml4s[i], 0x1000, 0x1000);
+        memset(pml4s[i], 0, 0x1000);
+        pml4s[i][0] = (uint64_t)pdpt | PRESENT;
+    }
+
+    for (int i = 0; i < CONCURRENT_THREADS; i++) {
+        args[i].pml4 = pml4s[i];
+        args[i].thread = i;
+        args[i].failed = false;
+        pthread_create(&threads[i], NULL, concurrent_churn_thread, &args[i]);
+    }
+
+    for (int i = 0; i < CONCURRENT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        munit_assert_false(args[i].failed);
+    }
+
+    // Everything was freed again (the shared PDPT isn't the mapper's)
+    munit_assert_uint64(pdpt[0], ==, 0);
+    munit_assert_uint32(test_pmm_get_total_page_allocs(), ==,
+                        test_pmm_get_total_page_frees());
+
+    for (int i = 0; i < CONCURRENT_THREADS; i++) {
+        free(pml4s[i]);
+    }
+
+    free(pdpt);
+    return MUNIT_OK;
+}
+
+static MunitResult test_global_kernel_page(const MunitParameter params[],
+                                           void *param) {
+    vmm_map_page_in(empty_pml4, CHURN_KERNEL_BASE, 0x1000, PRESENT);
+
+    uint64_t *pdpt = table_at(empty_pml4, PML4ENTRY(CHURN_KERNEL_BASE));
+    uint64_t *pd = table_at(pdpt, PDPTENTRY(CHURN_KERNEL_BASE));
+    uint64_t *pt = table_at(pd, PDENTRY(CHURN_KERNEL_BASE));
+
+    // Kernel pages are global, but the tables above them never are
+    munit_assert_uint64(pt[PTENTRY(CHURN_KERNEL_BASE)], ==,
+                        0x1000 | PRESENT | GLOBAL);
+    munit_assert_uint64(empty_pml4[PML4ENTRY(CHURN_KERNEL_BASE)] & GLOBAL, ==,
+                        0);
+    munit_assert_uint64(pdpt[PDPTENTRY(CHURN_KERNEL_BASE)] & GLOBAL, ==, 0);
+    munit_assert_uint64(pd[PDENTRY(CHURN_KERNEL_BASE)] & GLOBAL, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_global_user_page(const MunitParameter params[],
+                                         void *param) {
+    // Tables never get the global bit, even if it's asked for...
+    vmm_map_page_in(empty_pml4, 0x1000, 0x2000, PRESENT | GLOBAL);
+
+    uint64_t *pdpt = table_at(empty_pml4, 0);
+    uint64_t *pd = table_at(pdpt, 0);
+
+    munit_assert_uint64(empty_pml4[0] & GLOBAL, ==, 0);
+    munit_assert_uint64(pdpt[0] & GLOBAL, ==, 0);
+    munit_assert_uint64(pd[0] & GLOBAL, ==, 0);
+
+    // ... and it isn't added to user pages
+    vmm_map_page_in(empty_pml4, 0x2000, 0x3000, PRESENT);
+    munit_assert_uint64(table_at(pd, 0)[2], ==, 0x3000 | PRESENT);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_global_kernel_range(const MunitParameter params[],
+                                            void *param) {
+    munit_assert_true(vmm_map_range_in(empty_pml4, CHURN_KERNEL_BASE, 0x100000,
+                                       512, PRESENT | WRITE));
+
+    uint64_t *pt = table_at(
+            table_at(table_at(empty_pml4, PML4ENTRY(CHURN_KERNEL_BASE)),
+                     PDPTENTRY(CHURN_KERNEL_BASE)),
+            PDENTRY(CHURN_KERNEL_BASE));
+
+    for (int i = 0; i < 512; i++) {
+        munit_assert_uint64(pt[i], ==,
+                            (0x100000 + (i << 12)) | PRESENT | WRITE | GLOBAL);
+    }
+
+    // Still just the one (global, this time) flush
+    munit_assert_uint64(test_vmm_mapper_tlb_flushes(), ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_global_kernel_large(const MunitParameter params[],
+                                            void *param) {
+    munit_assert_true(vmm_map_large_page_in(empty_pml4, CHURN_KERNEL_BASE,
+                                            0x400000, PRESENT));
+
+    uint64_t *pd =
+            table_at(table_at(empty_pml4, PML4ENTRY(CHURN_KERNEL_BASE)),
+                     PDPTENTRY(CHURN_KERNEL_BASE));
+
+    munit_assert_uint64(pd[PDENTRY(CHURN_KERNEL_BASE)], ==,
+                        0x400000 | PRESENT | LARGE_PAGE | GLOBAL);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_kernel_half_init(const MunitParameter params[],
+                                         void *param) {
+    empty_pml4[RECURSIVE_ENTRY] = (uint64_t)empty_pml4 | PRESENT | WRITE;
+    empty_pml4[511] = 0x1000 | PRESENT | WRITE;
+
+    munit_assert_true(vmm_kernel_half_init(empty_pml4));
+
+    // Everything in the kernel half now has a table...
+    for (int i = RECURSIVE_ENTRY + 1; i < 511; i++) {
+        munit_assert_uint64(empty_pml4[i] & PRESENT, !=, 0);
+        munit_assert_not_null(table_at(empty_pml4, i));
+    }
+
+    // ... except what was already there, and nothing in the user half
+    munit_assert_uint64(empty_pml4[RECURSIVE_ENTRY], ==,
+                        (uint64_t)empty_pml4 | PRESENT | WRITE);
+    munit_assert_uint64(empty_pml4[511], ==, 0x1000 | PRESENT | WRITE);
+
+    for (int i = 0; i < RECURSIVE_ENTRY; i++) {
+        munit_assert_uint64(empty_pml4[i], ==, 0);
+    }
+
+    munit_assert_uint32(test_pmm_get_total_page_allocs(), ==, 254);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_init_address_space(const MunitParameter params[],
+                                           void *param) {
+    uint64_t *new_pml4;
+    posix_memalign((void **)&new_pml4, 0x1000, 0x1000);
+    memset(new_pml4, 0xff, 0x1000);
+
+    empty_pml4[RECURSIVE_ENTRY] = (uint64_t)empty_pml4 | PRESENT | WRITE;
+    vmm_map_page_in(empty_pml4, 0x1000, 0x2000, PRESENT);
+    vmm_map_page_in(empty_pml4, CHURN_KERNEL_BASE, 0x3000, PRESENT);
+
+    munit_assert_ptr_equal(
+            vmm_init_address_space(empty_pml4, (uint64_t)new_pml4), new_pml4);
+
+    for (int i = 0; i < RECURSIVE_ENTRY; i++) {
+        munit_assert_uint64(new_pml4[i], ==, 0);
+    }
+
+    munit_assert_uint64(new_pml4[RECURSIVE_ENTRY], ==,
+                        (uint64_t)new_pml4 | PRESENT | WRITE);
+
+    for (int i = RECURSIVE_ENTRY + 1; i < 512; i++) {
+        munit_assert_uint64(new_pml4[i], ==, empty_pml4[i]);
+    }
+
+    // Kernel mappings made through one are there in the other
+    vmm_map_page_in(empty_pml4, CHURN_KERNEL_BASE + 0x1000, 0x4000, PRESENT);
+
+    uint64_t *pt =
+            table_at(table_at(table_at(new_pml4, PML4ENTRY(CHURN_KERNEL_BASE)),
+                              PDPTENTRY(CHURN_KERNEL_BASE)),
+                     PDENTRY(CHURN_KERNEL_BASE));
+
+    munit_assert_uint64(pt[PTENTRY(CHURN_KERNEL_BASE) + 1], ==,
+                        0x4000 | PRESENT | GLOBAL);
+
+    free(new_pml4);
+    return MUNIT_OK;
+}
+
 static void *setup(const MunitParameter params[], void *user_data) {
+    test_vmm_mapper_reset_flush_counts();
+
     posix_memalign((void **)&empty_pml4, 0x1000, 0x1000);
     memset(empty_pml4, 0, 0x1000);
 
@@ -348,6 +1130,73 @@ static MunitTest test_suite_tests[] = {
         {(char *)"/unmap/complete_pml4_2M", test_unmap_page_complete_pml4_2M,
          setup, teardown, MUNIT_TEST_OPTION_NONE, NULL},
 
+        {(char *)"/map_large/empty_pml4", test_map_large_page_empty_pml4,
+         setup, teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/map_large/unaligned", test_map_large_page_unaligned, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/map_large/over_table", test_map_large_page_over_table,
+         setup, teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/map_large/page_within", test_map_page_within_large_page,
+         setup, teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/map_huge/empty_pml4", test_map_huge_page_empty_pml4, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/map_huge/unaligned", test_map_huge_page_unaligned, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/map_range/empty_pml4", test_map_range_empty_pml4, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/map_range/big", test_map_range_big, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/map_range/over_large", test_map_range_over_large, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/map_pages/array", test_map_pages_array, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/unmap_pages/scattered", test_unmap_pages, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/unmap_pages/big", test_unmap_pages_big, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/unmap_pages/shootdown", test_unmap_pages_shootdown, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/unmap_range/partial", test_unmap_range, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/unmap_range/empty_pml4", test_unmap_range_empty_pml4, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/unmap_range/skips_large", test_unmap_range_skips_large,
+         setup, teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/map/concurrent_shared", test_map_concurrent_shared, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/reclaim/partial", test_unmap_partial_keeps_tables, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/reclaim/kernel_pdpt", test_unmap_keeps_kernel_pdpt, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/reclaim/failed_map", test_reclaim_failed_map, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/reclaim/churn", test_reclaim_churn, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/reclaim/concurrent_shared", test_reclaim_concurrent_shared,
+         setup, teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/global/kernel_page", test_global_kernel_page, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/global/user_page", test_global_user_page, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/global/kernel_range", test_global_kernel_range, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/global/kernel_large", test_global_kernel_large, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/kernel_half/init", test_kernel_half_init, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/kernel_half/address_space", test_init_address_space, setup,
+         teardown, MUNIT_TEST_OPTION_NONE, NULL},
+
+        {(char *)"/unmap/large_page", test_unmap_large_page, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+        {(char *)"/unmap/huge_page", test_unmap_huge_page, setup, teardown,
+         MUNIT_TEST_OPTION_NONE, NULL},
+
         {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
 };
 